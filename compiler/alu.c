@@ -5,9 +5,10 @@
 #include "branches.h"
 #include "instructions.h"
 #include "timing.h"
+#include "decode.h"
 
 // helper for reading GB memory during compilation
-#define READ_BYTE(off) (ctx->read(ctx->dmg, src_address + (off)))
+#define READ_BYTE(off) (decode_read(ctx, src_address + (off)))
 
 // ops that emit DAA tracking (the add/sub family)
 static int daa_tracked_op(uint8_t op)
@@ -41,21 +42,18 @@ static int daa_scan_barrier(uint8_t op)
 
 // returns 0 when a later tracked ALU op re-establishes DAA state before any
 // daa/branch/block end could observe this op's state, so tracking is dead
-static int daa_track_needed(
-    struct compile_ctx *ctx,
-    uint16_t src_address,
-    uint16_t off
-) {
+static int daa_track_needed(struct compile_ctx *ctx, uint16_t off)
+{
     while (off < 256) {
-        uint8_t op = READ_BYTE(off);
+        const struct gb_insn *in = decode_at(ctx, off);
 
-        if (op == 0x27)
+        if (in->op == 0x27)
             return 1;
-        if (daa_tracked_op(op))
+        if (daa_tracked_op(in->op))
             return 0;
-        if (daa_scan_barrier(op))
+        if (daa_scan_barrier(in->op))
             return 1;
-        off += insn_length[op];
+        off += in->length;
     }
     return 1;
 }
@@ -264,7 +262,7 @@ int compile_alu_op(
         uint16_t next_off = *src_ptr;
         if (op == 0xc6 || op == 0xce || op == 0xd6 || op == 0xde)
             next_off++;
-        daa_track = daa_track_needed(ctx, src_address, next_off);
+        daa_track = daa_track_needed(ctx, next_off);
     }
 
     switch (op) {
@@ -600,10 +598,11 @@ int compile_alu_op(
         return 1;
 
     case 0xa0: // and a, b
-        emit_swap(block, REG_68K_D_BC);
-        emit_and_b_dn_dn(block, REG_68K_D_BC, REG_68K_D_A);
+        // operate on a copy so the CCR is still live for a fused branch
+        emit_move_l_dn_dn(block, REG_68K_D_BC, REG_68K_D_SCRATCH_1);
+        emit_swap(block, REG_68K_D_SCRATCH_1);
+        emit_and_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_A);
         compile_set_zc_flags(block);
-        emit_swap(block, REG_68K_D_BC);
         return 1;
 
     case 0xa1: // and a, c
@@ -612,10 +611,11 @@ int compile_alu_op(
         return 1;
 
     case 0xa2: // and a, d
-        emit_swap(block, REG_68K_D_DE);
-        emit_and_b_dn_dn(block, REG_68K_D_DE, REG_68K_D_A);
+        // operate on a copy so the CCR is still live for a fused branch
+        emit_move_l_dn_dn(block, REG_68K_D_DE, REG_68K_D_SCRATCH_1);
+        emit_swap(block, REG_68K_D_SCRATCH_1);
+        emit_and_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_A);
         compile_set_zc_flags(block);
-        emit_swap(block, REG_68K_D_DE);
         return 1;
 
     case 0xa3: // and a, e
@@ -744,11 +744,11 @@ int compile_alu_op(
         return 1;
 
     case 0xb8: // cp a, b
-        // cannot fuse branch because it needs to swap back BC :/
-        emit_swap(block, REG_68K_D_BC);
-        emit_cmp_b_dn_dn(block, REG_68K_D_BC, REG_68K_D_A);
+        // operate on a copy so the CCR is still live for a fused branch
+        emit_move_l_dn_dn(block, REG_68K_D_BC, REG_68K_D_SCRATCH_1);
+        emit_swap(block, REG_68K_D_SCRATCH_1);
+        emit_cmp_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_A);
         compile_set_zc_flags(block);
-        emit_swap(block, REG_68K_D_BC);
         return 1;
 
     case 0xb9: // cp a, c
@@ -756,12 +756,12 @@ int compile_alu_op(
         compile_set_zc_flags(block);
         return 1;
 
-    case 0xba: // cp a, d 
-        // can't fuse
-        emit_swap(block, REG_68K_D_DE);
-        emit_cmp_b_dn_dn(block, REG_68K_D_DE, REG_68K_D_A);
+    case 0xba: // cp a, d
+        // operate on a copy so the CCR is still live for a fused branch
+        emit_move_l_dn_dn(block, REG_68K_D_DE, REG_68K_D_SCRATCH_1);
+        emit_swap(block, REG_68K_D_SCRATCH_1);
+        emit_cmp_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_A);
         compile_set_zc_flags(block);
-        emit_swap(block, REG_68K_D_DE);
         return 1;
 
     case 0xbb: // cp a, e
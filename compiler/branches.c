@@ -2,10 +2,287 @@
 #include "compiler.h"
 #include "branches.h"
 #include "emitters.h"
+#include "flags.h"
 #include "stack.h"
+#include "peephole.h"
+#include "decode.h"
+#include "jumptable.h"
+#include "timing.h"
+#include "cold.h"
 
 // helper for reading GB memory during compilation
-#define READ_BYTE(off) (ctx->read(ctx->dmg, src_address + (off)))
+#define READ_BYTE(off) (decode_read(ctx, src_address + (off)))
+
+// Return shadow stack. Calls push (return address, landing) onto the ring at
+// JIT_CTX_RET_SP; RET pops it and jumps straight to the landing when the
+// popped GB address matches. The landing lives in the calling block and is
+// an ordinary exit to the return address, so a stale entry is still correct.
+
+// push the shadow entry; returns the lea to patch once the landing exists
+static size_t emit_ret_stack_push(struct code_block *block, uint16_t ret_addr)
+{
+    size_t lea_at;
+
+    // addq.b #8, RET_SP+3(a4) - low byte only, so the ring wraps
+    emit_addq_b_disp_an(block, 8, JIT_CTX_RET_SP + 3, REG_68K_A_CTX);
+    emit_movea_l_disp_an_an(block, JIT_CTX_RET_SP, REG_68K_A_CTX, REG_68K_A_SCRATCH_1);
+    emit_move_l_imm_ind_an(block, ret_addr, REG_68K_A_SCRATCH_1);
+    lea_at = block->length;
+    emit_lea_disp_pc_an(block, 0, REG_68K_A_SCRATCH_2);
+    emit_move_l_an_disp_an(block, REG_68K_A_SCRATCH_2, 4, REG_68K_A_SCRATCH_1);
+    return lea_at;
+}
+
+// landing for a shadow RET hit, D3 already holds ret_addr. must not be
+// reachable by falling through from the code before it
+static void emit_ret_landing(struct code_block *block, size_t lea_at, uint16_t ret_addr)
+{
+    // lea d16(pc) has the same displacement layout as bra.w
+    patch_branch_w(block, lea_at);
+
+    // a banked return address gets a bank-checked exit, so the landing
+    // needs no check of its own
+    emit_block_exit(block, ret_addr);
+}
+
+// after compile_pop_pc: take the shadow landing if it matches D3. the
+// compare is a long so an empty 0xffffffff entry can never match
+static void emit_ret_stack_pop(struct code_block *block, struct compile_ctx *ctx)
+{
+    emit_movea_l_disp_an_an(block, JIT_CTX_RET_SP, REG_68K_A_CTX, REG_68K_A_SCRATCH_1);
+    emit_subq_b_disp_an(block, 8, JIT_CTX_RET_SP + 3, REG_68K_A_CTX);
+    emit_cmp_l_ind_an_dn(block, REG_68K_A_SCRATCH_1, REG_68K_D_NEXT_PC);
+    emit_bne_b(block, 6);
+    emit_movea_l_disp_an_an(block, 4, REG_68K_A_SCRATCH_1, REG_68K_A_SCRATCH_1);
+    emit_jmp_ind_an(block, REG_68K_A_SCRATCH_1);
+    compile_indirect_exit(block, ctx);
+}
+
+// same budget test as the dispatcher, so a cache hit never outruns
+// wake_limit. returns the branch for compile_ic_lookup
+static size_t compile_ic_budget(struct code_block *block)
+{
+    size_t out_of_budget;
+
+    emit_cmp_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+    out_of_budget = block->length;
+    emit_bcc_s(block, 0);
+    return out_of_budget;
+}
+
+// the cache words at A1 for the GB PC in D3: a hit jumps straight to the
+// cached block, a miss enters the dispatcher through JIT_CTX_DISPATCH_IC,
+// which refills them for ROM targets
+static void compile_ic_lookup(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    size_t out_of_budget
+) {
+    size_t miss_target, miss_bank, bank0;
+
+    emit_cmp_l_ind_an_dn(block, REG_68K_A_SCRATCH_2, REG_68K_D_NEXT_PC);
+    miss_target = block->length;
+    emit_bne_b(block, 0);
+
+    // banked targets also have to match the bank they were cached in
+    emit_cmpi_w_imm_dn(block, 0x4000, REG_68K_D_NEXT_PC);
+    bank0 = block->length;
+    emit_bcs_b(block, 0);
+    emit_move_b_disp_an_dn(block, IC_BANK, REG_68K_A_SCRATCH_2, REG_68K_D_SCRATCH_0);
+    emit_cmp_b_disp_an_dn(block, JIT_CTX_ROM_BANK, REG_68K_A_CTX, REG_68K_D_SCRATCH_0);
+    miss_bank = block->length;
+    emit_bne_b(block, 0);
+
+    patch_branch_b(block, bank0);
+    if (ctx->ic_counters) {
+        emit_addq_l_disp_an(block, 1, JIT_CTX_IC_HITS, REG_68K_A_CTX);
+    }
+    emit_movea_l_disp_an_an(block, IC_CODE, REG_68K_A_SCRATCH_2, REG_68K_A_SCRATCH_1);
+    emit_jmp_ind_an(block, REG_68K_A_SCRATCH_1);
+
+    patch_branch_b(block, miss_target);
+    patch_branch_b(block, miss_bank);
+    if (ctx->ic_counters) {
+        emit_addq_l_disp_an(block, 1, JIT_CTX_IC_MISSES, REG_68K_A_CTX);
+    }
+    emit_movea_l_disp_an_an(block, JIT_CTX_DISPATCH_IC, REG_68K_A_CTX, REG_68K_A_SCRATCH_1);
+    emit_jmp_ind_an(block, REG_68K_A_SCRATCH_1);
+
+    // out of budget: what the dispatcher would do anyway
+    patch_branch_b(block, out_of_budget);
+    emit_rts(block);
+}
+
+// Exit to the GB PC in D3 through a monomorphic inline cache.
+// Upper-region code can be rewritten, so it is never cached.
+void compile_indirect_exit(struct code_block *block, struct compile_ctx *ctx)
+{
+    size_t out_of_budget, lea_at;
+
+    out_of_budget = compile_ic_budget(block);
+    lea_at = block->length;
+    emit_lea_disp_pc_an(block, 0, REG_68K_A_SCRATCH_2);
+    compile_ic_lookup(block, ctx, out_of_budget);
+
+    // the cache words, lea d16(pc) patches like bra.w
+    patch_branch_w(block, lea_at);
+    peephole_mark_data(block->length, block->length + IC_SIZE);
+    emit_long(block, 0xffffffff);
+    emit_long(block, 0);
+    emit_word(block, 0);
+}
+
+// Indexed dispatch for a call into a jump table helper, see jumptable.h.
+// Does what the helper would for A from its record and exits through the
+// record's cache words. returns the branch taken for an index past the
+// table, for the caller to point at the usual call
+size_t compile_jump_table(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    struct jump_table *jt,
+    uint16_t ret_addr
+) {
+    size_t past_table, lea_at = 0, out_of_budget;
+
+    flush_cycles(block);
+    emit_cmp_b_imm_dn(block, REG_68K_D_A, jt->count);
+    past_table = block->length;
+    emit_bcc_opcode_w(block, COND_CC, 0);
+    emit_add_cycles(block, jt->cycles);
+    if (jt->returns) {
+        compile_push_imm16(block, ret_addr);
+        lea_at = emit_ret_stack_push(block, ret_addr);
+    }
+
+    // A1 = record for A
+    emit_moveq_dn(block, REG_68K_D_SCRATCH_1, 0);
+    emit_move_b_dn_dn(block, REG_68K_D_A, REG_68K_D_SCRATCH_1);
+    emit_lsl_w_imm_dn(block, 4, REG_68K_D_SCRATCH_1);
+    jt->lea_at = block->length;
+    emit_lea_disp_pc_an(block, 0, REG_68K_A_SCRATCH_2);
+    emit_adda_w_dn_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_SCRATCH_2);
+
+    // HL is the target, jp (hl) went there
+    emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
+    emit_move_w_disp_an_dn(block, JT_TARGET, REG_68K_A_SCRATCH_2, REG_68K_D_NEXT_PC);
+    emit_movea_w_dn_an(block, REG_68K_D_NEXT_PC, REG_68K_A_HL);
+    if (jt->writes & (1 << GB_REG_A)) {
+        emit_move_b_disp_an_dn(block, JT_A, REG_68K_A_SCRATCH_2, REG_68K_D_A);
+    }
+    if (jt->writes & (1 << GB_REG_D)) {
+        // 0x????DDEE -> 0x??DD00EE
+        emit_move_w_disp_an_dn(block, JT_DE, REG_68K_A_SCRATCH_2, REG_68K_D_DE);
+        emit_lsl_l_imm_dn(block, 8, REG_68K_D_DE);
+        emit_lsr_w_imm_dn(block, 8, REG_68K_D_DE);
+    }
+    if (jt->flags) {
+        emit_andi_b_dn(block, REG_68K_D_FLAGS, ~jt->flags);
+        emit_move_b_disp_an_dn(block, JT_F, REG_68K_A_SCRATCH_2, REG_68K_D_SCRATCH_0);
+        emit_or_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_FLAGS);
+    }
+
+    out_of_budget = compile_ic_budget(block);
+    compile_ic_lookup(block, ctx, out_of_budget);
+    if (jt->returns) {
+        emit_ret_landing(block, lea_at, ret_addr);
+    }
+    return past_table;
+}
+
+void compile_loop_jump(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint16_t target_gb_pc,
+    uint16_t target_m68k
+) {
+    int16_t m68k_disp;
+    struct code_block *cold;
+    size_t expired;
+
+    // Register mid-block entry point for this branch target
+    compile_entry_point(ctx, target_gb_pc, target_m68k);
+
+    flush_cycles(block);
+
+    // Check cycle count, exit to dispatcher if >= budget
+    // cmp.l JIT_CTX_WAKE_LIMIT(a4), d2
+    emit_cmp_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+
+    // out of budget to the cold tail, the loop only falls through it
+    expired = block->length;
+    emit_bcc_w(block, 0);
+
+    // Native branch (cycles < scanline boundary)
+    m68k_disp = (int16_t) target_m68k - (int16_t) (block->length + 2);
+    emit_bra_w(block, m68k_disp);
+
+    // Exit to dispatcher with target PC
+    cold = cold_begin(block, expired);
+    emit_moveq_dn(cold, REG_68K_D_NEXT_PC, 0);
+    emit_move_w_dn(cold, REG_68K_D_NEXT_PC, target_gb_pc);
+    emit_block_exit(cold, target_gb_pc);
+    cold_close();
+}
+
+void compile_loop_branch(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    int cond,
+    uint16_t target_gb_pc,
+    uint16_t target_m68k
+) {
+    int16_t m68k_disp;
+    struct code_block *cold;
+    size_t taken, fall, expired;
+
+    // Register mid-block entry point for this branch target
+    compile_entry_point(ctx, target_gb_pc, target_m68k);
+
+    // Check condition, then cycle count
+    // Structure:
+    //   btst #flag_bit, d7           ; already emitted by the caller, if needed
+    //   b<cond> .check_cycles        ; if condition met, check cycles
+    //   bra.b .fall_through          ; condition not met, skip all
+    // .check_cycles:
+    //   add pending + 4 to d2
+    //   cmp.l JIT_CTX_WAKE_LIMIT(a4), d2
+    //   bcs.w loop_target            ; cycles < exit budget, do native branch
+    //   bra.w .expired               ; in the cold tail
+    // .fall_through:
+    //   ...
+    // .expired:
+    //   moveq #0, d0                 ; cycles >= exit budget, exit
+    //   move.w #target, d0
+    //   patchable_exit
+
+    taken = block->length;
+    emit_bcc_opcode_b(block, cond, 0);  // skip the bra.b to .check_cycles
+
+    // bra.b to .fall_through
+    fall = block->length;
+    emit_bra_b(block, 0);
+
+    // .check_cycles:
+    patch_branch_b(block, taken);
+    emit_add_cycles(block, pending_cycles + 4);
+    emit_cmp_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+
+    // bcs.w to native loop target (cycles < exit budget)
+    m68k_disp = (int16_t) target_m68k - (int16_t) (block->length + 2);
+    emit_bcs_w(block, m68k_disp);
+    expired = block->length;
+    emit_bra_w(block, 0);
+
+    // .fall_through: block continues deferring
+    patch_branch_b(block, fall);
+
+    // Exit to dispatcher (cycles >= exit budget)
+    cold = cold_begin(block, expired);
+    emit_moveq_dn(cold, REG_68K_D_NEXT_PC, 0);
+    emit_move_w_dn(cold, REG_68K_D_NEXT_PC, target_gb_pc);
+    emit_block_exit(cold, target_gb_pc);
+    cold_close();
+}
 
 void compile_jr(
     struct code_block *block,
@@ -15,8 +292,7 @@ void compile_jr(
 ) {
     int8_t disp;
     int16_t target_gb_offset;
-    uint16_t target_m68k, target_gb_pc;
-    int16_t m68k_disp;
+    uint16_t target_gb_pc;
 
     disp = (int8_t) READ_BYTE(*src_ptr);
     (*src_ptr)++;
@@ -27,36 +303,8 @@ void compile_jr(
 
     // Check if this is a backward jump to a location we've already compiled
     if (target_gb_offset >= 0 && target_gb_offset < (int16_t) (*src_ptr - 2)) {
-        // Backward jump within block
-        target_gb_pc = src_address + target_gb_offset;
-        target_m68k = m68k_offsets[target_gb_offset];
-        m68k_disp = (int16_t) target_m68k - (int16_t) (block->length + 2);
-
-        // Register mid-block entry point for this branch target
-        if (ctx->cache_store) {
-            void *code_ptr = (void *) (block->code + target_m68k);
-            ctx->cache_store(target_gb_pc, ctx->current_bank, code_ptr);
-        }
-
-        flush_cycles(block);
-
-        // Check cycle count, exit to dispatcher if >= budget
-        // cmp.l JIT_CTX_WAKE_LIMIT(a4), d2
-        emit_cmp_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
-
-        // branch if cycles < exit budget
-        size_t skip = block->length;
-        emit_bcs_b(block, 0);
-        // Exit to dispatcher with target PC
-        emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
-        emit_move_w_dn(block, REG_68K_D_NEXT_PC, target_gb_pc);
-        emit_block_exit(block, target_gb_pc);
-
-        // Native branch (cycles < scanline boundary)
-        // Recompute displacement since block->length changed
-        patch_branch_b(block, skip);
-        m68k_disp = (int16_t) target_m68k - (int16_t) (block->length + 2);
-        emit_bra_w(block, m68k_disp);
+        compile_loop_jump(block, ctx, src_address + target_gb_offset,
+                m68k_offsets[target_gb_offset]);
         return;
     }
 
@@ -81,73 +329,21 @@ void compile_jr_cond(
 ) {
     int8_t disp;
     int16_t target_gb_offset;
-    uint16_t target_m68k, target_gb_pc;
-    int16_t m68k_disp;
+    uint16_t target_gb_pc;
+    int cond;
 
     disp = (int8_t) READ_BYTE(*src_ptr);
     (*src_ptr)++;
 
     target_gb_offset = (int16_t) *src_ptr + disp;
 
-    // Test the flag bit in D7
-    // btst sets 68k Z=1 if tested bit is 0, Z=0 if tested bit is 1
-    emit_btst_imm_dn(block, flag_bit, REG_68K_D_FLAGS);
+    // Test the flag bit in D7, cond holds when the branch is taken
+    cond = compile_flag_test(block, flag_bit, branch_if_set);
 
     // Check if this is a backward jump within block
     if (target_gb_offset >= 0 && target_gb_offset < (int16_t) (*src_ptr - 2)) {
-        // Backward jump - check condition, then maybe interrupt flag
-        target_gb_pc = src_address + target_gb_offset;
-        target_m68k = m68k_offsets[target_gb_offset];
-
-        // Register mid-block entry point for this branch target
-        if (ctx->cache_store) {
-            void *code_ptr = (void *) (block->code + target_m68k);
-            ctx->cache_store(target_gb_pc, ctx->current_bank, code_ptr);
-        }
-
-        // Check condition, then cycle count
-        // Structure:
-        //   btst #flag_bit, d7           ; already emitted above
-        //   bne/beq .check_cycles        ; if condition met, check cycles
-        //   bra.b .fall_through          ; condition not met, skip all
-        // .check_cycles:
-        //   add pending + 4 to d2
-        //   cmp.l JIT_CTX_WAKE_LIMIT(a4), d2
-        //   bcs.w loop_target            ; cycles < exit budget, do native branch
-        //   moveq #0, d0                 ; cycles >= exit budget, exit
-        //   move.w #target, d0
-        //   patchable_exit
-        // .fall_through:
-
-        size_t cond = block->length;
-        if (branch_if_set) {
-            // Branch if flag is set: btst gives Z=0 when bit=1, so use bne
-            emit_bne_b(block, 0);  // skip the bra.b to .check_cycles
-        } else {
-            // Branch if flag is clear: btst gives Z=1 when bit=0, so use beq
-            emit_beq_b(block, 0);
-        }
-
-        // bra.b to .fall_through
-        size_t fall = block->length;
-        emit_bra_b(block, 0);
-
-        // .check_cycles:
-        patch_branch_b(block, cond);
-        emit_add_cycles(block, pending_cycles + 4);
-        emit_cmp_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
-
-        // bcs.w to native loop target (cycles < exit budget)
-        m68k_disp = (int16_t) target_m68k - (int16_t) (block->length + 2);
-        emit_bcs_w(block, m68k_disp);
-
-        // Exit to dispatcher (cycles >= exit budget)
-        emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
-        emit_move_w_dn(block, REG_68K_D_NEXT_PC, target_gb_pc);
-        emit_block_exit(block, target_gb_pc);
-
-        // .fall_through: block continues deferring
-        patch_branch_b(block, fall);
+        compile_loop_branch(block, ctx, cond, src_address + target_gb_offset,
+                m68k_offsets[target_gb_offset]);
         return;
     }
 
@@ -156,13 +352,7 @@ void compile_jr_cond(
     target_gb_pc = src_address + target_gb_offset;
 
     size_t skip = block->length;
-    if (branch_if_set) {
-        // Skip exit if flag is clear (btst Z=1 when bit=0)
-        emit_beq_b(block, 0);
-    } else {
-        // Skip exit if flag is set (btst Z=0 when bit=1)
-        emit_bne_b(block, 0);
-    }
+    emit_bcc_opcode_b(block, cond ^ 1, 0);
 
     emit_add_cycles(block, pending_cycles + 4);  // pending + taken extra
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
@@ -185,20 +375,15 @@ void compile_jp_cond(
 ) {
     uint16_t target = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
     size_t skip;
+    int cond;
     *src_ptr += 2;
 
     // Test the flag bit in D7
-    emit_btst_imm_dn(block, flag_bit, REG_68K_D_FLAGS);
+    cond = compile_flag_test(block, flag_bit, branch_if_set);
 
     // If condition NOT met, skip the exit sequence
     skip = block->length;
-    if (branch_if_set) {
-        // Skip exit if flag is clear (btst Z=1 when bit=0)
-        emit_beq_b(block, 0);
-    } else {
-        // Skip exit if flag is set (btst Z=0 when bit=1)
-        emit_bne_b(block, 0);
-    }
+    emit_bcc_opcode_b(block, cond ^ 1, 0);
 
     emit_add_cycles(block, pending_cycles + 4);  // pending + taken extra
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
@@ -216,15 +401,68 @@ void compile_call_imm16(
 ) {
     uint16_t target = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
     uint16_t ret_addr = src_address + *src_ptr + 2;  // address after call
+    size_t lea_at;
     *src_ptr += 2;
 
     flush_cycles(block);
     compile_push_imm16(block, ret_addr);
+    lea_at = emit_ret_stack_push(block, ret_addr);
 
     // jump to target
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
     emit_move_w_dn(block, REG_68K_D_NEXT_PC, target);
     emit_block_exit(block, target);
+    emit_ret_landing(block, lea_at, ret_addr);
+}
+
+// call followed into the same block by the superblock former: the callee
+// is compiled next, so the landing is branched over
+void compile_call_inline(struct code_block *block, uint16_t ret_addr)
+{
+    size_t lea_at, over;
+
+    flush_cycles(block);
+    compile_push_imm16(block, ret_addr);
+    lea_at = emit_ret_stack_push(block, ret_addr);
+    over = block->length;
+    emit_bra_w(block, 0);
+    emit_ret_landing(block, lea_at, ret_addr);
+    patch_branch_w(block, over);
+}
+
+// call into a leaf the superblock former compiles inline: its ret comes
+// back into the same block, so there's no shadow entry or landing. the
+// return address is still pushed for code that looks at the stack
+void compile_call_leaf(struct code_block *block, uint16_t ret_addr)
+{
+    compile_push_imm16(block, ret_addr);
+}
+
+// the inlined leaf's ret: carries on in the block when it pops ret_addr,
+// anything that was stored over it goes to the dispatcher
+void compile_ret_leaf(struct code_block *block, uint16_t ret_addr)
+{
+    compile_pop_pc(block);
+    emit_cmpi_w_imm_dn(block, ret_addr, REG_68K_D_NEXT_PC);
+    emit_beq_b(block, 6);
+    emit_dispatch_jump(block);
+}
+
+// the code after it is compiled for ROM bank `bank`, which a bank select
+// the compiler saw picked. the mapped bank is what the MBC made of it,
+// so any other bank goes to target the usual way
+void compile_bank_guard(struct code_block *block, uint8_t bank, uint16_t target)
+{
+    size_t hit;
+
+    flush_cycles(block);
+    emit_cmpi_b_imm_disp_an(block, bank, JIT_CTX_ROM_BANK, REG_68K_A_CTX);
+    hit = block->length;
+    emit_beq_w(block, 0);
+    emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
+    emit_move_w_dn(block, REG_68K_D_NEXT_PC, target);
+    emit_block_exit(block, target);
+    patch_branch_w(block, hit);
 }
 
 // Compile conditional call (call nz, call z, call nc, call c)
@@ -240,67 +478,72 @@ void compile_call_cond(
 ) {
     uint16_t target = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
     uint16_t ret_addr = src_address + *src_ptr + 2;  // address after call
-    size_t skip;
-    int saved;
+    size_t skip, lea_at;
+    int saved, cond;
     *src_ptr += 2;
 
     // Test the flag bit in D7
-    emit_btst_imm_dn(block, flag_bit, REG_68K_D_FLAGS);
+    cond = compile_flag_test(block, flag_bit, branch_if_set);
 
     // If condition NOT met, skip the call sequence
     skip = block->length;
-    if (branch_if_set) {
-        emit_beq_w(block, 0);
-    } else {
-        emit_bne_w(block, 0);
-    }
+    emit_bcc_opcode_w(block, cond ^ 1, 0);
 
     // taken path: materialize pending + extra; restore for the fall-through
     saved = pending_cycles;
     emit_add_cycles(block, pending_cycles + 12);
     pending_cycles = 0;
     compile_push_imm16(block, ret_addr);
+    lea_at = emit_ret_stack_push(block, ret_addr);
 
     // Jump to target
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
     emit_move_w_dn(block, REG_68K_D_NEXT_PC, target);
     emit_block_exit(block, target);
+    emit_ret_landing(block, lea_at, ret_addr);
     pending_cycles = saved;
 
     patch_branch_w(block, skip);
 }
 
-void compile_ret(struct code_block *block)
+void compile_ret(struct code_block *block, struct compile_ctx *ctx)
 {
     compile_pop_pc(block);
-    emit_dispatch_jump(block);
+    emit_ret_stack_pop(block, ctx);
+}
+
+// interrupt entry never pushes a shadow entry, so reti must not pop one
+void compile_reti(struct code_block *block, struct compile_ctx *ctx)
+{
+    compile_pop_pc(block);
+    compile_indirect_exit(block, ctx);
 }
 
 // Compile conditional return (ret nz, ret z, ret nc, ret c)
 // flag_bit: which bit in D7 to test (2=Z, 0=C)
 // branch_if_set: if true, return when flag is set; if false, return when clear
-void compile_ret_cond(struct code_block *block, uint8_t flag_bit, int branch_if_set)
-{
+void compile_ret_cond(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint8_t flag_bit,
+    int branch_if_set
+) {
     size_t skip;
-    int saved;
+    int saved, cond;
 
     // Test the flag bit in D7
-    emit_btst_imm_dn(block, flag_bit, REG_68K_D_FLAGS);
+    cond = compile_flag_test(block, flag_bit, branch_if_set);
 
     // If condition NOT met, skip the return sequence
     skip = block->length;
-    if (branch_if_set) {
-        emit_beq_w(block, 0);
-    } else {
-        emit_bne_w(block, 0);
-    }
+    emit_bcc_opcode_w(block, cond ^ 1, 0);
 
     // taken path: materialize pending + extra; restore for the fall-through
     saved = pending_cycles;
     emit_add_cycles(block, pending_cycles + 12);
     pending_cycles = 0;
     compile_pop_pc(block);
-    emit_dispatch_jump(block);
+    emit_ret_stack_pop(block, ctx);
     pending_cycles = saved;
 
     patch_branch_w(block, skip);
@@ -308,9 +551,13 @@ void compile_ret_cond(struct code_block *block, uint8_t flag_bit, int branch_if_
 
 void compile_rst_n(struct code_block *block, uint8_t target, uint16_t ret_addr)
 {
+    size_t lea_at;
+
     compile_push_imm16(block, ret_addr);
+    lea_at = emit_ret_stack_push(block, ret_addr);
 
     // jump to target (0x00, 0x08, 0x10, 0x18, 0x20, 0x28, 0x30, 0x38)
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, target);
     emit_block_exit(block, target);
+    emit_ret_landing(block, lea_at, ret_addr);
 }
@@ -1,6 +1,27 @@
 #ifndef _BRANCHES_H
 #define _BRANCHES_H
 
+#include "jumptable.h"
+
+// back edges to code[target_m68k], compiled for target_gb_pc at a loop
+// head: pending cycles flushed, nothing known. the branch is taken while
+// the budget lasts, after that it exits to the dispatcher from the cold
+// tail. compile_loop_branch takes it when cond, from compile_flag_test,
+// holds
+void compile_loop_jump(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint16_t target_gb_pc,
+    uint16_t target_m68k
+);
+void compile_loop_branch(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    int cond,
+    uint16_t target_gb_pc,
+    uint16_t target_m68k
+);
+
 void compile_jr(
     struct code_block *block,
     struct compile_ctx *ctx,
@@ -42,8 +63,27 @@ void compile_call_cond(
     int branch_if_set
 );
 
-void compile_ret(struct code_block *block);
-void compile_ret_cond(struct code_block *block, uint8_t flag_bit, int branch_if_set);
+void compile_call_inline(struct code_block *block, uint16_t ret_addr);
+void compile_call_leaf(struct code_block *block, uint16_t ret_addr);
+void compile_bank_guard(struct code_block *block, uint8_t bank, uint16_t target);
+
+void compile_indirect_exit(struct code_block *block, struct compile_ctx *ctx);
+size_t compile_jump_table(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    struct jump_table *jt,
+    uint16_t ret_addr
+);
+
+void compile_ret(struct code_block *block, struct compile_ctx *ctx);
+void compile_ret_leaf(struct code_block *block, uint16_t ret_addr);
+void compile_reti(struct code_block *block, struct compile_ctx *ctx);
+void compile_ret_cond(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint8_t flag_bit,
+    int branch_if_set
+);
 void compile_rst_n(struct code_block *block, uint8_t target, uint16_t ret_addr);
 
 #endif
\ No newline at end of file
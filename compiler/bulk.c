@@ -0,0 +1,321 @@
+#include <stdint.h>
+
+#include "bulk.h"
+#include "compiler.h"
+#include "emitters.h"
+#include "instructions.h"
+#include "interop.h"
+#include "timing.h"
+#include "decode.h"
+
+#define READ_BYTE(off) (decode_read(ctx, src_address + (off)))
+
+// native loop plus the loop's body compiled the usual way
+#define BULK_ROOM 640
+
+int bulk_match(
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t off,
+    int room,
+    struct bulk_loop *loop
+) {
+    uint8_t b[9];
+    int n, k;
+
+    if (room < BULK_ROOM || off > 256 - sizeof b) {
+        return 0;
+    }
+    for (k = 0; k < (int) sizeof b; k++) {
+        b[k] = READ_BYTE(off + k);
+    }
+
+    loop->copy = 0;
+    loop->src_hl = 0;
+    loop->down = 0;
+    loop->value = BULK_FILL_ZERO;
+    if (((b[0] == 0x2a && b[1] == 0x12) || (b[0] == 0x1a && b[1] == 0x22))
+            && b[2] == 0x13) {
+        loop->copy = 1;
+        loop->src_hl = b[0] == 0x2a;
+        n = 3;
+    } else if ((b[0] == 0x7a || b[0] == 0x7b || b[0] == 0xaf) && b[1] == 0x22) {
+        // A is the count's low bits after an iteration, the value comes
+        // from D, E or nowhere
+        if (b[0] != 0xaf) {
+            loop->value = b[0] == 0x7a ? GB_REG_D : GB_REG_E;
+        }
+        n = 2;
+    } else if (b[0] == 0x22 || b[0] == 0x32) {
+        loop->down = b[0] == 0x32;
+        n = 1;
+    } else {
+        return 0;
+    }
+
+    if (b[n] == 0x0b && ((b[n + 1] == 0x78 && b[n + 2] == 0xb1)
+            || (b[n + 1] == 0x79 && b[n + 2] == 0xb0))) {
+        // dec bc; ld a, b; or c overwrites A, so a fill with A isn't one
+        if (n == 1) {
+            return 0;
+        }
+        loop->count = BULK_COUNT_BC;
+        n += 3;
+    } else if (b[n] == 0x05 || b[n] == 0x0d) {
+        if (n == 2) {
+            return 0;
+        }
+        loop->count = b[n] == 0x05 ? GB_REG_B : GB_REG_C;
+        n += 1;
+    } else {
+        return 0;
+    }
+
+    if (b[n] != 0x20 || (int8_t) b[n + 1] != -(n + 2)) {
+        return 0;
+    }
+    // nothing else may branch into the middle
+    for (k = 1; k <= n; k++) {
+        if (flush_at[off + k]) {
+            return 0;
+        }
+    }
+
+    loop->end = off + n + 2;
+    loop->iter_cycles = instructions[0x20].cycles_branch;
+    loop->last_less = instructions[0x20].cycles_branch - instructions[0x20].cycles;
+    for (k = 0; k < n; k++) {
+        loop->iter_cycles += instructions[b[k]].cycles;
+    }
+    return 1;
+}
+
+// D0.w = a GB pointer
+static void load_pointer(struct code_block *block, int hl)
+{
+    if (hl) {
+        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
+    } else {
+        compile_join_de(block, REG_68K_D_SCRATCH_0);
+    }
+}
+
+// split the word in src into the 0x00HH00LL pair format
+static void split_pair(struct code_block *block, uint8_t src, uint8_t pair)
+{
+    emit_move_w_dn_dn(block, src, pair);
+    emit_lsl_l_imm_dn(block, 8, pair);
+    emit_move_b_dn_dn(block, src, pair);
+    emit_andi_l_dn(block, pair, 0x00ff00ff);
+}
+
+// page base for the GB pointer in D0 into areg plus D0, branching out
+// through *slow if the page isn't directly mapped
+static void lookup_host(
+    struct code_block *block,
+    uint8_t table,
+    uint8_t areg,
+    size_t *slow
+) {
+    emit_move_w_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
+    compile_page_lookup(block, table, REG_68K_D_SCRATCH_1, areg);
+    emit_move_l_an_dn(block, areg, REG_68K_D_SCRATCH_1);
+    *slow = block->length;
+    emit_beq_w(block, 0);
+    emit_adda_w_dn_an(block, REG_68K_D_SCRATCH_0, areg);
+    emit_andi_l_dn(block, REG_68K_D_SCRATCH_0, 0x0fff);
+}
+
+size_t compile_bulk_loop(
+    struct code_block *block,
+    struct bulk_loop *loop,
+    uint16_t loop_pc
+) {
+    size_t slow[2], chunk, top, fits, one, some, done_branch, done;
+    int slows = 0, k;
+    int dst_hl = !loop->copy || !loop->src_hl;
+
+    flush_cycles(block);
+
+    // D3 = iterations left. the count is decremented before it's tested,
+    // so 0 means 65536 or 256
+    if (loop->count == BULK_COUNT_BC) {
+        compile_join_bc(block, REG_68K_D_NEXT_PC);
+        emit_subq_w_dn(block, REG_68K_D_NEXT_PC, 1);
+        emit_andi_l_dn(block, REG_68K_D_NEXT_PC, 0xffff);
+        emit_addq_l_dn(block, REG_68K_D_NEXT_PC, 1);
+    } else {
+        emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
+        if (loop->count == GB_REG_B) {
+            emit_move_l_dn_dn(block, REG_68K_D_BC, REG_68K_D_SCRATCH_0);
+            emit_swap(block, REG_68K_D_SCRATCH_0);
+            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_NEXT_PC);
+        } else {
+            emit_move_b_dn_dn(block, REG_68K_D_BC, REG_68K_D_NEXT_PC);
+        }
+        emit_subq_w_dn(block, REG_68K_D_NEXT_PC, 1);
+        emit_andi_w_dn(block, REG_68K_D_NEXT_PC, 0xff);
+        emit_addq_w_dn(block, REG_68K_D_NEXT_PC, 1);
+    }
+
+    // fills store D4: A itself for the 8-bit counts. the BC-counted ones
+    // reload A every iteration and finish with A = B | C, so A is free
+    if (!loop->copy && loop->count == BULK_COUNT_BC) {
+        if (loop->value == GB_REG_D) {
+            emit_move_l_dn_dn(block, REG_68K_D_DE, REG_68K_D_A);
+            emit_swap(block, REG_68K_D_A);
+        } else if (loop->value == GB_REG_E) {
+            emit_move_b_dn_dn(block, REG_68K_D_DE, REG_68K_D_A);
+        } else {
+            emit_moveq_dn(block, REG_68K_D_A, 0);
+        }
+    }
+
+    // each chunk stays on one source and one destination page
+    chunk = block->length;
+    if (loop->copy) {
+        // A0 = host source, D4 = bytes to the end of its page. A is
+        // reloaded by the loop body before anything reads it
+        load_pointer(block, loop->src_hl);
+        lookup_host(block, REG_68K_A_READ_PAGE, REG_68K_A_SCRATCH_1,
+                &slow[slows++]);
+        emit_move_l_dn(block, REG_68K_D_A, 0x1000);
+        emit_sub_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
+    }
+    // A1 = host destination, D1 = bytes to the edge of its page
+    load_pointer(block, dst_hl);
+    lookup_host(block, REG_68K_A_WRITE_PAGE, REG_68K_A_SCRATCH_2,
+            &slow[slows++]);
+    if (loop->down) {
+        // -(a1) stores below the pointer
+        emit_move_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
+        emit_addq_l_dn(block, REG_68K_D_SCRATCH_1, 1);
+        emit_addq_l_an(block, REG_68K_A_SCRATCH_2, 1);
+    } else {
+        emit_move_l_dn(block, REG_68K_D_SCRATCH_1, 0x1000);
+        emit_sub_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
+    }
+    if (loop->copy) {
+        emit_cmp_l_dn_dn(block, REG_68K_D_A, REG_68K_D_SCRATCH_1);
+        emit_bls_b(block, 2);
+        emit_move_l_dn_dn(block, REG_68K_D_A, REG_68K_D_SCRATCH_1);
+    }
+    emit_cmp_l_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_1);
+    emit_bls_b(block, 2);
+    emit_move_l_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_1);
+
+    // D0 = cycle count after D1 iterations. if that's past the wake
+    // limit, only do as many as fit, at least one
+    emit_move_w_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_SCRATCH_0);
+    emit_mulu_w_imm_dn(block, loop->iter_cycles, REG_68K_D_SCRATCH_0);
+    emit_add_l_dn_dn(block, REG_68K_D_CYCLE_COUNT, REG_68K_D_SCRATCH_0);
+    emit_cmp_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX,
+            REG_68K_D_SCRATCH_0);
+    fits = block->length;
+    emit_bls_b(block, 0);
+    emit_move_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX,
+            REG_68K_D_SCRATCH_0);
+    emit_sub_l_dn_dn(block, REG_68K_D_CYCLE_COUNT, REG_68K_D_SCRATCH_0);
+    one = block->length;
+    emit_bls_b(block, 0);
+    // quotient < D1 <= 4096
+    emit_divu_w_imm_dn(block, loop->iter_cycles, REG_68K_D_SCRATCH_0);
+    emit_andi_l_dn(block, REG_68K_D_SCRATCH_0, 0xffff);
+    some = block->length;
+    emit_bne_b(block, 0);
+    patch_branch_b(block, one);
+    emit_moveq_dn(block, REG_68K_D_SCRATCH_0, 1);
+    patch_branch_b(block, some);
+    emit_move_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
+    emit_mulu_w_imm_dn(block, loop->iter_cycles, REG_68K_D_SCRATCH_0);
+    emit_add_l_dn_dn(block, REG_68K_D_CYCLE_COUNT, REG_68K_D_SCRATCH_0);
+    patch_branch_b(block, fits);
+    emit_move_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_CYCLE_COUNT);
+
+    // move D1 bytes
+    emit_move_w_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_SCRATCH_0);
+    emit_subq_w_dn(block, REG_68K_D_SCRATCH_0, 1);
+    top = block->length;
+    if (loop->copy) {
+        emit_move_b_postinc_postinc(block, REG_68K_A_SCRATCH_1,
+                REG_68K_A_SCRATCH_2);
+    } else if (loop->down) {
+        emit_move_b_dn_predec_an(block, REG_68K_D_A, REG_68K_A_SCRATCH_2);
+    } else {
+        emit_move_b_dn_postinc_an(block, REG_68K_D_A, REG_68K_A_SCRATCH_2);
+    }
+    emit_dbra_dn(block, REG_68K_D_SCRATCH_0,
+            (int16_t) (top - (block->length + 2)));
+
+    // registers as the last of those iterations left them
+    if (loop->down) {
+        emit_suba_l_dn_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_HL);
+    } else {
+        emit_adda_l_dn_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_HL);
+    }
+    if (loop->copy) {
+        compile_join_de(block, REG_68K_D_SCRATCH_0);
+        emit_add_w_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_SCRATCH_0);
+        split_pair(block, REG_68K_D_SCRATCH_0, REG_68K_D_DE);
+    }
+    emit_sub_l_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_NEXT_PC);
+    if (loop->count == BULK_COUNT_BC) {
+        split_pair(block, REG_68K_D_NEXT_PC, REG_68K_D_BC);
+    } else if (loop->count == GB_REG_B) {
+        emit_swap(block, REG_68K_D_BC);
+        emit_move_b_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_BC);
+        emit_swap(block, REG_68K_D_BC);
+    } else {
+        emit_move_b_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_BC);
+    }
+    emit_tst_l_dn(block, REG_68K_D_NEXT_PC);
+    done_branch = block->length;
+    emit_beq_w(block, 0);
+
+    // keep going while the compiled back edge would
+    emit_move_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX,
+            REG_68K_D_SCRATCH_0);
+    emit_sub_l_dn_dn(block, REG_68K_D_CYCLE_COUNT, REG_68K_D_SCRATCH_0);
+    emit_bcc_opcode_w(block, COND_HI, (int16_t) (chunk - (block->length + 2)));
+
+    // out of budget between iterations: A and flags as the loop body
+    // leaves them with the count not done (Z=0)
+    if (loop->count == BULK_COUNT_BC) {
+        // ld a, b; or c: C=0
+        emit_move_w_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_A);
+        emit_lsr_w_imm_dn(block, 8, REG_68K_D_A);
+        emit_or_b_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_A);
+        emit_moveq_dn(block, REG_68K_D_FLAGS, 0);
+    } else {
+        // dec b/c keeps C
+        if (loop->copy) {
+            emit_move_b_disp_an_dn(block, -1, REG_68K_A_SCRATCH_2, REG_68K_D_A);
+        }
+        emit_andi_b_dn(block, REG_68K_D_FLAGS, 0x01);
+    }
+    emit_move_l_dn(block, REG_68K_D_NEXT_PC, loop_pc);
+    emit_rts(block);
+
+    // count done, the last jr wasn't taken
+    patch_branch_w(block, done_branch);
+    emit_subq_l_dn(block, REG_68K_D_CYCLE_COUNT, loop->last_less);
+    if (loop->count == BULK_COUNT_BC) {
+        emit_moveq_dn(block, REG_68K_D_A, 0);
+        emit_moveq_dn(block, REG_68K_D_FLAGS, 0x04);
+    } else {
+        if (loop->copy) {
+            emit_move_b_disp_an_dn(block, -1, REG_68K_A_SCRATCH_2, REG_68K_D_A);
+        }
+        emit_andi_b_dn(block, REG_68K_D_FLAGS, 0x01);
+        emit_ori_b_dn(block, REG_68K_D_FLAGS, 0x04);
+    }
+    done = block->length;
+    emit_bra_w(block, 0);
+
+    // a page that goes through the helpers: one iteration of the compiled
+    // body, whose back edge comes here again
+    for (k = 0; k < slows; k++) {
+        patch_branch_w(block, slow[k]);
+    }
+    return done;
+}
@@ -0,0 +1,59 @@
+#ifndef _BULK_H
+#define _BULK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "compiler.h"
+
+// Copy and fill loops. The usual SM83 memcpy/memset loops are recognized
+// at their loop head, like the delay loop in timing.c:
+//   ld a, (hl+); ld (de), a; inc de; <count>      copy HL -> DE
+//   ld a, (de); ld (hl+), a; inc de; <count>      copy DE -> HL
+//   ld a, d / ld a, e / xor a; ld (hl+), a; dec bc; ld a, b; or c
+//   ld (hl+), a / ld (hl-), a; dec b / dec c      fill with A
+// where <count> is dec bc; ld a, b; or c (or ld a, c; or b), or dec b/c,
+// and a jr nz closes the loop.
+
+#define BULK_COUNT_BC 0xff
+#define BULK_FILL_ZERO 0xff
+
+struct bulk_loop {
+    // source offset just past the closing jr
+    uint16_t end;
+    int copy;
+    // copies: HL is the source and DE the destination, or the other way
+    int src_hl;
+    // fills: HL goes down
+    int down;
+    // GB_REG_B, GB_REG_C or BULK_COUNT_BC
+    uint8_t count;
+    // fills counted in BC: GB_REG_D, GB_REG_E or BULK_FILL_ZERO
+    uint8_t value;
+    // cycles of one iteration with the jr taken, and how many fewer the
+    // last one takes
+    int iter_cycles;
+    int last_less;
+};
+
+// recognizes a loop starting at off, with room bytes of code to spare
+// for it. returns 0 if there is none
+int bulk_match(
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t off,
+    int room,
+    struct bulk_loop *loop
+);
+
+// Emits the native loop at the loop head. It moves whole runs of bytes
+// that stay on directly mapped pages and exits at loop_pc when the cycle
+// budget runs out. Falling through runs one iteration of the loop's
+// compiled body instead, for pages that go through the helpers. Returns
+// the branch to point past the compiled body, taken when the count is done
+size_t compile_bulk_loop(
+    struct code_block *block,
+    struct bulk_loop *loop,
+    uint16_t loop_pc
+);
+
+#endif
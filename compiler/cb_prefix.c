@@ -9,17 +9,21 @@
 // todo remove these
 static void compile_shift_flags(struct code_block *block)
 {
-    emit_move_sr_dn(block, REG_68K_D_FLAGS);
+    compile_set_zc_flags(block);
 }
 
 static void compile_swap_flags(struct code_block *block)
 {
+    if (!flags_live)
+        return;
     emit_move_sr_dn(block, REG_68K_D_FLAGS);
     emit_andi_b_dn(block, REG_68K_D_FLAGS, 0xfe);
 }
 
 static void compile_bit_flags(struct code_block *block)
 {
+    if (!(flags_live & FLAG_Z))
+        return;
     // Metroid II (and probably others) depend on bit only affecting Z and not C
     emit_scc(block, COND_EQ, REG_68K_D_SCRATCH_0);
     emit_andi_b_dn(block, REG_68K_D_SCRATCH_0, 0x04);
@@ -0,0 +1,123 @@
+#include <stdint.h>
+
+#include "cold.h"
+#include "emitters.h"
+#include "peephole.h"
+
+// open slow paths, innermost last
+#define COLD_DEPTH 4
+
+static union code_block_buffer tail;
+static int enabled;
+
+// branches out of the block into the tail and back, each by its offset
+// in the code it sits in
+static uint16_t out_site[COLD_MAX_PATHS];
+static uint16_t out_target[COLD_MAX_PATHS];
+static uint16_t back_site[COLD_MAX_PATHS];
+static uint16_t back_target[COLD_MAX_PATHS];
+static int out_count, back_count;
+
+static struct {
+    struct code_block *block;
+    // emitted in line after a bra.w over it at `over`
+    int in_line;
+    size_t over;
+} open[COLD_DEPTH];
+static int depth;
+
+size_t cold_length;
+
+void cold_reset(void)
+{
+    tail.block.length = 0;
+    tail.block.capacity = BLOCK_MAX_CODE;
+    cold_length = 0;
+    out_count = 0;
+    back_count = 0;
+    depth = 0;
+    enabled = 1;
+}
+
+struct code_block *cold_begin(struct code_block *block, size_t site)
+{
+    open[depth].block = block;
+    open[depth].in_line = !enabled || depth || out_count == COLD_MAX_PATHS
+            || back_count == COLD_MAX_PATHS;
+
+    if (open[depth].in_line) {
+        open[depth].over = block->length;
+        emit_bra_w(block, 0);
+        patch_branch_w(block, site);
+        depth++;
+        return block;
+    }
+    depth++;
+    peephole_data_cold(1);
+    cold_branch(site);
+    return &tail.block;
+}
+
+void cold_branch(size_t site)
+{
+    if (open[depth - 1].in_line) {
+        patch_branch_w(open[depth - 1].block, site);
+        return;
+    }
+    out_site[out_count] = site;
+    out_target[out_count++] = tail.block.length;
+}
+
+static void cold_end(int resume)
+{
+    struct code_block *block = open[--depth].block;
+
+    if (open[depth].in_line) {
+        patch_branch_w(block, open[depth].over);
+        return;
+    }
+    if (resume) {
+        back_site[back_count] = tail.block.length;
+        back_target[back_count++] = block->length;
+        emit_bra_w(&tail.block, 0);
+    }
+    peephole_data_cold(0);
+    cold_length = tail.block.length;
+}
+
+void cold_resume(void)
+{
+    cold_end(1);
+}
+
+void cold_close(void)
+{
+    cold_end(0);
+}
+
+static void patch_disp_w(struct code_block *block, size_t site, size_t target)
+{
+    uint16_t disp = target - (site + 2);
+
+    block->code[site + 2] = disp >> 8;
+    block->code[site + 3] = disp & 0xff;
+}
+
+size_t cold_append(struct code_block *block)
+{
+    size_t at = block->length, k;
+
+    enabled = 0;
+    for (k = 0; k < tail.block.length; k++) {
+        emit_byte(block, tail.block.code[k]);
+    }
+    for (k = 0; k < (size_t) out_count; k++) {
+        patch_disp_w(block, out_site[k], at + out_target[k]);
+    }
+    for (k = 0; k < (size_t) back_count; k++) {
+        patch_disp_w(block, at + back_site[k], back_target[k]);
+    }
+    peephole_place_cold(at);
+    cold_length = 0;
+    return at;
+}
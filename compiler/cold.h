@@ -0,0 +1,43 @@
+#ifndef _COLD_H
+#define _COLD_H
+
+#include <stddef.h>
+#include "compiler.h"
+
+// Cold tail. The slow paths next to a fast path (the stack in slow mode,
+// 16-bit accesses that cross a page or miss the page table, the exits of
+// back edges that ran out of budget) almost never run, but emitted in
+// line they sit between the fast path and the code after it, and loops
+// share the instruction cache with them. Instead they are compiled into
+// a side buffer while the block is, and appended after its last exit:
+// the fast path leaves through a .w branch and the slow path comes back
+// with a bra.w. Slow paths inside slow paths, and any past
+// COLD_MAX_PATHS, stay in line.
+
+#define COLD_MAX_PATHS 64
+
+// bytes waiting to be appended, BLOCK_ROOM counts them against the block
+extern size_t cold_length;
+
+// starts a block: forgets the previous tail and sends slow paths to it.
+// outside compile_block (the helpers) everything stays in line
+void cold_reset(void);
+
+// starts the slow path that the .w branch at site in block goes to. call
+// after the fast path, emit the slow path into the block returned
+struct code_block *cold_begin(struct code_block *block, size_t site);
+
+// another .w branch in block into the slow path just begun
+void cold_branch(size_t site);
+
+// ends the slow path, carrying on where block is now
+void cold_resume(void);
+
+// ends a slow path that leaves the block on its own
+void cold_close(void);
+
+// appends the tail to block and points the branches across at it.
+// returns the offset it starts at
+size_t cold_append(struct code_block *block);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,18 +15,98 @@
 #include "stack.h"
 #include "instructions.h"
 #include "timing.h"
+#include "consts.h"
+#include "pointers.h"
+#include "pairs.h"
+#include "jumptable.h"
+#include "bulk.h"
+#include "peephole.h"
+#include "decode.h"
+#include "cold.h"
 
 // helper for reading GB memory during compilation
-#define READ_BYTE(off) (ctx->read(ctx->dmg, src_address + (off)))
+#define READ_BYTE(off) (decode_read(ctx, src_address + (off)))
 
 uint16_t m68k_offsets[256];
 
 int pending_cycles;
 
+struct link_log link_log;
+
+// no single instruction should emit more than this, see the warning below
+#define MAX_INSN_BYTES 272
+
+// room kept free at the end of code[]: one worst-case instruction plus the
+// exit that ends an over-long block (bank linked, at most 64 bytes)
+#define BLOCK_SLACK (MAX_INSN_BYTES + 72)
+
+// smallest reservation worth starting a block in, a few instructions and
+// the slack. a block that fills it ends with an exit like any other
+#define BLOCK_MIN_CODE (2 * BLOCK_SLACK)
+
+// bytes left for code before the slack, the cold tail and the reentry
+// map go after the code
+#define BLOCK_ROOM(block) \
+    ((int) ((block)->capacity - BLOCK_SLACK - (block)->length - cold_length \
+        - reentry_count * sizeof (struct block_reentry)))
+
 // GB offsets that are targets of backward jumps within the block; pending
 // cycles need to be flushed before these so loop heads sit at pending == 0
 uint8_t flush_at[256];
 
+// the window has an ld sp, a loop head may be reached from after one
+static int sp_in_window;
+
+// Loop regions. A loop whose back edge is a jp, or sits in another
+// superblock segment than its head (past an inlined call, or a window
+// further on), is compiled as one region: the back edge branches to the
+// head in the block, checking the budget like a backward jr does, instead
+// of exiting to the dispatcher every time round. A back edge to code the
+// block compiled without flushing at it asks for another pass that does.
+#define LOOP_MAX_HEADS 32
+#define LOOP_MAX_WANTED 8
+#define LOOP_PASSES 2
+
+// where the main loop flushed so far, by GB address, first one kept
+static uint16_t head_pc[LOOP_MAX_HEADS];
+static uint16_t head_at[LOOP_MAX_HEADS];
+static int head_count;
+// loop heads the scans didn't find, marked in flush_at on the next pass
+static uint16_t wanted_pc[LOOP_MAX_WANTED];
+static int wanted_count;
+// this pass wanted one the last didn't
+static int wanted_new;
+
+static void loop_head_add(uint16_t pc, size_t at)
+{
+    int k;
+
+    for (k = 0; k < head_count; k++) {
+        if (head_pc[k] == pc) {
+            return;
+        }
+    }
+    if (head_count < LOOP_MAX_HEADS) {
+        head_pc[head_count] = pc;
+        head_at[head_count++] = at;
+    }
+}
+
+static void loop_want(uint16_t pc)
+{
+    int k;
+
+    for (k = 0; k < wanted_count; k++) {
+        if (wanted_pc[k] == pc) {
+            return;
+        }
+    }
+    if (wanted_count < LOOP_MAX_WANTED) {
+        wanted_pc[wanted_count++] = pc;
+        wanted_new = 1;
+    }
+}
+
 // SM83 instruction lengths for the branch-target pre-scan (CB handled as 2)
 const uint8_t insn_length[256] = {
     1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1, // 0x00
@@ -57,33 +138,426 @@ void flush_cycles(struct code_block *block)
     pending_cycles = 0;
 }
 
-// mark targets of backward jr within the block so the main loop flushes
-// pending cycles there. spurious marks (offsets the main loop never lands
-// on, or code past an exit) are harmless
-static void scan_branch_targets(
-    uint16_t src_address,
-    struct compile_ctx *ctx
-) {
+// mark targets of backward jr and jp within the window starting at base,
+// and the loop heads wanted in it, so the main loop flushes pending cycles
+// there. spurious marks (offsets the main loop never lands on, or code
+// past an exit) are harmless. this walks the whole window, most of which
+// the block never compiles, so it reads opcodes and branch operands only
+// instead of decoding every instruction
+static void scan_branch_targets(struct compile_ctx *ctx, uint16_t base)
+{
     uint16_t off = 0;
+    int k;
 
+    sp_in_window = 0;
     while (off < 256) {
-        uint8_t op = READ_BYTE(off);
-        uint16_t next = off + insn_length[op];
+        uint8_t op = decode_read(ctx, base + off);
 
+        if (op == 0x31 || op == 0xf9) {
+            sp_in_window = 1;
+        }
         if (op == 0x18 || op == 0x20 || op == 0x28
                 || op == 0x30 || op == 0x38) {
-            int16_t target = (int16_t) next + (int8_t) READ_BYTE(off + 1);
+            int16_t target = (int16_t) (off + 2)
+                    + (int8_t) decode_read(ctx, base + off + 1);
             if (target >= 0 && target < off) {
                 flush_at[target] = 1;
             }
+        } else if (op == 0xc3 || (op & 0xe7) == 0xc2) {
+            uint16_t target = decode_read(ctx, base + off + 1)
+                    | decode_read(ctx, base + off + 2) << 8;
+            if ((uint16_t) (target - base) < off) {
+                flush_at[target - base] = 1;
+            }
+        }
+        off += insn_length[op];
+    }
+    for (k = 0; k < wanted_count; k++) {
+        if ((uint16_t) (wanted_pc[k] - base) < 256) {
+            flush_at[wanted_pc[k] - base] = 1;
         }
-        off = next;
     }
 }
 
+// mid-block entry points of the block being compiled, stored in the cache
+// after the peephole pass has moved the code. past the limit they're just
+// not registered, the dispatcher compiles those addresses on their own
+#define MAX_ENTRIES 32
+
+static uint16_t entry_pc[MAX_ENTRIES];
+// one more for the start of the cold tail while the peephole pass runs
+static uint16_t entry_off[MAX_ENTRIES + 1];
+static int entry_count;
+// a superblock followed a far call: banked code from here on may be from
+// another bank than the one entries are stored for
+static int entry_far;
+
+// code past the stack guard relies on it, entering there would skip it.
+// a quick block's own start has to go through its count, or a loop back
+// to it would keep the block from ever getting hot
+static void drop_skipping_entries(struct code_block *block)
+{
+    int k, n = 0;
+
+    for (k = 0; k < entry_count; k++) {
+        if (!stack_guarded(entry_off[k]) && !(block->tier == TIER_QUICK
+                && entry_pc[k] == block->src_address)) {
+            entry_pc[n] = entry_pc[k];
+            entry_off[n] = entry_off[k];
+            n++;
+        }
+    }
+    entry_count = n;
+}
+
+void compile_entry_point(struct compile_ctx *ctx, uint16_t gb_pc, uint16_t m68k_off)
+{
+    if (entry_far && gb_pc >= 0x4000 && gb_pc < 0x8000) {
+        return;
+    }
+    if (ctx->cache_store && entry_count < MAX_ENTRIES) {
+        entry_pc[entry_count] = gb_pc;
+        entry_off[entry_count] = m68k_off;
+        entry_count++;
+    }
+}
+
+// instruction boundaries of the block being compiled that the dispatcher
+// could enter at, kept with the block for block_reentry. only boundaries
+// up to REENTRY_REACH past the start are recorded, that's as far back as
+// block_reentry looks
+#define REENTRY_REACH 256
+
+static uint16_t reentry_pc[PEEPHOLE_MAX_ENTRIES];
+// where it was before the peephole pass
+static uint16_t reentry_at[PEEPHOLE_MAX_ENTRIES];
+static int reentry_count;
+
+static int reentry_fits(struct code_block *block, uint16_t pc)
+{
+    uint16_t start = block->src_address;
+
+    if (reentry_count == PEEPHOLE_MAX_ENTRIES || pc >= 0x8000 || pc == start
+            || (uint16_t) (pc - start) > REENTRY_REACH) {
+        return 0;
+    }
+    // banked code is looked up in the bank the block was stored for, but
+    // a far call may have switched to another
+    if (pc >= 0x4000) {
+        return start >= 0x4000 && !entry_far;
+    }
+    return start < 0x4000;
+}
+
+// superblocks: an unconditional jp/jr/call into ROM that can't change under
+// the block keeps compiling at the target instead of ending the block, so
+// jump-linked routines become one straight-line block with one exit
+#define SUPERBLOCK_MAX_SEGMENTS 8
+#define SUPERBLOCK_MAX_BYTES 1024
+#define SUPERBLOCK_MAX_INSNS 128
+// longest call target compiled inline as a leaf
+#define SUPERBLOCK_LEAF_INSNS 16
+
+struct superblock {
+    int segments;
+    // SUPERBLOCK_MAX_SEGMENTS, 1 in the quick tier: it follows nothing
+    int max_segments;
+    // GB address ranges compiled so far, the last one is still growing
+    uint16_t start[SUPERBLOCK_MAX_SEGMENTS];
+    uint16_t end[SUPERBLOCK_MAX_SEGMENTS];
+    // every segment so far is in 0x4000-0x7fff, so the block will be cached
+    // for the current bank and may inline more code from it
+    int banked;
+    // a store that could have reached the MBC registers was compiled, the
+    // current bank is no longer known
+    int rom_written;
+    // compiling a leaf callee inline: its ret goes back to leaf_ret, with
+    // banked as it was at the call
+    int in_leaf;
+    uint16_t leaf_ret;
+    int leaf_banked;
+    // the ROM bank the last store that could reach the MBC selected, when
+    // it was a constant written to the bank register. -1 if unknown
+    int far_bank;
+};
+
+// stores whose address isn't known to be outside 0x0000-0x7fff
+static int store_may_hit_rom(const struct gb_insn *in)
+{
+    switch (in->op) {
+    case 0x02: case 0x12: case 0x22: case 0x32:
+    case 0x34: case 0x35: case 0x36:
+    case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75:
+    case 0x77:
+        return 1;
+    case 0x08: case 0xea:
+        return in->operand < 0x8000;
+    case 0xcb:
+        return (in->operand & 7) == 6
+                && (in->operand < 0x40 || in->operand >= 0x80);
+    }
+    return 0;
+}
+
+// ld (a16), a of a constant into the bank select register: the bank it
+// selects, -1 for any other store
+static int superblock_bank_select(
+    struct compile_ctx *ctx,
+    const struct gb_insn *in
+) {
+    if (in->op != 0xea || !ctx->read_bank || !ctx->bank_reg_hi
+            || in->operand < ctx->bank_reg_lo
+            || in->operand > ctx->bank_reg_hi
+            || !(consts_known & (1 << GB_REG_A))) {
+        return -1;
+    }
+    return consts_val[GB_REG_A];
+}
+
+// the size limits, and no loops back into code already in the block
+static int superblock_fits(
+    struct superblock *sb,
+    struct code_block *block,
+    uint16_t target
+) {
+    int k;
+
+    if (block->src_address >= 0x8000 || target >= 0x8000) {
+        return 0;
+    }
+    if (sb->segments == sb->max_segments
+            || block->length > SUPERBLOCK_MAX_BYTES
+            || block->count > SUPERBLOCK_MAX_INSNS) {
+        return 0;
+    }
+    // already compiled into this block: that's a loop, leave it to the
+    // dispatcher so the budget check stays in it
+    for (k = 0; k < sb->segments; k++) {
+        if (target >= sb->start[k] && target < sb->end[k]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int superblock_can_follow(
+    struct superblock *sb,
+    struct code_block *block,
+    uint16_t target
+) {
+    // bank 0 is always mapped. banked code is only safe while the block
+    // will be looked up by the same bank it was compiled from
+    if (target >= 0x4000 && (!sb->banked || sb->rom_written)) {
+        return 0;
+    }
+    return superblock_fits(sb, block, target);
+}
+
+// far calls and jumps: a jp or call into 0x4000-0x7fff right after a
+// bank select with a constant, like a trampoline does, is followed into
+// the selected bank behind compile_bank_guard
+static int superblock_can_follow_far(
+    struct superblock *sb,
+    struct code_block *block,
+    uint16_t target
+) {
+    if (sb->far_bank < 0 || target < 0x4000) {
+        return 0;
+    }
+    return superblock_fits(sb, block, target);
+}
+
+// whether the routine at target is a leaf short enough to compile inline:
+// a straight run to its ret with nothing that branches, calls, returns
+// early or reads or moves SP. stack contents aren't seen, the ret checks
+// what it pops
+static int superblock_leaf(
+    struct superblock *sb,
+    struct compile_ctx *ctx,
+    uint16_t target
+) {
+    uint16_t pc = target;
+    uint8_t op;
+    int k;
+
+    // the callee and the rest of the caller after it
+    if (sb->segments + 2 > sb->max_segments) {
+        return 0;
+    }
+    for (k = 0; k < SUPERBLOCK_LEAF_INSNS; k++) {
+        op = decode_read(ctx, pc);
+        switch (op) {
+        case 0xc9: // ret
+            return 1;
+        case 0x08: case 0x31: case 0x33: case 0x39: case 0x3b: // sp
+        case 0x10: case 0x76: // stop, halt
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // jr
+            return 0;
+        // the rest of 0xc0-0xff is control flow, stack or interrupts
+        case 0xc6: case 0xce: case 0xd6: case 0xde: // ALU on imm8
+        case 0xe6: case 0xee: case 0xf6: case 0xfe:
+        case 0xcb:
+        case 0xe0: case 0xe2: case 0xea: case 0xf0: case 0xf2: case 0xfa:
+            break;
+        default:
+            if (op >= 0xc0) {
+                return 0;
+            }
+        }
+        pc += insn_length[op];
+        // stays in the 16K region target was checked for
+        if ((pc ^ target) & 0xc000) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// whether an inlined leaf's ret can carry on compiling the caller at
+// ret_addr, under the same rules as following a jump there
+static int superblock_can_return(struct superblock *sb, uint16_t ret_addr)
+{
+    int k;
+
+    if (sb->segments == SUPERBLOCK_MAX_SEGMENTS) {
+        return 0;
+    }
+    if (ret_addr >= 0x4000 && (!sb->leaf_banked || sb->rom_written)) {
+        return 0;
+    }
+    for (k = 0; k < sb->segments; k++) {
+        if (ret_addr >= sb->start[k] && ret_addr < sb->end[k]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// a straight-line run longer than the source window carries on in a new
+// segment at target instead of exiting there. that duplicates no code, so
+// the size limits for following jumps don't apply
+static int superblock_can_fall_through(struct superblock *sb, uint16_t target)
+{
+    if (sb->segments == sb->max_segments || target >= 0x8000
+            || sb->start[0] >= 0x8000) {
+        return 0;
+    }
+    return target < 0x4000 || (sb->banked && !sb->rom_written);
+}
+
+// start a new segment at target, the caller rebases src_address/src_ptr
+static void superblock_enter(
+    struct superblock *sb,
+    uint16_t target,
+    struct compile_ctx *ctx
+) {
+    sb->start[sb->segments] = target;
+    sb->end[sb->segments] = target;
+    sb->segments++;
+    if (target < 0x4000) {
+        sb->banked = 0;
+    }
+
+    // per-segment offsets: backward branches can only reach code in the
+    // segment they are in
+    memset(m68k_offsets, 0, sizeof m68k_offsets);
+    memset(flush_at, 0, sizeof flush_at);
+    decode_window(target);
+    scan_branch_targets(ctx, target);
+}
+
+// the far segment: the guard has made the selected bank the mapped one,
+// so banked code may be inlined from it again, read from that bank
+static void superblock_enter_far(
+    struct superblock *sb,
+    uint16_t target,
+    struct compile_ctx *ctx
+) {
+    decode_rom_bank(sb->far_bank);
+    entry_far = 1;
+    superblock_enter(sb, target, ctx);
+    sb->banked = 1;
+    sb->rom_written = 0;
+}
+
+// the code at pc is from the bank the block is looked up in, or needs none
+static int loop_bank_ok(struct superblock *sb, uint16_t pc)
+{
+    return pc < 0x4000 || pc >= 0x8000
+            || (sb->banked && !sb->rom_written && !entry_far);
+}
+
+// whether the block compiled pc so far, cur being where it is now
+static int superblock_compiled(struct superblock *sb, uint16_t pc, uint16_t cur)
+{
+    int k;
+
+    for (k = 0; k < sb->segments - 1; k++) {
+        if (pc >= sb->start[k] && pc < sb->end[k]) {
+            return 1;
+        }
+    }
+    return pc >= sb->start[sb->segments - 1] && pc < cur;
+}
+
+// a jr or jp back to a loop head, other than a backward jr within the
+// segment that compile_jr and compile_jr_cond already keep in the block
+static int compile_loop_edge(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    struct superblock *sb,
+    uint8_t op,
+    const struct gb_insn *insn,
+    uint16_t src_address,
+    uint16_t *src_ptr
+) {
+    uint16_t target = insn->target, insn_off = *src_ptr - 1;
+    int k, cond;
+
+    switch (op) {
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        if ((uint16_t) (target - src_address) < insn_off) {
+            return 0;
+        }
+        break;
+    case 0xc2: case 0xc3: case 0xca: case 0xd2: case 0xda:
+        break;
+    default:
+        return 0;
+    }
+    if (!loop_bank_ok(sb, target)) {
+        return 0;
+    }
+    for (k = 0; k < head_count && head_pc[k] != target; k++) {
+    }
+    if (k == head_count) {
+        if (superblock_compiled(sb, target, src_address + insn_off)) {
+            loop_want(target);
+        }
+        return 0;
+    }
+    if (!stack_reaches(head_at[k])) {
+        return 0;
+    }
+
+    *src_ptr += insn->length - 1;
+    if (op == 0x18 || op == 0xc3) {
+        compile_loop_jump(block, ctx, target, head_at[k]);
+    } else {
+        // nz, z, nc, c: Z is bit 2 of D7, C bit 0
+        cond = compile_flag_test(block, op & 0x10 ? 0 : 2, (op & 0x08) != 0);
+        compile_loop_branch(block, ctx, cond, target, head_at[k]);
+    }
+    return 1;
+}
+
 // Reconstruct BC from split format (0x00BB00CC) into D1.w as 0xBBCC
 void compile_join_bc(struct code_block *block, int dreg)
 {
+    if (pairs_contiguous & PAIR_BC) {
+        emit_move_w_dn_dn(block, REG_68K_D_BC, dreg);
+        return;
+    }
     emit_move_l_dn_dn(block, REG_68K_D_BC, dreg);  // D1 = 0x00BB00CC
     emit_lsr_l_imm_dn(block, 8, dreg);             // D1 = 0x0000BB00
     emit_move_b_dn_dn(block, REG_68K_D_BC, dreg);  // D1 = 0x0000BBCC
@@ -92,6 +566,10 @@ void compile_join_bc(struct code_block *block, int dreg)
 // Reconstruct DE from split format (0x00DD00EE) into D1.w as 0xDDEE
 void compile_join_de(struct code_block *block, int dreg)
 {
+    if (pairs_contiguous & PAIR_DE) {
+        emit_move_w_dn_dn(block, REG_68K_D_DE, dreg);
+        return;
+    }
     emit_move_l_dn_dn(block, REG_68K_D_DE, dreg);  // D1 = 0x00DD00EE
     emit_lsr_l_imm_dn(block, 8, dreg);             // D1 = 0x0000DD00
     emit_move_b_dn_dn(block, REG_68K_D_DE, dreg);  // D1 = 0x0000DDEE
@@ -108,7 +586,9 @@ static void compile_ld_imm16_split(
     uint8_t hibyte = READ_BYTE(*src_ptr + 1);
     uint32_t split = ((uint32_t) hibyte << 16) | lobyte;
     *src_ptr += 2;
-    if (split < 0x80) {
+    if (pairs_contiguous & (reg == REG_68K_D_BC ? PAIR_BC : PAIR_DE)) {
+        emit_move_w_dn(block, reg, hibyte << 8 | lobyte);
+    } else if (split < 0x80) {
         emit_moveq_dn(block, reg, split);
     } else {
         emit_move_l_dn(block, reg, split);
@@ -128,13 +608,84 @@ static void compile_ld_imm16_contiguous(
     emit_movea_w_imm16(block, reg, hibyte << 8 | lobyte);
 }
 
+// rst/call into a jump table helper: emits the indexed dispatch, which
+// falls back to the call the caller compiles next, and returns the table
+// for compile_jump_table_data after it. NULL to compile the call as usual
+static struct jump_table *compile_jump_table_call(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint16_t target,
+    uint16_t ret_addr,
+    int banked
+) {
+    static struct jump_table jt;
+    int room = BLOCK_ROOM(block) + BLOCK_SLACK - JT_CODE_BYTES;
+
+    if (!jump_table_match(ctx, target, ret_addr, banked, room, &jt)) {
+        return NULL;
+    }
+    patch_branch_w(block, compile_jump_table(block, ctx, &jt, ret_addr));
+    return &jt;
+}
+
+// the reentries the peephole pass kept a boundary for, right after the code
+static void write_reentries(struct code_block *block)
+{
+    struct block_reentry *map = (struct block_reentry *) (block->code + block->length);
+    int k, off;
+
+    for (k = 0; k < reentry_count; k++) {
+        off = peephole_entry(k);
+        if (off >= 0 && !stack_guarded(reentry_at[k])) {
+            map[block->reentry_count].pc = reentry_pc[k];
+            map[block->reentry_count].off = off;
+            block->reentry_count++;
+        }
+    }
+}
+
+// a quick block's prologue: counts the entry, and the one that uses up
+// the count leaves through the hot exit for the dispatcher to see
+static void compile_tier_count(struct code_block *block, uint16_t entries)
+{
+    emit_lea_disp_pc_an(block, TIER_COUNT - 2, REG_68K_A_SCRATCH_1);
+    emit_subq_w_ind_an(block, 1, REG_68K_A_SCRATCH_1);
+    emit_bne_b(block, TIER_PROLOGUE - block->length - 2);
+    peephole_mark_data(block->length, TIER_PROLOGUE);
+    emit_move_l_dn(block, REG_68K_D_NEXT_PC, block->src_address);
+    emit_rts(block);
+    emit_word(block, entries);
+}
+
 struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
 {
     struct code_block *block;
-    uint16_t src_ptr = 0;
-    uint8_t op;
-    int done = 0;
+    uint16_t src_ptr;
+    uint8_t op, uncond;
+    int done, passes = 0;
     size_t k;
+    struct superblock sb;
+    // pointer speculation: 1 while compiling the direct copy of a run,
+    // 2 while compiling the helper copy
+    struct pointer_run run;
+    struct consts_snapshot run_consts;
+    uint16_t run_start = 0;
+    size_t run_join = 0;
+    int run_pass;
+    // copy/fill loop compiled natively, done_at still to be pointed past
+    // the loop's compiled body
+    struct bulk_loop bulk;
+    size_t bulk_done = 0;
+    int bulk_pending;
+    // poll whose closing jr fast-forwards instead, jr is 0 if none
+    struct idle_loop idle;
+    // counted loop checked once at its head: 1 while compiling the copy
+    // without budget checks, 2 while compiling the one with them
+    struct counted_loop counted;
+    struct consts_snapshot counted_consts;
+    int counted_pass;
+    const struct gb_insn *insn;
+    size_t size;
 
 #ifdef DEBUG_COMPILE
     printf("compile_block: src_address=0x%04x\n", src_address);
@@ -142,38 +693,110 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
            READ_BYTE(0), READ_BYTE(1), READ_BYTE(2));
 #endif
 
-    if (ctx->alloc) {
-        block = ctx->alloc(sizeof *block);
+    // code is streamed into the free tail of the arena, and the block is
+    // only as big as its code once it's committed at the end
+    if (ctx->reserve) {
+        block = ctx->reserve(offsetof(struct code_block, code) + BLOCK_MIN_CODE,
+                &size);
     } else {
-        block = malloc(sizeof *block);
+        size = offsetof(struct code_block, code) + BLOCK_MAX_CODE;
+        block = malloc(size);
     }
     if (!block) {
         return NULL;
     }
+    wanted_count = 0;
 
+again:
+    passes++;
     block->length = 0;
+    block->capacity = size - offsetof(struct code_block, code);
+    if (block->capacity > BLOCK_MAX_CODE) {
+        block->capacity = BLOCK_MAX_CODE;
+    }
     block->count = 0;
     block->src_address = src_address;
     block->error = 0;
+    block->link_count = 0;
+    block->magic = BLOCK_MAGIC;
+    block->peephole_saved = 0;
+    block->cold_bytes = 0;
+    block->exit_bytes = 0;
+    block->reentry_count = 0;
+    block->version = 0;
+    block->tier = ctx->tier;
     block->failed_opcode = 0;
     block->failed_address = 0;
     memset(m68k_offsets, 0, sizeof m68k_offsets);
 
+    src_ptr = 0;
+    done = 0;
+    run_pass = 0;
+    bulk_pending = 0;
+    counted_pass = 0;
     pending_cycles = 0;
+    flags_live = FLAGS_ALL;
+    flags_ccr_at = (size_t) -1;
     memset(flush_at, 0, sizeof flush_at);
-    scan_branch_targets(src_address, ctx);
-
-    // set everything to illegal instruction so it's easy to catch weird branches
-    for (k = 0; k < sizeof block->code; k += 2) {
-      block->code[k] = 0x4a;
-      block->code[k + 1] = 0xfc;
+    decode_window(src_address);
+    scan_branch_targets(ctx, src_address);
+    consts_reset();
+    pairs_contiguous = 0;
+    idle.jr = 0;
+    peephole_reset();
+    cold_reset();
+    exit_stubs_reset();
+    entry_count = 0;
+    entry_far = 0;
+    reentry_count = 0;
+    head_count = 0;
+    wanted_new = 0;
+    decode_rom_bank(-1);
+
+    sb.segments = 1;
+    sb.max_segments = block->tier == TIER_QUICK ? 1 : SUPERBLOCK_MAX_SEGMENTS;
+    sb.start[0] = src_address;
+    sb.end[0] = src_address;
+    sb.banked = src_address >= 0x4000 && src_address < 0x8000;
+    sb.rom_written = 0;
+    sb.in_leaf = 0;
+    sb.far_bank = -1;
+
+    if (block->tier == TIER_QUICK) {
+        compile_tier_count(block, ctx->hot_entries);
+    }
+    if (compile_stack_guard(block, ctx)) {
+        block->version = VERSION_STACK_RAM;
     }
 
     while (!done) {
-        size_t before = block->length;
+        if (src_ptr >= 256 && !run_pass && !bulk_pending
+                && superblock_can_fall_through(&sb, src_address + src_ptr)) {
+            uint16_t target = src_address + src_ptr;
+            sb.end[sb.segments - 1] = target;
+            superblock_enter(&sb, target, ctx);
+            src_address = target;
+            src_ptr = 0;
+            idle.jr = 0;
+        }
+
+        size_t before = block->length + cold_length, table_bytes = 0;
+        // src_address moves when a superblock follows a jump
+        uint16_t insn_base = src_address, insn_off = src_ptr;
+        if (bulk_pending && src_ptr == bulk.end) {
+            // where the native copy/fill loop goes when it's done
+            flush_cycles(block);
+            patch_branch_w(block, bulk_done);
+            flags_ccr_at = (size_t) -1;
+            consts_reset();
+            bulk_pending = 0;
+        }
         // detect overflow of code block and chain to next block
         // longest instruction is around 150 bytes, exit sequence is 26 bytes
-        if (block->length > sizeof(block->code) - 200 || src_ptr >= 256) {
+        // a speculated run checked for room for both of its copies up front
+        if (!run_pass && !counted_pass
+                && (BLOCK_ROOM(block) < 0 || src_ptr >= 256)) {
+            compile_pairs_split(block);
             flush_cycles(block);
             emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
             emit_move_w_dn(block, REG_68K_D_NEXT_PC, src_address + src_ptr);
@@ -182,17 +805,141 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
         }
 
         if (flush_at[src_ptr]) {
+            compile_pairs_split(block);
+            flush_cycles(block);
+            // loop heads are entered with an unrelated CCR, split pairs,
+            // and with registers that aren't known
+            flags_ccr_at = (size_t) -1;
+            consts_reset();
+            if (sp_in_window) {
+                stack_forget();
+            }
+            if (!run_pass && !bulk_pending && !counted_pass && !sb.in_leaf
+                    && loop_bank_ok(&sb, src_address + src_ptr)) {
+                loop_head_add(src_address + src_ptr, block->length);
+            }
+        }
+        // the helper copy of a run is only reached from its guard, the
+        // checked copy of a counted loop from its check
+        if (run_pass != 2 && counted_pass != 2) {
+            m68k_offsets[src_ptr] = block->length;
+            block->count++;
+        }
+        // the dispatcher enters with nothing known and no cycles deferred,
+        // like at the start of a block
+        if (!run_pass && !bulk_pending && !counted_pass && !sb.in_leaf
+                && !pending_cycles && !consts_known && !consts_flags_known
+                && !pairs_contiguous && !pointers_direct
+                && flags_ccr_at != block->length
+                && reentry_fits(block, src_address + src_ptr)) {
+            reentry_pc[reentry_count] = src_address + src_ptr;
+            reentry_at[reentry_count++] = block->length;
+            peephole_mark_entry(block->length);
+        }
+        if (flush_at[src_ptr] && run_pass == 0 && bulk_match(ctx,
+                src_address, src_ptr,
+                BLOCK_ROOM(block),
+                &bulk)) {
+            bulk_done = compile_bulk_loop(block, &bulk, src_address + src_ptr);
+            bulk_pending = 1;
+        } else if (flush_at[src_ptr] && run_pass == 0
+                && idle_loop_scan(ctx, src_address, src_ptr, &idle)) {
+            // compiles as usual up to the closing jr
+        } else if (run_pass == 0 && !counted_pass
+                && pointers_scan(ctx, src_address, src_ptr,
+                BLOCK_ROOM(block),
+                &run)) {
+            compile_pairs_split(block);
             flush_cycles(block);
+            compile_pointer_guard(block, &run);
+            consts_save(&run_consts);
+            pointers_direct = run.used;
+            run_start = src_ptr;
+            run_pass = 1;
+        } else if (flush_at[src_ptr] && run_pass == 0 && !bulk_pending
+                && !counted_pass && counted_loop_scan(ctx, src_address,
+                        src_ptr, BLOCK_ROOM(block), &counted)) {
+            compile_counted_check(block, &counted);
+            consts_save(&counted_consts);
+            counted_pass = 1;
+        }
+        insn = decode_at(ctx, src_ptr);
+        if (store_may_hit_rom(insn)) {
+            sb.rom_written = 1;
+            sb.far_bank = superblock_bank_select(ctx, insn);
         }
-        m68k_offsets[src_ptr] = block->length;
-        block->count++;
-        op = READ_BYTE(src_ptr);
+        op = insn->op;
         src_ptr++;
 
+        // a condition known at compile time makes the branch either
+        // unconditional (taken cycles match) or a nop
+        switch (consts_branch(op, &uncond)) {
+        case 1:
+            defer_cycles(instructions[op].cycles_branch
+                    - instructions[uncond].cycles);
+            op = uncond;
+            break;
+        case 0:
+            defer_cycles(instructions[op].cycles - instructions[0x00].cycles);
+            src_ptr += insn_length[op] - 1;
+            op = 0x00;
+            break;
+        }
+
+        // BC/DE as pointers in a straight run, see pairs.h
+        compile_pairs(block, ctx, op, insn->operand, insn_off,
+                !run_pass && !bulk_pending && !counted_pass
+                    && block->tier == TIER_FULL);
+
+        // skip capturing flags nothing will read. only look as far ahead
+        // as is sure to fit in this block
+        flags_live = FLAGS_ALL;
+        if (flag_writes(op, op == 0xcb ? insn->operand : 0)) {
+            int room = BLOCK_ROOM(block);
+            flags_live = compute_flags_live(ctx,
+                    src_ptr - 1 + insn_length[op], room / MAX_INSN_BYTES);
+        }
+
         if (op != 0xcb) {
             defer_cycles(instructions[op].cycles);
         }
 
+        if (idle.jr && insn_off >= idle.jr) {
+            // the LY and HRAM waits in mem_loads.c may have taken the jr
+            if (insn_off == idle.jr && (op & 0xe7) == 0x20) {
+                compile_idle_loop(block, &idle, op, src_address);
+                src_ptr++;
+                op = 0x00;
+            }
+            idle.jr = 0;
+        }
+
+        if (counted_pass && insn_off == counted.jr && op == 0x20) {
+            int cond = compile_flag_test(block, 2, 0);
+
+            src_ptr++;
+            if (counted_pass == 1) {
+                compile_counted_branch(block, &counted, cond);
+            } else {
+                compile_loop_branch(block, ctx, cond,
+                        src_address + counted.head, counted.checked_head);
+            }
+            op = 0x00;
+        }
+
+        if (compile_known_op(block, ctx, op, src_address, &src_ptr)
+                || compile_pointer_op(block, op)) {
+            // already compiled, the nop case emits nothing
+            op = 0x00;
+        }
+
+        if (!run_pass && !bulk_pending && !sb.in_leaf
+                && compile_loop_edge(block, ctx, &sb, op, insn, src_address,
+                        &src_ptr)) {
+            done = op == 0x18 || op == 0xc3;
+            op = 0x00;
+        }
+
         switch (op) {
         case 0x00: // nop
             // emit nothing
@@ -265,6 +1012,10 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0x03: // inc bc
+            if (pairs_contiguous & PAIR_BC) {
+                emit_addq_w_dn(block, REG_68K_D_BC, 1);
+                break;
+            }
             emit_ext_w_dn(block, REG_68K_D_BC);
             emit_addq_l_dn(block, REG_68K_D_BC, 1);
             break;
@@ -278,11 +1029,17 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
 
         case 0x07: // rlca - rotate A left, old bit 7 to carry and bit 0
             emit_rol_b_imm(block, 1, REG_68K_D_A);
-            emit_move_sr_dn(block, REG_68K_D_FLAGS);
-            emit_andi_b_dn(block, REG_68K_D_FLAGS, 0xfb); // Z always 0
+            if (flags_live) {
+                emit_move_sr_dn(block, REG_68K_D_FLAGS);
+                emit_andi_b_dn(block, REG_68K_D_FLAGS, 0xfb); // Z always 0
+            }
             break;
 
         case 0x0b: // dec bc
+            if (pairs_contiguous & PAIR_BC) {
+                emit_subq_w_dn(block, REG_68K_D_BC, 1);
+                break;
+            }
             emit_ext_w_dn(block, REG_68K_D_BC);
             emit_subq_l_dn(block, REG_68K_D_BC, 1);
             break;
@@ -293,16 +1050,26 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
 
         case 0x0f: // rrca - rotate A right, old bit 0 to carry and bit 7
             emit_ror_b_imm(block, 1, REG_68K_D_A);
-            emit_move_sr_dn(block, REG_68K_D_FLAGS);
-            emit_andi_b_dn(block, REG_68K_D_FLAGS, 0xfb); // Z always 0
+            if (flags_live) {
+                emit_move_sr_dn(block, REG_68K_D_FLAGS);
+                emit_andi_b_dn(block, REG_68K_D_FLAGS, 0xfb); // Z always 0
+            }
             break;
 
         case 0x13: // inc de
+            if (pairs_contiguous & PAIR_DE) {
+                emit_addq_w_dn(block, REG_68K_D_DE, 1);
+                break;
+            }
             emit_ext_w_dn(block, REG_68K_D_DE);
             emit_addq_l_dn(block, REG_68K_D_DE, 1);
             break;
 
         case 0x1b: // dec de
+            if (pairs_contiguous & PAIR_DE) {
+                emit_subq_w_dn(block, REG_68K_D_DE, 1);
+                break;
+            }
             emit_ext_w_dn(block, REG_68K_D_DE);
             emit_subq_l_dn(block, REG_68K_D_DE, 1);
             break;
@@ -377,6 +1144,16 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0x18: // jr disp8
+            {
+                uint16_t target = insn->target;
+                sb.end[sb.segments - 1] = src_address + src_ptr + 1;
+                if (superblock_can_follow(&sb, block, target)) {
+                    superblock_enter(&sb, target, ctx);
+                    src_address = target;
+                    src_ptr = 0;
+                    break;
+                }
+            }
             compile_jr(block, ctx, &src_ptr, src_address);
             // always ends the block to avoid compiling following data
             // as code
@@ -403,7 +1180,8 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
 
         case 0xcb: // CB prefix
             {
-                uint8_t cb_op = READ_BYTE(src_ptr++);
+                uint8_t cb_op = insn->operand;
+                src_ptr++;
                 defer_cycles(instructions[0x100 + cb_op].cycles);
                 if (!compile_cb_insn(block, cb_op)) {
                     block->error = 1;
@@ -418,7 +1196,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0xc0: // ret nz
-            compile_ret_cond(block, 2, 0);
+            compile_ret_cond(block, ctx, 2, 0);
             break;
 
         case 0xc2: // jp nz, imm16
@@ -427,8 +1205,22 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
 
         case 0xc3: // jp imm16
             {
-                uint16_t target = READ_BYTE(src_ptr) | (READ_BYTE(src_ptr + 1) << 8);
+                uint16_t target = insn->target;
                 src_ptr += 2;
+                sb.end[sb.segments - 1] = src_address + src_ptr;
+                if (superblock_can_follow(&sb, block, target)) {
+                    superblock_enter(&sb, target, ctx);
+                    src_address = target;
+                    src_ptr = 0;
+                    break;
+                }
+                if (superblock_can_follow_far(&sb, block, target)) {
+                    compile_bank_guard(block, sb.far_bank, target);
+                    superblock_enter_far(&sb, target, ctx);
+                    src_address = target;
+                    src_ptr = 0;
+                    break;
+                }
                 flush_cycles(block);
                 emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
                 emit_move_w_dn(block, REG_68K_D_NEXT_PC, target);
@@ -438,11 +1230,31 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0xc8: // ret z
-            compile_ret_cond(block, 2, 1);
+            compile_ret_cond(block, ctx, 2, 1);
             break;
 
         case 0xc9: // ret
-            compile_ret(block);
+            if (sb.in_leaf) {
+                uint16_t ret_addr = sb.leaf_ret;
+                sb.in_leaf = 0;
+                sb.end[sb.segments - 1] = src_address + src_ptr;
+                compile_ret_leaf(block, ret_addr);
+                if (!run_pass && !bulk_pending
+                        && superblock_can_return(&sb, ret_addr)) {
+                    superblock_enter(&sb, ret_addr, ctx);
+                    if (ret_addr >= 0x4000) {
+                        sb.banked = sb.leaf_banked;
+                    }
+                    src_address = ret_addr;
+                    src_ptr = 0;
+                    idle.jr = 0;
+                    break;
+                }
+                emit_block_exit(block, ret_addr);
+                done = 1;
+                break;
+            }
+            compile_ret(block, ctx);
             done = 1;
             break;
 
@@ -459,6 +1271,47 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0xcd: // call imm16
+            {
+                uint16_t target = insn->target;
+                struct jump_table *jt = compile_jump_table_call(block, ctx,
+                        target, src_address + src_ptr + 2,
+                        sb.banked && !sb.rom_written);
+                if (jt) {
+                    compile_call_imm16(block, ctx, &src_ptr, src_address);
+                    table_bytes = jt->count * JT_RECORD;
+                    compile_jump_table_data(block, jt);
+                    done = 1;
+                    break;
+                }
+                sb.end[sb.segments - 1] = src_address + src_ptr + 2;
+                if (superblock_can_follow(&sb, block, target)
+                        && superblock_leaf(&sb, ctx, target)) {
+                    sb.leaf_ret = src_address + src_ptr + 2;
+                    sb.leaf_banked = sb.banked;
+                    sb.in_leaf = 1;
+                    compile_call_leaf(block, sb.leaf_ret);
+                    superblock_enter(&sb, target, ctx);
+                    src_address = target;
+                    src_ptr = 0;
+                    idle.jr = 0;
+                    break;
+                }
+                if (superblock_can_follow(&sb, block, target)) {
+                    compile_call_inline(block, src_address + src_ptr + 2);
+                    superblock_enter(&sb, target, ctx);
+                    src_address = target;
+                    src_ptr = 0;
+                    break;
+                }
+                if (superblock_can_follow_far(&sb, block, target)) {
+                    compile_call_inline(block, src_address + src_ptr + 2);
+                    compile_bank_guard(block, sb.far_bank, target);
+                    superblock_enter_far(&sb, target, ctx);
+                    src_address = target;
+                    src_ptr = 0;
+                    break;
+                }
+            }
             compile_call_imm16(block, ctx, &src_ptr, src_address);
             done = 1;
             break;
@@ -468,7 +1321,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0xd0: // ret nc
-            compile_ret_cond(block, 0, 0);
+            compile_ret_cond(block, ctx, 0, 0);
             break;
 
         case 0xd2: // jp nc, imm16
@@ -476,7 +1329,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0xd8: // ret c
-            compile_ret_cond(block, 0, 1);
+            compile_ret_cond(block, ctx, 0, 1);
             break;
 
         case 0xda: // jp c, imm16
@@ -497,7 +1350,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             // so clear upper 16 bits
             emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
             emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_NEXT_PC);
-            emit_dispatch_jump(block);
+            compile_indirect_exit(block, ctx);
             done = 1;
             break;
 
@@ -510,8 +1363,10 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             // Shift left - bit 7 goes to 68k C flag, 0 goes to bit 0
             emit_lsl_b_imm_dn(block, 1, REG_68K_D_A);
 
-            emit_move_sr_dn(block, REG_68K_D_FLAGS);
-            emit_andi_b_dn(block, REG_68K_D_FLAGS, 0xfb); // Z always 0
+            if (flags_live) {
+                emit_move_sr_dn(block, REG_68K_D_FLAGS);
+                emit_andi_b_dn(block, REG_68K_D_FLAGS, 0xfb); // Z always 0
+            }
 
             // OR old carry into bit 0
             emit_or_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_A);
@@ -529,8 +1384,10 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             // Shift right - bit 0 goes to 68k C flag, 0 goes to bit 7
             emit_lsr_b_imm_dn(block, 1, REG_68K_D_A);
 
-            emit_move_sr_dn(block, REG_68K_D_FLAGS);
-            emit_andi_b_dn(block, REG_68K_D_FLAGS, 0xfb); // Z always 0
+            if (flags_live) {
+                emit_move_sr_dn(block, REG_68K_D_FLAGS);
+                emit_andi_b_dn(block, REG_68K_D_FLAGS, 0xfb); // Z always 0
+            }
 
             // OR old carry into bit 7
             emit_or_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_A);
@@ -538,36 +1395,18 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
         }
 
-        case 0xc7: // rst nn
-            compile_rst_n(block, 0x00, src_address + src_ptr);
-            done = 1;
-            break;
-        case 0xcf:
-            compile_rst_n(block, 0x08, src_address + src_ptr);
-            done = 1;
-            break;
-        case 0xd7:
-            compile_rst_n(block, 0x10, src_address + src_ptr);
-            done = 1;
-            break;
-        case 0xdf:
-            compile_rst_n(block, 0x18, src_address + src_ptr);
-            done = 1;
-            break;
-        case 0xe7:
-            compile_rst_n(block, 0x20, src_address + src_ptr);
-            done = 1;
-            break;
-        case 0xef:
-            compile_rst_n(block, 0x28, src_address + src_ptr);
-            done = 1;
-            break;
-        case 0xf7:
-            compile_rst_n(block, 0x30, src_address + src_ptr);
-            done = 1;
-            break;
-        case 0xff:
-            compile_rst_n(block, 0x38, src_address + src_ptr);
+        case 0xc7: case 0xcf: case 0xd7: case 0xdf: // rst nn
+        case 0xe7: case 0xef: case 0xf7: case 0xff:
+            {
+                uint16_t ret_addr = src_address + src_ptr;
+                struct jump_table *jt = compile_jump_table_call(block, ctx,
+                        op & 0x38, ret_addr, sb.banked && !sb.rom_written);
+                compile_rst_n(block, op & 0x38, ret_addr);
+                if (jt) {
+                    table_bytes = jt->count * JT_RECORD;
+                    compile_jump_table_data(block, jt);
+                }
+            }
             done = 1;
             break;
 
@@ -587,7 +1426,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
 
         case 0xd9: // reti
             compile_call_ei_di(block, 1);
-            compile_ret(block);
+            compile_reti(block, ctx);
             done = 1;
             break;
 
@@ -622,10 +1461,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             if (READ_BYTE(src_ptr) == 0x20
                     && (int8_t) READ_BYTE(src_ptr + 1) == -3) {
                 uint16_t loop_pc = src_address + src_ptr - 1;
-                if (ctx->cache_store) {
-                    ctx->cache_store(loop_pc, ctx->current_bank,
-                            (void *) (block->code + m68k_offsets[src_ptr - 1]));
-                }
+                compile_entry_point(ctx, loop_pc, m68k_offsets[src_ptr - 1]);
                 compile_delay_loop(block, op, loop_pc,
                         src_address + src_ptr + 2);
                 src_ptr += 2;
@@ -660,14 +1496,86 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
         }
 
-        size_t emitted = block->length - before;
-        // the fused register LY wait is the biggest expected sequence
-        if (emitted > 176) {
+        consts_update(ctx, insn_base, insn_off);
+
+        if (run_pass && src_ptr == run.end) {
+            // both copies end with the same cycle count and an unknown CCR
+            flush_cycles(block);
+            flags_ccr_at = (size_t) -1;
+            if (run_pass == 1) {
+                run_join = block->length;
+                emit_bra_w(block, 0);
+                compile_pointer_fails(block, &run);
+                pointers_direct = 0;
+                consts_restore(&run_consts);
+                src_ptr = run_start;
+                run_pass = 2;
+            } else {
+                patch_branch_w(block, run_join);
+                run_pass = 0;
+            }
+        }
+
+        if (counted_pass && src_ptr == counted.jr + 2) {
+            // the same goes for the copies of a counted loop
+            flush_cycles(block);
+            flags_ccr_at = (size_t) -1;
+            if (counted_pass == 1) {
+                counted.join = block->length;
+                emit_bra_w(block, 0);
+                patch_branch_w(block, counted.to_checked);
+                counted.checked_head = block->length;
+                consts_restore(&counted_consts);
+                src_ptr = counted.head;
+                counted_pass = 2;
+            } else {
+                patch_branch_w(block, counted.join);
+                counted_pass = 0;
+            }
+        }
+
+        // a banked conditional call, with a bank linked exit and a bank
+        // linked return landing, is the biggest expected sequence. jump
+        // table records end the block, which has room for them
+        size_t emitted = block->length + cold_length - before - table_bytes;
+        if (emitted > MAX_INSN_BYTES) {
             fprintf(stderr, "warning: instruction %02x emitted %zu bytes\n", op, emitted);
         }
     }
 
     block->end_address = src_address + src_ptr;
+    // back edges found code that wasn't a loop head, compile it again with
+    // them as heads
+    if (wanted_new && passes < LOOP_PASSES && !block->error) {
+        src_address = block->src_address;
+        goto again;
+    }
+    decode_end();
+    drop_skipping_entries(block);
+    entry_off[entry_count] = cold_append(block);
+    exit_stubs_end();
+    block->exit_bytes = exit_bytes;
+    if (!block->error && block->tier == TIER_FULL) {
+        block->peephole_saved = peephole_block(block, entry_off, entry_count + 1);
+    }
+    block->cold_bytes = block->length - entry_off[entry_count];
+    if (!block->error) {
+        write_reentries(block);
+    }
+
+    // the code is final, give the rest of the reservation back before
+    // cache_store can allocate
+    block->capacity = block->length;
+    if (ctx->reserve) {
+        ctx->commit(block, offsetof(struct code_block, code) + block->length
+                + block->reentry_count * sizeof (struct block_reentry));
+    }
+    if (!block->error) {
+        for (k = 0; k < (size_t) entry_count; k++) {
+            ctx->cache_store(entry_pc[k], ctx->current_bank,
+                    (void *) (block->code + entry_off[k]));
+        }
+    }
     return block;
 }
 
@@ -675,3 +1583,182 @@ void block_free(struct code_block *block)
 {
     free(block);
 }
+
+struct code_block *block_from_code(void *code)
+{
+    uint32_t magic;
+
+    // a mid-block entry's "header" is arbitrary code, maybe misaligned
+    memcpy(&magic, (uint8_t *) code + BLOCK_MAGIC_AT, sizeof magic);
+    if (magic != BLOCK_MAGIC) {
+        return NULL;
+    }
+    return (struct code_block *) ((uint8_t *) code - offsetof(struct code_block, code));
+}
+
+void *block_reentry(struct compile_ctx *ctx, uint16_t pc)
+{
+    uint16_t base = pc < 0x4000 ? 0 : 0x4000;
+    const struct block_reentry *map;
+    struct code_block *block;
+    void *code;
+    int back, k;
+
+    if (!ctx->cache_lookup || pc >= 0x8000) {
+        return NULL;
+    }
+    for (back = 1; back <= REENTRY_REACH && back <= pc - base; back++) {
+        code = ctx->cache_lookup(pc - back, ctx->current_bank);
+        block = code ? block_from_code(code) : NULL;
+        if (!block) {
+            continue;
+        }
+        map = BLOCK_REENTRIES(block);
+        for (k = 0; k < block->reentry_count; k++) {
+            if (map[k].pc == pc) {
+                code = block->code + map[k].off;
+                return ctx->cache_store(pc, ctx->current_bank, code) ? code : NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+int block_version_holds(void *code, uint8_t version)
+{
+    struct code_block *block = block_from_code(code);
+
+    return !block || !(block->version & ~version);
+}
+
+// jmp.l target
+static void patch_jmp_l(uint8_t *site, uint32_t target)
+{
+    site[0] = 0x4e;
+    site[1] = 0xf9;
+    site[2] = target >> 24;
+    site[3] = target >> 16;
+    site[4] = target >> 8;
+    site[5] = target;
+}
+
+void block_version_link(struct code_block *block, uint32_t target)
+{
+    patch_jmp_l(block->code + VERSION_EXIT, target);
+}
+
+uint32_t block_version_target(void *code)
+{
+    struct code_block *block = block_from_code(code);
+    uint8_t *site;
+
+    if (!block) {
+        return 0;
+    }
+    site = block->code + VERSION_EXIT;
+    if (site[0] != 0x4e || site[1] != 0xf9) {
+        return 0;
+    }
+    return (uint32_t) site[2] << 24 | (uint32_t) site[3] << 16
+            | (uint32_t) site[4] << 8 | site[5];
+}
+
+int block_is_hot(void *code)
+{
+    struct code_block *block = block_from_code(code);
+
+    return block && block->tier == TIER_QUICK
+            && !block->code[TIER_COUNT] && !block->code[TIER_COUNT + 1];
+}
+
+int block_add_link(void *code, uint8_t *site)
+{
+    struct code_block *target = block_from_code(code);
+    struct block_link *link;
+
+    if (target && target->link_count < BLOCK_LINKS) {
+        target->links[target->link_count++] = site - target->code;
+        return 1;
+    }
+    if (link_log.count >= LINK_LOG_SIZE) {
+        link_log.overflowed = 1;
+        return 0;
+    }
+    link = &link_log.links[link_log.count++];
+    link->site = site;
+    link->target = code;
+    return 1;
+}
+
+// Incoming sites are either a JMP.L written over an emit_patchable_exit's
+// movea.l/jsr, or a key in an emit_bank_linked_exit table (0x01xx, never
+// the JMP.L opcode). Links from blocks that were dropped themselves still
+// point into their dead code, which is harmless to rewrite
+static void unlink_site(uint8_t *site)
+{
+    if (site[0] == 0x4e && site[1] == 0xf9) {
+        // movea.l JIT_CTX_PATCH_HELPER(a4), a0; jsr (a0)
+        site[0] = 0x20;
+        site[1] = 0x6c;
+        site[2] = 0;
+        site[3] = JIT_CTX_PATCH_HELPER;
+        site[4] = 0x4e;
+        site[5] = 0x90;
+    } else {
+        site[BANK_LINK_KEY] = 0;
+        site[BANK_LINK_KEY + 1] = 0;
+    }
+}
+
+// undo and drop the logged links with a target in [lo, hi)
+static void unlink_logged(uint8_t *lo, uint8_t *hi)
+{
+    uint32_t k, kept = 0;
+
+    for (k = 0; k < link_log.count; k++) {
+        struct block_link *link = &link_log.links[k];
+
+        if (link->target >= lo && link->target < hi) {
+            unlink_site(link->site);
+        } else {
+            link_log.links[kept++] = *link;
+        }
+    }
+    link_log.count = kept;
+}
+
+void block_unlink(struct code_block *block)
+{
+    uint32_t k;
+
+    for (k = 0; k < block->link_count; k++) {
+        unlink_site(block->code + block->links[k]);
+    }
+    block->link_count = 0;
+    unlink_logged(block->code, block->code + block->length);
+}
+
+void block_unlink_entry(void *code)
+{
+    struct code_block *block = block_from_code(code);
+
+    if (block) {
+        block_unlink(block);
+    } else {
+        unlink_logged(code, (uint8_t *) code + 1);
+    }
+}
+
+void block_links_reset(void)
+{
+    link_log.count = 0;
+    link_log.overflowed = 0;
+}
+
+void block_retire(struct code_block *block, uint32_t target)
+{
+    block_unlink(block);
+    // nothing inside a quick block branches back over its prologue, and
+    // mid-block entries keep running the old code, which is still correct
+    patch_jmp_l(block->code, target);
+}
@@ -76,10 +76,78 @@
 #define JIT_CTX_SKIPPED     84  // u32: GB cycles skipped by wake_skip
 #define JIT_CTX_LY_SKIPS    88  // u32: LY-wait clamp skips (cycles unknown)
 #define JIT_CTX_MBC_WRITE   92  // void *mbc_write_func (dmg_mbc_write)
+#define JIT_CTX_RET_SP      96  // u32: top entry of the return shadow stack
+#define JIT_CTX_DISPATCH_IC 100 // void *dispatcher entry that refills the
+                                // inline cache at A1 after a miss
+#define JIT_CTX_IC_HITS     104 // u32: indirect exit inline cache hits
+#define JIT_CTX_IC_MISSES   108 // u32: ... and misses (ic_counters only)
+#define JIT_CTX_LINK_LOG    112 // struct link_log *
+
+// return shadow stack: compiled calls push (u32 GB return address, u32 68k
+// landing) entries into a 256-byte ring, reset to all 0xff bytes. the ring
+// must be 256-byte aligned so the top pointer wraps with a byte-sized
+// addq/subq
+#define RET_STACK_SIZE 256
+
+// inline cache words after each indirect exit: last GB target, its code and
+// the ROM bank it was looked up in. target 0xffffffff = empty
+#define IC_TARGET 0  // u32
+#define IC_CODE   4  // void *
+#define IC_BANK   8  // u8, only checked for 0x4000-0x7fff targets
+#define IC_SIZE   10
+
+// link table after each patchable exit into 0x4000-0x7fff (see
+// emit_bank_linked_exit): key 0x0100 | ROM bank, 0 = empty slot
+#define BANK_LINK_KEY   0  // u16
+#define BANK_LINK_CODE  2  // void *
+#define BANK_LINK_SIZE  6
+#define BANK_LINK_SLOTS 2  // patch_helper's slot search assumes 2
+
+// patched sites a block keeps in its own header. links to mid-block
+// entries and the ones past a full header go to link_log instead
+#define BLOCK_LINKS 6
+// code[] is preceded by magic, then link_count, then links[]. the cache
+// also holds mid-block entries (backward branch targets), so patch_helper
+// only trusts the header of a code pointer that has the magic in front
+#define BLOCK_MAGIC 0x47424c4b // 'GBLK', never emitted as code
+#define BLOCK_MAGIC_AT      (-4)                   // from code[]
+#define BLOCK_LINK_COUNT_AT (-8)
+#define BLOCK_LINKS_AT      (-8 - 4 * BLOCK_LINKS)
+
+// facts a block can be compiled for (ctx->version), checked once at its
+// start. when they don't hold the block leaves through the 6 bytes at
+// code[VERSION_EXIT] with D3 = its start, and the dispatcher compiles a
+// version that doesn't assume them and links the exit to it
+#define VERSION_STACK_RAM 0x01 // JIT_CTX_STACK_IN_RAM is non-zero
+#define VERSION_EXIT 6
+
+// compilation tiers (ctx->tier). TIER_QUICK leaves out the passes that
+// cost the most compile time: superblocks, BC/DE as pointers (pairs.h),
+// stack versions and the peephole pass. its blocks count down their
+// entries from ctx->hot_entries in the u16 at code[TIER_COUNT], and the
+// entry that takes it to 0 leaves through the hot exit with D3 = the
+// block's start. the dispatcher then compiles the block again at
+// TIER_FULL, caches that and retires the quick one (block_is_hot).
+// only entries at the block's start count. mid-block reentries and return
+// stack landings skip the prologue: counting them would need one at every
+// such pc, and a block that is hot through them is usually entered at its
+// start often enough too
+#define TIER_FULL  0
+#define TIER_QUICK 1
+#define TIER_COUNT    16
+#define TIER_PROLOGUE 18
+// entries a quick block runs before it's compiled again
+#define TIER_HOT_ENTRIES 64
+
+// code[] is as long as the allocator had room for, up to BLOCK_MAX_CODE:
+// offsets into it are 16 bits and branches across it are .w
+#define BLOCK_MAX_CODE 4096
 
 struct code_block {
     // number of bytes populated in code[]
     size_t length;
+    // bytes code[] has room for, length once the block is finished
+    size_t capacity;
     // number of GB instructions
     size_t count;
     uint16_t src_address;
@@ -89,8 +157,72 @@ struct code_block {
     uint16_t error;
     uint16_t failed_opcode;
     uint16_t failed_address;
+
+    // bytes the peephole pass took out of code[]
+    uint16_t peephole_saved;
+    // bytes at the end of code[] only slow paths run (cold.h)
+    uint16_t cold_bytes;
+    // bytes of the block's exits after D3 is loaded, before the peephole
+    // pass
+    uint16_t exit_bytes;
+    // struct block_reentry records right after code[length]
+    uint16_t reentry_count;
+    // VERSION_* facts the block was compiled for
+    uint8_t version;
+    // TIER_* it was compiled at
+    uint8_t tier;
+
+    // incoming links: exits in other blocks that patch_helper pointed
+    // straight at code[] (a JMP.L or a bank link slot), stored as
+    // site - code. these sit right before code[], patch_helper finds
+    // them through the code pointer (BLOCK_*_AT)
+    int32_t links[BLOCK_LINKS];
+    uint32_t link_count;
+    uint32_t magic;
+
     // at the end so arena can only be bumped by actual code size
-    uint8_t code[2048];
+    uint8_t code[];
+};
+
+// incoming links no block header has room for: exits linked to mid-block
+// entries, and to blocks whose links[] is full. block_unlink finds a
+// block's ones by where they point. with the log full as well, links into
+// ROM are still made and overflowed is set, so only jit_clear_all_blocks
+// can undo those. patch_helper reaches it through JIT_CTX_LINK_LOG
+#define LINK_LOG_SIZE 512
+#define LINK_LOG_COUNT      0
+#define LINK_LOG_OVERFLOWED 4
+#define LINK_LOG_LINKS      8   // site, target pairs of pointers
+
+struct block_link {
+    uint8_t *site;
+    uint8_t *target;
+};
+
+struct link_log {
+    uint32_t count;
+    uint32_t overflowed;
+    struct block_link links[LINK_LOG_SIZE];
+};
+
+extern struct link_log link_log;
+
+// an instruction boundary the block can be entered at from the dispatcher,
+// kept for block_reentry: nothing about registers or flags is assumed
+// there and no cycles are deferred
+struct block_reentry {
+    uint16_t pc;
+    uint16_t off;   // into code[]
+};
+
+#define BLOCK_REENTRIES(block) \
+    ((const struct block_reentry *) ((block)->code + (block)->length))
+
+// a code_block with room for BLOCK_MAX_CODE, for scratch blocks that
+// aren't allocated (the helpers, tests). set block.capacity before use
+union code_block_buffer {
+    struct code_block block;
+    uint8_t bytes[offsetof(struct code_block, code) + BLOCK_MAX_CODE];
 };
 
 extern uint16_t m68k_offsets[256];
@@ -108,19 +240,28 @@ extern uint8_t flush_at[256];
 extern const uint8_t insn_length[256];
 
 typedef uint8_t (*dmg_read_fn)(void *dmg, uint16_t address);
+// a byte of any ROM bank at 0x4000-0x7fff, whichever is mapped
+typedef uint8_t (*rom_read_fn)(void *dmg, uint8_t bank, uint16_t address);
 
 // cache store function signature for registering mid-block entry points
 typedef int (*cache_store_fn)(uint16_t pc, uint8_t bank, void *code_ptr);
+typedef void *(*cache_lookup_fn)(uint16_t pc, uint8_t bank);
 
-// allocator function signature for arena allocation
-typedef void *(*alloc_fn)(size_t size);
+// streamed allocation (arena_reserve/arena_commit): reserve hands out all
+// the free space, at least min bytes, with its size in *size. commit keeps
+// the first used bytes of it. nothing else is allocated in between
+typedef void *(*reserve_fn)(size_t min, size_t *size);
+typedef void (*commit_fn)(void *ptr, size_t used);
 
 // compile-time context
 struct compile_ctx {
     void *dmg;                  // for memory reads
     dmg_read_fn read;
+    rom_read_fn read_bank;      // far calls followed into other banks, NULL = off
     cache_store_fn cache_store; // NULL in tests, registers mid-block entries
-    alloc_fn alloc;             // NULL uses malloc, otherwise arena_alloc
+    cache_lookup_fn cache_lookup; // finds blocks for block_reentry
+    reserve_fn reserve;         // NULL uses malloc, otherwise arena_reserve
+    commit_fn commit;           // arena_commit
     uint8_t current_bank;       // current ROM bank for cache_store calls
     // GB memory the emitted fast paths address absolutely
     void *wram_base;            // dmg->wram
@@ -128,13 +269,70 @@ struct compile_ctx {
     void *joyp_ptr;             // &dmg->joyp, the maintained FF00 shadow
     uint16_t bank_reg_lo;       // MBC ROM-bank select range for the
     uint16_t bank_reg_hi;       // same-bank write skip, both 0 = off
+    uint8_t ic_counters;        // count inline cache hits/misses in jit_ctx
+    uint8_t version;            // VERSION_* facts that hold now, 0 = none
+    uint8_t tier;               // TIER_* to compile at
+    uint16_t hot_entries;       // for TIER_QUICK, entries before it's hot
 };
 
 struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx);
 
+// registers code[m68k_off] as the entry point for gb_pc in the cache, once
+// the block is finished and its code won't move any more
+void compile_entry_point(struct compile_ctx *ctx, uint16_t gb_pc, uint16_t m68k_off);
+
+// a way into a block already compiled for pc, at one of its reentry
+// points, so pc doesn't get an overlapping block of its own. the block
+// is found through ctx->cache_lookup among the blocks starting up to 256
+// bytes before pc, and the entry is registered with ctx->cache_store.
+// NULL when no block has one
+void *block_reentry(struct compile_ctx *ctx, uint16_t pc);
+
+// whether the facts the block at code was compiled for all hold in
+// version. always for a mid-block entry
+int block_version_holds(void *code, uint8_t version);
+
+// points the version exit of block at code that doesn't need its facts,
+// target as the emitted code addresses it
+void block_version_link(struct code_block *block, uint32_t target);
+
+// where block_version_link pointed the version exit of the block at code,
+// 0 while it still goes to the dispatcher
+uint32_t block_version_target(void *code);
+
+// whether the block at code is a TIER_QUICK one that has used up its
+// entries, to be compiled again at TIER_FULL. never for a mid-block entry
+int block_is_hot(void *code);
+
 // Free a compiled block
 void block_free(struct code_block *block);
 
+// the block whose code[] starts at code, NULL for a mid-block entry
+struct code_block *block_from_code(void *code);
+
+// Record a patched exit at site pointing at code, a block start or a
+// mid-block entry: in the block's header when there is room, otherwise
+// in link_log. Returns 0 when both are full, leaving the link untracked
+int block_add_link(void *code, uint8_t *site);
+
+// Restore every exit linked to block, or to any entry inside it, to its
+// unpatched form (JMP.L back to movea.l/jsr patch_helper, bank link slots
+// emptied) so the block can be invalidated or evicted. The caller flushes
+// the CPU cache
+void block_unlink(struct code_block *block);
+
+// The same for one cache entry: all of the block's links for a block
+// start, only the ones made to it for a mid-block entry
+void block_unlink_entry(void *code);
+
+// Forget every logged link, when the arena they point into is reset
+void block_links_reset(void);
+
+// Unlink block and turn its entry into a jmp.l to target, the block that
+// replaces it, so the pointers into it nobody tracks (inline caches, jump
+// table records) go straight there. Its memory must stay allocated
+void block_retire(struct code_block *block, uint32_t target);
+
 void compile_join_bc(struct code_block *block, int dreg);
 void compile_join_de(struct code_block *block, int dreg);
 
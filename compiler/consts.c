@@ -0,0 +1,440 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "consts.h"
+#include "compiler.h"
+#include "emitters.h"
+#include "flags.h"
+#include "mem_loads.h"
+#include "timing.h"
+#include "decode.h"
+
+#define READ_BYTE(off) (decode_read(ctx, src_address + (off)))
+
+uint8_t consts_known;
+uint8_t consts_val[8];
+uint8_t consts_flags_known;
+uint8_t consts_flags;
+
+void consts_reset(void)
+{
+    consts_known = 0;
+    consts_flags_known = 0;
+}
+
+void consts_save(struct consts_snapshot *snap)
+{
+    snap->known = consts_known;
+    memcpy(snap->val, consts_val, sizeof consts_val);
+    snap->flags_known = consts_flags_known;
+    snap->flags = consts_flags;
+}
+
+void consts_restore(const struct consts_snapshot *snap)
+{
+    consts_known = snap->known;
+    memcpy(consts_val, snap->val, sizeof consts_val);
+    consts_flags_known = snap->flags_known;
+    consts_flags = snap->flags;
+}
+
+static int known(int reg)
+{
+    return consts_known & (1 << reg);
+}
+
+static void set_reg(int reg, uint8_t val)
+{
+    consts_known |= 1 << reg;
+    consts_val[reg] = val;
+}
+
+static void forget(int reg)
+{
+    consts_known &= ~(1 << reg);
+}
+
+// pairs by their high register: GB_REG_B, GB_REG_D, GB_REG_H
+static int pair_known(int hi, uint16_t *val)
+{
+    if (!known(hi) || !known(hi + 1)) {
+        return 0;
+    }
+    *val = consts_val[hi] << 8 | consts_val[hi + 1];
+    return 1;
+}
+
+static void set_pair(int hi, uint16_t val)
+{
+    set_reg(hi, val >> 8);
+    set_reg(hi + 1, val & 0xff);
+}
+
+static void forget_pair(int hi)
+{
+    forget(hi);
+    forget(hi + 1);
+}
+
+static void set_flag(int flag, int on)
+{
+    consts_flags_known |= flag;
+    if (on) {
+        consts_flags |= flag;
+    } else {
+        consts_flags &= ~flag;
+    }
+}
+
+// 8-bit ALU op kind (add, adc, sub, sbc, and, xor, or, cp) on A and an
+// operand that may not be known. same is set for the A, A forms, carry_known
+// is whether C was known going in
+static void alu_update(
+    int kind,
+    int have_src,
+    uint8_t src,
+    int same,
+    int carry_known
+) {
+    int a = consts_val[GB_REG_A];
+    int carry = consts_flags & FLAG_C;
+    int res;
+
+    // sub a, xor a and cp a don't depend on A at all
+    if (same && (kind == 2 || kind == 5 || kind == 7)) {
+        if (kind != 7) {
+            set_reg(GB_REG_A, 0);
+        }
+        set_flag(FLAG_Z, 1);
+        set_flag(FLAG_C, 0);
+        return;
+    }
+    // and, xor, or always clear C
+    if (kind >= 4 && kind <= 6) {
+        set_flag(FLAG_C, 0);
+    }
+    if (!known(GB_REG_A) || !have_src
+            || ((kind == 1 || kind == 3) && !carry_known)) {
+        if (kind != 7) {
+            forget(GB_REG_A);
+        }
+        return;
+    }
+
+    switch (kind) {
+    case 0: res = a + src; break;
+    case 1: res = a + src + carry; break;
+    case 2: case 7: res = a - src; break;
+    case 3: res = a - src - carry; break;
+    case 4: res = a & src; break;
+    case 5: res = a ^ src; break;
+    default: res = a | src; break;
+    }
+
+    set_flag(FLAG_Z, (res & 0xff) == 0);
+    if (kind < 4 || kind == 7) {
+        set_flag(FLAG_C, res < 0 || res > 0xff);
+    }
+    if (kind != 7) {
+        set_reg(GB_REG_A, res);
+    }
+}
+
+void consts_update(
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t off
+) {
+    uint8_t op = READ_BYTE(off);
+    uint8_t cb_op = op == 0xcb ? READ_BYTE(off + 1) : 0;
+    uint8_t old_flags_known = consts_flags_known;
+    int reg = (op >> 3) & 7;
+    int hi = (op >> 4) * 2;
+    uint16_t val;
+
+    // whatever the op computes below goes on top of this
+    consts_flags_known &= ~flag_writes(op, cb_op);
+
+    // ld r, u8 / inc r / dec r
+    if ((op & 0xc7) == 0x06 && reg != GB_REG_HL) {
+        set_reg(reg, READ_BYTE(off + 1));
+        return;
+    }
+    if ((op & 0xc6) == 0x04 && reg != GB_REG_HL) {
+        if (known(reg)) {
+            set_reg(reg, consts_val[reg] + (op & 1 ? -1 : 1));
+            set_flag(FLAG_Z, consts_val[reg] == 0);
+        } else {
+            forget(reg);
+        }
+        return;
+    }
+    // ld r, r'
+    if (op >= 0x40 && op < 0x80 && op != 0x76) {
+        int src = op & 7;
+        if (reg == GB_REG_HL) {
+            return;
+        }
+        if (src == GB_REG_HL) {
+            if (pair_known(GB_REG_H, &val) && val < 0x4000) {
+                set_reg(reg, decode_read(ctx, val));
+            } else {
+                forget(reg);
+            }
+        } else if (known(src)) {
+            set_reg(reg, consts_val[src]);
+        } else {
+            forget(reg);
+        }
+        return;
+    }
+    if (op >= 0x80 && op < 0xc0) {
+        int src = op & 7;
+        alu_update(reg, src != GB_REG_HL && known(src), consts_val[src],
+                src == GB_REG_A, old_flags_known & FLAG_C);
+        return;
+    }
+
+    switch (op) {
+    // nothing tracked changes. conditional branches only get here on
+    // the fall-through path, unconditional ones when the superblock
+    // former keeps going at the target
+    case 0x00: case 0x02: case 0x08: case 0x12:
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x31:
+    case 0x33: case 0x34: case 0x35: case 0x36: case 0x38: case 0x3b:
+    case 0xc0: case 0xc2: case 0xc3: case 0xc4: case 0xc5: case 0xc8:
+    case 0xca: case 0xcc: case 0xcd: case 0xd0: case 0xd2: case 0xd4:
+    case 0xd5: case 0xd8: case 0xda: case 0xdc: case 0xe0: case 0xe2:
+    case 0xe5: case 0xe8: case 0xea: case 0xf3: case 0xf5: case 0xf9:
+    case 0xfb:
+        break;
+
+    case 0x01: case 0x11: case 0x21:
+        set_pair(hi, READ_BYTE(off + 1) | READ_BYTE(off + 2) << 8);
+        break;
+
+    case 0x03: case 0x13: case 0x23:
+    case 0x0b: case 0x1b: case 0x2b:
+        if (pair_known(hi, &val)) {
+            set_pair(hi, val + (op & 8 ? -1 : 1));
+        } else {
+            forget_pair(hi);
+        }
+        break;
+
+    case 0x22: case 0x32:
+        if (pair_known(GB_REG_H, &val)) {
+            set_pair(GB_REG_H, val + (op == 0x22 ? 1 : -1));
+        }
+        break;
+
+    case 0x0a: case 0x1a: case 0x2a: case 0x3a:
+        // only bank 0 is sure not to change under a known pointer
+        if (pair_known(op < 0x20 ? hi : GB_REG_H, &val) && val < 0x4000) {
+            set_reg(GB_REG_A, decode_read(ctx, val));
+        } else {
+            forget(GB_REG_A);
+        }
+        if (op == 0x2a || op == 0x3a) {
+            if (pair_known(GB_REG_H, &val)) {
+                set_pair(GB_REG_H, val + (op == 0x2a ? 1 : -1));
+            }
+        }
+        break;
+
+    case 0xfa:
+        val = READ_BYTE(off + 1) | READ_BYTE(off + 2) << 8;
+        if (rom_read_foldable(src_address, val)) {
+            set_reg(GB_REG_A, decode_read(ctx, val));
+        } else {
+            forget(GB_REG_A);
+        }
+        break;
+
+    case 0xf0:
+        // may have been fused with the and a / or a of a polling loop
+        forget(GB_REG_A);
+        consts_flags_known = 0;
+        break;
+
+    case 0x07: case 0x0f: case 0x17: case 0x1f: case 0x27:
+    case 0xf2:
+        forget(GB_REG_A);
+        break;
+
+    case 0x2f: // cpl
+        if (known(GB_REG_A)) {
+            set_reg(GB_REG_A, ~consts_val[GB_REG_A]);
+        }
+        break;
+
+    case 0x37: // scf
+        set_flag(FLAG_C, 1);
+        break;
+
+    case 0x3f: // ccf
+        if (old_flags_known & FLAG_C) {
+            set_flag(FLAG_C, !(consts_flags & FLAG_C));
+        }
+        break;
+
+    case 0x09: case 0x19: case 0x29:
+        {
+            uint16_t hl, rr;
+            if (pair_known(GB_REG_H, &hl) && pair_known(hi, &rr)) {
+                set_pair(GB_REG_H, hl + rr);
+                set_flag(FLAG_C, hl + rr > 0xffff);
+            } else {
+                forget_pair(GB_REG_H);
+            }
+        }
+        break;
+
+    case 0x39: case 0xe1: case 0xf8:
+        forget_pair(GB_REG_H);
+        break;
+    case 0xc1: case 0xd1:
+        forget_pair((op >> 4) * 2 - 0x18);
+        break;
+    case 0xf1:
+        forget(GB_REG_A);
+        break;
+
+    case 0xc6: case 0xce: case 0xd6: case 0xde:
+    case 0xe6: case 0xee: case 0xf6: case 0xfe:
+        alu_update(reg, 1, READ_BYTE(off + 1), 0, old_flags_known & FLAG_C);
+        break;
+
+    case 0xcb:
+        reg = cb_op & 7;
+        if (reg == GB_REG_HL) {
+            break;
+        }
+        if (cb_op < 0x40) {
+            forget(reg);
+        } else if (known(reg)) {
+            uint8_t bit = 1 << ((cb_op >> 3) & 7);
+            if (cb_op < 0x80) {
+                set_flag(FLAG_Z, !(consts_val[reg] & bit));
+            } else if (cb_op < 0xc0) {
+                set_reg(reg, consts_val[reg] & ~bit);
+            } else {
+                set_reg(reg, consts_val[reg] | bit);
+            }
+        }
+        break;
+
+    default:
+        consts_reset();
+        break;
+    }
+}
+
+int consts_branch(uint8_t op, uint8_t *uncond)
+{
+    int flag, if_set;
+
+    switch (op & 0xe7) {
+    case 0x20: *uncond = 0x18; break; // jr cc
+    case 0xc0: *uncond = 0xc9; break; // ret cc
+    case 0xc2: *uncond = 0xc3; break; // jp cc
+    case 0xc4: *uncond = 0xcd; break; // call cc
+    default:
+        return -1;
+    }
+    flag = op & 0x10 ? FLAG_C : FLAG_Z;
+    if_set = op & 0x08;
+    if (!(consts_flags_known & flag)) {
+        return -1;
+    }
+    return !(consts_flags & flag) == !if_set;
+}
+
+int compile_known_op(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint8_t op,
+    uint16_t src_address,
+    uint16_t *src_ptr
+) {
+    int reg = (op >> 3) & 7;
+    uint16_t addr;
+
+    // reloads of what the register already holds
+    if ((op & 0xc7) == 0x06 && reg != GB_REG_HL) {
+        if (known(reg) && consts_val[reg] == READ_BYTE(*src_ptr)) {
+            (*src_ptr)++;
+            return 1;
+        }
+        return 0;
+    }
+    if (op == 0x01 || op == 0x11 || op == 0x21) {
+        uint16_t imm = READ_BYTE(*src_ptr) | READ_BYTE(*src_ptr + 1) << 8;
+        if (pair_known((op >> 4) * 2, &addr) && addr == imm) {
+            *src_ptr += 2;
+            return 1;
+        }
+        return 0;
+    }
+    if (op >= 0x40 && op < 0x80 && op != 0x76
+            && reg != GB_REG_HL && (op & 7) != GB_REG_HL) {
+        return known(reg) && known(op & 7)
+                && consts_val[reg] == consts_val[op & 7];
+    }
+
+    // accesses through a known pointer or ($ff00 + c)
+    switch (op) {
+    case 0x02: case 0x12:
+        if (!pair_known((op >> 4) * 2, &addr)) {
+            return 0;
+        }
+        compile_ld_addr_a(block, ctx, addr);
+        return 1;
+
+    case 0x0a: case 0x1a:
+        if (!pair_known((op >> 4) * 2, &addr)) {
+            return 0;
+        }
+        compile_ld_a_addr(block, ctx, addr, addr < 0x4000);
+        return 1;
+
+    case 0x77: case 0x22: case 0x32:
+        if (!pair_known(GB_REG_H, &addr)) {
+            return 0;
+        }
+        compile_ld_addr_a(block, ctx, addr);
+        break;
+
+    case 0x7e: case 0x2a: case 0x3a:
+        if (!pair_known(GB_REG_H, &addr)) {
+            return 0;
+        }
+        compile_ld_a_addr(block, ctx, addr, addr < 0x4000);
+        break;
+
+    case 0xe2:
+        if (!known(GB_REG_C)) {
+            return 0;
+        }
+        compile_ldh_u8_a(block, ctx, consts_val[GB_REG_C]);
+        return 1;
+
+    case 0xf2:
+        if (!known(GB_REG_C)) {
+            return 0;
+        }
+        compile_ldh_a_u8_direct(block, ctx, consts_val[GB_REG_C]);
+        return 1;
+
+    default:
+        return 0;
+    }
+
+    // hl+ / hl-
+    if (op == 0x22 || op == 0x2a) {
+        emit_addq_w_an(block, REG_68K_A_HL, 1);
+    } else if (op == 0x32 || op == 0x3a) {
+        emit_subq_w_an(block, REG_68K_A_HL, 1);
+    }
+    return 1;
+}
@@ -0,0 +1,53 @@
+#ifndef _CONSTS_H
+#define _CONSTS_H
+
+#include <stdint.h>
+#include "compiler.h"
+
+// Compile-time constants: which GB registers and flags hold a value known
+// at the current point of the block. Only straight-line code is followed,
+// so compile_block resets this wherever execution can enter mid-block
+// (loop heads, the delay loop) and anything not understood forgets it all.
+// Registers are indexed like GB_REG_* in timing.h, flags like FLAG_*.
+extern uint8_t consts_known;
+extern uint8_t consts_val[8];
+extern uint8_t consts_flags_known;
+extern uint8_t consts_flags;
+
+void consts_reset(void);
+
+// for compiling the same instructions twice from the same starting point
+struct consts_snapshot {
+    uint8_t known;
+    uint8_t val[8];
+    uint8_t flags_known;
+    uint8_t flags;
+};
+
+void consts_save(struct consts_snapshot *snap);
+void consts_restore(const struct consts_snapshot *snap);
+
+// after the instruction at src_address + off has been compiled
+void consts_update(
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t off
+);
+
+// conditional branch op with a known outcome: returns 1 and sets *uncond
+// to the unconditional form when it is always taken, 0 when it never is,
+// -1 when it has to be tested at run time
+int consts_branch(uint8_t op, uint8_t *uncond);
+
+// instructions made cheaper by known registers: reloads of a value that is
+// already there, and memory accesses through a known pointer. returns 0 to
+// compile op the usual way
+int compile_known_op(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint8_t op,
+    uint16_t src_address,
+    uint16_t *src_ptr
+);
+
+#endif
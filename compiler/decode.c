@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "decode.h"
+#include "compiler.h"
+#include "instructions.h"
+
+static uint8_t window[DECODE_WINDOW];
+// bytes are read on first use, short blocks don't pay for the whole window
+static uint8_t window_have[DECODE_WINDOW];
+static uint16_t window_base;
+static int window_open;
+// ROM bank 0x4000-0x7fff is read from, -1 for the mapped one
+static int window_bank = -1;
+
+static struct gb_insn insns[256];
+static uint8_t insn_have[256];
+
+void decode_window(uint16_t src_address)
+{
+    window_base = src_address;
+    window_open = 1;
+    memset(window_have, 0, sizeof window_have);
+    memset(insn_have, 0, sizeof insn_have);
+}
+
+void decode_end(void)
+{
+    window_open = 0;
+}
+
+void decode_rom_bank(int bank)
+{
+    window_bank = bank;
+}
+
+static uint8_t read_source(struct compile_ctx *ctx, uint16_t address)
+{
+    if (window_bank >= 0 && address >= 0x4000 && address < 0x8000) {
+        return ctx->read_bank(ctx->dmg, window_bank, address);
+    }
+    return ctx->read(ctx->dmg, address);
+}
+
+uint8_t decode_read(struct compile_ctx *ctx, uint16_t address)
+{
+    uint16_t off = address - window_base;
+
+    if (!window_open || off >= DECODE_WINDOW) {
+        return read_source(ctx, address);
+    }
+    if (!window_have[off]) {
+        window[off] = read_source(ctx, address);
+        window_have[off] = 1;
+    }
+    return window[off];
+}
+
+const struct gb_insn *decode_at(struct compile_ctx *ctx, uint16_t off)
+{
+    struct gb_insn *in = &insns[off];
+    uint16_t pc = window_base + off;
+    const struct instruction *info;
+
+    if (insn_have[off]) {
+        return in;
+    }
+    insn_have[off] = 1;
+
+    in->op = decode_read(ctx, pc);
+    in->length = insn_length[in->op];
+    in->operand = 0;
+    if (in->length > 1) {
+        in->operand = decode_read(ctx, pc + 1);
+    }
+    if (in->length > 2) {
+        in->operand |= decode_read(ctx, pc + 2) << 8;
+    }
+
+    info = &instructions[in->op == 0xcb ? 0x100 + in->operand : in->op];
+    in->cycles = info->cycles;
+    in->cycles_branch = info->cycles_branch;
+
+    in->has_target = 1;
+    switch (in->op) {
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        in->target = pc + 2 + (int8_t) in->operand;
+        break;
+    case 0xc2: case 0xc3: case 0xc4: case 0xca: case 0xcc: case 0xcd:
+    case 0xd2: case 0xd4: case 0xda: case 0xdc:
+        in->target = in->operand;
+        break;
+    case 0xc7: case 0xcf: case 0xd7: case 0xdf:
+    case 0xe7: case 0xef: case 0xf7: case 0xff:
+        in->target = in->op & 0x38;
+        break;
+    default:
+        in->has_target = 0;
+        in->target = 0;
+        break;
+    }
+    return in;
+}
@@ -0,0 +1,51 @@
+#ifndef _DECODE_H
+#define _DECODE_H
+
+#include <stdint.h>
+#include "compiler.h"
+
+// Decoded source window. A block compiles at most 256 bytes from where it
+// (or a superblock segment) starts, and the pre-scans, the main loop and
+// the pattern matchers all look at the same bytes. Each byte of the window
+// is read through ctx->read once and kept, READ_BYTE in the compiler files
+// goes through decode_read. Instructions are decoded on first use and kept
+// by offset, the main loop and the pattern matchers share them. The branch
+// pre-scan walks the whole window, most of which a block never compiles, so
+// it only reads opcodes and branch operands: decoding all of it cost more
+// than it saved.
+
+// 256 bytes, the operands of an instruction at 255, and one byte of
+// lookahead past that
+#define DECODE_WINDOW 259
+
+struct gb_insn {
+    uint8_t op;
+    uint8_t length;
+    // cycles not taken / taken, CB opcodes included
+    uint8_t cycles;
+    uint8_t cycles_branch;
+    // imm8, imm16 or the CB opcode
+    uint16_t operand;
+    // jr/jp/call/rst: the GB address it goes to
+    uint8_t has_target;
+    uint16_t target;
+};
+
+// starts a new window at src_address, forgetting the previous one
+void decode_window(uint16_t src_address);
+
+// forgets the window, reads go straight to ctx->read again
+void decode_end(void);
+
+// reads of 0x4000-0x7fff come from ROM bank `bank` through ctx->read_bank
+// instead of the mapped one, -1 to go back to it. set before the window
+// starts, the window doesn't notice a change
+void decode_rom_bank(int bank);
+
+// the byte at address, from the window when it's in it
+uint8_t decode_read(struct compile_ctx *ctx, uint16_t address);
+
+// the instruction at window offset off (< 256)
+const struct gb_insn *decode_at(struct compile_ctx *ctx, uint16_t off);
+
+#endif
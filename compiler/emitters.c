@@ -3,10 +3,11 @@
 #include <stdlib.h>
 
 #include "compiler.h"
+#include "peephole.h"
 
 void emit_byte(struct code_block *block, uint8_t byte)
 {
-    if (block->length < sizeof(block->code)) {
+    if (block->length < block->capacity) {
         block->code[block->length++] = byte;
     }
 }
@@ -274,6 +275,14 @@ void emit_move_b_imm_ind_an(struct code_block *block, uint8_t imm, uint8_t areg)
     emit_word(block, imm);
 }
 
+// move.l #imm, (An) - store immediate long to memory
+void emit_move_l_imm_ind_an(struct code_block *block, uint32_t imm, uint8_t areg)
+{
+    // 00 10 aaa 010 111 100
+    emit_word(block, 0x20bc | (areg << 9));
+    emit_long(block, imm);
+}
+
 // move.b #imm, d(An) - store immediate byte to memory with displacement
 void emit_move_b_imm_disp_an(
     struct code_block *block,
@@ -488,6 +497,12 @@ void emit_bcc_opcode_w(struct code_block *block, int cond, int16_t disp)
     emit_word(block, disp);
 }
 
+// emit Bcc.b with condition code, same codes as above
+void emit_bcc_opcode_b(struct code_block *block, int cond, int8_t disp)
+{
+    emit_word(block, 0x6000 | (cond << 8) | ((uint8_t) disp));
+}
+
 // btst #bit, Dn - test bit, sets Z=1 if bit is 0
 void emit_btst_imm_dn(struct code_block *block, uint8_t bit, uint8_t dreg)
 {
@@ -636,6 +651,13 @@ void emit_jsr_ind_an(struct code_block *block, uint8_t areg)
     emit_word(block, 0x4e90 | areg);
 }
 
+// jmp (An)
+void emit_jmp_ind_an(struct code_block *block, uint8_t areg)
+{
+    // 0100 1110 11 010 aaa
+    emit_word(block, 0x4ed0 | areg);
+}
+
 // jsr (addr).l - jump to subroutine at absolute address
 void emit_jsr_abs_l(struct code_block *block, uint32_t addr)
 {
@@ -728,6 +750,13 @@ void emit_ext_w_dn(struct code_block *block, uint8_t dreg)
     emit_word(block, 0x4880 | dreg);
 }
 
+// ext.l Dn - sign-extend word to long
+void emit_ext_l_dn(struct code_block *block, uint8_t dreg)
+{
+    // 0100 100 011 000 ddd
+    emit_word(block, 0x48c0 | dreg);
+}
+
 // not.b Dn - one's complement (flip all bits)
 void emit_not_b_dn(struct code_block *block, uint8_t dreg)
 {
@@ -819,6 +848,46 @@ void emit_adda_l_dn_an(struct code_block *block, uint8_t dreg, uint8_t areg)
     emit_word(block, 0xd1c0 | (areg << 9) | dreg);
 }
 
+// suba.l Dn, An
+void emit_suba_l_dn_an(struct code_block *block, uint8_t dreg, uint8_t areg)
+{
+    // 1001 aaa 111 000 ddd
+    emit_word(block, 0x91c0 | (areg << 9) | dreg);
+}
+
+// dbra Dn, disp - decrement Dn.w and branch unless it was 0. disp is
+// relative to the displacement word, like the other .w branches
+void emit_dbra_dn(struct code_block *block, uint8_t dreg, int16_t disp)
+{
+    // 0101 0001 1100 1ddd (dbf)
+    emit_word(block, 0x51c8 | dreg);
+    emit_word(block, disp);
+}
+
+// move.b (Ay)+, (Ax)+
+void emit_move_b_postinc_postinc(
+    struct code_block *block,
+    uint8_t src_areg,
+    uint8_t dest_areg
+) {
+    // 00 01 xxx 011 011 yyy
+    emit_word(block, 0x10d8 | (dest_areg << 9) | src_areg);
+}
+
+// move.b Dn, (An)+
+void emit_move_b_dn_postinc_an(struct code_block *block, uint8_t dreg, uint8_t areg)
+{
+    // 00 01 aaa 011 000 ddd
+    emit_word(block, 0x10c0 | (areg << 9) | dreg);
+}
+
+// move.b Dn, -(An)
+void emit_move_b_dn_predec_an(struct code_block *block, uint8_t dreg, uint8_t areg)
+{
+    // 00 01 aaa 100 000 ddd
+    emit_word(block, 0x1100 | (areg << 9) | dreg);
+}
+
 // tst.b d(An) - test byte at displacement from address register
 void emit_tst_b_disp_an(struct code_block *block, int16_t disp, uint8_t areg)
 {
@@ -876,6 +945,13 @@ void emit_tst_b_dn(struct code_block *block, uint8_t dreg)
     emit_word(block, 0x4a00 | dreg);
 }
 
+// tst.l Dn
+void emit_tst_l_dn(struct code_block *block, uint8_t dreg)
+{
+    // 0100 1010 10 000 rrr
+    emit_word(block, 0x4a80 | dreg);
+}
+
 // lsr.w #count, Dn - logical shift right word by immediate (1-8)
 void emit_lsr_w_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg)
 {
@@ -994,6 +1070,46 @@ void emit_move_b_dn_disp_idx_an(
     emit_word(block, (idx_dreg << 12) | ((uint8_t) disp));
 }
 
+// move.b (An,Am.w), Dd - load byte indexed by an address register
+void emit_move_b_aidx_an_dn(
+    struct code_block *block,
+    uint8_t base_areg,
+    uint8_t idx_areg,
+    uint8_t dest_dreg
+) {
+    // move.b ea, Dn: 00 01 ddd 000 110 aaa (mode 110 = An with index)
+    // extension word: D/A=1 | idx_reg | W/L=0 | 000 | 0 (disp=0)
+    emit_word(block, 0x1030 | (dest_dreg << 9) | base_areg);
+    emit_word(block, 0x8000 | (idx_areg << 12));
+}
+
+// move.b Ds, (An,Am.w) - store byte indexed by an address register
+void emit_move_b_dn_aidx_an(
+    struct code_block *block,
+    uint8_t src_dreg,
+    uint8_t base_areg,
+    uint8_t idx_areg
+) {
+    // move.b Dn, ea: 00 01 aaa 110 000 sss (mode 110 = An with index)
+    // extension word: D/A=1 | idx_reg | W/L=0 | 000 | 0 (disp=0)
+    emit_word(block, 0x1180 | (base_areg << 9) | src_dreg);
+    emit_word(block, 0x8000 | (idx_areg << 12));
+}
+
+// move.b #imm, (An,Am.w) - store immediate byte indexed by an address register
+void emit_move_b_imm_aidx_an(
+    struct code_block *block,
+    uint8_t imm,
+    uint8_t base_areg,
+    uint8_t idx_areg
+) {
+    // move.b #imm, ea: 00 01 aaa 110 111 100
+    // immediate word comes before the destination extension word
+    emit_word(block, 0x11bc | (base_areg << 9));
+    emit_word(block, imm);
+    emit_word(block, 0x8000 | (idx_areg << 12));
+}
+
 // lea d(An), An - load effective address with 16-bit displacement
 void emit_lea_disp_an_an(
     struct code_block *block,
@@ -1006,6 +1122,22 @@ void emit_lea_disp_an_an(
     emit_word(block, disp);
 }
 
+// pea d(An) - push the address with 16-bit displacement
+void emit_pea_disp_an(struct code_block *block, int16_t disp, uint8_t areg)
+{
+    // 0100 1000 01 101 aaa
+    emit_word(block, 0x4868 | areg);
+    emit_word(block, disp);
+}
+
+// lea d16(pc), An - position-independent address of code in this block
+void emit_lea_disp_pc_an(struct code_block *block, int16_t disp, uint8_t dest_areg)
+{
+    // 0100 ddd 111 111 010
+    emit_word(block, 0x41fa | (dest_areg << 9));
+    emit_word(block, disp);
+}
+
 // move.l Dn, d(An) - store long from data register to memory with displacement
 void emit_move_l_dn_disp_an(
     struct code_block *block,
@@ -1018,6 +1150,18 @@ void emit_move_l_dn_disp_an(
     emit_word(block, disp);
 }
 
+// move.l As, d(Ad) - store long from address register to memory with displacement
+void emit_move_l_an_disp_an(
+    struct code_block *block,
+    uint8_t src_areg,
+    int16_t disp,
+    uint8_t dest_areg
+) {
+    // 00 10 ddd 101 001 sss
+    emit_word(block, 0x2148 | (dest_areg << 9) | src_areg);
+    emit_word(block, disp);
+}
+
 // add.l d(An), Dn - add long from memory to data register
 void emit_add_l_disp_an_dn(
     struct code_block *block,
@@ -1183,6 +1327,27 @@ void emit_subq_w_disp_an(
     emit_word(block, disp);
 }
 
+// subq.w #data, (An) - subtract quick (1-8) from memory word
+void emit_subq_w_ind_an(struct code_block *block, uint8_t data, uint8_t areg)
+{
+    // 0101 ddd 1 01 010 aaa (ddd: 1-7 = 1-7, 0 = 8)
+    uint8_t ddd = (data == 8) ? 0 : data;
+    emit_word(block, 0x5150 | (ddd << 9) | areg);
+}
+
+// subq.b #data, d(An) - subtract quick (1-8) from memory byte
+void emit_subq_b_disp_an(
+    struct code_block *block,
+    uint8_t data,
+    int16_t disp,
+    uint8_t areg
+) {
+    // 0101 ddd 1 00 101 aaa (ddd: 1-7 = 1-7, 0 = 8)
+    uint8_t ddd = (data == 8) ? 0 : data;
+    emit_word(block, 0x5100 | (ddd << 9) | 0x28 | areg);
+    emit_word(block, disp);
+}
+
 
 // addi.l #imm32, d(An) - add immediate long to memory
 void emit_addi_l_disp_an(
@@ -1234,6 +1399,18 @@ void emit_cmpa_w_imm_an(struct code_block *block, uint16_t imm, uint8_t areg)
     emit_word(block, imm);
 }
 
+// cmpa.l (An,Dm.w), Ad - compare long from indexed address with Ad
+void emit_cmpa_l_idx_an_an(
+    struct code_block *block,
+    uint8_t base_areg,
+    uint8_t idx_dreg,
+    uint8_t areg
+) {
+    // cmpa.l ea, An: 1011 aaa 111 110 bbb (mode 110 = An with index)
+    emit_word(block, 0xb1f0 | (areg << 9) | base_areg);
+    emit_word(block, idx_dreg << 12);
+}
+
 // bcs.b - branch if carry set with 8-bit displacement
 void emit_bcs_b(struct code_block *block, int8_t disp)
 {
@@ -1353,6 +1530,33 @@ void emit_cmp_b_disp_an_dn(
     emit_word(block, disp);
 }
 
+// cmp.l (An), Dn - compare memory long with data register
+void emit_cmp_l_ind_an_dn(struct code_block *block, uint8_t areg, uint8_t dreg)
+{
+    // 1011 ddd 010 010 aaa
+    emit_word(block, 0xb090 | (dreg << 9) | areg);
+}
+
+// cmp.w (An), Dn
+void emit_cmp_w_ind_an_dn(struct code_block *block, uint8_t areg, uint8_t dreg)
+{
+    // 1011 ddd 001 010 aaa
+    emit_word(block, 0xb050 | (dreg << 9) | areg);
+}
+
+// cmpi.b #imm, d(An) - compare memory byte with immediate
+void emit_cmpi_b_imm_disp_an(
+    struct code_block *block,
+    uint8_t imm,
+    int16_t disp,
+    uint8_t areg
+) {
+    // 0000 1100 00 101 aaa
+    emit_word(block, 0x0c28 | areg);
+    emit_word(block, imm);
+    emit_word(block, disp);
+}
+
 // emit_add_cycles - add GB cycles to D2, picks optimal instruction
 void emit_add_cycles(struct code_block *block, int cycles)
 {
@@ -1390,12 +1594,134 @@ void emit_patchable_exit(struct code_block *block)
     emit_rts(block);
 }
 
+// Patchable exit into the switchable ROM window (0x4000-0x7fff)
+// A JMP.L patched over the JSR would keep running the old bank's code after
+// a bank switch, so instead the exit is followed by a small table of
+// (0x0100 | bank, code) links that is checked against the mapped bank:
+//   lea table(pc), a1
+//   stub: cmp.l wake(a4), d2 / bcc.s exit
+//   move.w #0x100, d0 / move.b ROM_BANK(a4), d0
+//   cmp.w (a1), d0 / beq.s hit / addq.l #6, a1   (all slots but the last)
+//   cmp.w (a1), d0 / bne.s miss
+//   hit: movea.l 2(a1), a0 / jmp (a0)
+//   miss: pea -8(a1) / movea.l PATCH_HELPER(a4), a0 / jmp (a0)
+//   exit: rts
+//   table: BANK_LINK_SLOTS * BANK_LINK_SIZE bytes, keys 0 = empty
+// patch_helper fills an empty slot for the current bank; with every slot
+// taken it leaves the table alone and just jumps, so the site stays correct.
+// It is handed the rts in front of the table as its return address, as if
+// the exit had jsr'd to it.
+//
+// Only the table is the exit's own, so within a block the first exit keeps
+// the stub and the others share it:
+//   lea table(pc), a1 / bra.w stub / rts / table
+// The cold tail is a buffer of its own and gets its own stub. Outside
+// compile_block (the helpers, tests) every exit has one.
+static struct {
+    const struct code_block *block;
+    size_t at;
+} link_stub[2];
+// stubs recorded, -1 while exits don't share
+static int link_stubs = -1;
+
+size_t exit_bytes;
+
+void exit_stubs_reset(void)
+{
+    link_stubs = 0;
+    exit_bytes = 0;
+}
+
+void exit_stubs_end(void)
+{
+    link_stubs = -1;
+}
+
+// the part after the lea, ending in the rts in front of the table
+static void emit_bank_link_stub(struct code_block *block)
+{
+    size_t hits[BANK_LINK_SLOTS];
+    size_t exit_at, miss_at;
+    int k;
+
+    emit_cmp_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+    exit_at = block->length;
+    emit_bcc_s(block, 0);
+
+    emit_move_w_dn(block, REG_68K_D_SCRATCH_0, 0x100);
+    emit_move_b_disp_an_dn(block, JIT_CTX_ROM_BANK, REG_68K_A_CTX, REG_68K_D_SCRATCH_0);
+
+    for (k = 0; k < BANK_LINK_SLOTS - 1; k++) {
+        emit_cmp_w_ind_an_dn(block, REG_68K_A_SCRATCH_2, REG_68K_D_SCRATCH_0);
+        hits[k] = block->length;
+        emit_beq_b(block, 0);
+        emit_addq_l_an(block, REG_68K_A_SCRATCH_2, BANK_LINK_SIZE);
+    }
+    emit_cmp_w_ind_an_dn(block, REG_68K_A_SCRATCH_2, REG_68K_D_SCRATCH_0);
+    miss_at = block->length;
+    emit_bne_b(block, 0);
+
+    for (k = 0; k < BANK_LINK_SLOTS - 1; k++) {
+        patch_branch_b(block, hits[k]);
+    }
+    emit_movea_l_disp_an_an(block, BANK_LINK_CODE, REG_68K_A_SCRATCH_2, REG_68K_A_SCRATCH_1);
+    emit_jmp_ind_an(block, REG_68K_A_SCRATCH_1);
+
+    patch_branch_b(block, miss_at);
+    emit_pea_disp_an(block, -2 - BANK_LINK_SIZE * (BANK_LINK_SLOTS - 1),
+            REG_68K_A_SCRATCH_2);
+    emit_movea_l_disp_an_an(block, JIT_CTX_PATCH_HELPER, REG_68K_A_CTX, REG_68K_A_SCRATCH_1);
+    emit_jmp_ind_an(block, REG_68K_A_SCRATCH_1);
+
+    patch_branch_b(block, exit_at);
+    emit_rts(block);
+}
+
+void emit_bank_linked_exit(struct code_block *block)
+{
+    size_t lea_at;
+    int k;
+
+    lea_at = block->length;
+    emit_lea_disp_pc_an(block, 0, REG_68K_A_SCRATCH_2);
+
+    for (k = 0; k < link_stubs && link_stub[k].block != block; k++) {
+    }
+    if (k < link_stubs) {
+        emit_bra_w(block, (int16_t) link_stub[k].at - (int16_t) (block->length + 2));
+        emit_rts(block);
+    } else {
+        if (link_stubs >= 0 && link_stubs < 2) {
+            link_stub[link_stubs].block = block;
+            link_stub[link_stubs++].at = block->length;
+        }
+        emit_bank_link_stub(block);
+    }
+
+    patch_branch_w(block, lea_at);
+    peephole_mark_data(block->length,
+            block->length + BANK_LINK_SLOTS * BANK_LINK_SIZE);
+    for (k = 0; k < BANK_LINK_SLOTS; k++) {
+        emit_word(block, 0);
+        emit_long(block, 0);
+    }
+}
+
 // allows skipping patch helper for areas that it will never patch
 void emit_block_exit(struct code_block *block, uint16_t target_gb_pc)
 {
-    if (target_gb_pc >= 0x8000) {
+    size_t before = block->length;
+
+    if (target_gb_pc >= 0xc000 && target_gb_pc < 0xe000) {
+        // WRAM blocks get linked to as well, the links are undone when the
+        // game rewrites them (cache_invalidate_upper_page)
+        emit_patchable_exit(block);
+    } else if (target_gb_pc >= 0x8000) {
         emit_dispatch_jump(block);
+    } else if (target_gb_pc >= 0x4000) {
+        emit_bank_linked_exit(block);
     } else {
         emit_patchable_exit(block);
     }
+    exit_bytes += block->length - before;
 }
\ No newline at end of file
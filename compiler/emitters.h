@@ -37,6 +37,7 @@ void emit_move_w_ind_an_dn(struct code_block *block, uint8_t areg, uint8_t dreg)
 void emit_move_b_dn_ind_an(struct code_block *block, uint8_t dreg, uint8_t areg);
 void emit_move_b_dn_disp_an(struct code_block *block, uint8_t dreg, int16_t disp, uint8_t areg);
 void emit_move_b_imm_ind_an(struct code_block *block, uint8_t imm, uint8_t areg);
+void emit_move_l_imm_ind_an(struct code_block *block, uint32_t imm, uint8_t areg);
 void emit_move_b_imm_disp_an(struct code_block *block, uint8_t imm, int16_t disp, uint8_t areg);
 void emit_move_b_ind_an_dn(struct code_block *block, uint8_t areg, uint8_t dreg);
 void emit_move_b_disp_an_dn(struct code_block *block, int16_t disp, uint8_t areg, uint8_t dreg);
@@ -56,7 +57,11 @@ void emit_or_l_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
 void emit_rts(struct code_block *block);
 void emit_dispatch_jump(struct code_block *block);
 void emit_patchable_exit(struct code_block *block);
+void emit_bank_linked_exit(struct code_block *block);
 void emit_block_exit(struct code_block *block, uint16_t target_gb_pc);
+void exit_stubs_reset(void);
+void exit_stubs_end(void);
+extern size_t exit_bytes;
 void emit_bra_b(struct code_block *block, int8_t disp);
 void emit_bra_w(struct code_block *block, int16_t disp);
 void emit_beq_b(struct code_block *block, int8_t disp);
@@ -66,6 +71,7 @@ void emit_bcs_w(struct code_block *block, int16_t disp);
 void emit_bcc_w(struct code_block *block, int16_t disp);
 void emit_bcc_s(struct code_block *block, int8_t disp);
 void emit_bcc_opcode_w(struct code_block *block, int cond, int16_t disp);
+void emit_bcc_opcode_b(struct code_block *block, int cond, int8_t disp);
 void patch_branch_b(struct code_block *block, size_t branch_at);
 void patch_branch_w(struct code_block *block, size_t branch_at);
 void emit_btst_imm_dn(struct code_block *block, uint8_t bit, uint8_t dreg);
@@ -87,6 +93,7 @@ void emit_push_l_disp_an(struct code_block *block, int16_t disp, uint8_t areg);
 void emit_movea_l_ind_an_an(struct code_block *block, uint8_t src_areg, uint8_t dest_areg);
 void emit_movea_l_disp_an_an(struct code_block *block, int16_t disp, uint8_t src_areg, uint8_t dest_areg);
 void emit_jsr_ind_an(struct code_block *block, uint8_t areg);
+void emit_jmp_ind_an(struct code_block *block, uint8_t areg);
 void emit_jsr_abs_l(struct code_block *block, uint32_t addr);
 void emit_addq_l_an(struct code_block *block, uint8_t areg, uint8_t val);
 void emit_movem_l_to_predec(struct code_block *block, uint16_t mask);
@@ -99,6 +106,7 @@ void emit_eor_b_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
 void emit_eor_b_imm_dn(struct code_block *block, uint8_t imm, uint8_t dreg);
 
 void emit_ext_w_dn(struct code_block *block, uint8_t dreg);
+void emit_ext_l_dn(struct code_block *block, uint8_t dreg);
 void emit_not_b_dn(struct code_block *block, uint8_t dreg);
 void emit_and_b_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
 void emit_ror_b_imm(struct code_block *block, uint8_t count, uint8_t dreg);
@@ -110,11 +118,17 @@ void emit_sub_b_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
 void emit_sub_w_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
 void emit_adda_w_dn_an(struct code_block *block, uint8_t dreg, uint8_t areg);
 void emit_adda_l_dn_an(struct code_block *block, uint8_t dreg, uint8_t areg);
+void emit_suba_l_dn_an(struct code_block *block, uint8_t dreg, uint8_t areg);
+void emit_dbra_dn(struct code_block *block, uint8_t dreg, int16_t disp);
+void emit_move_b_postinc_postinc(struct code_block *block, uint8_t src_areg, uint8_t dest_areg);
+void emit_move_b_dn_postinc_an(struct code_block *block, uint8_t dreg, uint8_t areg);
+void emit_move_b_dn_predec_an(struct code_block *block, uint8_t dreg, uint8_t areg);
 void emit_tst_b_disp_an(struct code_block *block, int16_t disp, uint8_t areg);
 void emit_lsl_b_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg);
 void emit_lsr_b_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg);
 void emit_asr_b_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg);
 void emit_tst_b_dn(struct code_block *block, uint8_t dreg);
+void emit_tst_l_dn(struct code_block *block, uint8_t dreg);
 void emit_lsr_w_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg);
 void emit_lsr_l_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg);
 void emit_move_l_an_dn(struct code_block *block, uint8_t areg, uint8_t dreg);
@@ -124,8 +138,14 @@ void emit_move_b_idx_an_dn(struct code_block *block, uint8_t base_areg, uint8_t
 void emit_move_b_dn_idx_an(struct code_block *block, uint8_t src_dreg, uint8_t base_areg, uint8_t idx_dreg);
 void emit_move_b_disp_idx_an_dn(struct code_block *block, int8_t disp, uint8_t base_areg, uint8_t idx_dreg, uint8_t dest_dreg);
 void emit_move_b_dn_disp_idx_an(struct code_block *block, uint8_t src_dreg, int8_t disp, uint8_t base_areg, uint8_t idx_dreg);
+void emit_move_b_aidx_an_dn(struct code_block *block, uint8_t base_areg, uint8_t idx_areg, uint8_t dest_dreg);
+void emit_move_b_dn_aidx_an(struct code_block *block, uint8_t src_dreg, uint8_t base_areg, uint8_t idx_areg);
+void emit_move_b_imm_aidx_an(struct code_block *block, uint8_t imm, uint8_t base_areg, uint8_t idx_areg);
 void emit_lea_disp_an_an(struct code_block *block, int16_t disp, uint8_t src_areg, uint8_t dest_areg);
+void emit_lea_disp_pc_an(struct code_block *block, int16_t disp, uint8_t dest_areg);
+void emit_pea_disp_an(struct code_block *block, int16_t disp, uint8_t areg);
 void emit_move_l_dn_disp_an(struct code_block *block, uint8_t dreg, int16_t disp, uint8_t areg);
+void emit_move_l_an_disp_an(struct code_block *block, uint8_t src_areg, int16_t disp, uint8_t dest_areg);
 void emit_add_l_disp_an_dn(struct code_block *block, int16_t disp, uint8_t areg, uint8_t dreg);
 void emit_add_l_dn_disp_an(struct code_block *block, uint8_t dreg, int16_t disp, uint8_t areg);
 void emit_sub_l_disp_an_dn(struct code_block *block, int16_t disp, uint8_t areg, uint8_t dreg);
@@ -139,12 +159,15 @@ void emit_subi_w_disp_an(struct code_block *block, int16_t imm, int16_t disp, ui
 void emit_addq_b_disp_an(struct code_block *block, uint8_t data, int16_t disp, uint8_t areg);
 void emit_addq_w_disp_an(struct code_block *block, uint8_t data, int16_t disp, uint8_t areg);
 void emit_subq_w_disp_an(struct code_block *block, uint8_t data, int16_t disp, uint8_t areg);
+void emit_subq_w_ind_an(struct code_block *block, uint8_t data, uint8_t areg);
+void emit_subq_b_disp_an(struct code_block *block, uint8_t data, int16_t disp, uint8_t areg);
 void emit_addq_l_disp_an(struct code_block *block, uint8_t data, int16_t disp, uint8_t areg);
 void emit_addi_l_disp_an(struct code_block *block, uint32_t imm, int16_t disp, uint8_t areg);
 void emit_cmpi_l_imm32_disp_an(struct code_block *block, uint32_t imm, int16_t disp, uint8_t areg);
 void emit_cmpi_l_imm_dn(struct code_block *block, uint32_t imm, uint8_t dreg);
 void emit_cmpi_w_imm_dn(struct code_block *block, uint16_t imm, uint8_t dreg);
 void emit_cmpa_w_imm_an(struct code_block *block, uint16_t imm, uint8_t areg);
+void emit_cmpa_l_idx_an_an(struct code_block *block, uint8_t base_areg, uint8_t idx_dreg, uint8_t areg);
 void emit_bcs_b(struct code_block *block, int8_t disp);
 void emit_ble_b(struct code_block *block, int8_t disp);
 void emit_bne_b(struct code_block *block, int8_t disp);
@@ -171,5 +194,13 @@ void emit_cmp_b_disp_an_dn(
     uint8_t areg,
     uint8_t dreg
 );
+void emit_cmp_l_ind_an_dn(struct code_block *block, uint8_t areg, uint8_t dreg);
+void emit_cmp_w_ind_an_dn(struct code_block *block, uint8_t areg, uint8_t dreg);
+void emit_cmpi_b_imm_disp_an(
+    struct code_block *block,
+    uint8_t imm,
+    int16_t disp,
+    uint8_t areg
+);
 
 #endif
@@ -1,5 +1,7 @@
 #include "compiler.h"
 #include "emitters.h"
+#include "flags.h"
+#include "decode.h"
 
 // how to do the flags properly:
 // 8-bit and, or, xor -> set Z for result, set C=0
@@ -12,13 +14,116 @@
 // swap -> set Z for result, set C=0
 // bit -> set Z for result, leave C alone
 
+int flags_live = FLAGS_ALL;
+size_t flags_ccr_at = (size_t) -1;
+
+// flags the emitted code for op overwrites without looking at them. this
+// follows what the compiler actually does, so add sp, e / ld hl, sp + e
+// (which leave D7 alone) don't count
+int flag_writes(uint8_t op, uint8_t cb_op)
+{
+    if (op >= 0x80 && op <= 0xbf)
+        return FLAGS_ALL;
+    switch (op) {
+    case 0x04: case 0x05: case 0x0c: case 0x0d:
+    case 0x14: case 0x15: case 0x1c: case 0x1d:
+    case 0x24: case 0x25: case 0x2c: case 0x2d:
+    case 0x34: case 0x35: case 0x3c: case 0x3d:
+        return FLAG_Z;
+    case 0x09: case 0x19: case 0x29: case 0x39:
+    case 0x37: case 0x3f:
+        return FLAG_C;
+    case 0x07: case 0x0f: case 0x17: case 0x1f:
+    case 0x27:
+    case 0xc6: case 0xce: case 0xd6: case 0xde:
+    case 0xe6: case 0xee: case 0xf6: case 0xfe:
+    case 0xf1:
+        return FLAGS_ALL;
+    case 0xcb:
+        if (cb_op < 0x40)
+            return FLAGS_ALL;
+        if (cb_op < 0x80)
+            return FLAG_Z;
+        return 0;
+    }
+    return 0;
+}
+
+// flags op reads, -1 if the block may leave straight-line code here (any
+// branch, exit or fused loop), where everything has to be treated as read
+static int flag_reads(uint8_t op, uint8_t cb_op)
+{
+    if ((op >= 0x88 && op <= 0x8f) || (op >= 0x98 && op <= 0x9f))
+        return FLAG_C;
+    switch (op) {
+    case 0x17: case 0x1f: case 0x3f:
+    case 0xce: case 0xde:
+        return FLAG_C;
+    case 0x27: case 0xf5:
+        return FLAGS_ALL;
+    case 0xcb:
+        if (cb_op >= 0x10 && cb_op < 0x20)
+            return FLAG_C;
+        return 0;
+
+    case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+    case 0x76:
+    case 0xc0: case 0xc2: case 0xc3: case 0xc4: case 0xc7:
+    case 0xc8: case 0xc9: case 0xca: case 0xcc: case 0xcd: case 0xcf:
+    case 0xd0: case 0xd2: case 0xd4: case 0xd7:
+    case 0xd8: case 0xd9: case 0xda: case 0xdc: case 0xdf:
+    case 0xe7: case 0xe9: case 0xef:
+    case 0xf7: case 0xff:
+    // ldh a, (n) starts the LY/HRAM polling loops, which can end the block
+    case 0xf0:
+    // unused opcodes end the block with an error
+    case 0xd3: case 0xdb: case 0xdd: case 0xe3: case 0xe4:
+    case 0xeb: case 0xec: case 0xed: case 0xf4: case 0xfc: case 0xfd:
+        return -1;
+    }
+    return 0;
+}
+
+// scan forward from window offset off and return which flags are read before being
+// overwritten. max_insns bounds the lookahead to instructions guaranteed
+// to be compiled into this block, since a size-limit exit in between
+// would expose D7 to the next block
+int compute_flags_live(
+    struct compile_ctx *ctx,
+    uint16_t off,
+    int max_insns
+) {
+    int live = 0;
+    int pending = FLAGS_ALL;
+
+    while (off < 256 && max_insns-- > 0) {
+        const struct gb_insn *in = decode_at(ctx, off);
+        uint8_t cb_op = in->op == 0xcb ? in->operand : 0;
+        int reads = flag_reads(in->op, cb_op);
+
+        if (reads < 0)
+            break;
+        live |= reads & pending;
+        pending &= ~flag_writes(in->op, cb_op);
+        if (!pending)
+            return live;
+        off += in->length;
+    }
+    return live | pending;
+}
+
 void compile_set_zc_flags(struct code_block *block)
 {
+    if (!flags_live)
+        return;
     emit_move_sr_dn(block, REG_68K_D_FLAGS);
+    flags_ccr_at = block->length;
 }
 
 void compile_set_z_flag(struct code_block *block)
 {
+    if (!(flags_live & FLAG_Z))
+        return;
     // inc/dec/bit sets Z from result but preserve C from previous flags.
     // Save new CCR to D3, extract Z, merge with old C from D7.
     emit_move_sr_dn(block, REG_68K_D_NEXT_PC);
@@ -29,10 +134,30 @@ void compile_set_z_flag(struct code_block *block)
 
 void compile_set_c_flag(struct code_block *block)
 {
+    if (!(flags_live & FLAG_C))
+        return;
     // add hl,rr sets C from result but preserves Z from previous flags.
     // Save new CCR to D3, extract C, merge with old Z from D7.
     emit_move_sr_dn(block, REG_68K_D_NEXT_PC);
     emit_andi_b_dn(block, REG_68K_D_NEXT_PC, 0x01);
     emit_andi_b_dn(block, REG_68K_D_FLAGS, 0x04);
     emit_or_b_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_FLAGS);
-}
\ No newline at end of file
+}
+
+int compile_flag_test(
+    struct code_block *block,
+    uint8_t flag_bit,
+    int branch_if_set
+) {
+    // cp/and/sub etc. directly before the branch: the CCR is still the one
+    // move sr, d7 copied, so skip the btst and branch on it
+    if (flags_ccr_at == block->length) {
+        if (flag_bit == 2)
+            return branch_if_set ? COND_EQ : COND_NE;
+        return branch_if_set ? COND_CS : COND_CC;
+    }
+
+    // btst sets 68k Z=1 if tested bit is 0, Z=0 if tested bit is 1
+    emit_btst_imm_dn(block, flag_bit, REG_68K_D_FLAGS);
+    return branch_if_set ? COND_NE : COND_EQ;
+}
@@ -1,8 +1,38 @@
 #ifndef _FLAGS_H
 #define _FLAGS_H
 
+#include "compiler.h"
+
+// GB flags as they sit in D7
+#define FLAG_Z 0x04
+#define FLAG_C 0x01
+#define FLAGS_ALL (FLAG_Z | FLAG_C)
+
+// flags written by the current instruction that something later can still
+// observe. set per instruction by compile_block, FLAGS_ALL when unknown
+extern int flags_live;
+
+// block->length right after the last move sr, d7 - while nothing else has
+// been emitted, the 68k CCR still matches D7 and a branch can use it directly
+extern size_t flags_ccr_at;
+
+int flag_writes(uint8_t op, uint8_t cb_op);
+int compute_flags_live(
+    struct compile_ctx *ctx,
+    uint16_t off,
+    int max_insns
+);
+
 void compile_set_zc_flags(struct code_block *block);
 void compile_set_z_flag(struct code_block *block);
 void compile_set_c_flag(struct code_block *block);
 
-#endif
\ No newline at end of file
+// emits the test for a conditional branch on GB flag_bit (2=Z, 0=C) and
+// returns the 68k condition that holds when the branch is taken
+int compile_flag_test(
+    struct code_block *block,
+    uint8_t flag_bit,
+    int branch_if_set
+);
+
+#endif
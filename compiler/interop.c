@@ -1,6 +1,8 @@
 #include "compiler.h"
 #include "emitters.h"
 #include "interop.h"
+#include "pointers.h"
+#include "cold.h"
 
 // Retro68 uses D0-D2 as scratch so I have to push cycle count before calling
 // back into C. i'm not sure if this is a mac calling convention or specific
@@ -33,7 +35,7 @@ void compile_page_lookup(
 struct jit_helpers jit_helpers;
 
 // scratch the helpers are emitted into
-static struct code_block helper_block;
+static union code_block_buffer helper_buffer;
 
 // C-call sequence for dmg_read - addr in D1.w, result in D0.b
 static void emit_c_read_call(struct code_block *block)
@@ -76,10 +78,11 @@ static void pad_align16(struct code_block *block)
 
 const struct code_block *compile_emit_helpers(uint32_t base, void *hram_base)
 {
-    struct code_block *b = &helper_block;
+    struct code_block *b = &helper_buffer.block;
     size_t unmapped, lo, ie;
 
     b->length = 0;
+    b->capacity = BLOCK_MAX_CODE;
     lo = ie = 0;
 
     // read chain - page lookup falls through to the hit and its rts
@@ -221,6 +224,11 @@ void compile_call_dmg_write_d0(struct code_block *block)
 // Call dmg_write(dmg, HL, val) - val in D0, D1 loaded inside the helper
 void compile_call_dmg_write_hl_d0(struct code_block *block)
 {
+    if (pointers_direct & PTR_HL) {
+        emit_move_b_dn_aidx_an(block, REG_68K_D_SCRATCH_0,
+                REG_68K_A_SCRATCH_1, REG_68K_A_HL);
+        return;
+    }
     flush_cycles(block);
     emit_jsr_abs_l(block, jit_helpers.write8_hl);
 }
@@ -228,6 +236,11 @@ void compile_call_dmg_write_hl_d0(struct code_block *block)
 // Call dmg_write(dmg, HL, A)
 void compile_call_dmg_write_hl_a(struct code_block *block)
 {
+    if (pointers_direct & PTR_HL) {
+        emit_move_b_dn_aidx_an(block, REG_68K_D_A,
+                REG_68K_A_SCRATCH_1, REG_68K_A_HL);
+        return;
+    }
     flush_cycles(block);
     emit_jsr_abs_l(block, jit_helpers.write8_hl_a);
 }
@@ -235,6 +248,11 @@ void compile_call_dmg_write_hl_a(struct code_block *block)
 // Call dmg_write(dmg, HL, val) - val is immediate
 void compile_call_dmg_write_hl_imm(struct code_block *block, uint8_t val)
 {
+    if (pointers_direct & PTR_HL) {
+        emit_move_b_imm_aidx_an(block, val,
+                REG_68K_A_SCRATCH_1, REG_68K_A_HL);
+        return;
+    }
     emit_move_b_dn(block, 0, val);
     flush_cycles(block);
     emit_jsr_abs_l(block, jit_helpers.write8_hl);
@@ -259,6 +277,12 @@ void compile_call_dmg_read(struct code_block *block)
 // Call dmg_read(dmg, HL) - D1 loaded inside the helper, result in D0
 void compile_call_dmg_read_hl(struct code_block *block)
 {
+    // A0 is HL's page after a pointer guard
+    if (pointers_direct & PTR_HL) {
+        emit_move_b_aidx_an_dn(block, REG_68K_A_SCRATCH_1, REG_68K_A_HL,
+                REG_68K_D_SCRATCH_0);
+        return;
+    }
     flush_cycles(block);
     emit_jsr_abs_l(block, jit_helpers.read8_hl);
 }
@@ -273,6 +297,11 @@ void compile_call_dmg_read_a(struct code_block *block)
 // Call dmg_read(dmg, HL) - result goes to D4 (A register)
 void compile_call_dmg_read_hl_a(struct code_block *block)
 {
+    if (pointers_direct & PTR_HL) {
+        emit_move_b_aidx_an_dn(block, REG_68K_A_SCRATCH_1, REG_68K_A_HL,
+                REG_68K_D_A);
+        return;
+    }
     compile_call_dmg_read_hl(block);
     emit_move_b_dn_dn(block, 0, REG_68K_D_A);
 }
@@ -314,7 +343,8 @@ void compile_slow_dmg_read16(struct code_block *block)
 // Inline fast path for page table hits when both bytes on same page
 void compile_call_dmg_read16(struct code_block *block)
 {
-    size_t cross, unmapped, done;
+    size_t cross, unmapped;
+    struct code_block *cold;
 
     // flush before the fast/slow split so both paths see the same D2
     flush_cycles(block);
@@ -328,7 +358,7 @@ void compile_call_dmg_read16(struct code_block *block)
     // cmpi.w #$0fff, d0
     emit_cmpi_w_imm_dn(block, 0x0fff, REG_68K_D_SCRATCH_0);
     cross = block->length;
-    emit_beq_b(block, 0);
+    emit_beq_w(block, 0);
 
     // Page table lookup
     // move.w d1, d0
@@ -338,7 +368,7 @@ void compile_call_dmg_read16(struct code_block *block)
     // move.l a0, d0 - sets Z, d0 is dead
     emit_move_l_an_dn(block, REG_68K_A_SCRATCH_1, REG_68K_D_SCRATCH_0);
     unmapped = block->length;
-    emit_beq_b(block, 0);
+    emit_beq_w(block, 0);
 
     // Fast read - low byte at (a0,d1.w), high byte one address later
     // (no page cross possible: low byte of the address is not 0xff)
@@ -354,13 +384,11 @@ void compile_call_dmg_read16(struct code_block *block)
     emit_lsl_w_imm_dn(block, 8, REG_68K_D_SCRATCH_0);
     // move.b d3, d0 - combine low byte
     emit_move_b_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_0);
-    done = block->length;
-    emit_bra_b(block, 0);
 
-    patch_branch_b(block, cross);
-    patch_branch_b(block, unmapped);
-    compile_slow_dmg_read16(block);
-    patch_branch_b(block, done);
+    cold = cold_begin(block, cross);
+    cold_branch(unmapped);
+    compile_slow_dmg_read16(cold);
+    cold_resume();
 }
 
 // Slow path for dmg_write16 - addr in D1.w, data in D0.w
@@ -381,7 +409,8 @@ void compile_slow_dmg_write16(struct code_block *block)
 // Inline fast path for page table hits when both bytes on same page
 void compile_call_dmg_write16_d0(struct code_block *block)
 {
-    size_t cross, unmapped, done;
+    size_t cross, unmapped;
+    struct code_block *cold;
 
     // flush before the fast/slow split so both paths see the same D2
     flush_cycles(block);
@@ -398,7 +427,7 @@ void compile_call_dmg_write16_d0(struct code_block *block)
     // cmpi.w #$0fff, d0
     emit_cmpi_w_imm_dn(block, 0x0fff, REG_68K_D_SCRATCH_0);
     cross = block->length;
-    emit_beq_b(block, 0);
+    emit_beq_w(block, 0);
 
     // Page table lookup
     // move.w d1, d0
@@ -408,7 +437,7 @@ void compile_call_dmg_write16_d0(struct code_block *block)
     // move.l a0, d0 - sets Z, d0 is dead
     emit_move_l_an_dn(block, REG_68K_A_SCRATCH_1, REG_68K_D_SCRATCH_0);
     unmapped = block->length;
-    emit_beq_b(block, 0);
+    emit_beq_w(block, 0);
 
     // Fast write - low byte at (a0,d1.w), high byte one address later
     // (no page cross possible: low byte of the address is not 0xff)
@@ -422,16 +451,14 @@ void compile_call_dmg_write16_d0(struct code_block *block)
     emit_addq_w_dn(block, REG_68K_D_SCRATCH_0, 1);
     // move.b d3, (a0,d0.w) - write high byte
     emit_move_b_dn_idx_an(block, REG_68K_D_NEXT_PC, REG_68K_A_SCRATCH_1, REG_68K_D_SCRATCH_0);
-    done = block->length;
-    emit_bra_b(block, 0);
 
-    // Slow path: restore data from D3 to D0
-    patch_branch_b(block, cross);
-    patch_branch_b(block, unmapped);
+    // Slow path, in the cold tail: restore data from D3 to D0
+    cold = cold_begin(block, cross);
+    cold_branch(unmapped);
     // move.w d3, d0
-    emit_move_w_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_0);
-    compile_slow_dmg_write16(block);
-    patch_branch_b(block, done);
+    emit_move_w_dn_dn(cold, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_0);
+    compile_slow_dmg_write16(cold);
+    cold_resume();
 }
 
 // Call stop_func(dmg) - returns 0 to continue, non-zero to halt
@@ -0,0 +1,262 @@
+#include <stdint.h>
+
+#include "jumptable.h"
+#include "compiler.h"
+#include "consts.h"
+#include "emitters.h"
+#include "flags.h"
+#include "instructions.h"
+#include "peephole.h"
+#include "timing.h"
+#include "decode.h"
+
+// the longest helper followed, and how deep it may push
+#define JT_MAX_INSNS 16
+#define JT_STACK 4
+
+// the helper run for one index. registers are indexed like GB_REG_*
+struct jt_run {
+    uint8_t reg[8];
+    uint8_t known;
+    uint8_t writes;
+    uint8_t flags;
+    uint8_t f;
+    uint16_t stack[JT_STACK];
+    int sp;
+    int cycles;
+    int reads;
+};
+
+static int readable(uint16_t addr, int banked)
+{
+    return addr < 0x4000 || (banked && addr < 0x8000);
+}
+
+static int get_reg(struct jt_run *run, int reg, uint8_t *val)
+{
+    if (!(run->known & (1 << reg))) {
+        return 0;
+    }
+    *val = run->reg[reg];
+    return 1;
+}
+
+static void set_reg(struct jt_run *run, int reg, uint8_t val)
+{
+    run->reg[reg] = val;
+    run->known |= 1 << reg;
+    run->writes |= 1 << reg;
+}
+
+// pair 0-2: BC, DE, HL
+static int get_pair(struct jt_run *run, int pair, uint16_t *val)
+{
+    uint8_t hi, lo;
+
+    if (!get_reg(run, pair * 2, &hi) || !get_reg(run, pair * 2 + 1, &lo)) {
+        return 0;
+    }
+    *val = hi << 8 | lo;
+    return 1;
+}
+
+static void set_pair(struct jt_run *run, int pair, uint16_t val)
+{
+    set_reg(run, pair * 2, val >> 8);
+    set_reg(run, pair * 2 + 1, val & 0xff);
+}
+
+static int read_hl(
+    struct compile_ctx *ctx,
+    struct jt_run *run,
+    int banked,
+    uint8_t *val
+) {
+    uint16_t hl;
+
+    if (!get_pair(run, 2, &hl) || !readable(hl, banked)) {
+        return 0;
+    }
+    *val = decode_read(ctx, hl);
+    run->reads++;
+    return 1;
+}
+
+// runs the helper at pc with A = index, from what consts knows. 0 when it
+// does anything but load, add and move the stack before its jp (hl)
+static int run_helper(
+    struct compile_ctx *ctx,
+    uint16_t pc,
+    uint16_t ret_addr,
+    int index,
+    int banked,
+    struct jt_run *run
+) {
+    int k, reg;
+    uint8_t op, val;
+    uint16_t pair, other;
+    uint32_t sum;
+
+    run->known = consts_known & ~(1 << GB_REG_A | 1 << GB_REG_HL);
+    for (reg = 0; reg < 8; reg++) {
+        run->reg[reg] = consts_val[reg];
+    }
+    run->reg[GB_REG_A] = index;
+    run->known |= 1 << GB_REG_A;
+    run->writes = 0;
+    run->flags = 0;
+    run->f = 0;
+    run->stack[0] = ret_addr;
+    run->sp = 1;
+    run->cycles = 0;
+    run->reads = 0;
+
+    for (k = 0; k < JT_MAX_INSNS; k++) {
+        if (!readable(pc, banked) || !readable(pc + 2, banked)) {
+            return 0;
+        }
+        op = decode_read(ctx, pc);
+        run->cycles += instructions[op].cycles;
+
+        if (op >= 0x40 && op < 0x80 && op != 0x76) {
+            // ld r, r'; ld r, (hl)
+            reg = (op >> 3) & 7;
+            if (reg == GB_REG_HL) {
+                return 0;
+            }
+            if ((op & 7) == GB_REG_HL ? !read_hl(ctx, run, banked, &val)
+                    : !get_reg(run, op & 7, &val)) {
+                return 0;
+            }
+            set_reg(run, reg, val);
+        } else if (op < 0x40 && (op & 7) == 6 && op != 0x36) {
+            // ld r, imm8
+            set_reg(run, (op >> 3) & 7, decode_read(ctx, pc + 1));
+        } else if (op >= 0x80 && op < 0x88) {
+            // add a, r
+            if ((op & 7) == GB_REG_HL ? !read_hl(ctx, run, banked, &val)
+                    : !get_reg(run, op & 7, &val)) {
+                return 0;
+            }
+            sum = run->reg[GB_REG_A] + val;
+            set_reg(run, GB_REG_A, sum);
+            run->flags = FLAG_Z | FLAG_C;
+            run->f = ((sum & 0xff) ? 0 : FLAG_Z) | (sum > 0xff ? FLAG_C : 0);
+        } else {
+            switch (op) {
+            case 0x09: case 0x19: case 0x29: // add hl, rr
+                if (!get_pair(run, 2, &pair) || !get_pair(run, op >> 4, &other)) {
+                    return 0;
+                }
+                sum = pair + other;
+                set_pair(run, 2, sum);
+                run->flags |= FLAG_C;
+                run->f = (run->f & ~FLAG_C) | (sum > 0xffff ? FLAG_C : 0);
+                break;
+            case 0x03: case 0x13: case 0x23: // inc rr
+            case 0x0b: case 0x1b: case 0x2b: // dec rr
+                if (!get_pair(run, op >> 4, &pair)) {
+                    return 0;
+                }
+                set_pair(run, op >> 4, pair + (op & 8 ? -1 : 1));
+                break;
+            case 0x2a: case 0x3a: // ld a, (hl+); ld a, (hl-)
+                if (!read_hl(ctx, run, banked, &val)) {
+                    return 0;
+                }
+                set_reg(run, GB_REG_A, val);
+                get_pair(run, 2, &pair);
+                set_pair(run, 2, pair + (op == 0x2a ? 1 : -1));
+                break;
+            case 0xc1: case 0xd1: case 0xe1: // pop rr
+                if (!run->sp) {
+                    return 0;
+                }
+                set_pair(run, (op >> 4) - 0xc, run->stack[--run->sp]);
+                break;
+            case 0xc5: case 0xd5: case 0xe5: // push rr
+                if (run->sp == JT_STACK || !get_pair(run, (op >> 4) - 0xc, &pair)) {
+                    return 0;
+                }
+                run->stack[run->sp++] = pair;
+                break;
+            case 0xe9: // jp (hl)
+                // either the table was the return address, or the
+                // return address is left for the target
+                return get_pair(run, 2, &pair) && (run->sp == 0
+                        || (run->sp == 1 && run->stack[0] == ret_addr));
+            default:
+                return 0;
+            }
+        }
+        pc += insn_length[op];
+    }
+    return 0;
+}
+
+int jump_table_match(
+    struct compile_ctx *ctx,
+    uint16_t target,
+    uint16_t ret_addr,
+    int banked,
+    int room,
+    struct jump_table *jt
+) {
+    struct jt_run run;
+    uint16_t hl;
+    int k, max = room / JT_RECORD;
+
+    if (max > JT_MAX_ENTRIES) {
+        max = JT_MAX_ENTRIES;
+    }
+    for (k = 0; k < max; k++) {
+        if (!run_helper(ctx, target, ret_addr, k, banked, &run)) {
+            break;
+        }
+        if (k == 0) {
+            // a table is read, BC is left alone, and D and E go together
+            if (!run.reads || run.writes & (1 << GB_REG_B | 1 << GB_REG_C)
+                    || !(run.writes & (1 << GB_REG_D))
+                        != !(run.writes & (1 << GB_REG_E))) {
+                return 0;
+            }
+            jt->returns = run.sp == 1;
+            jt->cycles = run.cycles;
+            jt->writes = run.writes;
+            jt->flags = run.flags;
+        } else if (jt->returns != (run.sp == 1) || jt->cycles != run.cycles
+                || jt->writes != run.writes || jt->flags != run.flags) {
+            break;
+        }
+        // RAM targets can't be cached, the table ends before them
+        get_pair(&run, 2, &hl);
+        if (hl >= 0x8000) {
+            break;
+        }
+        jt->target[k] = hl;
+        jt->a[k] = run.reg[GB_REG_A];
+        jt->f[k] = run.f;
+        jt->de[k] = run.reg[GB_REG_D] << 8 | run.reg[GB_REG_E];
+    }
+    jt->count = k;
+    return k >= JT_MIN_ENTRIES;
+}
+
+void compile_jump_table_data(struct code_block *block, struct jump_table *jt)
+{
+    int k;
+
+    // lea d16(pc) has the same displacement layout as bra.w
+    patch_branch_w(block, jt->lea_at);
+    peephole_mark_data(block->length, block->length + jt->count * JT_RECORD);
+    for (k = 0; k < jt->count; k++) {
+        // IC_TARGET, IC_CODE, IC_BANK: empty until the dispatcher fills them
+        emit_long(block, 0xffffffff);
+        emit_long(block, 0);
+        emit_word(block, 0);
+        emit_word(block, jt->target[k]);
+        emit_byte(block, jt->a[k]);
+        emit_byte(block, jt->f[k]);
+        emit_word(block, jt->de[k]);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef _JUMPTABLE_H
+#define _JUMPTABLE_H
+
+#include <stdint.h>
+#include "compiler.h"
+
+// Jump tables: an rst or call into a helper that indexes a table in ROM
+// with A and ends in jp (hl), the way state machines dispatch. Either the
+// table follows the call and the helper pops it as the return address, or
+// HL points at it and the target returns to the caller. The helper is run
+// at compile time for every index, so any shape that only loads, adds and
+// moves the stack is understood. The call site then gets an indexed
+// dispatch: one record per index with what the helper leaves in the
+// registers and inline cache words for its target, filled by the
+// dispatcher on first use like compile_indirect_exit's. An index past the
+// table takes the call as usual.
+
+#define JT_MAX_ENTRIES 32
+// fewer isn't worth the dispatch
+#define JT_MIN_ENTRIES 2
+
+// record layout: the IC_* words first
+#define JT_RECORD 16
+#define JT_TARGET 10  // u16 GB address of the target
+#define JT_A      12  // u8
+#define JT_F      13  // u8, FLAG_* bits
+#define JT_DE     14  // u16 0xDDEE
+
+// the dispatch and the usual call next to it, without the records
+#define JT_CODE_BYTES 256
+
+struct jump_table {
+    uint8_t count;
+    // the return address stays on the stack for the target's ret
+    uint8_t returns;
+    // GB cycles of the helper, call not included
+    uint8_t cycles;
+    // GB registers (1 << GB_REG_*) and flags the helper writes
+    uint8_t writes;
+    uint8_t flags;
+    uint16_t target[JT_MAX_ENTRIES];
+    uint8_t a[JT_MAX_ENTRIES];
+    uint8_t f[JT_MAX_ENTRIES];
+    uint16_t de[JT_MAX_ENTRIES];
+    // lea of the records, patched by compile_jump_table_data
+    size_t lea_at;
+};
+
+// whether the helper at target, called with ret_addr pushed, is a jump
+// table helper, with at most room bytes for its records. banked is set
+// when the bank at 0x4000 is known to be the one the block compiles for
+int jump_table_match(
+    struct compile_ctx *ctx,
+    uint16_t target,
+    uint16_t ret_addr,
+    int banked,
+    int room,
+    struct jump_table *jt
+);
+
+// the records, at the end of the block
+void compile_jump_table_data(struct code_block *block, struct jump_table *jt);
+
+#endif
@@ -5,8 +5,9 @@
 #include "emitters.h"
 #include "interop.h"
 #include "timing.h"
+#include "decode.h"
 
-#define READ_BYTE(off) (ctx->read(ctx->dmg, src_address + (off)))
+#define READ_BYTE(off) (decode_read(ctx, src_address + (off)))
 
 void compile_ldh_u8_a(
     struct code_block *block,
@@ -22,7 +23,7 @@ void compile_ldh_u8_a(
     }
 }
 
-static void compile_ldh_a_u8_direct(
+void compile_ldh_a_u8_direct(
     struct code_block *block,
     struct compile_ctx *ctx,
     uint8_t addr
@@ -148,18 +149,13 @@ void compile_ldh_a_c(struct code_block *block)
     compile_call_dmg_read_a(block);
 }
 
-void compile_ld_u16_a(
+void compile_ld_addr_a(
     struct code_block *block,
     struct compile_ctx *ctx,
-    uint16_t src_address,
-    uint16_t *src_ptr
+    uint16_t addr
 ) {
-    uint16_t addr = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
-    *src_ptr += 2;
-
-    if (addr >= 0xff80 && addr != 0xffff) {
-        emit_move_b_dn_abs32(block, REG_68K_D_A,
-                (uint32_t) (uintptr_t) ctx->hram_base + (addr - 0xff80));
+    if (addr >= 0xff00) {
+        compile_ldh_u8_a(block, ctx, addr & 0xff);
     } else if (addr < 0x8000) {
         // MBC register write: straight to mbc_write_func. for
         // the bank select reg, skip the call when A already
@@ -182,35 +178,43 @@ void compile_ld_u16_a(
             patch_branch_b(block, skip);
         }
     } else {
+        // write pages can be unmapped under compiled code, so RAM
+        // still goes through the lookup
         emit_move_w_dn(block, REG_68K_D_SCRATCH_1, addr);
         compile_call_dmg_write_a(block);
     }
 }
 
-void compile_ld_a_u16(
+void compile_ld_u16_a(
     struct code_block *block,
     struct compile_ctx *ctx,
     uint16_t src_address,
     uint16_t *src_ptr
 ) {
     uint16_t addr = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
-    // banked reads are only folded from banked blocks
-    int fold = addr < 0x4000
-            || (addr < 0x8000 && src_address >= 0x4000 && src_address < 0x8000);
     *src_ptr += 2;
+    compile_ld_addr_a(block, ctx, addr);
+}
+
+// banked reads are only folded from banked blocks
+int rom_read_foldable(uint16_t src_address, uint16_t addr)
+{
+    return addr < 0x4000
+            || (addr < 0x8000 && src_address >= 0x4000 && src_address < 0x8000);
+}
 
+void compile_ld_a_addr(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint16_t addr,
+    int fold
+) {
     if (fold) {
-        uint8_t val = ctx->read(ctx->dmg, addr);
+        uint8_t val = decode_read(ctx, addr);
         emit_moveq_dn(block, REG_68K_D_A, val);
-    } else if (addr == 0xff00 && ctx->joyp_ptr) {
-        emit_move_b_abs32_dn(block,
-                (uint32_t) (uintptr_t) ctx->joyp_ptr,
-                REG_68K_D_A);
-    } else if (addr >= 0xff80) {
-        // HRAM/IE: fixed address
-        emit_move_b_abs32_dn(block,
-                (uint32_t) (uintptr_t) ctx->hram_base + (addr - 0xff80),
-                REG_68K_D_A);
+    } else if (addr >= 0xff00) {
+        // joypad, HRAM/IE or straight to C for I/O
+        compile_ldh_a_u8_direct(block, ctx, addr & 0xff);
     } else if (addr >= 0xc000 && addr < 0xd000) {
         emit_move_b_abs32_dn(block,
                 (uint32_t) (uintptr_t) ctx->wram_base + (addr - 0xc000),
@@ -231,3 +235,14 @@ void compile_ld_a_u16(
         compile_call_dmg_read_a(block);
     }
 }
+
+void compile_ld_a_u16(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t *src_ptr
+) {
+    uint16_t addr = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
+    *src_ptr += 2;
+    compile_ld_a_addr(block, ctx, addr, rom_read_foldable(src_address, addr));
+}
@@ -20,6 +20,13 @@ int compile_ldh_a_u8(
     uint16_t *src_ptr
 );
 
+// ld a, ($ff00 + addr) without the polling loop checks
+void compile_ldh_a_u8_direct(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint8_t addr
+);
+
 // 0xe2: ld ($ff00 + c), a
 void compile_ldh_c_a(struct code_block *block);
 
@@ -42,4 +49,22 @@ void compile_ld_a_u16(
     uint16_t *src_ptr
 );
 
+// whether addr reads the same byte every time code at src_address runs:
+// bank 0, or the current bank from a block cached for that bank
+int rom_read_foldable(uint16_t src_address, uint16_t addr);
+
+// ld (addr), a / ld a, (addr) for an address known at compile time. fold
+// loads the byte now, for ROM addresses that pass the check above
+void compile_ld_addr_a(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint16_t addr
+);
+void compile_ld_a_addr(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint16_t addr,
+    int fold
+);
+
 #endif
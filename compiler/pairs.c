@@ -0,0 +1,165 @@
+#include <stdint.h>
+
+#include "pairs.h"
+#include "compiler.h"
+#include "consts.h"
+#include "emitters.h"
+#include "decode.h"
+#include "timing.h"
+
+#define USE_NONE 0
+// compiles to word code while the pair is contiguous
+#define USE_WORD 1
+// needs the pair split
+#define USE_OTHER 2
+
+// 68000 cycles: a join is move.l, lsr.l #8, move.b against one move.w,
+// inc/dec is ext.w, addq.l against addq.w. converting there and back
+// costs about two joins
+#define JOIN_SAVES 28
+#define STEP_SAVES 8
+#define CONVERT_COST 66
+
+// how far ahead to look for uses
+#define SCAN_INSNS 32
+
+uint8_t pairs_contiguous;
+
+// how op uses pair, with what having it contiguous saves in *saves.
+// unknown opcodes, control flow and anything that may leave the block
+// need it split
+static int pair_use(uint8_t op, uint8_t cb_op, int pair, int *saves)
+{
+    int hi = pair == PAIR_BC ? GB_REG_B : GB_REG_D;
+    int dst = (op >> 3) & 7;
+
+    *saves = 0;
+
+    // ld rr, imm16; ld (rr), a; inc rr; add hl, rr; ld a, (rr); dec rr.
+    // the other pair's don't touch this one
+    if (op < 0x20 && (op & 0x07) >= 1 && (op & 0x07) <= 3) {
+        if ((op >> 4) != (pair == PAIR_BC ? 0 : 1)) {
+            return USE_NONE;
+        }
+        if ((op & 0x07) == 3) {
+            *saves = STEP_SAVES;
+        } else if (op & 0x0e) {
+            *saves = JOIN_SAVES;
+        }
+        return USE_WORD;
+    }
+
+    if (op == 0xcb) {
+        return (cb_op & 6) == hi ? USE_OTHER : USE_NONE;
+    }
+    if (op >= 0x40 && op < 0x80 && op != 0x76) {
+        return (dst & 6) == hi || (op & 6) == hi ? USE_OTHER : USE_NONE;
+    }
+    if (op >= 0x80 && op < 0xc0) {
+        return (op & 6) == hi ? USE_OTHER : USE_NONE;
+    }
+    // inc r, dec r, ld r, imm8
+    if (op < 0x40 && (op & 0x07) >= 4 && (op & 0x07) <= 6) {
+        return (dst & 6) == hi ? USE_OTHER : USE_NONE;
+    }
+
+    switch (op) {
+    case 0x00: // nop
+    case 0x07: case 0x0f: case 0x17: case 0x1f: // rotates on A
+    case 0x27: case 0x2f: case 0x37: case 0x3f: // daa, cpl, scf, ccf
+    case 0x21: case 0x22: case 0x23: case 0x29: // hl
+    case 0x2a: case 0x2b: case 0x32: case 0x3a:
+    case 0x31: case 0x33: case 0x39: case 0x3b: // sp
+    case 0xc6: case 0xce: case 0xd6: case 0xde: // ALU on imm8
+    case 0xe6: case 0xee: case 0xf6: case 0xfe:
+    case 0xe1: case 0xe5: case 0xf1: case 0xf5: // push/pop hl, af
+        return USE_NONE;
+    }
+    return USE_OTHER;
+}
+
+// whether the run starting at off uses pair as a 16-bit value enough to
+// pay for converting it
+static int pair_pays(struct compile_ctx *ctx, uint16_t off, int pair)
+{
+    int hi = pair == PAIR_BC ? GB_REG_B : GB_REG_D;
+    int known = (consts_known >> hi & 3) == 3;
+    int saves = 0, k;
+
+    for (k = 0; k < SCAN_INSNS && off < 256; k++) {
+        const struct gb_insn *insn = decode_at(ctx, off);
+        int use, s;
+
+        if (k && flush_at[off]) {
+            break;
+        }
+        use = pair_use(insn->op, insn->operand, pair, &s);
+        if (use == USE_OTHER) {
+            break;
+        }
+        if (use == USE_WORD && (insn->op & 0x0f) == 0x01) {
+            known = 1;
+        }
+        // a known pair is accessed by address, without a join
+        if (!known || (insn->op & 0x07) != 0x02) {
+            saves += s;
+        }
+        off += insn->length;
+    }
+    return saves > CONVERT_COST;
+}
+
+// 0x00BB00CC -> 0x00??BBCC
+static void compile_pair_contiguous(struct code_block *block, int dreg)
+{
+    emit_move_b_dn_dn(block, dreg, REG_68K_D_SCRATCH_1);
+    emit_lsr_l_imm_dn(block, 8, dreg);
+    emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_1, dreg);
+}
+
+// 0x????BBCC -> 0x00BB??CC
+static void compile_pair_split(struct code_block *block, int dreg)
+{
+    emit_move_b_dn_dn(block, dreg, REG_68K_D_SCRATCH_1);
+    emit_lsr_w_imm_dn(block, 8, dreg);
+    emit_swap(block, dreg);
+    emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_1, dreg);
+}
+
+void compile_pairs(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint8_t op,
+    uint8_t cb_op,
+    uint16_t off,
+    int convert
+) {
+    int pair, use, saves;
+
+    for (pair = PAIR_BC; pair <= PAIR_DE; pair <<= 1) {
+        int dreg = pair == PAIR_BC ? REG_68K_D_BC : REG_68K_D_DE;
+
+        use = pair_use(op, cb_op, pair, &saves);
+        if (pairs_contiguous & pair) {
+            if (use == USE_OTHER) {
+                compile_pair_split(block, dreg);
+                pairs_contiguous &= ~pair;
+            }
+        } else if (use == USE_WORD && saves && convert
+                && pair_pays(ctx, off, pair)) {
+            compile_pair_contiguous(block, dreg);
+            pairs_contiguous |= pair;
+        }
+    }
+}
+
+void compile_pairs_split(struct code_block *block)
+{
+    if (pairs_contiguous & PAIR_BC) {
+        compile_pair_split(block, REG_68K_D_BC);
+    }
+    if (pairs_contiguous & PAIR_DE) {
+        compile_pair_split(block, REG_68K_D_DE);
+    }
+    pairs_contiguous = 0;
+}
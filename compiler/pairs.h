@@ -0,0 +1,38 @@
+#ifndef _PAIRS_H
+#define _PAIRS_H
+
+#include <stdint.h>
+#include "compiler.h"
+
+// BC and DE representation. They are kept split (0x00BB00CC) so B and D
+// are a swap away, which makes every use as a 16-bit value a join of
+// three instructions. A straight run that uses a pair as a pointer more
+// than converting costs gets it contiguous (0x????BBCC, like HL in A2)
+// for its length: compile_join_bc/de is then a move.w, and inc/dec and
+// ld rr, imm16 work on the word. Before anything else touches the pair,
+// and at every exit, loop head and pointer run, it is split again, so
+// the rest of the compiler never sees it.
+
+// bits for pairs_contiguous
+#define PAIR_BC 0x01
+#define PAIR_DE 0x02
+
+// pairs currently contiguous
+extern uint8_t pairs_contiguous;
+
+// before compiling op (the CB opcode in cb_op) at window offset off:
+// splits the pairs op needs split, and makes contiguous the ones the run
+// starting at op pays off for when convert is set
+void compile_pairs(
+    struct code_block *block,
+    struct compile_ctx *ctx,
+    uint8_t op,
+    uint8_t cb_op,
+    uint16_t off,
+    int convert
+);
+
+// splits both pairs
+void compile_pairs_split(struct code_block *block);
+
+#endif
@@ -0,0 +1,849 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "peephole.h"
+#include "compiler.h"
+
+#define MAX_INSNS (BLOCK_MAX_CODE / 2)
+
+// most instructions between two swaps that cancel
+#define SWAP_REACH 8
+
+// PC-relative references, all relocated when the code moves
+#define REF_NONE 0
+#define REF_BRANCH_B 1  // bra/bsr/bcc.b
+#define REF_BRANCH_W 2  // bra/bsr/bcc.w
+#define REF_DBCC 3      // dbcc Dn, d16
+#define REF_EA 4        // lea/pea/jmp/jsr d16(pc)
+
+struct pp_insn {
+    uint16_t at;
+    // length after the pass, 0 once deleted
+    uint16_t len;
+    uint16_t new_at;
+    // instruction index the reference points at, n for the block end
+    uint16_t target;
+    uint8_t ref;
+    uint8_t data;
+    uint8_t label;
+    // a rewrite joined it to the instruction before
+    uint8_t cut;
+};
+
+static struct pp_insn insns[MAX_INSNS + 1];
+// instruction index by offset / 2, -1 inside an instruction
+static int16_t index_at[MAX_INSNS + 1];
+
+static uint16_t data_start[PEEPHOLE_MAX_DATA];
+static uint16_t data_end[PEEPHOLE_MAX_DATA];
+static int data_count;
+// marks made in the cold tail, by tail offset until it's placed
+static uint8_t data_cold[PEEPHOLE_MAX_DATA];
+static int marking_cold;
+// more data than marks: can't tell code from data, leave the block alone
+static int data_overflow;
+
+// entries that don't stop rewrites, and where they ended up (-1: cut)
+static uint16_t soft_at[PEEPHOLE_MAX_ENTRIES];
+static int16_t soft_new[PEEPHOLE_MAX_ENTRIES];
+static int soft_count;
+
+// an EA with d16(pc) or d8(pc,Xn) outside lea/pea/jmp/jsr
+static int pc_operand;
+
+void peephole_reset(void)
+{
+    data_count = 0;
+    data_overflow = 0;
+    marking_cold = 0;
+    soft_count = 0;
+}
+
+void peephole_mark_data(size_t start, size_t end)
+{
+    if (data_count == PEEPHOLE_MAX_DATA) {
+        data_overflow = 1;
+        return;
+    }
+    data_start[data_count] = start;
+    data_end[data_count] = end;
+    data_cold[data_count] = marking_cold;
+    data_count++;
+}
+
+void peephole_mark_entry(size_t at)
+{
+    if (soft_count < PEEPHOLE_MAX_ENTRIES) {
+        soft_at[soft_count] = at;
+        soft_new[soft_count] = at;
+        soft_count++;
+    }
+}
+
+int peephole_entry(int k)
+{
+    return soft_new[k];
+}
+
+void peephole_data_cold(int cold)
+{
+    marking_cold = cold;
+}
+
+void peephole_place_cold(size_t at)
+{
+    int k;
+
+    for (k = 0; k < data_count; k++) {
+        if (data_cold[k]) {
+            data_start[k] += at;
+            data_end[k] += at;
+            data_cold[k] = 0;
+        }
+    }
+}
+
+static uint16_t read_word(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static void write_word(uint8_t *p, uint16_t w)
+{
+    p[0] = w >> 8;
+    p[1] = w & 0xff;
+}
+
+// extension bytes of an effective address, -1 if it doesn't exist
+static int ea_ext(int mode, int reg, int size)
+{
+    switch (mode) {
+    case 5: // d16(An)
+    case 6: // d8(An,Xn)
+        return 2;
+    case 7:
+        switch (reg) {
+        case 0: // abs.w
+            return 2;
+        case 1: // abs.l
+            return 4;
+        case 2: // d16(pc)
+        case 3: // d8(pc,Xn)
+            pc_operand = 1;
+            return 2;
+        case 4: // #imm
+            return size == 4 ? 4 : 2;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// length of the 68000 instruction starting with op, 0 if unknown
+static int insn_size(uint16_t op)
+{
+    int mode = (op >> 3) & 7, reg = op & 7;
+    int ss = (op >> 6) & 3;
+    int size = ss == 0 ? 1 : ss == 1 ? 2 : 4;
+    int opmode = (op >> 6) & 7;
+    int ext;
+
+    switch (op >> 12) {
+    case 0x0:
+        if (op & 0x0100) {
+            // movep, or btst/bchg/bclr/bset Dn, <ea>
+            if (mode == 1) {
+                return 4;
+            }
+            ext = ea_ext(mode, reg, 1);
+            break;
+        }
+        switch ((op >> 9) & 7) {
+        case 4: // btst/bchg/bclr/bset #n, <ea>
+            ext = ea_ext(mode, reg, 1);
+            return ext < 0 ? 0 : 4 + ext;
+        case 7:
+            return 0;
+        }
+        // ori/andi/subi/addi/eori/cmpi
+        if (ss == 3) {
+            return 0;
+        }
+        if (mode == 7 && reg == 4) {
+            // to CCR/SR
+            return 4;
+        }
+        ext = ea_ext(mode, reg, size);
+        return ext < 0 ? 0 : 2 + (size == 4 ? 4 : 2) + ext;
+
+    case 0x1:
+    case 0x2:
+    case 0x3:
+        {
+            // move: 1 = byte, 3 = word, 2 = long
+            int msize = (op >> 12) == 1 ? 1 : (op >> 12) == 3 ? 2 : 4;
+            int dst = ea_ext((op >> 6) & 7, (op >> 9) & 7, msize);
+
+            ext = ea_ext(mode, reg, msize);
+            return ext < 0 || dst < 0 ? 0 : 2 + ext + dst;
+        }
+
+    case 0x4:
+        if ((op & 0x01c0) == 0x01c0) {
+            // lea
+            ext = ea_ext(mode, reg, 4);
+            break;
+        }
+        if ((op & 0x01c0) == 0x0180) {
+            // chk
+            ext = ea_ext(mode, reg, 2);
+            break;
+        }
+        switch (op) {
+        case 0x4e70: case 0x4e71: case 0x4e73:
+        case 0x4e75: case 0x4e76: case 0x4e77:
+            return 2;
+        case 0x4e72: // stop
+            return 4;
+        case 0x4afc: // illegal
+            return 0;
+        }
+        if ((op & 0xfff0) == 0x4e40 || (op & 0xfff8) == 0x4e58
+                || (op & 0xfff0) == 0x4e60) {
+            // trap, unlk, move usp
+            return 2;
+        }
+        if ((op & 0xfff8) == 0x4e50) {
+            // link
+            return 4;
+        }
+        if ((op & 0xff80) == 0x4e80) {
+            // jsr, jmp
+            ext = ea_ext(mode, reg, 4);
+            break;
+        }
+        if ((op & 0xfff8) == 0x4840 || (op & 0xfeb8) == 0x4880) {
+            // swap, ext
+            return 2;
+        }
+        if ((op & 0xffc0) == 0x4840) {
+            // pea
+            ext = ea_ext(mode, reg, 4);
+            break;
+        }
+        if ((op & 0xfb80) == 0x4880) {
+            // movem
+            ext = ea_ext(mode, reg, 2);
+            return ext < 0 ? 0 : 4 + ext;
+        }
+        if ((op & 0xf9c0) == 0x40c0) {
+            // move from SR, to CCR, to SR
+            ext = ea_ext(mode, reg, 2);
+            break;
+        }
+        if ((op & 0xffc0) == 0x4800 || (op & 0xffc0) == 0x4ac0) {
+            // nbcd, tas
+            ext = ea_ext(mode, reg, 1);
+            break;
+        }
+        switch (op & 0xff00) {
+        case 0x4000: case 0x4200: case 0x4400: case 0x4600: case 0x4a00:
+            // negx, clr, neg, not, tst
+            ext = ss == 3 ? -1 : ea_ext(mode, reg, size);
+            break;
+        default:
+            return 0;
+        }
+        break;
+
+    case 0x5:
+        if (ss == 3) {
+            // dbcc, scc
+            if (mode == 1) {
+                return 4;
+            }
+            ext = ea_ext(mode, reg, 1);
+            break;
+        }
+        // addq, subq
+        ext = ea_ext(mode, reg, size);
+        break;
+
+    case 0x6:
+        // an 8-bit displacement of 0xff is a 32-bit one on the 68020
+        if ((op & 0xff) == 0xff) {
+            return 0;
+        }
+        return (op & 0xff) == 0 ? 4 : 2;
+
+    case 0x7:
+        return op & 0x0100 ? 0 : 2;
+
+    case 0x8:
+    case 0xc:
+        if (opmode == 3 || opmode == 7) {
+            // divu/divs, mulu/muls
+            ext = ea_ext(mode, reg, 2);
+            break;
+        }
+        if ((op & 0x01f0) == 0x0100
+                || ((op >> 12) == 0xc && ((op & 0x01f8) == 0x0140
+                    || (op & 0x01f8) == 0x0148 || (op & 0x01f8) == 0x0188))) {
+            // sbcd/abcd, exg
+            return 2;
+        }
+        ext = ea_ext(mode, reg, size);
+        break;
+
+    case 0x9:
+    case 0xd:
+        if (opmode == 3 || opmode == 7) {
+            // suba/adda
+            ext = ea_ext(mode, reg, opmode == 3 ? 2 : 4);
+            break;
+        }
+        if (opmode >= 4 && mode <= 1) {
+            // subx/addx
+            return 2;
+        }
+        ext = ea_ext(mode, reg, size);
+        break;
+
+    case 0xb:
+        if (opmode == 3 || opmode == 7) {
+            // cmpa
+            ext = ea_ext(mode, reg, opmode == 3 ? 2 : 4);
+            break;
+        }
+        if (opmode >= 4 && mode == 1) {
+            // cmpm
+            return 2;
+        }
+        ext = ea_ext(mode, reg, size);
+        break;
+
+    case 0xe:
+        // shifts and rotates, on memory when the size field is 3
+        if (ss == 3) {
+            ext = ea_ext(mode, reg, 2);
+            break;
+        }
+        return 2;
+
+    default:
+        return 0;
+    }
+
+    return ext < 0 ? 0 : 2 + ext;
+}
+
+static int is_pc_ea(uint16_t op)
+{
+    // lea, pea, jsr, jmp d16(pc)
+    return (op & 0xf1ff) == 0x41fa || op == 0x487a
+            || op == 0x4eba || op == 0x4efa;
+}
+
+// sets N, Z, V and C without reading them, so the CCR before it is dead
+static int sets_ccr(uint16_t op)
+{
+    int top = op >> 12;
+
+    if (top == 0x7 || op == 0x4e75) {
+        // moveq. rts: nothing reads the CCR across an exit
+        return 1;
+    }
+    if (top >= 0x1 && top <= 0x3) {
+        // move, not movea
+        return ((op >> 6) & 7) != 1;
+    }
+    if ((op & 0xff00) == 0x4a00 && ((op >> 6) & 3) != 3) {
+        // tst
+        return 1;
+    }
+    if (top == 0xb && ((op >> 6) & 7) <= 2) {
+        // cmp
+        return 1;
+    }
+    return (op & 0xff00) == 0x0c00;  // cmpi
+}
+
+// the data registers an EA uses, -1 for the indexed modes, whose
+// extension word names another
+static int ea_dn(int mode, int reg)
+{
+    if (mode == 6 || (mode == 7 && reg == 3)) {
+        return -1;
+    }
+    return mode == 0 ? 1 << reg : 0;
+}
+
+// the data registers op uses, for the instructions the compiler puts
+// between a swap and the one undoing it. *sets is whether it sets N, Z,
+// V and C. -1 for anything else, and anything else reading the CCR
+static int dn_refs(uint16_t op, int *sets)
+{
+    int top = op >> 12, mode = (op >> 3) & 7, reg = op & 7;
+    int rn = (op >> 9) & 7, opmode = (op >> 6) & 7, size = (op >> 6) & 3;
+    int src, dst;
+
+    *sets = 1;
+    switch (top) {
+    case 0x0:
+        // ori, andi, subi, addi, eori, cmpi, not on the CCR or SR
+        if (op & 0x0100 || rn == 4 || rn == 7 || size == 3
+                || (mode == 7 && reg == 4)) {
+            return -1;
+        }
+        return ea_dn(mode, reg);
+    case 0x1: case 0x2: case 0x3:
+        src = ea_dn(mode, reg);
+        dst = ea_dn(opmode, rn);
+        if (src < 0 || dst < 0) {
+            return -1;
+        }
+        *sets = opmode != 1;  // movea doesn't
+        return src | dst;
+    case 0x4:
+        if ((op & 0xfff8) == 0x4840 || (op & 0xfff8) == 0x4880
+                || (op & 0xfff8) == 0x48c0) {
+            // swap, ext
+            return 1 << reg;
+        }
+        if ((op & 0xffc0) == 0x40c0 || (op & 0xf1c0) == 0x41c0) {
+            // move from sr, lea
+            *sets = 0;
+            return ea_dn(mode, reg);
+        }
+        if (((op & 0xff00) == 0x4200 || (op & 0xff00) == 0x4400
+                || (op & 0xff00) == 0x4600 || (op & 0xff00) == 0x4a00)
+                && size != 3) {
+            // clr, neg, not, tst
+            return ea_dn(mode, reg);
+        }
+        return -1;
+    case 0x5:
+        // addq, subq, not scc/dbcc
+        if (size == 3) {
+            return -1;
+        }
+        *sets = mode != 1;
+        return ea_dn(mode, reg);
+    case 0x7:
+        return op & 0x0100 ? -1 : 1 << rn;
+    case 0x8: case 0x9: case 0xb: case 0xc: case 0xd:
+        if (opmode == 3 || opmode == 7) {
+            // adda, suba, cmpa. not mul/div
+            if (top == 0x8 || top == 0xc) {
+                return -1;
+            }
+            *sets = top == 0xb;
+            return ea_dn(mode, reg);
+        }
+        // addx, subx, abcd, sbcd, exg, cmpm
+        if (opmode >= 4 && mode <= 1 && (top != 0xb || mode == 1)) {
+            return -1;
+        }
+        src = ea_dn(mode, reg);
+        return src < 0 ? -1 : src | 1 << rn;
+    case 0xe:
+        // register shifts, not roxl/roxr, which read X
+        if (size == 3 || ((op >> 3) & 3) == 2) {
+            return -1;
+        }
+        return (op & 0x20 ? 1 << rn : 0) | 1 << reg;
+    }
+    return -1;
+}
+
+// decodes code[] into insns[], returns the instruction count or -1
+static int decode(struct code_block *block)
+{
+    size_t at = 0;
+    int n = 0, k;
+
+    memset(index_at, 0xff, sizeof index_at);
+    while (at < block->length) {
+        struct pp_insn *in = &insns[n];
+        int len = 0;
+
+        in->at = at;
+        in->ref = REF_NONE;
+        in->cut = 0;
+        in->data = 0;
+        in->label = 0;
+        for (k = 0; k < data_count; k++) {
+            if (data_start[k] == at) {
+                len = data_end[k] - data_start[k];
+                in->data = 1;
+            }
+        }
+        if (!in->data) {
+            uint16_t op = read_word(block->code + at);
+
+            pc_operand = 0;
+            len = insn_size(op);
+            if (!len) {
+                return -1;
+            }
+            if ((op >> 12) == 0x6) {
+                in->ref = len == 2 ? REF_BRANCH_B : REF_BRANCH_W;
+            } else if ((op & 0xf0f8) == 0x50c8) {
+                in->ref = REF_DBCC;
+            } else if (is_pc_ea(op)) {
+                in->ref = REF_EA;
+            } else if (pc_operand) {
+                return -1;
+            }
+        }
+        if (at + len > block->length || (len & 1)) {
+            return -1;
+        }
+        // data starting inside an instruction: the decode went wrong
+        for (k = 0; k < data_count; k++) {
+            if (data_start[k] > at && data_start[k] < at + len) {
+                return -1;
+            }
+        }
+        index_at[at / 2] = n;
+        in->len = len;
+        at += len;
+        n++;
+    }
+    index_at[at / 2] = n;
+    insns[n].at = at;
+    insns[n].len = 0;
+    insns[n].label = 1;
+    return n;
+}
+
+// resolves the targets of every reference, returns 0 on one that doesn't
+// land on an instruction
+static int resolve(struct code_block *block, int n)
+{
+    int k;
+
+    for (k = 0; k < n; k++) {
+        struct pp_insn *in = &insns[k];
+        const uint8_t *p = block->code + in->at;
+        int32_t target;
+
+        switch (in->ref) {
+        case REF_NONE:
+            continue;
+        case REF_BRANCH_B:
+            target = in->at + 2 + (int8_t) p[1];
+            break;
+        default:
+            target = in->at + 2 + (int16_t) read_word(p + 2);
+            break;
+        }
+        if (target < 0 || target > (int32_t) block->length || (target & 1)
+                || index_at[target / 2] < 0) {
+            return 0;
+        }
+        in->target = index_at[target / 2];
+        insns[in->target].label = 1;
+    }
+    return 1;
+}
+
+// next instruction that's still there
+static int next_live(int k, int n)
+{
+    for (k++; k < n && !insns[k].len; k++) {
+    }
+    return k;
+}
+
+// swap Dn at k, instructions that leave Dn alone, then swap Dn again:
+// the index of the second swap, -1 if that isn't what follows. whatever
+// reads the CCR in between has to see it set by something after the
+// first swap
+static int swap_partner(struct code_block *block, int k, int n)
+{
+    uint16_t swap = read_word(block->code + insns[k].at);
+    int j, reach, refs, sets, ccr_set = 0;
+
+    for (j = next_live(k, n), reach = 0; j < n && reach <= SWAP_REACH;
+            j = next_live(j, n), reach++) {
+        struct pp_insn *in = &insns[j];
+        uint16_t op;
+
+        if (in->data || in->ref || in->label) {
+            return -1;
+        }
+        op = read_word(block->code + in->at);
+        if (op == swap) {
+            return j;
+        }
+        refs = dn_refs(op, &sets);
+        if (refs < 0 || refs & 1 << (swap & 7)) {
+            return -1;
+        }
+        // move from sr
+        if ((op & 0xffc0) == 0x40c0 && !ccr_set) {
+            return -1;
+        }
+        ccr_set |= sets;
+    }
+    return -1;
+}
+
+// the immediate a moveq #imm, Dn or move.l #imm, Dn loads, for a pair of
+// instructions on the same data register
+static int const_load(const uint8_t *p, uint16_t op, int len, int32_t *value)
+{
+    if ((op & 0xf100) == 0x7000) {
+        *value = (int8_t) (op & 0xff);
+        return 1;
+    }
+    if ((op & 0xf1ff) == 0x203c && len == 6) {
+        *value = (int32_t) ((uint32_t) read_word(p + 2) << 16 | read_word(p + 4));
+        return 1;
+    }
+    return 0;
+}
+
+// entering anywhere after k up to j would miss part of a rewrite of both
+static void cut_after(int k, int j)
+{
+    for (k++; k <= j; k++) {
+        insns[k].cut = 1;
+    }
+}
+
+// the rewrites, each keeps the CCR as it was after the original sequence
+// unless the instruction after it sets the CCR anyway
+static void rewrite(struct code_block *block, int n)
+{
+    int k;
+
+    for (k = 0; k < n; k = next_live(k, n)) {
+        struct pp_insn *a = &insns[k];
+        int j = next_live(k, n);
+        struct pp_insn *b = &insns[j];
+        uint8_t *pa = block->code + a->at, *pb = block->code + b->at;
+        uint16_t opa, opb;
+        int dn;
+        int32_t value;
+
+        if (a->data || a->ref) {
+            continue;
+        }
+        opa = read_word(pa);
+        dn = (opa >> 9) & 7;
+
+        // move.l #imm, Dn with a moveq-sized imm
+        if (const_load(pa, opa, a->len, &value) && a->len == 6
+                && value >= -128 && value < 128) {
+            opa = 0x7000 | dn << 9 | (uint8_t) value;
+            write_word(pa, opa);
+            a->len = 2;
+        }
+
+        if (j >= n || b->data || b->label) {
+            continue;
+        }
+        opb = read_word(pb);
+
+        // swap Dn; swap Dn, with at most SWAP_REACH instructions not
+        // using Dn in between
+        if ((opa & 0xfff8) == 0x4840) {
+            int m = swap_partner(block, k, n), after, sets;
+            uint16_t op;
+
+            if (m < 0 || (after = next_live(m, n)) >= n || insns[after].data) {
+                continue;
+            }
+            op = read_word(block->code + insns[after].at);
+            if (sets_ccr(op) || (dn_refs(op, &sets) >= 0 && sets)) {
+                a->len = 0;
+                insns[m].len = 0;
+                cut_after(k, m);
+            }
+            continue;
+        }
+
+        // moveq #0, Dn; move.w #imm, Dn
+        if ((opa & 0xf1ff) == 0x7000 && opb == (0x303c | dn << 9)
+                && read_word(pb + 2) < 0x80) {
+            write_word(pa, 0x7000 | dn << 9 | read_word(pb + 2));
+            b->len = 0;
+            cut_after(k, j);
+            continue;
+        }
+
+        // andi.b/ori.b on the same register back to back, or after it was
+        // loaded with a constant
+        if ((opb & 0xfff8) == 0x0200 || (opb & 0xfff8) == 0x0000) {
+            int breg = opb & 7;
+            uint8_t imm = pb[3];
+
+            if ((opa & 0xfff8) == (opb & 0xfff8) && (opa & 7) == breg) {
+                pa[3] = (opb & 0x0200) ? pa[3] & imm : pa[3] | imm;
+                b->len = 0;
+                cut_after(k, j);
+                continue;
+            }
+            if (const_load(pa, opa, a->len, &value) && dn == breg) {
+                uint8_t lo = (opb & 0x0200) ? (value & imm) : (value | imm);
+                int32_t result = (int32_t) (((uint32_t) value & 0xffffff00) | lo);
+
+                if (result == (int8_t) lo) {
+                    write_word(pa, 0x7000 | dn << 9 | lo);
+                    a->len = 2;
+                    b->len = 0;
+                    cut_after(k, j);
+                }
+            }
+        }
+    }
+}
+
+// branches to a bra go straight to its target, a bra to an rts becomes one
+static void thread_branches(struct code_block *block, int n)
+{
+    int k, hops;
+
+    for (k = 0; k < n; k++) {
+        struct pp_insn *in = &insns[k];
+        uint16_t op;
+
+        if (!in->len || (in->ref != REF_BRANCH_B && in->ref != REF_BRANCH_W)) {
+            continue;
+        }
+        op = read_word(block->code + in->at);
+        if ((op & 0xff00) == 0x6100) {
+            // bsr
+            continue;
+        }
+        for (hops = 0; hops < 4; hops++) {
+            struct pp_insn *t = &insns[in->target];
+            int32_t disp;
+
+            if (in->target == n || t->data || !t->len || in->target == k
+                    || (t->ref != REF_BRANCH_B && t->ref != REF_BRANCH_W)
+                    || (read_word(block->code + t->at) & 0xff00) != 0x6000) {
+                break;
+            }
+            // distances only shrink from here, so a byte branch has to
+            // reach the new target already
+            disp = insns[t->target].at - (in->at + 2);
+            if (in->ref == REF_BRANCH_B && (disp < -128 || disp > 127)) {
+                break;
+            }
+            in->target = t->target;
+        }
+        if ((op & 0xff00) == 0x6000 && in->target < n && !insns[in->target].data
+                && read_word(block->code + insns[in->target].at) == 0x4e75) {
+            write_word(block->code + in->at, 0x4e75);
+            in->ref = REF_NONE;
+            in->len = 2;
+        }
+    }
+}
+
+static void layout(int n)
+{
+    uint16_t at = 0;
+    int k;
+
+    for (k = 0; k <= n; k++) {
+        insns[k].new_at = at;
+        at += insns[k].len;
+    }
+}
+
+// drops branches to the next instruction and shortens the rest where the
+// displacement fits. both only bring code closer, so it settles
+static void shorten_branches(struct code_block *block, int n)
+{
+    int changed = 1, k;
+
+    while (changed) {
+        changed = 0;
+        layout(n);
+        for (k = 0; k < n; k++) {
+            struct pp_insn *in = &insns[k];
+            int32_t disp;
+
+            if (!in->len || (in->ref != REF_BRANCH_B && in->ref != REF_BRANCH_W)) {
+                continue;
+            }
+            disp = insns[in->target].new_at - (in->new_at + 2);
+            if (insns[in->target].new_at == in->new_at + in->len
+                    && (read_word(block->code + in->at) & 0xff00) != 0x6100) {
+                in->len = 0;
+                changed = 1;
+            } else if (in->ref == REF_BRANCH_W && disp >= -128 && disp <= 127
+                    && disp != 0) {
+                in->ref = REF_BRANCH_B;
+                in->len = 2;
+                changed = 1;
+            }
+        }
+    }
+}
+
+size_t peephole_block(struct code_block *block, uint16_t *entries, int entry_count)
+{
+    int n, k;
+    size_t saved;
+
+    if (data_overflow || block->length == 0) {
+        return 0;
+    }
+    n = decode(block);
+    if (n < 0 || !resolve(block, n)) {
+        return 0;
+    }
+    insns[0].label = 1;
+    for (k = 0; k < entry_count; k++) {
+        if (entries[k] > block->length || index_at[entries[k] / 2] < 0) {
+            return 0;
+        }
+        insns[index_at[entries[k] / 2]].label = 1;
+    }
+
+    rewrite(block, n);
+    thread_branches(block, n);
+    shorten_branches(block, n);
+    layout(n);
+
+    // close up the gaps. everything moves down, so front to back is safe
+    for (k = 0; k < n; k++) {
+        struct pp_insn *in = &insns[k];
+        uint8_t *p;
+        int32_t disp;
+
+        if (!in->len) {
+            continue;
+        }
+        p = block->code + in->new_at;
+        memmove(p, block->code + in->at, in->len);
+        disp = insns[in->target].new_at - (in->new_at + 2);
+        switch (in->ref) {
+        case REF_BRANCH_B:
+            p[1] = (uint8_t) disp;
+            break;
+        case REF_BRANCH_W:
+        case REF_DBCC:
+        case REF_EA:
+            write_word(p + 2, (uint16_t) disp);
+            break;
+        }
+    }
+
+    for (k = 0; k < entry_count; k++) {
+        entries[k] = insns[index_at[entries[k] / 2]].new_at;
+    }
+    for (k = 0; k < soft_count; k++) {
+        int i = soft_at[k] <= block->length ? index_at[soft_at[k] / 2] : -1;
+
+        soft_new[k] = i < 0 || insns[i].cut ? -1 : insns[i].new_at;
+    }
+    saved = block->length - insns[n].new_at;
+    block->length = insns[n].new_at;
+    return saved;
+}
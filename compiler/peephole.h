@@ -0,0 +1,44 @@
+#ifndef _PEEPHOLE_H
+#define _PEEPHOLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "compiler.h"
+
+// Peephole pass over a finished block. The emitters write straight into
+// code[], so this decodes the 68k code back into instructions, rewrites a
+// few wasteful sequences, shortens branches that fit in 8 bits, and closes
+// up the gaps. Every PC-relative branch and lea is relocated; inline data
+// has to be marked while emitting so it isn't decoded. A block with
+// anything the decoder doesn't know is left alone.
+
+#define PEEPHOLE_MAX_DATA 64
+#define PEEPHOLE_MAX_ENTRIES 128
+
+// forget the data marks of the previous block
+void peephole_reset(void);
+
+// code[start..end) is data (inline cache words, bank link tables)
+void peephole_mark_data(size_t start, size_t end);
+
+// while set, marks are made in the cold tail (cold.h), by offset in it
+void peephole_data_cold(int cold);
+
+// the cold tail was appended at code[at], its marks move with it
+void peephole_place_cold(size_t at);
+
+// code[at] is an instruction boundary the block may be entered at later,
+// if the pass leaves it one. unlike the entries passed to peephole_block
+// it doesn't keep rewrites from going across it
+void peephole_mark_entry(size_t at);
+
+// where the k-th peephole_mark_entry offset is after the pass, -1 when a
+// rewrite went across it
+int peephole_entry(int k);
+
+// runs the pass. entries[] are offsets into code[] that are reached from
+// outside the block, they are translated to the new layout. returns the
+// number of bytes removed
+size_t peephole_block(struct code_block *block, uint16_t *entries, int entry_count);
+
+#endif
@@ -0,0 +1,313 @@
+#include <stdint.h>
+
+#include "pointers.h"
+#include "compiler.h"
+#include "consts.h"
+#include "emitters.h"
+#include "interop.h"
+#include "timing.h"
+#include "decode.h"
+
+#define READ_BYTE(off) (decode_read(ctx, src_address + (off)))
+
+// longest run to speculate on, and the most one instruction from the run
+// can take in either copy
+#define PTR_RUN_MAX_INSNS 16
+#define PTR_INSN_BYTES 48
+// guard for two pointers, plus the cycle flush and branch ending each copy
+#define PTR_GUARD_BYTES 128
+// with a single access the guard costs about what it saves
+#define PTR_MIN_ACCESSES 2
+
+#define ACCESS_READ 1
+#define ACCESS_WRITE 2
+
+// pointer index: bit number in PTR_*
+#define PTR_INDEX_HL 2
+
+uint8_t pointers_direct;
+
+// What one instruction does with the pointers: which one it accesses and
+// how, how far it moves it afterwards, and which GB registers it writes.
+// returns 0 for anything that can't be part of a run: ends the block,
+// calls a helper that clobbers A0/A1, or changes H or L
+static int classify(
+    uint8_t op,
+    uint8_t cb_op,
+    int *ptr,
+    int *access,
+    int *step,
+    uint8_t *writes
+) {
+    *ptr = -1;
+    *access = 0;
+    *step = 0;
+    *writes = 0;
+
+    if (op == 0xcb) {
+        int bit = (cb_op & 0xc0) == 0x40;
+        if ((cb_op & 7) == 6) {
+            *ptr = PTR_INDEX_HL;
+            *access = bit ? ACCESS_READ : ACCESS_READ | ACCESS_WRITE;
+        } else if (!bit) {
+            *writes = 1 << (cb_op & 7);
+        }
+    } else if (op >= 0x40 && op < 0x80) {
+        // ld r, r'
+        if (op == 0x76) {
+            return 0;
+        }
+        if ((op & 7) == 6) {
+            *ptr = PTR_INDEX_HL;
+            *access = ACCESS_READ;
+        }
+        if (((op >> 3) & 7) == 6) {
+            *ptr = PTR_INDEX_HL;
+            *access = ACCESS_WRITE;
+        } else {
+            *writes = 1 << ((op >> 3) & 7);
+        }
+    } else if ((op >= 0x80 && op < 0xc0) || (op & 0xc7) == 0xc6) {
+        // 8-bit ALU, only A and flags change
+        if ((op & 0xc7) == 0x86) {
+            *ptr = PTR_INDEX_HL;
+            *access = ACCESS_READ;
+        }
+    } else if ((op & 0xc7) == 0x06 || (op & 0xc6) == 0x04) {
+        // ld r, u8; inc r; dec r
+        if (((op >> 3) & 7) == 6) {
+            *ptr = PTR_INDEX_HL;
+            *access = op == 0x36 ? ACCESS_WRITE : ACCESS_READ | ACCESS_WRITE;
+        } else {
+            *writes = 1 << ((op >> 3) & 7);
+        }
+    } else {
+        switch (op) {
+        case 0x00: // nop
+        case 0x07: case 0x0f: case 0x17: case 0x1f: // rotates on A
+        case 0x27: case 0x2f: case 0x37: case 0x3f: // daa, cpl, scf, ccf
+            break;
+        case 0x02: // ld (bc), a
+        case 0x12: // ld (de), a
+            *ptr = op >> 4;
+            *access = ACCESS_WRITE;
+            break;
+        case 0x0a: // ld a, (bc)
+        case 0x1a: // ld a, (de)
+            *ptr = op >> 4;
+            *access = ACCESS_READ;
+            break;
+        case 0x03: // inc bc
+        case 0x13: // inc de
+            *ptr = op >> 4;
+            *step = 1;
+            break;
+        case 0x0b: // dec bc
+        case 0x1b: // dec de
+            *ptr = op >> 4;
+            *step = -1;
+            break;
+        case 0x22: // ld (hl+), a
+        case 0x32: // ld (hl-), a
+            *ptr = PTR_INDEX_HL;
+            *access = ACCESS_WRITE;
+            *step = op == 0x22 ? 1 : -1;
+            break;
+        case 0x2a: // ld a, (hl+)
+        case 0x3a: // ld a, (hl-)
+            *ptr = PTR_INDEX_HL;
+            *access = ACCESS_READ;
+            *step = op == 0x2a ? 1 : -1;
+            break;
+        case 0x23: // inc hl
+        case 0x2b: // dec hl
+            *ptr = PTR_INDEX_HL;
+            *step = op == 0x23 ? 1 : -1;
+            break;
+        default:
+            return 0;
+        }
+    }
+
+    return !(*writes & (1 << GB_REG_H | 1 << GB_REG_L));
+}
+
+int pointers_scan(
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t off,
+    int room,
+    struct pointer_run *run
+) {
+    int16_t disp[3] = { 0, 0, 0 };
+    uint8_t dirty = 0;
+    uint16_t start = off;
+    int max = (room - PTR_GUARD_BYTES) / (2 * PTR_INSN_BYTES);
+    int insns, accesses = 0;
+
+    if (max > PTR_RUN_MAX_INSNS) {
+        max = PTR_RUN_MAX_INSNS;
+    }
+    run->used = 0;
+    run->read = 0;
+    run->written = 0;
+
+    for (insns = 0; insns < max && off < 256; insns++) {
+        uint8_t op = READ_BYTE(off);
+        uint8_t writes, bit, pair_mask;
+        int ptr, access, step, k;
+
+        // loop heads start a run of their own
+        if (off != start && flush_at[off]) {
+            break;
+        }
+        if (!classify(op, READ_BYTE(off + 1), &ptr, &access, &step, &writes)) {
+            break;
+        }
+        // dec r; jr nz, -3 compiles as one delay loop
+        if ((op == 0x05 || op == 0x3d) && READ_BYTE(off + 1) == 0x20
+                && READ_BYTE(off + 2) == 0xfd) {
+            break;
+        }
+        // a pair already accessed has to keep its guarded value
+        if ((writes & 0x03 && run->used & PTR_BC)
+                || (writes & 0x0c && run->used & PTR_DE)) {
+            break;
+        }
+
+        if (access) {
+            bit = 1 << ptr;
+            pair_mask = 3 << (ptr * 2);
+            // known pointers get direct code from compile_known_op already,
+            // a pair written earlier in the run isn't what the guard will
+            // see, and only A1 is left for one of BC and DE
+            if ((consts_known & pair_mask) == pair_mask || dirty & bit) {
+                break;
+            }
+            if (ptr != PTR_INDEX_HL && run->used & (PTR_BC | PTR_DE) & ~bit) {
+                break;
+            }
+            if (!(run->used & bit)) {
+                run->lo[ptr] = disp[ptr];
+                run->hi[ptr] = disp[ptr];
+            } else if (disp[ptr] < run->lo[ptr]) {
+                run->lo[ptr] = disp[ptr];
+            } else if (disp[ptr] > run->hi[ptr]) {
+                run->hi[ptr] = disp[ptr];
+            }
+            run->used |= bit;
+            if (access & ACCESS_READ) {
+                run->read |= bit;
+            }
+            if (access & ACCESS_WRITE) {
+                run->written |= bit;
+            }
+            accesses++;
+        }
+
+        for (k = 0; k < 2; k++) {
+            if (writes & (3 << (k * 2))) {
+                dirty |= 1 << k;
+            }
+        }
+        if (ptr >= 0) {
+            disp[ptr] += step;
+        }
+        off += insn_length[op];
+    }
+
+    run->end = off;
+    return accesses >= PTR_MIN_ACCESSES;
+}
+
+static void emit_guard_fail(
+    struct code_block *block,
+    struct pointer_run *run,
+    int cond
+) {
+    run->fails[run->fail_count++] = block->length;
+    emit_bcc_opcode_w(block, cond, 0);
+}
+
+void compile_pointer_guard(struct code_block *block, struct pointer_run *run)
+{
+    int k;
+
+    run->fail_count = 0;
+    for (k = 0; k < 3; k++) {
+        uint8_t bit = 1 << k;
+        uint8_t areg = k == PTR_INDEX_HL ? REG_68K_A_SCRATCH_1 : REG_68K_A_SCRATCH_2;
+        int span;
+
+        if (!(run->used & bit)) {
+            continue;
+        }
+        span = run->hi[k] - run->lo[k];
+
+        // D0.w = lowest address the run accesses through this pointer
+        if (k == PTR_INDEX_HL) {
+            emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
+        } else if (bit == PTR_BC) {
+            compile_join_bc(block, REG_68K_D_SCRATCH_0);
+        } else {
+            compile_join_de(block, REG_68K_D_SCRATCH_0);
+        }
+        if (run->lo[k]) {
+            emit_subi_w_dn(block, (uint16_t) -run->lo[k], REG_68K_D_SCRATCH_0);
+        }
+
+        // the highest one has to be on the same page
+        if (span) {
+            emit_move_w_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
+            emit_andi_w_dn(block, REG_68K_D_SCRATCH_1, 0x0fff);
+            emit_cmpi_w_imm_dn(block, 0x1000 - span, REG_68K_D_SCRATCH_1);
+            emit_guard_fail(block, run, COND_CC);
+        }
+
+        // a pointer used both ways looks up the write table and checks the
+        // read table agrees
+        compile_page_lookup(block,
+                run->written & bit ? REG_68K_A_WRITE_PAGE : REG_68K_A_READ_PAGE,
+                REG_68K_D_SCRATCH_0, areg);
+        emit_move_l_an_dn(block, areg, REG_68K_D_SCRATCH_1);
+        emit_guard_fail(block, run, COND_EQ);
+        if (run->read & run->written & bit) {
+            emit_cmpa_l_idx_an_an(block, REG_68K_A_READ_PAGE,
+                    REG_68K_D_SCRATCH_0, areg);
+            emit_guard_fail(block, run, COND_NE);
+        }
+    }
+}
+
+void compile_pointer_fails(struct code_block *block, struct pointer_run *run)
+{
+    int k;
+
+    for (k = 0; k < run->fail_count; k++) {
+        patch_branch_w(block, run->fails[k]);
+    }
+}
+
+int compile_pointer_op(struct code_block *block, uint8_t op)
+{
+    uint8_t bit = op & 0x10 ? PTR_DE : PTR_BC;
+
+    if ((op & 0xe7) != 0x02 || !(pointers_direct & bit)) {
+        return 0;
+    }
+
+    // D1.w = BC or DE, A1 = its page
+    if (bit == PTR_BC) {
+        compile_join_bc(block, REG_68K_D_SCRATCH_1);
+    } else {
+        compile_join_de(block, REG_68K_D_SCRATCH_1);
+    }
+    if (op & 0x08) {
+        emit_move_b_idx_an_dn(block, REG_68K_A_SCRATCH_2,
+                REG_68K_D_SCRATCH_1, REG_68K_D_A);
+    } else {
+        emit_move_b_dn_idx_an(block, REG_68K_D_A,
+                REG_68K_A_SCRATCH_2, REG_68K_D_SCRATCH_1);
+    }
+    return 1;
+}
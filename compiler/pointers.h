@@ -0,0 +1,62 @@
+#ifndef _POINTERS_H
+#define _POINTERS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "compiler.h"
+
+// Pointer speculation: a straight run of instructions that goes through
+// HL and one of BC/DE, with every access on the same 4K page, compiles
+// twice. A guard in front looks the pages up once and leaves their host
+// bases in A0 (HL) and A1 (BC/DE), the run then uses (A0,A2.w) and
+// (A1,D1.w) directly. If any page is unmapped or an access would leave
+// it, the guard branches to the second copy, which calls the helpers as
+// usual. Both copies join after the run.
+
+// bits for pointer_run.used, .read, .written and pointers_direct
+#define PTR_BC 0x01
+#define PTR_DE 0x02
+#define PTR_HL 0x04
+
+#define PTR_MAX_FAILS 6
+
+struct pointer_run {
+    // source offset just past the last instruction of the run
+    uint16_t end;
+    uint8_t used;
+    uint8_t read;
+    uint8_t written;
+    // range of the accesses relative to the pointer's value at the
+    // guard, indexed by bit number
+    int16_t lo[3];
+    int16_t hi[3];
+    // guard branches to point at the helper copy
+    size_t fails[PTR_MAX_FAILS];
+    int fail_count;
+};
+
+// pointers the instructions being compiled may access directly. the (hl)
+// helper calls in interop.c and compile_pointer_op check it
+extern uint8_t pointers_direct;
+
+// finds a run worth speculating on starting at off, with room bytes of
+// code to spare for both copies. returns 0 if there is none
+int pointers_scan(
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t off,
+    int room,
+    struct pointer_run *run
+);
+
+// the guard, branching away through run->fails
+void compile_pointer_guard(struct code_block *block, struct pointer_run *run);
+
+// points the guard's branches at the current end of the block
+void compile_pointer_fails(struct code_block *block, struct pointer_run *run);
+
+// ld (bc)/(de), a and ld a, (bc)/(de) while pointers_direct covers the pair.
+// returns 0 to compile op the usual way
+int compile_pointer_op(struct code_block *block, uint8_t op);
+
+#endif
@@ -1,9 +1,103 @@
 #include "stack.h"
+#include "cold.h"
 #include "emitters.h"
 #include "interop.h"
 #include "compiler.h"
+#include "decode.h"
+#include "peephole.h"
 
-#define READ_BYTE(off) (ctx->read(ctx->dmg, src_address + (off)))
+#define READ_BYTE(off) (decode_read(ctx, src_address + (off)))
+
+// the pushes and pops ahead that make the guard worth it
+#define GUARD_MIN_OPS 2
+
+// the guard at the start of the block holds here: A3 points into WRAM or
+// HRAM. guarded_to is the last push or pop that relies on it
+static int stack_in_ram;
+static size_t guarded_to;
+
+// pushes and pops from the start of the window up to the first jump or
+// return, or an ld sp that makes the guard moot
+static int stack_ops_ahead(struct compile_ctx *ctx)
+{
+    uint16_t off = 0;
+    int ops = 0;
+
+    while (off < 256) {
+        const struct gb_insn *in = decode_at(ctx, off);
+        uint8_t op = in->op;
+
+        if (op == 0x31 || op == 0xf9) {
+            break;
+        }
+        // push, pop, call, rst, ret, reti
+        if ((op & 0xcb) == 0xc1 || (op & 0xe7) == 0xc4 || op == 0xcd
+                || (op & 0xc7) == 0xc7 || (op & 0xe7) == 0xc0
+                || op == 0xc9 || op == 0xd9) {
+            ops++;
+        }
+        if (op == 0x18 || op == 0xc3 || op == 0xe9 || op == 0xc9
+                || op == 0xd9 || op == 0x10 || op == 0x76) {
+            break;
+        }
+        off += in->length;
+    }
+    return ops;
+}
+
+int compile_stack_guard(struct code_block *block, struct compile_ctx *ctx)
+{
+    stack_in_ram = 0;
+    guarded_to = 0;
+    if (!(ctx->version & VERSION_STACK_RAM) || block->tier != TIER_FULL
+            || block->src_address >= 0x8000
+            || stack_ops_ahead(ctx) < GUARD_MIN_OPS) {
+        return 0;
+    }
+
+    emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
+    emit_bne_b(block, 8);
+    // the version exit, back to the dispatcher until block_version_link
+    // writes a jmp.l over the move.l
+    peephole_mark_data(block->length, block->length + 6);
+    emit_move_l_dn(block, REG_68K_D_NEXT_PC, block->src_address);
+    emit_rts(block);
+    stack_in_ram = 1;
+    return 1;
+}
+
+void stack_forget(void)
+{
+    stack_in_ram = 0;
+}
+
+int stack_guarded(size_t at)
+{
+    return at > VERSION_EXIT && at <= guarded_to;
+}
+
+int stack_reaches(size_t at)
+{
+    return stack_in_ram || !stack_guarded(at);
+}
+
+// the test before a push or pop: returns the .w branch to its slow path,
+// or 0 when the guard already made it
+static size_t stack_test(struct code_block *block)
+{
+    size_t slow;
+
+    // flush before the fast/slow split so both paths see the same D2
+    flush_cycles(block);
+    if (stack_in_ram) {
+        guarded_to = block->length;
+        return 0;
+    }
+    emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
+    slow = block->length;
+    emit_beq_w(block, 0);
+    return slow;
+}
 
 void compile_ld_sp_imm16(
     struct compile_ctx *ctx,
@@ -13,6 +107,7 @@ void compile_ld_sp_imm16(
 ) {
     uint16_t gb_sp = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
     *src_ptr += 2;
+    stack_forget();
 
     // always store gb_sp to context
     emit_move_w_dn(block, REG_68K_D_SCRATCH_1, gb_sp);
@@ -82,40 +177,34 @@ static void compile_slow_push_d0(struct code_block *block)
 // Guarded push of a 16-bit constant (call/rst return addresses)
 void compile_push_imm16(struct code_block *block, uint16_t value)
 {
-    size_t slow_push, done;
+    size_t slow_push;
+    struct code_block *cold;
 
-    // flush before the fast/slow split so both paths see the same D2
-    flush_cycles(block);
-    emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
-    slow_push = block->length;
-    emit_beq_b(block, 0);
+    slow_push = stack_test(block);
 
     // Fast path: use A3 directly, store both bytes as immediates
     emit_subq_w_an(block, REG_68K_A_SP, 2);
     emit_subq_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
     emit_move_b_imm_ind_an(block, value & 0xff, REG_68K_A_SP);
     emit_move_b_imm_disp_an(block, value >> 8, 1, REG_68K_A_SP);
-    done = block->length;
-    emit_bra_b(block, 0);
 
-    // Slow path
-    patch_branch_b(block, slow_push);
-    emit_move_w_dn(block, REG_68K_D_SCRATCH_0, value);
-    compile_slow_push_d0(block);
+    if (slow_push) {
+        // Slow path, in the cold tail
+        cold = cold_begin(block, slow_push);
+        emit_move_w_dn(cold, REG_68K_D_SCRATCH_0, value);
+        compile_slow_push_d0(cold);
 
-    patch_branch_b(block, done);
+        cold_resume();
+    }
 }
 
 // Guarded pop of the return address into D3, zero-extended (ret)
 void compile_pop_pc(struct code_block *block)
 {
-    size_t slow_pop, done;
+    size_t slow_pop;
+    struct code_block *cold;
 
-    // flush before the fast/slow split so both paths see the same D2
-    flush_cycles(block);
-    emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
-    slow_pop = block->length;
-    emit_beq_b(block, 0);
+    slow_pop = stack_test(block);
 
     // Fast path: use A3 directly
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
@@ -124,16 +213,16 @@ void compile_pop_pc(struct code_block *block)
     emit_move_b_ind_an_dn(block, REG_68K_A_SP, REG_68K_D_NEXT_PC);
     emit_addq_w_an(block, REG_68K_A_SP, 2);
     emit_addq_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-    done = block->length;
-    emit_bra_b(block, 0);
 
-    // Slow path: dmg_read16 clobbers D3, so build it afterward
-    patch_branch_b(block, slow_pop);
-    compile_slow_pop_to_d1(block);
-    emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
-    emit_move_w_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_NEXT_PC);
+    if (slow_pop) {
+        // Slow path: dmg_read16 clobbers D3, so build it afterward
+        cold = cold_begin(block, slow_pop);
+        compile_slow_pop_to_d1(cold);
+        emit_moveq_dn(cold, REG_68K_D_NEXT_PC, 0);
+        emit_move_w_dn_dn(cold, REG_68K_D_SCRATCH_1, REG_68K_D_NEXT_PC);
 
-    patch_branch_b(block, done);
+        cold_resume();
+    }
 }
 
 int compile_stack_op(
@@ -158,14 +247,10 @@ int compile_stack_op(
 
     case 0xc5: // push bc
         {
-            size_t slow_push, done;
+            size_t slow_push;
+            struct code_block *cold;
 
-            // Check if sp_adjust is 0 (slow mode)
-            // flush before the fast/slow split so both paths see the same D2
-            flush_cycles(block);
-            emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
-            slow_push = block->length;
-            emit_beq_b(block, 0);  // branch to slow path
+            slow_push = stack_test(block);
 
             // Fast path: use A3 directly
             // SP -= 2 (both A3 and gb_sp)
@@ -178,28 +263,24 @@ int compile_stack_op(
             emit_swap(block, REG_68K_D_BC);
             // [SP] = low byte (C)
             emit_move_b_dn_ind_an(block, REG_68K_D_BC, REG_68K_A_SP);
-            done = block->length;
-            emit_bra_b(block, 0);
 
-            // Slow path
-            patch_branch_b(block, slow_push);
-            compile_join_bc(block, REG_68K_D_SCRATCH_0);
-            compile_slow_push_d0(block);
+            if (slow_push) {
+                // Slow path
+                cold = cold_begin(block, slow_push);
+                compile_join_bc(cold, REG_68K_D_SCRATCH_0);
+                compile_slow_push_d0(cold);
 
-            // Patch done branch
-            patch_branch_b(block, done);
+                cold_resume();
+            }
         }
         return 1;
 
     case 0xd5: // push de
         {
-            size_t slow_push, done;
+            size_t slow_push;
+            struct code_block *cold;
 
-            // flush before the fast/slow split so both paths see the same D2
-            flush_cycles(block);
-            emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
-            slow_push = block->length;
-            emit_beq_b(block, 0);
+            slow_push = stack_test(block);
 
             // Fast path: bytes already in split positions
             emit_subq_w_an(block, REG_68K_A_SP, 2);
@@ -208,27 +289,24 @@ int compile_stack_op(
             emit_move_b_dn_disp_an(block, REG_68K_D_DE, 1, REG_68K_A_SP);
             emit_swap(block, REG_68K_D_DE);
             emit_move_b_dn_ind_an(block, REG_68K_D_DE, REG_68K_A_SP);
-            done = block->length;
-            emit_bra_b(block, 0);
 
-            // Slow path
-            patch_branch_b(block, slow_push);
-            compile_join_de(block, REG_68K_D_SCRATCH_0);
-            compile_slow_push_d0(block);
+            if (slow_push) {
+                // Slow path
+                cold = cold_begin(block, slow_push);
+                compile_join_de(cold, REG_68K_D_SCRATCH_0);
+                compile_slow_push_d0(cold);
 
-            patch_branch_b(block, done);
+                cold_resume();
+            }
         }
         return 1;
 
     case 0xe5: // push hl
         {
-            size_t slow_push, done;
+            size_t slow_push;
+            struct code_block *cold;
 
-            // flush before the fast/slow split so both paths see the same D2
-            flush_cycles(block);
-            emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
-            slow_push = block->length;
-            emit_beq_b(block, 0);
+            slow_push = stack_test(block);
 
             // Fast path
             emit_subq_w_an(block, REG_68K_A_SP, 2);
@@ -237,27 +315,24 @@ int compile_stack_op(
             emit_move_b_dn_ind_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_SP);
             emit_rol_w_8(block, REG_68K_D_SCRATCH_1);
             emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_1, 1, REG_68K_A_SP);
-            done = block->length;
-            emit_bra_b(block, 0);
 
-            // Slow path
-            patch_branch_b(block, slow_push);
-            emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
-            compile_slow_push_d0(block);
+            if (slow_push) {
+                // Slow path
+                cold = cold_begin(block, slow_push);
+                emit_move_w_an_dn(cold, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
+                compile_slow_push_d0(cold);
 
-            patch_branch_b(block, done);
+                cold_resume();
+            }
         }
         return 1;
 
     case 0xf5: // push af
         {
-            size_t slow_push, done;
+            size_t slow_push;
+            struct code_block *cold;
 
-            // flush before the fast/slow split so both paths see the same D2
-            flush_cycles(block);
-            emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
-            slow_push = block->length;
-            emit_beq_b(block, 0);
+            slow_push = stack_test(block);
 
             // Fast path
             emit_subq_w_an(block, REG_68K_A_SP, 2);
@@ -266,29 +341,26 @@ int compile_stack_op(
             emit_move_b_dn_ind_an(block, REG_68K_D_FLAGS, REG_68K_A_SP);
             // [SP+1] = A (high byte)
             emit_move_b_dn_disp_an(block, REG_68K_D_A, 1, REG_68K_A_SP);
-            done = block->length;
-            emit_bra_b(block, 0);
 
-            // Slow path: build AF in D0.w
-            patch_branch_b(block, slow_push);
-            emit_move_b_dn_dn(block, REG_68K_D_A, REG_68K_D_SCRATCH_0);
-            emit_rol_w_8(block, REG_68K_D_SCRATCH_0);
-            emit_move_b_dn_dn(block, REG_68K_D_FLAGS, REG_68K_D_SCRATCH_0);
-            compile_slow_push_d0(block);
+            if (slow_push) {
+                // Slow path: build AF in D0.w
+                cold = cold_begin(block, slow_push);
+                emit_move_b_dn_dn(cold, REG_68K_D_A, REG_68K_D_SCRATCH_0);
+                emit_rol_w_8(cold, REG_68K_D_SCRATCH_0);
+                emit_move_b_dn_dn(cold, REG_68K_D_FLAGS, REG_68K_D_SCRATCH_0);
+                compile_slow_push_d0(cold);
 
-            patch_branch_b(block, done);
+                cold_resume();
+            }
         }
         return 1;
 
     case 0xc1: // pop bc
         {
-            size_t slow_pop, done;
+            size_t slow_pop;
+            struct code_block *cold;
 
-            // flush before the fast/slow split so both paths see the same D2
-            flush_cycles(block);
-            emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
-            slow_pop = block->length;
-            emit_beq_b(block, 0);
+            slow_pop = stack_test(block);
 
             // Fast path: load directly into split positions
             emit_swap(block, REG_68K_D_BC);
@@ -297,32 +369,28 @@ int compile_stack_op(
             emit_move_b_ind_an_dn(block, REG_68K_A_SP, REG_68K_D_BC);  // C
             emit_addq_w_an(block, REG_68K_A_SP, 2);
             emit_addq_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-            done = block->length;
-            emit_bra_b(block, 0);
 
-            // Slow path: convert D1.w = 0xBBCC to 0x00BB00CC in BC
-            patch_branch_b(block, slow_pop);
-            compile_slow_pop_to_d1(block);
-            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_BC);  // C = low byte
-            emit_rol_w_8(block, REG_68K_D_SCRATCH_1);  // D1.b = B
-            emit_swap(block, REG_68K_D_BC);
-            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_BC);  // B = high byte
-            emit_swap(block, REG_68K_D_BC);
-
-            // Patch done branch
-            patch_branch_b(block, done);
+            if (slow_pop) {
+                // Slow path: convert D1.w = 0xBBCC to 0x00BB00CC in BC
+                cold = cold_begin(block, slow_pop);
+                compile_slow_pop_to_d1(cold);
+                emit_move_b_dn_dn(cold, REG_68K_D_SCRATCH_1, REG_68K_D_BC);  // C = low byte
+                emit_rol_w_8(cold, REG_68K_D_SCRATCH_1);  // D1.b = B
+                emit_swap(cold, REG_68K_D_BC);
+                emit_move_b_dn_dn(cold, REG_68K_D_SCRATCH_1, REG_68K_D_BC);  // B = high byte
+                emit_swap(cold, REG_68K_D_BC);
+
+                cold_resume();
+            }
         }
         return 1;
 
     case 0xd1: // pop de
         {
-            size_t slow_pop, done;
+            size_t slow_pop;
+            struct code_block *cold;
 
-            // flush before the fast/slow split so both paths see the same D2
-            flush_cycles(block);
-            emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
-            slow_pop = block->length;
-            emit_beq_b(block, 0);
+            slow_pop = stack_test(block);
 
             // Fast path: load directly into split positions
             emit_swap(block, REG_68K_D_DE);
@@ -331,31 +399,28 @@ int compile_stack_op(
             emit_move_b_ind_an_dn(block, REG_68K_A_SP, REG_68K_D_DE);  // E
             emit_addq_w_an(block, REG_68K_A_SP, 2);
             emit_addq_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-            done = block->length;
-            emit_bra_b(block, 0);
-
-            // Slow path: convert D1.w = 0xDDEE to 0x00DD00EE in DE
-            patch_branch_b(block, slow_pop);
-            compile_slow_pop_to_d1(block);
-            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_DE);
-            emit_rol_w_8(block, REG_68K_D_SCRATCH_1);
-            emit_swap(block, REG_68K_D_DE);
-            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_DE);
-            emit_swap(block, REG_68K_D_DE);
 
-            patch_branch_b(block, done);
+            if (slow_pop) {
+                // Slow path: convert D1.w = 0xDDEE to 0x00DD00EE in DE
+                cold = cold_begin(block, slow_pop);
+                compile_slow_pop_to_d1(cold);
+                emit_move_b_dn_dn(cold, REG_68K_D_SCRATCH_1, REG_68K_D_DE);
+                emit_rol_w_8(cold, REG_68K_D_SCRATCH_1);
+                emit_swap(cold, REG_68K_D_DE);
+                emit_move_b_dn_dn(cold, REG_68K_D_SCRATCH_1, REG_68K_D_DE);
+                emit_swap(cold, REG_68K_D_DE);
+
+                cold_resume();
+            }
         }
         return 1;
 
     case 0xe1: // pop hl
         {
-            size_t slow_pop, done;
+            size_t slow_pop;
+            struct code_block *cold;
 
-            // flush before the fast/slow split so both paths see the same D2
-            flush_cycles(block);
-            emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
-            slow_pop = block->length;
-            emit_beq_b(block, 0);
+            slow_pop = stack_test(block);
 
             // Fast path
             emit_move_b_disp_an_dn(block, 1, REG_68K_A_SP, REG_68K_D_SCRATCH_1);
@@ -363,14 +428,14 @@ int compile_stack_op(
             emit_move_b_ind_an_dn(block, REG_68K_A_SP, REG_68K_D_SCRATCH_1);
             emit_addq_w_an(block, REG_68K_A_SP, 2);
             emit_addq_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-            done = block->length;
-            emit_bra_b(block, 0);
 
-            // Slow path
-            patch_branch_b(block, slow_pop);
-            compile_slow_pop_to_d1(block);
+            if (slow_pop) {
+                // Slow path
+                cold = cold_begin(block, slow_pop);
+                compile_slow_pop_to_d1(cold);
 
-            patch_branch_b(block, done);
+                cold_resume();
+            }
 
             // HL = D1.w
             emit_movea_w_dn_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_HL);
@@ -379,32 +444,28 @@ int compile_stack_op(
 
     case 0xf1: // pop af
         {
-            size_t slow_pop, done;
+            size_t slow_pop;
+            struct code_block *cold;
 
-            // flush before the fast/slow split so both paths see the same D2
-            flush_cycles(block);
-            emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
-            slow_pop = block->length;
-            emit_beq_b(block, 0);
+            slow_pop = stack_test(block);
 
             // Fast path: sets A and F directly
             emit_move_b_disp_an_dn(block, 1, REG_68K_A_SP, REG_68K_D_A);  // A = [SP+1]
             emit_move_b_ind_an_dn(block, REG_68K_A_SP, REG_68K_D_FLAGS);  // F = [SP]
             emit_addq_w_an(block, REG_68K_A_SP, 2);
             emit_addq_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-            done = block->length;
-            emit_bra_b(block, 0);
-
-            // Slow path
-            patch_branch_b(block, slow_pop);
-            compile_slow_pop_to_d1(block);
-            // D1.w = 0xAAFF, A = high byte, F = low byte
-            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_FLAGS);  // F = low
-            emit_rol_w_8(block, REG_68K_D_SCRATCH_1);  // D1.b = A
-            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_A);  // A = high
-
-            // Patch done branch
-            patch_branch_b(block, done);
+
+            if (slow_pop) {
+                // Slow path
+                cold = cold_begin(block, slow_pop);
+                compile_slow_pop_to_d1(cold);
+                // D1.w = 0xAAFF, A = high byte, F = low byte
+                emit_move_b_dn_dn(cold, REG_68K_D_SCRATCH_1, REG_68K_D_FLAGS);  // F = low
+                emit_rol_w_8(cold, REG_68K_D_SCRATCH_1);  // D1.b = A
+                emit_move_b_dn_dn(cold, REG_68K_D_SCRATCH_1, REG_68K_D_A);  // A = high
+
+                cold_resume();
+            }
         }
         return 1;
 
@@ -452,6 +513,8 @@ int compile_stack_op(
 
     case 0xf9: // ld sp, hl
         {
+            stack_forget();
+
             // Store HL to gb_sp
             emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
             emit_move_w_dn_disp_an(block, REG_68K_D_SCRATCH_1, JIT_CTX_GB_SP, REG_68K_A_CTX);
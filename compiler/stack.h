@@ -4,6 +4,28 @@
 #include <stdint.h>
 #include "compiler.h"
 
+// Stack versions. Once a game has set its stack up in WRAM or HRAM it
+// rarely moves it out, so a block compiled while ctx->version has
+// VERSION_STACK_RAM, with pushes and pops ahead, tests
+// JIT_CTX_STACK_IN_RAM once at code[0] instead of at every push and pop:
+// those compile to their fast paths only, up to an ld sp or a loop head
+// that may follow one. The block can't be entered past the guard before
+// the last of them (stack_guarded).
+
+// starts a block: returns 1 if it compiled the guard at code[0], with the
+// version exit at code[VERSION_EXIT]. quick blocks are never versioned
+int compile_stack_guard(struct code_block *block, struct compile_ctx *ctx);
+
+// from here on the guard may not hold, test at every push and pop again
+void stack_forget(void);
+
+// whether code[at] is past the guard but code after it relies on it
+int stack_guarded(size_t at);
+
+// whether a branch from here back to code[at] keeps to what the code
+// there was compiled for
+int stack_reaches(size_t at);
+
 // Compile ld sp, imm16 - sets up SP pointer and stack_in_ram flag
 void compile_ld_sp_imm16(
     struct compile_ctx *ctx,
@@ -2,9 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include "../compiler.h"
 #include "../interop.h"
+#include "../peephole.h"
 #include "tests.h"
 #include "../musashi/m68k.h"
 
@@ -15,6 +17,7 @@ static uint8_t mem[MEM_SIZE];
 #define STUB_BASE 0x2000   // Where stub functions live
 #define HELPER_BASE 0x2100 // shared memory-access helpers
 #define JIT_CTX_ADDR 0x3000 // jit_runtime context structure
+#define RET_STACK_ADDR 0x3100 // return shadow stack ring, 256-byte aligned
 #define STACK_BASE 0x8000
 
 // GB memory is mapped at base of 68k address space
@@ -33,6 +36,14 @@ static uint8_t test_read(void *dmg, uint16_t address)
     return test_gb_rom[address];
 }
 
+// the test ROM is flat, every bank reads the same
+static uint8_t test_read_bank(void *dmg, uint8_t bank, uint16_t address)
+{
+    (void)dmg;
+    (void)bank;
+    return test_gb_rom[address];
+}
+
 // Memory access callbacks for Musashi
 unsigned int m68k_read_memory_8(unsigned int address)
 {
@@ -117,6 +128,13 @@ static void setup_page_tables(void)
     map_test_page(PAGE_TABLE_WRITE, 0xd, PAGE_BUF_D);
 }
 
+// empty ring: no entry matches a GB address (all 0xffff)
+static void reset_ret_stack(void)
+{
+    memset(mem + RET_STACK_ADDR, 0xff, RET_STACK_SIZE);
+    m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_RET_SP, RET_STACK_ADDR);
+}
+
 // Set up stub functions for dmg_read/dmg_write
 // These are 68k code that the compiled JIT code can call
 // Use A0 as scratch
@@ -225,6 +243,11 @@ static void setup_runtime_stubs(void)
     // wake_limit 0 means backward loops always exit to the dispatcher;
     // run_block_with_frame_cycles sets a real distance for skip tests
     m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_WAKE_LIMIT, 0);
+    reset_ret_stack();
+    // inline cache misses end up in the infinite loop at 0, like dispatch
+    m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_DISPATCH_IC, 0);
+    m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_IC_HITS, 0);
+    m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_IC_MISSES, 0);
 
     setup_page_tables();
 }
@@ -279,6 +302,8 @@ void run_prepared_block(void)
 void run_program(uint8_t *gb_rom, uint16_t start_pc)
 {
     struct code_block *cache[MAX_CACHED_BLOCKS] = {0};
+    uint32_t code_at[MAX_CACHED_BLOCKS];
+    uint32_t code_next = CODE_BASE, code_addr;
     uint32_t pc = start_pc;
     int k;
 
@@ -316,22 +341,39 @@ void run_program(uint8_t *gb_rom, uint16_t start_pc)
         struct code_block *block = NULL;
         if (pc < MAX_CACHED_BLOCKS) {
             block = cache[pc];
+            code_addr = code_at[pc];
         }
         if (!block) {
             test_gb_rom = gb_rom;
             block = compile_block(pc, test_compile_ctx);
+
+            // each block keeps its own copy so return shadow stack landings
+            // stay valid; when the code area fills, start over like
+            // jit_clear_all_blocks does
+            if (code_next + block->length > STUB_BASE) {
+                for (k = 0; k < MAX_CACHED_BLOCKS; k++) {
+                    if (cache[k]) {
+                        block_free(cache[k]);
+                        cache[k] = NULL;
+                    }
+                }
+                code_next = CODE_BASE;
+                reset_ret_stack();
+            }
+            code_addr = code_next;
+            code_next += (block->length + 1) & ~1;
+            memcpy(mem + code_addr, block->code, block->length);
+
             if (pc < MAX_CACHED_BLOCKS) {
                 cache[pc] = block;
+                code_at[pc] = code_addr;
             }
         }
 
-        // Copy block code to execution area
-        memcpy(mem + CODE_BASE, block->code, block->length);
-
         // Set up return address to trap
         m68k_write_memory_32(STACK_BASE - 4, 0);
         m68k_set_reg(M68K_REG_SP, STACK_BASE - 4);
-        m68k_set_reg(M68K_REG_PC, CODE_BASE);
+        m68k_set_reg(M68K_REG_PC, code_addr);
 
         m68k_execute(5000);
 
@@ -370,6 +412,11 @@ void set_mem_byte(uint16_t addr, uint8_t value)
     mem[addr] = value;
 }
 
+uint32_t get_ctx_long(int offset)
+{
+    return m68k_read_memory_32(JIT_CTX_ADDR + offset);
+}
+
 void set_frame_cycles(uint32_t cycles)
 {
     m68k_write_memory_32(FRAME_CYCLES_ADDR, cycles);
@@ -469,6 +516,55 @@ void run_block_with_frame_cycles(uint8_t *gb_rom, uint32_t frame_cycles)
 // Run a single block with a specific dispatcher exit budget, for testing
 // the native backward-branch paths (budget > accumulated cycles) and the
 // early-exit paths (small nonzero budget)
+// The next run_block_with_budget call overwrites the last bytes of the
+// block with these: the inline cache or bank link table of a final exit
+static uint8_t tail_seed[16];
+static size_t tail_seed_len;
+
+static void set_tail_seed(size_t len)
+{
+    memset(tail_seed, 0, sizeof(tail_seed));
+    tail_seed_len = len;
+}
+
+static void put_seed_32(size_t off, uint32_t val)
+{
+    tail_seed[off] = val >> 24;
+    tail_seed[off + 1] = val >> 16;
+    tail_seed[off + 2] = val >> 8;
+    tail_seed[off + 3] = val;
+}
+
+void set_ic_seed(uint32_t target, uint32_t code, uint8_t bank)
+{
+    set_tail_seed(IC_SIZE);
+    put_seed_32(IC_TARGET, target);
+    put_seed_32(IC_CODE, code);
+    tail_seed[IC_BANK] = bank;
+}
+
+void set_bank_link_seed(uint8_t bank, uint32_t code)
+{
+    set_tail_seed(BANK_LINK_SLOTS * BANK_LINK_SIZE);
+    tail_seed[BANK_LINK_KEY] = 1;
+    tail_seed[BANK_LINK_KEY + 1] = bank;
+    put_seed_32(BANK_LINK_CODE, code);
+}
+
+// The next run_block_with_budget call also copies these blocks in at the
+// given addresses, for exits that jump straight into other blocks
+#define CODE_SEEDS 2
+static struct code_block *code_seed[CODE_SEEDS];
+static uint32_t code_seed_at[CODE_SEEDS];
+static int code_seed_count;
+
+void set_code_seed(uint32_t addr, struct code_block *block)
+{
+    code_seed[code_seed_count] = block;
+    code_seed_at[code_seed_count] = addr;
+    code_seed_count++;
+}
+
 void run_block_with_budget(uint8_t *gb_rom, uint32_t budget)
 {
     int k;
@@ -482,6 +578,14 @@ void run_block_with_budget(uint8_t *gb_rom, uint32_t budget)
     struct code_block *block = compile_block(0, test_compile_ctx);
 
     memcpy(mem + CODE_BASE, block->code, block->length);
+    if (tail_seed_len) {
+        memcpy(mem + CODE_BASE + block->length - tail_seed_len, tail_seed, tail_seed_len);
+        tail_seed_len = 0;
+    }
+    for (k = 0; k < code_seed_count; k++) {
+        memcpy(mem + code_seed_at[k], code_seed[k]->code, code_seed[k]->length);
+    }
+    code_seed_count = 0;
 
     m68k_write_memory_32(STACK_BASE - 4, 0);
     m68k_write_memory_16(0, 0x60fe);  // bra.s *
@@ -509,10 +613,227 @@ void run_block_with_budget(uint8_t *gb_rom, uint32_t budget)
     block_free(block);
 }
 
+// Peephole golden tests: hand-assembled 68k in, expected 68k out. These
+// don't execute anything, they check the rewritten bytes directly
+static union code_block_buffer pp_buffer;
+static struct code_block *const pp_block = &pp_buffer.block;
+
+static struct code_block *peephole_load(const uint8_t *code, size_t len)
+{
+    memcpy(pp_block->code, code, len);
+    pp_block->length = len;
+    pp_block->capacity = BLOCK_MAX_CODE;
+    peephole_reset();
+    return pp_block;
+}
+
+TEST(test_peephole_swap_pair)
+{
+    // swap d5; swap d5; moveq #0, d1; rts
+    uint8_t code[] = { 0x48, 0x45, 0x48, 0x45, 0x72, 0x00, 0x4e, 0x75 };
+    struct code_block *block = peephole_load(code, sizeof code);
+
+    ASSERT_EQ(peephole_block(block, NULL, 0), 4);
+    ASSERT_BYTES(block, 0x72, 0x00, 0x4e, 0x75);
+}
+
+TEST(test_peephole_swap_around)
+{
+    // ld a, b; add a, 5; ld b, a: the swaps back and forth in the middle
+    // go, addi sets the CCR before move sr reads it
+    uint8_t code[] = {
+        0x48, 0x45, 0x18, 0x05, 0x48, 0x45, 0x06, 0x04, 0x00, 0x05,
+        0x40, 0xc7, 0x48, 0x45, 0x1a, 0x04, 0x48, 0x45, 0x4e, 0x75
+    };
+    struct code_block *block = peephole_load(code, sizeof code);
+
+    ASSERT_EQ(peephole_block(block, NULL, 0), 4);
+    ASSERT_BYTES(block, 0x48, 0x45, 0x18, 0x05, 0x06, 0x04, 0x00, 0x05,
+            0x40, 0xc7, 0x1a, 0x04, 0x48, 0x45, 0x4e, 0x75);
+}
+
+TEST(test_peephole_swap_ccr_read)
+{
+    // swap d6; move sr, d7; swap d6; rts: move sr sees the first swap's CCR
+    uint8_t code[] = { 0x48, 0x46, 0x40, 0xc7, 0x48, 0x46, 0x4e, 0x75 };
+    struct code_block *block = peephole_load(code, sizeof code);
+
+    ASSERT_EQ(peephole_block(block, NULL, 0), 0);
+    ASSERT_BYTES(block, 0x48, 0x46, 0x40, 0xc7, 0x48, 0x46, 0x4e, 0x75);
+}
+
+TEST(test_peephole_moveq_move_w)
+{
+    // moveq #0, d3; move.w #$38, d3; rts
+    uint8_t code[] = { 0x76, 0x00, 0x36, 0x3c, 0x00, 0x38, 0x4e, 0x75 };
+    struct code_block *block = peephole_load(code, sizeof code);
+
+    ASSERT_EQ(peephole_block(block, NULL, 0), 4);
+    ASSERT_BYTES(block, 0x76, 0x38, 0x4e, 0x75);
+}
+
+TEST(test_peephole_andi_pair)
+{
+    // andi.b #$fe, d7; andi.b #$fb, d7; rts
+    uint8_t code[] = {
+        0x02, 0x07, 0x00, 0xfe, 0x02, 0x07, 0x00, 0xfb, 0x4e, 0x75
+    };
+    struct code_block *block = peephole_load(code, sizeof code);
+
+    ASSERT_EQ(peephole_block(block, NULL, 0), 4);
+    ASSERT_BYTES(block, 0x02, 0x07, 0x00, 0xfa, 0x4e, 0x75);
+}
+
+TEST(test_peephole_short_branch)
+{
+    // beq.w over a moveq and a nop; nop; rts
+    uint8_t code[] = {
+        0x67, 0x00, 0x00, 0x06, 0x70, 0x01, 0x4e, 0x71, 0x4e, 0x71, 0x4e, 0x75
+    };
+    struct code_block *block = peephole_load(code, sizeof code);
+
+    ASSERT_EQ(peephole_block(block, NULL, 0), 2);
+    ASSERT_BYTES(block, 0x67, 0x04, 0x70, 0x01, 0x4e, 0x71, 0x4e, 0x71, 0x4e, 0x75);
+}
+
+TEST(test_peephole_bra_to_rts)
+{
+    // bra.w to the rts; nop; rts
+    uint8_t code[] = { 0x60, 0x00, 0x00, 0x04, 0x4e, 0x71, 0x4e, 0x75 };
+    struct code_block *block = peephole_load(code, sizeof code);
+
+    ASSERT_EQ(peephole_block(block, NULL, 0), 2);
+    ASSERT_BYTES(block, 0x4e, 0x75, 0x4e, 0x71, 0x4e, 0x75);
+}
+
+TEST(test_peephole_lea_data_entry)
+{
+    // move.l #1, d0; lea data(pc), a1; rts; data: illegal, 0
+    uint8_t code[] = {
+        0x20, 0x3c, 0x00, 0x00, 0x00, 0x01, 0x43, 0xfa, 0x00, 0x04,
+        0x4e, 0x75, 0x4a, 0xfc, 0x00, 0x00
+    };
+    uint16_t entry = 10;
+    struct code_block *block = peephole_load(code, sizeof code);
+
+    peephole_mark_data(12, 16);
+    ASSERT_EQ(peephole_block(block, &entry, 1), 4);
+    ASSERT_BYTES(block, 0x70, 0x01, 0x43, 0xfa, 0x00, 0x04, 0x4e, 0x75,
+            0x4a, 0xfc, 0x00, 0x00);
+    ASSERT_EQ(entry, 6);
+}
+
+TEST(test_peephole_label_blocks_rewrite)
+{
+    // beq.b to the move.w; moveq #0, d3; move.w #$38, d3; rts
+    uint8_t code[] = {
+        0x67, 0x02, 0x76, 0x00, 0x36, 0x3c, 0x00, 0x38, 0x4e, 0x75
+    };
+    struct code_block *block = peephole_load(code, sizeof code);
+
+    ASSERT_EQ(peephole_block(block, NULL, 0), 0);
+    ASSERT_BYTES(block, 0x67, 0x02, 0x76, 0x00, 0x36, 0x3c, 0x00, 0x38, 0x4e, 0x75);
+}
+
+TEST(test_peephole_unknown_untouched)
+{
+    // swap d5; swap d5; illegal
+    uint8_t code[] = { 0x48, 0x45, 0x48, 0x45, 0x4a, 0xfc };
+    struct code_block *block = peephole_load(code, sizeof code);
+
+    ASSERT_EQ(peephole_block(block, NULL, 0), 0);
+    ASSERT_BYTES(block, 0x48, 0x45, 0x48, 0x45, 0x4a, 0xfc);
+}
+
+static void register_peephole_tests(void)
+{
+    printf("\nPeephole pass:\n");
+    RUN_TEST(test_peephole_swap_pair);
+    RUN_TEST(test_peephole_swap_around);
+    RUN_TEST(test_peephole_swap_ccr_read);
+    RUN_TEST(test_peephole_moveq_move_w);
+    RUN_TEST(test_peephole_andi_pair);
+    RUN_TEST(test_peephole_short_branch);
+    RUN_TEST(test_peephole_bra_to_rts);
+    RUN_TEST(test_peephole_lea_data_entry);
+    RUN_TEST(test_peephole_label_blocks_rewrite);
+    RUN_TEST(test_peephole_unknown_untouched);
+}
+
+// Compile timing (--time-compile): a fixed pseudo-random ROM made of the
+// opcodes games use most, compiled at TIME_BLOCKS addresses across it.
+// only compile_block is timed, nothing is executed
+#define TIME_BLOCKS 20000
+
+static unsigned long time_reads;
+
+static uint8_t time_read(void *dmg, uint16_t address)
+{
+    (void)dmg;
+    time_reads++;
+    return test_gb_rom[address];
+}
+
+static void time_compiles(void)
+{
+    static const uint8_t ops[] = {
+        0x00, 0x04, 0x05, 0x06, 0x0c, 0x0e, 0x3e, 0x47, 0x78, 0x80, 0x90,
+        0xa7, 0xb1, 0xfe, 0xe6, 0x2a, 0x22, 0x77, 0x7e, 0x23, 0x13, 0x0b,
+        0x1a, 0x12, 0xea, 0xfa, 0xe0, 0xf0, 0x21, 0x11, 0x01, 0xc5, 0xc1,
+        0x20, 0x28, 0x38, 0xcb, 0x3c, 0x27, 0xc6, 0xd6, 0x87, 0x19, 0x09,
+        0x2c
+    };
+    static uint8_t rom[0x10000];
+    struct code_block *block;
+    uint32_t seed = 1;
+    unsigned long bytes = 0;
+    clock_t start;
+    int pc = 0, k, n;
+
+    // a 32-bit LCG so the corpus is the same everywhere
+#define TIME_RAND() (seed = seed * 1103515245 + 12345, (seed >> 16) & 0x7fff)
+    while (pc < 0x7ff0) {
+        uint8_t op = ops[TIME_RAND() % sizeof ops];
+
+        rom[pc] = op;
+        for (k = 1; k < insn_length[op]; k++) {
+            rom[pc + k] = TIME_RAND();
+        }
+        if (op == 0xcb) {
+            rom[pc + 1] &= 0x3f;
+        } else if (op == 0x20 || op == 0x28 || op == 0x38) {
+            // short jumps either way, some of them loops
+            rom[pc + 1] = TIME_RAND() % 2 ? -(TIME_RAND() % 12 + 2) : TIME_RAND() % 12;
+        } else if (op == 0xea || op == 0xfa) {
+            rom[pc + 2] = 0xc0 | (TIME_RAND() & 0x1f);
+        } else if (op == 0xe0 || op == 0xf0) {
+            rom[pc + 1] = 0x80 | (TIME_RAND() & 0x7f);
+        }
+        pc += insn_length[op];
+        if (TIME_RAND() % 24 == 0) {
+            rom[pc++] = 0xc9;
+        }
+    }
+#undef TIME_RAND
+
+    test_gb_rom = rom;
+    test_ctx.read = time_read;
+    time_reads = 0;
+    start = clock();
+    for (n = 0; n < TIME_BLOCKS; n++) {
+        block = compile_block((n * 97) % 0x7e00, &test_ctx);
+        bytes += block->length;
+        block_free(block);
+    }
+    printf("compiled %d blocks: %.2f us/block, %.1f reads/block, "
+           "%.1f bytes/block\n", TIME_BLOCKS,
+           (double) (clock() - start) * 1e6 / CLOCKS_PER_SEC / TIME_BLOCKS,
+           (double) time_reads / TIME_BLOCKS, (double) bytes / TIME_BLOCKS);
+    test_ctx.read = test_read;
+}
+
 int main(int argc, char *argv[])
 {
-    (void)argc;
-    (void)argv;
 
     printf("Initializing...\n");
     m68k_init();
@@ -521,6 +842,7 @@ int main(int argc, char *argv[])
     // Initialize test compile context
     test_ctx.dmg = NULL;
     test_ctx.read = test_read;
+    test_ctx.read_bank = test_read_bank;
     test_ctx.wram_base = (void *) (uintptr_t) PAGE_BUF_C;
     test_ctx.hram_base = (void *) (uintptr_t) GLOBALS_BASE;
 
@@ -528,6 +850,11 @@ int main(int argc, char *argv[])
     // copied into memory by setup_runtime_stubs
     compile_emit_helpers(HELPER_BASE, NULL);
 
+    if (argc > 1 && !strcmp(argv[1], "--time-compile")) {
+        time_compiles();
+        return 0;
+    }
+
     register_load_tests();
     register_alu_tests();
     register_branch_tests();
@@ -535,6 +862,7 @@ int main(int argc, char *argv[])
     register_stack_tests();
     register_timing_tests();
     register_cgb_tests();
+    register_peephole_tests();
 
     printf("\nall tests passed\n");
 
@@ -46,6 +46,30 @@ TEST(test_exec_jr_zero)
     ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0xff, 0xbb);
 }
 
+TEST(test_exec_long_straight_line)
+{
+    // longer than one 256-byte source window: falls through into a second
+    // segment at 0x0100 instead of ending the block there
+    uint8_t rom[302];
+    struct code_block *block;
+    int k;
+
+    for (k = 0; k < 300; k += 2) {
+        rom[k] = 0x04;     // inc b
+        rom[k + 1] = 0x0c; // inc c
+    }
+    rom[300] = 0x10;       // stop
+    rom[301] = 0x00;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->end_address, 0x012e);
+    block_free(block);
+
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0x00ff00ff, 0x00960096);
+}
+
 TEST(test_exec_dec_a_loop)
 {
     // Classic countdown loop: ld a,5; loop: dec a; jr nz,loop
@@ -393,7 +417,459 @@ TEST(test_jp_hl)
     ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x22);
 }
 
+TEST(test_jp_hl_inline_cache_miss)
+{
+    uint8_t rom[] = {
+        0x21, 0x08, 0x00, // 0x0000: ld hl, 0x0008
+        0xe9              // 0x0003: jp (hl)
+    };
+    test_compile_ctx->ic_counters = 1;
+    run_block_with_budget(rom, 100000);
+    test_compile_ctx->ic_counters = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x0008);
+    ASSERT_EQ(get_ctx_long(JIT_CTX_IC_HITS), 0);
+    ASSERT_EQ(get_ctx_long(JIT_CTX_IC_MISSES), 1);
+}
+
+TEST(test_jp_hl_inline_cache_hit)
+{
+    uint8_t rom[] = {
+        0x21, 0x08, 0x00, // 0x0000: ld hl, 0x0008
+        0xe9              // 0x0003: jp (hl)
+    };
+    // cached code is the bra.s * at 68k address 0
+    set_ic_seed(0x0008, 0, 1);
+    test_compile_ctx->ic_counters = 1;
+    run_block_with_budget(rom, 100000);
+    test_compile_ctx->ic_counters = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x0008);
+    ASSERT_EQ(get_ctx_long(JIT_CTX_IC_HITS), 1);
+    ASSERT_EQ(get_ctx_long(JIT_CTX_IC_MISSES), 0);
+}
+
+TEST(test_jp_hl_inline_cache_wrong_bank)
+{
+    uint8_t rom[] = {
+        0x21, 0x08, 0x40, // 0x0000: ld hl, 0x4008
+        0xe9              // 0x0003: jp (hl)
+    };
+    // cached for bank 2, but bank 1 is mapped
+    set_ic_seed(0x4008, 0, 2);
+    test_compile_ctx->ic_counters = 1;
+    run_block_with_budget(rom, 100000);
+    test_compile_ctx->ic_counters = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x4008);
+    ASSERT_EQ(get_ctx_long(JIT_CTX_IC_HITS), 0);
+    ASSERT_EQ(get_ctx_long(JIT_CTX_IC_MISSES), 1);
+}
+
+// jp into the switchable ROM window ends in a bank linked exit. a linked
+// hit jumps, a miss JSRs to patch_helper, which pushes a return address
+TEST(test_jp_banked_link_hit)
+{
+    uint8_t rom[] = {
+        0xc3, 0x00, 0x50  // 0x0000: jp 0x5000
+    };
+    uint32_t miss_sp;
+
+    run_block_with_budget(rom, 100000);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x5000);
+    miss_sp = get_areg(7);
+
+    // cached code is the bra.s * at 68k address 0, bank 1 is mapped
+    set_bank_link_seed(1, 0);
+    run_block_with_budget(rom, 100000);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x5000);
+    ASSERT_EQ(get_areg(7), miss_sp + 4);
+}
+
+TEST(test_jp_banked_link_wrong_bank)
+{
+    uint8_t rom[] = {
+        0xc3, 0x00, 0x50  // 0x0000: jp 0x5000
+    };
+    uint32_t miss_sp;
+
+    run_block_with_budget(rom, 100000);
+    miss_sp = get_areg(7);
+
+    set_bank_link_seed(2, 0);
+    run_block_with_budget(rom, 100000);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x5000);
+    ASSERT_EQ(get_areg(7), miss_sp);
+}
+
+// the second bank linked exit in a block branches to the first one's bank
+// check, with its own link table
+TEST(test_banked_link_shared_stub)
+{
+    uint8_t rom[] = {
+        0xca, 0x00, 0x50, // 0x0000: jp z, 0x5000 (Z clear, not taken)
+        0xc3, 0x00, 0x60  // 0x0003: jp 0x6000
+    };
+    uint32_t miss_sp;
+
+    run_block_with_budget(rom, 100000);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x6000);
+    miss_sp = get_areg(7);
+
+    set_bank_link_seed(1, 0);
+    run_block_with_budget(rom, 100000);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x6000);
+    ASSERT_EQ(get_areg(7), miss_sp + 4);
+}
+
+// Incoming link tracking: patch_helper's work done by hand, then undone
+
+TEST(test_block_unlink_jmp)
+{
+    uint8_t rom[] = {
+        0xc3, 0x50, 0x01  // 0x0000: jp 0x0150
+    };
+    struct code_block *from, *to;
+    uint8_t *site;
+
+    test_gb_rom = rom;
+    from = compile_block(0, test_compile_ctx);
+    to = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(to->link_count, 0);
+
+    // the movea.l/jsr of the final patchable exit becomes jmp.l
+    site = from->code + from->length - 8;
+    site[0] = 0x4e;
+    site[1] = 0xf9;
+    ASSERT_EQ(block_add_link(to->code, site), 1);
+    ASSERT_EQ(to->link_count, 1);
+
+    block_unlink(to);
+    ASSERT_EQ(to->link_count, 0);
+    ASSERT_EQ(site[0], 0x20);
+    ASSERT_EQ(site[1], 0x6c);
+    ASSERT_EQ(site[2], 0x00);
+    ASSERT_EQ(site[3], JIT_CTX_PATCH_HELPER);
+    ASSERT_EQ(site[4], 0x4e);
+    ASSERT_EQ(site[5], 0x90);
+    ASSERT_EQ(site[6], 0x4e);   // rts untouched
+    ASSERT_EQ(site[7], 0x75);
+
+    block_free(from);
+    block_free(to);
+}
+
+TEST(test_block_unlink_bank_slot)
+{
+    uint8_t rom[] = {
+        0xc3, 0x00, 0x50  // 0x0000: jp 0x5000
+    };
+    struct code_block *from, *to;
+    uint8_t *slot;
+
+    test_gb_rom = rom;
+    from = compile_block(0, test_compile_ctx);
+    to = compile_block(0, test_compile_ctx);
+
+    // second slot of the final bank linked exit's table
+    slot = from->code + from->length - BANK_LINK_SIZE;
+    ASSERT_EQ(slot[BANK_LINK_KEY], 0);
+    slot[BANK_LINK_KEY] = 0x01;
+    slot[BANK_LINK_KEY + 1] = 0x03;
+    ASSERT_EQ(block_add_link(to->code, slot), 1);
+
+    block_unlink(to);
+    ASSERT_EQ(to->link_count, 0);
+    ASSERT_EQ(slot[BANK_LINK_KEY], 0);
+    ASSERT_EQ(slot[BANK_LINK_KEY + 1], 0);
+
+    block_free(from);
+    block_free(to);
+}
+
+TEST(test_block_links_full)
+{
+    uint8_t rom[] = {
+        0xc3, 0x50, 0x01  // 0x0000: jp 0x0150
+    };
+    struct code_block *from, *to;
+    uint8_t *sites;
+    int k;
+
+    test_gb_rom = rom;
+    from = compile_block(0, test_compile_ctx);
+    to = compile_block(0, test_compile_ctx);
+    // jmp.l sites, one after the other. header links are offsets from
+    // code[], so they have to be near it
+    sites = from->code;
+    for (k = 0; k <= BLOCK_LINKS; k++) {
+        sites[6 * k] = 0x4e;
+        sites[6 * k + 1] = 0xf9;
+        ASSERT_EQ(block_add_link(to->code, sites + 6 * k), 1);
+    }
+    // the header is full, the last one went to the log
+    ASSERT_EQ(to->link_count, BLOCK_LINKS);
+    ASSERT_EQ(link_log.count, 1);
+    ASSERT_EQ(link_log.links[0].site == sites + 6 * BLOCK_LINKS, 1);
+
+    // only a block start has a header to record links in
+    ASSERT_EQ(block_from_code(to->code) == to, 1);
+    ASSERT_EQ(block_from_code(to->code + 2) == NULL, 1);
+
+    block_unlink(to);
+    ASSERT_EQ(link_log.count, 0);
+    for (k = 0; k <= BLOCK_LINKS; k++) {
+        ASSERT_EQ(sites[6 * k], 0x20);
+        ASSERT_EQ(sites[6 * k + 3], JIT_CTX_PATCH_HELPER);
+    }
+
+    block_free(from);
+    block_free(to);
+}
+
+// links to a mid-block entry are logged, and undone with the block or with
+// that entry alone
+TEST(test_block_links_mid_block)
+{
+    uint8_t rom[] = {
+        0xc3, 0x50, 0x01  // 0x0000: jp 0x0150
+    };
+    uint8_t site[6] = { 0x4e, 0xf9 }, other[6] = { 0x4e, 0xf9 };
+    struct code_block *to;
+
+    test_gb_rom = rom;
+    to = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block_add_link(to->code + 2, site), 1);
+    ASSERT_EQ(block_add_link(to->code + 4, other), 1);
+    ASSERT_EQ(to->link_count, 0);
+    ASSERT_EQ(link_log.count, 2);
+
+    // dropping one entry leaves the other's link alone
+    block_unlink_entry(to->code + 2);
+    ASSERT_EQ(site[0], 0x20);
+    ASSERT_EQ(other[0], 0x4e);
+    ASSERT_EQ(link_log.count, 1);
+
+    // dropping the block takes every entry inside it
+    block_unlink(to);
+    ASSERT_EQ(other[0], 0x20);
+    ASSERT_EQ(link_log.count, 0);
+
+    // with the log full as well the link is lost, and that is noted
+    link_log.count = LINK_LOG_SIZE;
+    ASSERT_EQ(block_add_link(to->code + 2, site), 0);
+    ASSERT_EQ(link_log.overflowed, 1);
+    block_links_reset();
+    ASSERT_EQ(link_log.count, 0);
+    ASSERT_EQ(link_log.overflowed, 0);
+
+    block_free(to);
+}
+
+TEST(test_block_retire)
+{
+    uint8_t rom[] = {
+        0x3e, 0x42,       // 0x0000: ld a, 0x42
+        0xc3, 0x50, 0x01  // 0x0002: jp 0x0150
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    block_retire(block, 0x12345678);
+    // jmp.l 0x12345678
+    ASSERT_BYTES(block, 0x4e, 0xf9, 0x12, 0x34, 0x56, 0x78);
+    block_free(block);
+}
+
+// Tiers: a quick block counts its entries and the last one leaves for the
+// dispatcher before running anything
+TEST(test_quick_tier_hot_exit)
+{
+    uint8_t rom[] = {
+        0x3e, 0x42,       // 0x0000: ld a, 0x42
+        0xc3, 0x50, 0x01  // 0x0002: jp 0x0150
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    test_compile_ctx->tier = TIER_QUICK;
+    test_compile_ctx->hot_entries = 2;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->tier, TIER_QUICK);
+    // lea TIER_COUNT(pc), a0
+    ASSERT_EQ(block->code[0], 0x41);
+    ASSERT_EQ(block->code[1], 0xfa);
+    ASSERT_EQ(block->code[TIER_COUNT + 1], 2);
+    ASSERT_EQ(block_is_hot(block->code), 0);
+    block->code[TIER_COUNT + 1] = 0;
+    ASSERT_EQ(block_is_hot(block->code), 1);
+    block_free(block);
+
+    run_block_with_budget(rom, 100000);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x0150);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x42);
+
+    test_compile_ctx->hot_entries = 1;
+    run_block_with_budget(rom, 100000);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0);
+    test_compile_ctx->tier = TIER_FULL;
+    test_compile_ctx->hot_entries = 0;
+}
+
+// an inline cache filled while the target was still quick keeps its code
+// pointer after tier-up. the retired entry jumps on to the full block, so
+// the next hit runs that without going through the dispatcher
+TEST(test_quick_tier_inline_cache_after_tier_up)
+{
+    uint8_t rom[] = {
+        0x21, 0x08, 0x00, // 0x0000: ld hl, 0x0008
+        0xe9,             // 0x0003: jp (hl)
+        0x00, 0x00, 0x00, 0x00,
+        0x3e, 0x42,       // 0x0008: ld a, 0x42
+        0xc3, 0x50, 0x01  // 0x000a: jp 0x0150
+    };
+    struct code_block *quick, *full;
+
+    test_gb_rom = rom;
+    test_compile_ctx->tier = TIER_QUICK;
+    test_compile_ctx->hot_entries = 1;
+    quick = compile_block(0x0008, test_compile_ctx);
+    test_compile_ctx->tier = TIER_FULL;
+    test_compile_ctx->hot_entries = 0;
+    full = compile_block(0x0008, test_compile_ctx);
+
+    // the count ran out: the dispatcher compiled full and retired quick
+    quick->code[TIER_COUNT + 1] = 0;
+    ASSERT_EQ(block_is_hot(quick->code), 1);
+    block_retire(quick, 0x1800);
+    ASSERT_BYTES(quick, 0x4e, 0xf9, 0x00, 0x00, 0x18, 0x00);
+
+    set_code_seed(0x1400, quick);
+    set_code_seed(0x1800, full);
+    set_ic_seed(0x0008, 0x1400, 1);
+    test_compile_ctx->ic_counters = 1;
+    run_block_with_budget(rom, 100000);
+    test_compile_ctx->ic_counters = 0;
+    ASSERT_EQ(get_ctx_long(JIT_CTX_IC_HITS), 1);
+    // a dispatcher round trip would stop at 0 with D3 = 0x0008
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x0150);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x42);
+    // and the quick prologue never ran
+    ASSERT_EQ(get_mem_byte(0x1400 + TIER_COUNT + 1), 0);
+
+    block_free(quick);
+    block_free(full);
+}
+
+// a one-entry cache for block_reentry
+static uint16_t reentry_cache_pc;
+static void *reentry_cache_code;
+
+static void *reentry_lookup(uint16_t pc, uint8_t bank)
+{
+    (void) bank;
+    return pc == reentry_cache_pc ? reentry_cache_code : NULL;
+}
+
+static int reentry_store(uint16_t pc, uint8_t bank, void *code)
+{
+    (void) bank;
+    reentry_cache_pc = pc;
+    reentry_cache_code = code;
+    return 1;
+}
+
+TEST(test_block_reentry)
+{
+    uint8_t rom[] = {
+        0x06, 0x03,       // 0x0000: ld b, 3
+        0x05,             // 0x0002: dec b
+        0x20, 0xfd,       // 0x0003: jr nz, 0x0002
+        0xc3, 0x50, 0x01  // 0x0005: jp 0x0150
+    };
+    struct code_block *block;
+    const struct block_reentry *map;
+    void *code;
+    int k;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    map = BLOCK_REENTRIES(block);
+    // the loop head starts with nothing known
+    for (k = 0; k < block->reentry_count; k++) {
+        if (map[k].pc == 0x0002) {
+            break;
+        }
+    }
+    ASSERT_EQ(k < block->reentry_count, 1);
+
+    reentry_cache_pc = 0;
+    reentry_cache_code = block->code;
+    test_compile_ctx->cache_lookup = reentry_lookup;
+    test_compile_ctx->cache_store = reentry_store;
+    // not at an instruction boundary
+    ASSERT_EQ(block_reentry(test_compile_ctx, 0x0001) == NULL, 1);
+    code = block_reentry(test_compile_ctx, 0x0002);
+    test_compile_ctx->cache_lookup = NULL;
+    test_compile_ctx->cache_store = NULL;
+
+    ASSERT_EQ(code == block->code + map[k].off, 1);
+    ASSERT_EQ(reentry_cache_pc, 0x0002);
+    ASSERT_EQ(reentry_cache_code == code, 1);
+    block_free(block);
+}
+
 // Call/ret tests
+TEST(test_exec_call_ret_shadow_balanced)
+{
+    // a matched call/ret leaves the return shadow stack where it started
+    uint8_t rom[] = {
+        0x3e, 0x11,       // 0x0000: ld a, 0x11
+        0xcd, 0x08, 0x00, // 0x0002: call 0x0008
+        0x3e, 0x33,       // 0x0005: ld a, 0x33 (after return)
+        0x10,             // 0x0007: stop
+        0x3c,             // 0x0008: inc a
+        0xc9              // 0x0009: ret
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x33);
+    ASSERT_EQ(get_ctx_long(JIT_CTX_RET_SP) & 0xff, 0);
+}
+
+TEST(test_exec_call_pushes_shadow_entry)
+{
+    uint8_t rom[] = {
+        0xcd, 0x04, 0x00, // 0x0000: call 0x0004
+        0x00,             // 0x0003: nop
+        0x10, 0x00        // 0x0004: stop
+    };
+    uint32_t top;
+
+    run_program(rom, 0);
+    top = get_ctx_long(JIT_CTX_RET_SP);
+    ASSERT_EQ(top & 0xff, 8);
+    ASSERT_EQ((get_mem_byte(top + 2) << 8) | get_mem_byte(top + 3), 0x0003);
+}
+
+TEST(test_exec_ret_shadow_mismatch)
+{
+    // the callee bumps its return address, so RET must not take the
+    // shadow landing for 0x0005
+    uint8_t rom[] = {
+        0x3e, 0x01,       // 0x0000: ld a, 1
+        0xcd, 0x08, 0x00, // 0x0002: call 0x0008
+        0x3c,             // 0x0005: inc a (skipped)
+        0x10,             // 0x0006: stop
+        0x00,             // 0x0007: padding
+        0xe1,             // 0x0008: pop hl
+        0x23,             // 0x0009: inc hl
+        0xe5,             // 0x000a: push hl
+        0xc9              // 0x000b: ret
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x01);
+    ASSERT_EQ(get_ctx_long(JIT_CTX_RET_SP) & 0xff, 0);
+}
+
 TEST(test_exec_call_ret_simple)
 {
     // Simple call and return
@@ -779,6 +1255,112 @@ TEST(test_rst_28)
     ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 0x22);
 }
 
+// rst 28h into the usual jump table helper: the table follows the rst,
+// indexed by A. Dispatched through the side table, the registers have to
+// come out as if the helper ran
+TEST(test_rst_jump_table)
+{
+    uint8_t rom[0x100] = {0};
+    rom[0x00] = 0x3e; rom[0x01] = 0x02;  // ld a, 2
+    rom[0x02] = 0xef;                     // rst 28h
+    rom[0x03] = 0x40; rom[0x04] = 0x00;  // dw 0x0040
+    rom[0x05] = 0x44; rom[0x06] = 0x00;  // dw 0x0044
+    rom[0x07] = 0x48; rom[0x08] = 0x00;  // dw 0x0048
+    // handler at 0x0028
+    rom[0x28] = 0x87;                     // add a, a
+    rom[0x29] = 0xe1;                     // pop hl
+    rom[0x2a] = 0x5f;                     // ld e, a
+    rom[0x2b] = 0x16; rom[0x2c] = 0x00;  // ld d, 0
+    rom[0x2d] = 0x19;                     // add hl, de
+    rom[0x2e] = 0x2a;                     // ld a, (hl+)
+    rom[0x2f] = 0x66;                     // ld h, (hl)
+    rom[0x30] = 0x6f;                     // ld l, a
+    rom[0x31] = 0xe9;                     // jp (hl)
+    // targets
+    rom[0x40] = 0x06; rom[0x41] = 0x11;  // ld b, 0x11
+    rom[0x42] = 0x10;                     // stop
+    rom[0x44] = 0x06; rom[0x45] = 0x22;  // ld b, 0x22
+    rom[0x46] = 0x10;                     // stop
+    rom[0x48] = 0x06; rom[0x49] = 0x33;  // ld b, 0x33
+    rom[0x4a] = 0x10;                     // stop
+    run_program(rom, 0);
+    ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 0x33);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x48);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0x0048);
+    ASSERT_EQ(get_dreg(REG_68K_D_DE) & 0x00ff00ff, 0x00000004);
+}
+
+// a leaf callee is compiled inline, and its ret carries on in the caller
+// within the same block
+TEST(test_call_leaf_inline)
+{
+    uint8_t rom[0x100] = {0};
+    struct code_block *block;
+    rom[0x00] = 0x3e; rom[0x01] = 0x01;  // ld a, 1
+    rom[0x02] = 0xcd; rom[0x03] = 0x10; rom[0x04] = 0x00;  // call 0x0010
+    rom[0x05] = 0x06; rom[0x06] = 0x22;  // ld b, 0x22
+    rom[0x07] = 0x10;                     // stop
+    // leaf at 0x0010
+    rom[0x10] = 0x3c;                     // inc a
+    rom[0x11] = 0x0e; rom[0x12] = 0x33;  // ld c, 0x33
+    rom[0x13] = 0xc9;                     // ret
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->end_address, 0x0009);
+    block_free(block);
+
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x02);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0x00ff00ff, 0x00220033);
+}
+
+// far call: ld a, bank; ld ($2000), a; call $4000. with the bank known
+// the callee is compiled into the caller's block behind a bank check
+static uint8_t far_rom[0x4010];
+
+static void far_call_rom(uint8_t bank)
+{
+    far_rom[0x00] = 0x3e; far_rom[0x01] = bank;  // ld a, bank
+    far_rom[0x02] = 0xea; far_rom[0x03] = 0x00; far_rom[0x04] = 0x20;  // ld ($2000), a
+    far_rom[0x05] = 0xcd; far_rom[0x06] = 0x00; far_rom[0x07] = 0x40;  // call $4000
+    far_rom[0x08] = 0x06; far_rom[0x09] = 0x22;  // ld b, 0x22
+    far_rom[0x0a] = 0x10;                         // stop
+    // callee at 0x4000
+    far_rom[0x4000] = 0x0e; far_rom[0x4001] = 0x33;  // ld c, 0x33
+    far_rom[0x4002] = 0xc9;                           // ret
+    test_compile_ctx->bank_reg_lo = 0x2000;
+    test_compile_ctx->bank_reg_hi = 0x3fff;
+}
+
+TEST(test_call_far_followed)
+{
+    struct code_block *block;
+
+    // the tests run with bank 1 mapped, the check passes
+    far_call_rom(1);
+    test_gb_rom = far_rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->end_address, 0x4003);
+    block_free(block);
+
+    run_program(far_rom, 0);
+    test_compile_ctx->bank_reg_lo = 0;
+    test_compile_ctx->bank_reg_hi = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0x00ff00ff, 0x00220033);
+}
+
+TEST(test_call_far_other_bank)
+{
+    // the write handler doesn't switch banks here: the check fails and
+    // the call leaves the block like any other
+    far_call_rom(2);
+    run_program(far_rom, 0);
+    test_compile_ctx->bank_reg_lo = 0;
+    test_compile_ctx->bank_reg_hi = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0x00ff00ff, 0x00220033);
+}
+
 // Chained ret tests (Pokemon TryDoWildEncounter pattern)
 TEST(test_chained_ret_nz_both_return)
 {
@@ -898,6 +1480,210 @@ TEST(test_di)
     ASSERT_EQ(get_mem_byte(U16_INTERRUPTS_ENABLED + 1), 0);
 }
 
+// Flag liveness and cp/branch fusion
+TEST(test_exec_cp_b_fused_jr_z)
+{
+    // cp b works on a copy of BC, so jr z can branch on the CCR directly
+    uint8_t rom[] = {
+        0x3e, 0x05,       // 0x0000: ld a, 5
+        0x06, 0x05,       // 0x0002: ld b, 5
+        0xb8,             // 0x0004: cp a, b
+        0x28, 0x02,       // 0x0005: jr z, +2 (taken)
+        0x3e, 0x00,       // 0x0007: ld a, 0 (skipped)
+        0x10              // 0x0009: stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x05);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0x00ff00ff, 0x00050000);
+}
+
+TEST(test_exec_dead_flags_overwritten)
+{
+    // the cp sets C but the and overwrites it before anything reads it
+    uint8_t rom[] = {
+        0x3e, 0x01,       // 0x0000: ld a, 1
+        0xfe, 0x42,       // 0x0002: cp a, 0x42 (C=1, dead)
+        0xa7,             // 0x0004: and a (Z=0, C=0)
+        0x38, 0x02,       // 0x0005: jr c, +2 (not taken)
+        0x0e, 0x33,       // 0x0007: ld c, 0x33
+        0x10              // 0x0009: stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0xff, 0x33);
+    ASSERT_EQ(get_dreg(REG_68K_D_FLAGS) & 0x05, 0x00);
+}
+
+TEST(test_exec_dead_z_keeps_carry)
+{
+    // the first inc's Z is dead, dropping it must not lose the C from scf
+    uint8_t rom[] = {
+        0x3e, 0xff,       // 0x0000: ld a, 0xff
+        0x37,             // 0x0002: scf
+        0x3c,             // 0x0003: inc a (A=0, Z=1, dead)
+        0x3c,             // 0x0004: inc a (A=1, Z=0)
+        0x38, 0x02,       // 0x0005: jr c, +2 (taken)
+        0x3e, 0x00,       // 0x0007: ld a, 0 (skipped)
+        0x10              // 0x0009: stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x01);
+    ASSERT_EQ(get_dreg(REG_68K_D_FLAGS) & 0x05, 0x01);
+}
+
+// Conditions the compiler can't see: A goes through HRAM first, so the
+// flags are tested at run time
+TEST(test_exec_jr_z_runtime)
+{
+    uint8_t rom[] = {
+        0x3e, 0x05,       // 0x0000: ld a, 5
+        0xe0, 0x90,       // 0x0002: ldh ($ff90), a
+        0xf0, 0x90,       // 0x0004: ldh a, ($ff90)
+        0x06, 0x05,       // 0x0006: ld b, 5
+        0xb8,             // 0x0008: cp a, b
+        0x28, 0x02,       // 0x0009: jr z, +2 (taken)
+        0x3e, 0x00,       // 0x000b: ld a, 0 (skipped)
+        0x10              // 0x000d: stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x05);
+}
+
+TEST(test_exec_jp_c_runtime)
+{
+    uint8_t rom[] = {
+        0x3e, 0x42,       // 0x0000: ld a, 0x42
+        0xe0, 0x90,       // 0x0002: ldh ($ff90), a
+        0xf0, 0x90,       // 0x0004: ldh a, ($ff90)
+        0xfe, 0x10,       // 0x0006: cp a, 0x10 (C=0)
+        0xda, 0x10, 0x00, // 0x0008: jp c, 0x0010 (not taken)
+        0x3e, 0x66,       // 0x000b: ld a, 0x66
+        0x10,             // 0x000d: stop
+        0x00, 0x00,       // 0x000e: padding
+        0x3e, 0x00,       // 0x0010: ld a, 0 (not reached)
+        0x10              // 0x0012: stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x66);
+}
+
+TEST(test_exec_call_ret_nz_runtime)
+{
+    uint8_t rom[] = {
+        0x3e, 0x42,       // 0x0000: ld a, 0x42
+        0xe0, 0x90,       // 0x0002: ldh ($ff90), a
+        0xf0, 0x90,       // 0x0004: ldh a, ($ff90)
+        0xb7,             // 0x0006: or a (Z=0)
+        0xc4, 0x0d, 0x00, // 0x0007: call nz, 0x000d (taken)
+        0x10,             // 0x000a: stop
+        0x00, 0x00,       // 0x000b: padding
+        0x0e, 0x99,       // 0x000d: ld c, 0x99
+        0xc0,             // 0x000f: ret nz (taken)
+        0x0e, 0x00,       // 0x0010: ld c, 0 (skipped)
+        0xc9              // 0x0012: ret
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0xff, 0x99);
+}
+
+// Conditions known at compile time
+TEST(test_known_jr_never_taken)
+{
+    // after xor a, jr nz compiles to the same code as two nops
+    uint8_t rom[] = {
+        0xaf,             // 0x0000: xor a
+        0x20, 0x02,       // 0x0001: jr nz, +2 (never taken)
+        0x3e, 0x05,       // 0x0003: ld a, 5
+        0x10, 0x00        // 0x0005: stop
+    };
+    uint8_t nops[] = {
+        0xaf, 0x00, 0x00, 0x3e, 0x05, 0x10, 0x00
+    };
+    struct code_block *a, *b;
+    size_t k;
+
+    test_gb_rom = rom;
+    a = compile_block(0, test_compile_ctx);
+    test_gb_rom = nops;
+    b = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(a->length, b->length);
+    for (k = 0; k < a->length; k++) {
+        ASSERT_EQ(a->code[k], b->code[k]);
+    }
+    block_free(a);
+    block_free(b);
+
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x05);
+}
+
+TEST(test_known_jp_always_taken)
+{
+    // jp z after xor a is a plain jp, so the superblock follows it
+    uint8_t rom[] = {
+        0xaf,             // 0x0000: xor a
+        0xca, 0x08, 0x00, // 0x0001: jp z, 0x0008 (always taken)
+        0x3e, 0x01,       // 0x0004: ld a, 1 (skipped)
+        0x10, 0x00,       // 0x0006: stop
+        0x0e, 0x33,       // 0x0008: ld c, 0x33
+        0x10, 0x00        // 0x000a: stop
+    };
+    test_gb_rom = rom;
+    struct code_block *block = compile_block(0, test_compile_ctx);
+    // xor, jp, ld, stop
+    ASSERT_EQ(block->count, 4);
+    block_free(block);
+
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x00);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0xff, 0x33);
+}
+
+// Superblocks: unconditional jumps into ROM keep compiling at the target
+TEST(test_superblock_follows_jp_jr)
+{
+    uint8_t rom[] = {
+        0x3e, 0x01,       // 0x0000: ld a, 1
+        0xc3, 0x08, 0x00, // 0x0002: jp 0x0008
+        0x3e, 0x55,       // 0x0005: ld a, 0x55 (skipped)
+        0x00,             // 0x0007: nop
+        0x18, 0x02,       // 0x0008: jr +2 (to 0x000c)
+        0x3e, 0x66,       // 0x000a: ld a, 0x66 (skipped)
+        0x3c,             // 0x000c: inc a
+        0x10, 0x00        // 0x000d: stop
+    };
+    test_gb_rom = rom;
+    struct code_block *block = compile_block(0, test_compile_ctx);
+    // ld, jp, jr, inc, stop all in one block
+    ASSERT_EQ(block->count, 5);
+    ASSERT_EQ(block->end_address, 0x000f);
+    block_free(block);
+
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x02);
+}
+
+TEST(test_superblock_follows_call)
+{
+    uint8_t rom[] = {
+        0x3e, 0x01,       // 0x0000: ld a, 1
+        0xcd, 0x08, 0x00, // 0x0002: call 0x0008
+        0x3c,             // 0x0005: inc a
+        0x10, 0x00,       // 0x0006: stop
+        0x87,             // 0x0008: add a, a
+        0xc9              // 0x0009: ret
+    };
+    test_gb_rom = rom;
+    struct code_block *block = compile_block(0, test_compile_ctx);
+    // ld, call, add, ret
+    ASSERT_EQ(block->count, 4);
+    block_free(block);
+
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x03);
+    // return address still pushed to the GB stack (SP starts at 0x0fff)
+    ASSERT_EQ(get_mem_byte(0x0ffd), 0x05);
+}
+
 void register_branch_tests(void)
 {
     printf("\nJP instruction:\n");
@@ -906,6 +1692,7 @@ void register_branch_tests(void)
     printf("\nJR instructions:\n");
     RUN_TEST(test_exec_jr_forward);
     RUN_TEST(test_exec_jr_zero);
+    RUN_TEST(test_exec_long_straight_line);
     RUN_TEST(test_exec_dec_a_loop);
 
     printf("\nCP (comparison) tests:\n");
@@ -925,6 +1712,11 @@ void register_branch_tests(void)
     RUN_TEST(test_exec_jr_nc_taken);
     RUN_TEST(test_exec_jr_nc_not_taken);
 
+    printf("\nFlag liveness:\n");
+    RUN_TEST(test_exec_cp_b_fused_jr_z);
+    RUN_TEST(test_exec_dead_flags_overwritten);
+    RUN_TEST(test_exec_dead_z_keeps_carry);
+
     printf("\nConditional JP tests:\n");
     RUN_TEST(test_exec_jp_z_taken);
     RUN_TEST(test_exec_jp_z_not_taken);
@@ -935,13 +1727,43 @@ void register_branch_tests(void)
     RUN_TEST(test_exec_jp_nc_taken);
     RUN_TEST(test_exec_jp_nc_not_taken);
 
+    printf("\nRun-time and known conditions:\n");
+    RUN_TEST(test_exec_jr_z_runtime);
+    RUN_TEST(test_exec_jp_c_runtime);
+    RUN_TEST(test_exec_call_ret_nz_runtime);
+    RUN_TEST(test_known_jr_never_taken);
+    RUN_TEST(test_known_jp_always_taken);
+
+    printf("\nSuperblocks:\n");
+    RUN_TEST(test_superblock_follows_jp_jr);
+    RUN_TEST(test_superblock_follows_call);
+
     printf("\nJP (HL):\n");
     RUN_TEST(test_jp_hl);
+    RUN_TEST(test_jp_hl_inline_cache_miss);
+    RUN_TEST(test_jp_hl_inline_cache_hit);
+    RUN_TEST(test_jp_hl_inline_cache_wrong_bank);
+    RUN_TEST(test_jp_banked_link_hit);
+    RUN_TEST(test_jp_banked_link_wrong_bank);
+    RUN_TEST(test_banked_link_shared_stub);
+
+    printf("\nBlock link tests:\n");
+    RUN_TEST(test_block_unlink_jmp);
+    RUN_TEST(test_block_unlink_bank_slot);
+    RUN_TEST(test_block_links_full);
+    RUN_TEST(test_block_links_mid_block);
+    RUN_TEST(test_block_retire);
+    RUN_TEST(test_quick_tier_hot_exit);
+    RUN_TEST(test_quick_tier_inline_cache_after_tier_up);
+    RUN_TEST(test_block_reentry);
 
     printf("\nCall/ret tests:\n");
     RUN_TEST(test_exec_call_ret_simple);
     RUN_TEST(test_exec_call_ret_nested);
     RUN_TEST(test_exec_call_preserves_regs);
+    RUN_TEST(test_exec_call_ret_shadow_balanced);
+    RUN_TEST(test_exec_call_pushes_shadow_entry);
+    RUN_TEST(test_exec_ret_shadow_mismatch);
 
     printf("\nConditional ret tests:\n");
     RUN_TEST(test_exec_ret_nz_taken);
@@ -965,6 +1787,10 @@ void register_branch_tests(void)
 
     printf("\nRST tests:\n");
     RUN_TEST(test_rst_28);
+    RUN_TEST(test_rst_jump_table);
+    RUN_TEST(test_call_leaf_inline);
+    RUN_TEST(test_call_far_followed);
+    RUN_TEST(test_call_far_other_bank);
 
     printf("\nChained ret preserves flags:\n");
     RUN_TEST(test_chained_ret_nz_both_return);
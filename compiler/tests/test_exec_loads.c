@@ -445,6 +445,289 @@ TEST(test_page_write16_cross_falls_back)
     ASSERT_EQ(get_mem_byte(0xb000), 0x12);
 }
 
+// Known register values: accesses through a pointer loaded earlier in the
+// block are compiled for the address it holds
+TEST(test_known_hl_hram)
+{
+    uint8_t rom[] = {
+        0x21, 0x90, 0xff, // 0x0000: ld hl, $ff90
+        0x3e, 0x5a,       // 0x0003: ld a, $5a
+        0x77,             // 0x0005: ld (hl), a
+        0xaf,             // 0x0006: xor a
+        0x2a,             // 0x0007: ld a, (hl+)
+        0x10              // 0x0008: stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_mem_byte(GLOBALS_BASE + 0x10), 0x5a);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x5a);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0xff91);
+}
+
+TEST(test_known_bc_de_wram)
+{
+    uint8_t rom[] = {
+        0x01, 0x05, 0xc0, // 0x0000: ld bc, $c005
+        0x11, 0x06, 0xc0, // 0x0003: ld de, $c006
+        0x0a,             // 0x0006: ld a, (bc)
+        0x12,             // 0x0007: ld (de), a
+        0x10              // 0x0008: stop
+    };
+    prepare_block(rom);
+    set_mem_byte(PAGE_BUF_C + 5, 0x3c);
+    run_prepared_block();
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x3c);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 6), 0x3c);
+}
+
+TEST(test_known_c_ldh_hram)
+{
+    uint8_t rom[] = {
+        0x0e, 0x91,       // 0x0000: ld c, $91
+        0x3e, 0x77,       // 0x0002: ld a, $77
+        0xe2,             // 0x0004: ld ($ff00 + c), a
+        0xaf,             // 0x0005: xor a
+        0xf2,             // 0x0006: ld a, ($ff00 + c)
+        0x10              // 0x0007: stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_mem_byte(GLOBALS_BASE + 0x11), 0x77);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x77);
+}
+
+TEST(test_known_hl_rom_folded)
+{
+    // bank 0 through a known pointer is read at compile time
+    uint8_t rom[] = {
+        0x21, 0x08, 0x00, // 0x0000: ld hl, $0008
+        0x7e,             // 0x0003: ld a, (hl)
+        0x10, 0x00,       // 0x0004: stop
+        0x00, 0x00,       // 0x0006: padding
+        0x99              // 0x0008: data
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x99);
+}
+
+TEST(test_known_reload_dropped)
+{
+    // loading a register with what it already holds emits nothing
+    uint8_t once[] = {
+        0x3e, 0x05,       // 0x0000: ld a, 5
+        0x21, 0x00, 0xc1, // 0x0002: ld hl, $c100
+        0x10, 0x00        // 0x0005: stop
+    };
+    uint8_t twice[] = {
+        0x3e, 0x05,       // 0x0000: ld a, 5
+        0x21, 0x00, 0xc1, // 0x0002: ld hl, $c100
+        0x3e, 0x05,       // 0x0005: ld a, 5
+        0x21, 0x00, 0xc1, // 0x0007: ld hl, $c100
+        0x10, 0x00        // 0x000a: stop
+    };
+    struct code_block *a, *b;
+
+    test_gb_rom = once;
+    a = compile_block(0, test_compile_ctx);
+    test_gb_rom = twice;
+    b = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(b->length, a->length);
+    block_free(a);
+    block_free(b);
+
+    run_program(twice, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x05);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0xc100);
+}
+
+// Pointer speculation: a loop body accessing memory through pointers that
+// aren't known at compile time uses the pages directly when they're mapped
+TEST(test_ptr_copy_wram)
+{
+    uint8_t rom[] = {
+        0x21, 0x10, 0xc0, // 0x0000: ld hl, $c010
+        0x11, 0x20, 0xc0, // 0x0003: ld de, $c020
+        0x06, 0x04,       // 0x0006: ld b, 4
+        0x2a,             // 0x0008: ld a, (hl+)
+        0x12,             // 0x0009: ld (de), a
+        0x13,             // 0x000a: inc de
+        0x05,             // 0x000b: dec b
+        0x20, 0xfa,       // 0x000c: jr nz, -6
+        0x10              // 0x000e: stop
+    };
+    prepare_block(rom);
+    set_mem_byte(PAGE_BUF_C + 0x10, 0x11);
+    set_mem_byte(PAGE_BUF_C + 0x11, 0x22);
+    set_mem_byte(PAGE_BUF_C + 0x12, 0x33);
+    set_mem_byte(PAGE_BUF_C + 0x13, 0x44);
+    run_prepared_block();
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x20), 0x11);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x21), 0x22);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x22), 0x33);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x23), 0x44);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0xc014);
+    ASSERT_EQ(get_dreg(REG_68K_D_DE) & 0xff, 0x24);
+}
+
+TEST(test_ptr_copy_from_hram)
+{
+    // HRAM has no page, every iteration fails the guard
+    uint8_t rom[] = {
+        0x21, 0x90, 0xff, // 0x0000: ld hl, $ff90
+        0x11, 0x20, 0xc0, // 0x0003: ld de, $c020
+        0x06, 0x02,       // 0x0006: ld b, 2
+        0x2a,             // 0x0008: ld a, (hl+)
+        0x12,             // 0x0009: ld (de), a
+        0x13,             // 0x000a: inc de
+        0x05,             // 0x000b: dec b
+        0x20, 0xfa,       // 0x000c: jr nz, -6
+        0x10              // 0x000e: stop
+    };
+    prepare_block(rom);
+    set_mem_byte(GLOBALS_BASE + 0x10, 0x5a);
+    set_mem_byte(GLOBALS_BASE + 0x11, 0xa5);
+    run_prepared_block();
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x20), 0x5a);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x21), 0xa5);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0xff92);
+}
+
+TEST(test_ptr_fill_crosses_page)
+{
+    // the first pair of stores straddles $d000 and takes the helpers,
+    // the second is on one page again
+    uint8_t rom[] = {
+        0x21, 0xff, 0xcf, // 0x0000: ld hl, $cfff
+        0x3e, 0xa5,       // 0x0003: ld a, $a5
+        0x06, 0x02,       // 0x0005: ld b, 2
+        0x22,             // 0x0007: ld (hl+), a
+        0x22,             // 0x0008: ld (hl+), a
+        0x05,             // 0x0009: dec b
+        0x20, 0xfb,       // 0x000a: jr nz, -5
+        0x10              // 0x000c: stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0xfff), 0xa5);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_D + 0x000), 0xa5);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_D + 0x001), 0xa5);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_D + 0x002), 0xa5);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_D + 0x003), 0x00);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0xd003);
+}
+
+// BC and DE both as pointers: no pointer run, the loop body has them
+// contiguous and splits them again before the jr
+TEST(test_pairs_contiguous_copy)
+{
+    uint8_t rom[] = {
+        0x01, 0x00, 0xc0, // 0x0000: ld bc, $c000
+        0x11, 0x10, 0xc0, // 0x0003: ld de, $c010
+        0x26, 0x02,       // 0x0006: ld h, 2
+        0x0a,             // 0x0008: ld a, (bc)
+        0x12,             // 0x0009: ld (de), a
+        0x03,             // 0x000a: inc bc
+        0x13,             // 0x000b: inc de
+        0x0a,             // 0x000c: ld a, (bc)
+        0x12,             // 0x000d: ld (de), a
+        0x03,             // 0x000e: inc bc
+        0x13,             // 0x000f: inc de
+        0x25,             // 0x0010: dec h
+        0x20, 0xf5,       // 0x0011: jr nz, -11
+        0x10              // 0x0013: stop
+    };
+    prepare_block(rom);
+    set_mem_byte(PAGE_BUF_C + 0x00, 0x11);
+    set_mem_byte(PAGE_BUF_C + 0x01, 0x22);
+    set_mem_byte(PAGE_BUF_C + 0x02, 0x33);
+    set_mem_byte(PAGE_BUF_C + 0x03, 0x44);
+    run_prepared_block();
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x10), 0x11);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x11), 0x22);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x12), 0x33);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x13), 0x44);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC), 0x00c00004);
+    ASSERT_EQ(get_dreg(REG_68K_D_DE), 0x00c00014);
+}
+
+// Copy and fill loops: compiled to a native loop over the mapped pages
+TEST(test_bulk_fill_then_copy)
+{
+    // the copy's destination crosses from $cfff to $d000
+    uint8_t rom[] = {
+        0x21, 0x00, 0xc0, // 0x0000: ld hl, $c000
+        0x3e, 0x5a,       // 0x0003: ld a, $5a
+        0x06, 0x10,       // 0x0005: ld b, 16
+        0x22,             // 0x0007: ld (hl+), a
+        0x05,             // 0x0008: dec b
+        0x20, 0xfc,       // 0x0009: jr nz, -4
+        0x21, 0x00, 0xc0, // 0x000b: ld hl, $c000
+        0x11, 0xf8, 0xcf, // 0x000e: ld de, $cff8
+        0x01, 0x10, 0x00, // 0x0011: ld bc, $0010
+        0x2a,             // 0x0014: ld a, (hl+)
+        0x12,             // 0x0015: ld (de), a
+        0x13,             // 0x0016: inc de
+        0x0b,             // 0x0017: dec bc
+        0x78,             // 0x0018: ld a, b
+        0xb1,             // 0x0019: or c
+        0x20, 0xf8,       // 0x001a: jr nz, -8
+        0x10, 0x00        // 0x001c: stop
+    };
+    run_block_with_budget(rom, 100000);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x00f), 0x5a);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0x010), 0x00);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0xff8), 0x5a);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 0xfff), 0x5a);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_D + 0x007), 0x5a);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_D + 0x008), 0x00);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0xc010);
+    ASSERT_EQ(get_dreg(REG_68K_D_DE), 0x00d00008);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC), 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_FLAGS) & 0x05, 0x04);
+    // 28 + (16 * 24 - 4) + 36 + (16 * 52 - 4) + 4 for the stop
+    ASSERT_EQ(get_cycle_count(), 1276);
+}
+
+TEST(test_bulk_fill_out_of_budget)
+{
+    // (100 - 28) / 24 = 3 iterations fit, then exit at the loop head
+    uint8_t rom[] = {
+        0x21, 0x00, 0xc0, // 0x0000: ld hl, $c000
+        0x3e, 0x5a,       // 0x0003: ld a, $5a
+        0x06, 0x10,       // 0x0005: ld b, 16
+        0x22,             // 0x0007: ld (hl+), a
+        0x05,             // 0x0008: dec b
+        0x20, 0xfc,       // 0x0009: jr nz, -4
+        0x10, 0x00        // 0x000b: stop
+    };
+    run_block_with_budget(rom, 100);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 2), 0x5a);
+    ASSERT_EQ(get_mem_byte(PAGE_BUF_C + 3), 0x00);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0xc003);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC), 0x000d0000);
+    ASSERT_EQ(get_dreg(REG_68K_D_FLAGS) & 0x04, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x0007);
+    ASSERT_EQ(get_cycle_count(), 100);
+}
+
+TEST(test_bulk_fill_hram)
+{
+    // no page for HRAM: the loop body runs through the helpers
+    uint8_t rom[] = {
+        0x21, 0x90, 0xff, // 0x0000: ld hl, $ff90
+        0x3e, 0x77,       // 0x0003: ld a, $77
+        0x06, 0x04,       // 0x0005: ld b, 4
+        0x22,             // 0x0007: ld (hl+), a
+        0x05,             // 0x0008: dec b
+        0x20, 0xfc,       // 0x0009: jr nz, -4
+        0x10              // 0x000b: stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_mem_byte(GLOBALS_BASE + 0x10), 0x77);
+    ASSERT_EQ(get_mem_byte(GLOBALS_BASE + 0x13), 0x77);
+    ASSERT_EQ(get_mem_byte(GLOBALS_BASE + 0x14), 0x00);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0xff94);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC), 0);
+}
+
 void register_load_tests(void)
 {
     printf("\n8-bit immediate loads:\n");
@@ -515,4 +798,22 @@ void register_load_tests(void)
     RUN_TEST(test_page_fast_pop_push);
     RUN_TEST(test_page_read16_cross_falls_back);
     RUN_TEST(test_page_write16_cross_falls_back);
+
+    printf("\nKnown register values:\n");
+    RUN_TEST(test_known_hl_hram);
+    RUN_TEST(test_known_bc_de_wram);
+    RUN_TEST(test_known_c_ldh_hram);
+    RUN_TEST(test_known_hl_rom_folded);
+    RUN_TEST(test_known_reload_dropped);
+
+    printf("\nPointer speculation:\n");
+    RUN_TEST(test_ptr_copy_wram);
+    RUN_TEST(test_ptr_copy_from_hram);
+    RUN_TEST(test_ptr_fill_crosses_page);
+    RUN_TEST(test_pairs_contiguous_copy);
+
+    printf("\nCopy and fill loops:\n");
+    RUN_TEST(test_bulk_fill_then_copy);
+    RUN_TEST(test_bulk_fill_out_of_budget);
+    RUN_TEST(test_bulk_fill_hram);
 }
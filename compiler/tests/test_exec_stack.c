@@ -43,6 +43,71 @@ TEST(test_push_hl)
     ASSERT_EQ(get_areg(REG_68K_A_HL), 0x5678);
 }
 
+// Slow mode push/pop, compiled into the cold tail
+TEST(test_push_pop_slow_mode)
+{
+    // a cart ram stack stays in slow mode, so push and pop take their
+    // slow paths, which sit after the block's exit
+    uint8_t rom[] = {
+        0x31, 0x80, 0xa1, // 0x0000: ld sp, 0xa180
+        0x01, 0x34, 0x12, // 0x0003: ld bc, 0x1234
+        0xc5,             // 0x0006: push bc
+        0xe1,             // 0x0007: pop hl
+        0x10              // 0x0008: stop
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->cold_bytes > 0, 1);
+    ASSERT_EQ(block->cold_bytes < block->length, 1);
+    block_free(block);
+
+    run_program(rom, 0);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0x1234);
+}
+
+// A stack version: guarded once, no slow paths, exit linkable
+TEST(test_push_pop_stack_version)
+{
+    uint8_t rom[] = {
+        0x01, 0x34, 0x12, // 0x0000: ld bc, 0x1234
+        0xc5,             // 0x0003: push bc
+        0xd1,             // 0x0004: pop de
+        0xc5,             // 0x0005: push bc
+        0xe1,             // 0x0006: pop hl
+        0x10              // 0x0007: stop
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    test_compile_ctx->version = VERSION_STACK_RAM;
+    block = compile_block(0, test_compile_ctx);
+    test_compile_ctx->version = 0;
+    ASSERT_EQ(block->version, VERSION_STACK_RAM);
+    ASSERT_EQ(block->cold_bytes, 0);
+    // tst.l STACK_IN_RAM(a4)
+    ASSERT_EQ(block->code[0], 0x4a);
+    ASSERT_EQ(block->code[1], 0xac);
+    ASSERT_EQ(block_version_holds(block->code, 0), 0);
+    ASSERT_EQ(block_version_holds(block->code, VERSION_STACK_RAM), 1);
+
+    // the dispatcher follows a linked exit instead of compiling again
+    ASSERT_EQ(block_version_target(block->code), 0);
+    block_version_link(block, 0x12345678);
+    ASSERT_EQ(block->code[VERSION_EXIT], 0x4e);
+    ASSERT_EQ(block->code[VERSION_EXIT + 1], 0xf9);
+    ASSERT_EQ(block->code[VERSION_EXIT + 5], 0x78);
+    ASSERT_EQ(block_version_target(block->code), 0x12345678);
+    block_free(block);
+
+    // nothing asked for, nothing guarded
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->version, 0);
+    ASSERT_EQ(block->cold_bytes > 0, 1);
+    block_free(block);
+}
+
 // Pop DE
 TEST(test_pop_de)
 {
@@ -160,6 +225,8 @@ void register_stack_tests(void)
 
     printf("\nPush/pop HL:\n");
     RUN_TEST(test_push_hl);
+    RUN_TEST(test_push_pop_slow_mode);
+    RUN_TEST(test_push_pop_stack_version);
 
     printf("\nPop DE:\n");
     RUN_TEST(test_pop_de);
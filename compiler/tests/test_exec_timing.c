@@ -874,6 +874,121 @@ TEST(test_idle_wait_mid_block)
     ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 7);
 }
 
+// ============================================================================
+// General polling loop tests
+// Loops that only read RAM (or IF's vblank bit) and recompute everything
+// they test each pass skip to the wake limit like the HRAM idle wait.
+// Loops reading LY or STAT skip to the next line or mode boundary. The
+// read stub returns host memory, so $ff41/$ff44 read mem[0xff41/0xff44]
+// ============================================================================
+
+TEST(test_poll_masked_flag_waits)
+{
+    uint8_t rom[] = {
+        0xf0, 0x90,       // ldh a, ($ff90)
+        0xe6, 0x01,       // and $01
+        0x28, 0xfa,       // jr z, -6
+        0x10              // stop
+    };
+    run_block_with_frame_cycles(rom, 10000);
+    ASSERT_EQ(get_cycle_count(), 65664 - 10000);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0);
+}
+
+TEST(test_poll_masked_flag_set_falls_through)
+{
+    uint8_t rom[] = {
+        0xf0, 0x90,       // ldh a, ($ff90)
+        0xe6, 0x01,       // and $01
+        0x28, 0xfa,       // jr z, -6
+        0x10              // stop
+    };
+    run_block_with_frame_cycles_mem(rom, 10000, TEST_HRAM_FLAG_HOST_ADDR, 0x03);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x01);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0xffffffff);
+    // 12 + 8 + 8 for the untaken jr + 4 for the stop
+    ASSERT_EQ(get_cycle_count(), 32);
+}
+
+TEST(test_poll_stat_mode_skips_to_boundary)
+{
+    // wait for hblank. line 2 starts at 912, so 1000 is 88 into mode 3
+    // and hblank starts at 912 + 252
+    uint8_t rom[] = {
+        0xf0, 0x41,       // ldh a, ($ff41)
+        0xe6, 0x03,       // and $03
+        0xfe, 0x00,       // cp $00
+        0x20, 0xf8,       // jr nz, -8
+        0x10              // stop
+    };
+    run_block_with_frame_cycles_mem(rom, 1000, 0xff41, 0x83);
+    ASSERT_EQ(get_cycle_count(), 912 + 252 - 1000);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0);
+}
+
+TEST(test_poll_stat_boundary_already_passed)
+{
+    // 1152 is 240 into line 2: the mode 3 -> 0 change falls inside the
+    // first pass, so it goes around once and skips to the line end
+    uint8_t rom[] = {
+        0xf0, 0x41,       // ldh a, ($ff41)
+        0xe6, 0x03,       // and $03
+        0xfe, 0x00,       // cp $00
+        0x20, 0xf8,       // jr nz, -8
+        0x10              // stop
+    };
+    run_block_with_frame_cycles_mem(rom, 1152, 0xff41, 0x83);
+    ASSERT_EQ(get_cycle_count(), 3 * 456 - 1152);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0);
+}
+
+TEST(test_poll_ly_in_vblank)
+{
+    // in vblank only LY changes, once per line
+    uint8_t rom[] = {
+        0xf0, 0x44,       // ldh a, ($ff44)
+        0xe6, 0x07,       // and $07
+        0x20, 0xfa,       // jr nz, -6
+        0x10              // stop
+    };
+    run_block_with_frame_cycles_mem(rom, 66000, 0xff44, 145);
+    ASSERT_EQ(get_cycle_count(), 145 * 456 - 66000);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0);
+}
+
+TEST(test_poll_stat_clamped_by_wake_limit)
+{
+    uint8_t rom[] = {
+        0xf0, 0x41,       // ldh a, ($ff41)
+        0xe6, 0x03,       // and $03
+        0xfe, 0x00,       // cp $00
+        0x20, 0xf8,       // jr nz, -8
+        0x10              // stop
+    };
+    set_wake_limit(100);
+    run_block_with_frame_cycles_mem(rom, 1000, 0xff41, 0x83);
+    ASSERT_EQ(get_cycle_count(), 100);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0);
+}
+
+TEST(test_poll_loop_carried_register_runs)
+{
+    // B counts up each pass, so this isn't a poll: it runs natively until
+    // B reaches the flag
+    uint8_t rom[] = {
+        0x04,             // inc b
+        0xf0, 0x90,       // ldh a, ($ff90)
+        0xb8,             // cp b
+        0x20, 0xfa,       // jr nz, -6
+        0x10              // stop
+    };
+    run_block_with_frame_cycles_mem(rom, 10000, TEST_HRAM_FLAG_HOST_ADDR, 5);
+    ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 5);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0xffffffff);
+    // 5 passes of 28, 4 of them taken, and the stop
+    ASSERT_EQ(get_cycle_count(), 5 * 28 + 4 * 4 + 4);
+}
+
 // ============================================================================
 // Fast-forward wake limit tests
 // HALT and the HRAM idle wait load jit_ctx.wake_limit verbatim; the C
@@ -959,6 +1074,72 @@ TEST(test_budget_cond_loop_runs_natively)
     ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0xffffffff);
 }
 
+// jp nz back to the head stays in the block like jr nz does
+TEST(test_budget_jp_loop_runs_natively)
+{
+    uint8_t rom[] = {
+        0x06, 0x05,       // 0x0000: ld b, 5
+        0x0c,             // 0x0002: inc c
+        0x05,             // 0x0003: dec b
+        0xc2, 0x02, 0x00, // 0x0004: jp nz, 0x0002
+        0x10              // 0x0007: stop
+    };
+    run_block_with_budget(rom, 100000);
+    ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0xff, 5);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0xffffffff);
+}
+
+// a loop spread over three superblock segments: the head at 0x0100 is
+// found by the back edge from the third and compiled in a second pass
+TEST(test_budget_loop_across_segments)
+{
+    uint8_t rom[0x200] = {
+        0x06, 0x05,       // 0x0000: ld b, 5
+        0xc3, 0x00, 0x01, // 0x0002: jp 0x0100
+        0x05,             // 0x0005: dec b
+        0xc2, 0x00, 0x01, // 0x0006: jp nz, 0x0100
+        0x10              // 0x0009: stop
+    };
+    rom[0x100] = 0x0c;                                       // inc c
+    rom[0x101] = 0xc3; rom[0x102] = 0x05; rom[0x103] = 0x00; // jp 0x0005
+
+    run_block_with_budget(rom, 100000);
+    ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0xff, 5);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0xffffffff);
+
+    // out of budget it leaves at the head
+    run_block_with_budget(rom, 1);
+    ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 4);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x0100);
+}
+
+// a counted loop checks its whole run against the budget once at the head
+TEST(test_budget_counted_loop_fits)
+{
+    uint8_t rom[] = {
+        0x06, 0x05,       // 0x0000: ld b, 5
+        0x0c,             // 0x0002: inc c
+        0xcb, 0x23,       // 0x0003: sla e
+        0x05,             // 0x0005: dec b
+        0x20, 0xfa,       // 0x0006: jr nz, 0x0002
+        0x10              // 0x0008: stop
+    };
+    run_block_with_budget(rom, 100000);
+    ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0xff, 5);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0xffffffff);
+
+    // 8 + 5 * 28 doesn't fit in 100: each back edge checks, and the
+    // fourth leaves at the head with D2 = 120
+    run_block_with_budget(rom, 100);
+    ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 1);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0xff, 4);
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 2);
+    ASSERT_EQ(get_cycle_count(), 120);
+}
+
 TEST(test_budget_cond_loop_exits_early)
 {
     uint8_t rom[] = {
@@ -1088,6 +1269,9 @@ void register_timing_tests(void)
 
     printf("\nDispatcher exit budget tests:\n");
     RUN_TEST(test_budget_cond_loop_runs_natively);
+    RUN_TEST(test_budget_jp_loop_runs_natively);
+    RUN_TEST(test_budget_loop_across_segments);
+    RUN_TEST(test_budget_counted_loop_fits);
     RUN_TEST(test_budget_cond_loop_exits_early);
     RUN_TEST(test_budget_uncond_loop_exits);
     RUN_TEST(test_budget_cp_hl_cond_loop_exits);
@@ -1101,4 +1285,13 @@ void register_timing_tests(void)
     RUN_TEST(test_idle_wait_or_a_variant);
     RUN_TEST(test_idle_wait_during_vblank);
     RUN_TEST(test_idle_wait_mid_block);
+
+    printf("\nGeneral polling loop tests:\n");
+    RUN_TEST(test_poll_masked_flag_waits);
+    RUN_TEST(test_poll_masked_flag_set_falls_through);
+    RUN_TEST(test_poll_stat_mode_skips_to_boundary);
+    RUN_TEST(test_poll_stat_boundary_already_passed);
+    RUN_TEST(test_poll_ly_in_vblank);
+    RUN_TEST(test_poll_stat_clamped_by_wake_limit);
+    RUN_TEST(test_poll_loop_carried_register_runs);
 }
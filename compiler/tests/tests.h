@@ -79,6 +79,9 @@ uint32_t get_areg(int reg);
 uint8_t get_mem_byte(uint16_t addr);
 void set_mem_byte(uint16_t addr, uint8_t value);
 
+// Get a long from the jit_runtime context (JIT_CTX_* offset)
+uint32_t get_ctx_long(int offset);
+
 void register_load_tests(void);
 void register_alu_tests(void);
 void register_branch_tests(void);
@@ -112,6 +115,14 @@ void run_block_with_frame_cycles_mem(
 // the native backward-branch and early-exit paths)
 void run_block_with_budget(uint8_t *gb_rom, uint32_t budget);
 
+// The next run_block_with_budget call pre-fills the inline cache of the
+// block's final indirect exit (for inline cache hit tests)
+void set_ic_seed(uint32_t target, uint32_t code, uint8_t bank);
+// ... or the first slot of a final bank linked exit's table
+void set_bank_link_seed(uint8_t bank, uint32_t code);
+// ... and copies block's code to addr (at most two per run)
+void set_code_seed(uint32_t addr, struct code_block *block);
+
 // The next run_block_with_frame_cycles[_mem] call uses this wake limit
 // (consumed and reset to "none"). For fast-forward clamp tests.
 void set_wake_limit(uint32_t limit);
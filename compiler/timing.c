@@ -6,11 +6,16 @@
 #include "emitters.h"
 #include "interop.h"
 #include "flags.h"
+#include "instructions.h"
 #include "timing.h"
+#include "decode.h"
 
 #define LINE_CYCLES  456
 #define FRAME_CYCLES 70224
 
+// helper for reading GB memory during compilation
+#define READ_BYTE(off) (decode_read(ctx, src_address + (off)))
+
 // fast-forward D2 to jit_ctx.wake_limit and exit at next_pc so the wait re-checks
 static void emit_wake_skip(struct code_block *block, int next_pc)
 {
@@ -535,3 +540,464 @@ void compile_hram_idle_wait(
     // fall through: loop exits, block continues at the next instruction
     patch_branch_b(block, skip);
 }
+
+// Polling loops in general: a short loop back to a loop head that reads
+// memory nothing but an interrupt handler changes, recomputes everything
+// it tests from those reads, and writes nothing. Going around again can
+// only give the same result until the next wake deadline, so a taken back
+// edge skips straight to it. Loops reading LY or STAT skip to the next
+// line or mode boundary instead, which is when those change.
+
+#define IDLE_MAX_INSNS 8
+
+// pseudo registers next to GB_REG_*, for the flags the loop tests
+#define IDLE_FLAG_Z (1 << 8)
+#define IDLE_FLAG_C (1 << 9)
+
+// addresses a poll may read: RAM only the CPU writes, IF's vblank bit,
+// and LY/STAT, which follow the beam. returns 0 for anything else, 1 for
+// RAM and 2 for the beam
+static int idle_read_ok(
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t next,
+    uint16_t addr
+) {
+    if ((addr >= 0xc000 && addr < 0xe000) || (addr >= 0xff80 && addr < 0xffff)) {
+        return 1;
+    }
+    if (addr == 0xff44 || addr == 0xff41) {
+        return 2;
+    }
+    // IF sets its other bits for interrupts the wake limit may ignore
+    if (addr == 0xff0f && READ_BYTE(next) == 0xe6
+            && !(READ_BYTE(next + 1) & 0xfe)) {
+        return 1;
+    }
+    return 0;
+}
+
+// which registers and flags an instruction reads and writes. returns 0
+// for anything that can't be in a poll
+static int idle_classify(uint8_t op, uint8_t cb_op, int *reads, int *writes)
+{
+    int src = op & 7, dst = (op >> 3) & 7;
+
+    *reads = 0;
+    *writes = 0;
+
+    if (op == 0xcb) {
+        if ((cb_op & 7) == 6) {
+            return 0;
+        }
+        if ((cb_op & 0xc0) == 0x40) {
+            // bit n, r
+            *reads = 1 << (cb_op & 7);
+            *writes = IDLE_FLAG_Z;
+        } else if ((cb_op & 0xc0) != 0x00 || (cb_op & 0xf8) == 0x30) {
+            // res, set, swap
+            *reads = 1 << (cb_op & 7);
+            *writes = 1 << (cb_op & 7) | ((cb_op & 0xc0) ? 0 : IDLE_FLAG_Z | IDLE_FLAG_C);
+        } else {
+            return 0;
+        }
+        return 1;
+    }
+    if (op >= 0x40 && op < 0x80) {
+        // ld r, r'
+        if (src == 6 || dst == 6) {
+            return 0;
+        }
+        *reads = 1 << src;
+        *writes = 1 << dst;
+        return 1;
+    }
+    if (op >= 0x80 && op < 0xc0) {
+        // 8-bit ALU on A. xor a and sub a don't depend on A
+        if (src == 6) {
+            return 0;
+        }
+        if (op != 0xaf && op != 0x97) {
+            *reads = 1 << GB_REG_A | 1 << src;
+        }
+        if (dst == 1 || dst == 3) {
+            // adc, sbc
+            *reads |= IDLE_FLAG_C;
+        }
+        *writes = (dst == 7 ? 0 : 1 << GB_REG_A) | IDLE_FLAG_Z | IDLE_FLAG_C;
+        return 1;
+    }
+    if ((op & 0xc7) == 0xc6) {
+        // ALU on A with an immediate
+        *reads = 1 << GB_REG_A | (op == 0xce || op == 0xde ? IDLE_FLAG_C : 0);
+        *writes = (op == 0xfe ? 0 : 1 << GB_REG_A) | IDLE_FLAG_Z | IDLE_FLAG_C;
+        return 1;
+    }
+    if ((op & 0xc6) == 0x04 && dst != 6) {
+        // inc r, dec r
+        *reads = 1 << dst;
+        *writes = 1 << dst | IDLE_FLAG_Z;
+        return 1;
+    }
+    if ((op & 0xc7) == 0x06 && dst != 6) {
+        // ld r, u8
+        *writes = 1 << dst;
+        return 1;
+    }
+    switch (op) {
+    case 0x00: // nop
+        return 1;
+    case 0x2f: // cpl
+        *reads = 1 << GB_REG_A;
+        *writes = 1 << GB_REG_A;
+        return 1;
+    case 0x37: // scf
+        *writes = IDLE_FLAG_C;
+        return 1;
+    case 0xf0: // ldh a, (u8)
+    case 0xfa: // ld a, (u16)
+        *writes = 1 << GB_REG_A;
+        return 1;
+    }
+    return 0;
+}
+
+int idle_loop_scan(
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t off,
+    struct idle_loop *loop
+) {
+    // read before written this pass / written anywhere in the loop
+    int live_in = 0, written = 0, reads_memory = 0;
+    int insns;
+
+    loop->head = off;
+    loop->beam = 0;
+    loop->cycles = 0;
+
+    for (insns = 0; insns < IDLE_MAX_INSNS && off < 256; insns++) {
+        uint8_t op = READ_BYTE(off);
+        uint16_t next = off + insn_length[op];
+        int reads, writes;
+
+        if (insns && flush_at[off]) {
+            return 0;
+        }
+
+        if (op == 0x20 || op == 0x28 || op == 0x30 || op == 0x38) {
+            int16_t target = (int16_t) next + (int8_t) READ_BYTE(off + 1);
+            int flag = op & 0x10 ? IDLE_FLAG_C : IDLE_FLAG_Z;
+
+            if (target != loop->head || !reads_memory) {
+                return 0;
+            }
+            if (!(written & flag)) {
+                live_in |= flag;
+            }
+            // nothing carried around from one pass into the next
+            if (live_in & written) {
+                return 0;
+            }
+            loop->jr = off;
+            loop->cycles += instructions[op].cycles_branch;
+            return 1;
+        }
+
+        if (!idle_classify(op, READ_BYTE(off + 1), &reads, &writes)) {
+            return 0;
+        }
+        if (op == 0xf0 || op == 0xfa) {
+            uint16_t addr = op == 0xf0 ? 0xff00 | READ_BYTE(off + 1)
+                    : READ_BYTE(off + 1) | READ_BYTE(off + 2) << 8;
+            int kind = idle_read_ok(ctx, src_address, next, addr);
+
+            if (!kind) {
+                return 0;
+            }
+            loop->beam |= kind == 2;
+            reads_memory = 1;
+        }
+
+        live_in |= reads & ~written;
+        written |= writes;
+        loop->cycles += op == 0xcb ? instructions[0x100 + READ_BYTE(off + 1)].cycles
+                : instructions[op].cycles;
+        off = next;
+    }
+    return 0;
+}
+
+// D1 = CPU cycles from now until LY or STAT can next read differently,
+// given the loop started loop->cycles ago. branches to no_skip if that's
+// already passed
+static size_t emit_beam_distance(struct code_block *block, struct idle_loop *loop)
+{
+    size_t line_end, have[2], no_skip;
+
+    // D0 = beam position at the loop head, 0:LY = divided by line length
+    emit_movea_l_disp_an_an(block, JIT_CTX_FRAME_CYCLES_PTR, REG_68K_A_CTX,
+            REG_68K_A_SCRATCH_1);
+    emit_move_l_ind_an_dn(block, REG_68K_A_SCRATCH_1, REG_68K_D_SCRATCH_0);
+    emit_add_l_dn_dn(block, REG_68K_D_CYCLE_COUNT, REG_68K_D_SCRATCH_0);
+    emit_addi_l_dn(block, REG_68K_D_SCRATCH_0, (uint32_t) -loop->cycles);
+    emit_divu_w_imm_dn(block, LINE_CYCLES, REG_68K_D_SCRATCH_0);
+    emit_move_w_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
+    emit_swap(block, REG_68K_D_SCRATCH_0);
+
+    // D1 = next mode change in this line: OAM scan, transfer, hblank. in
+    // vblank only the line changes
+    emit_cmpi_w_imm_dn(block, 144, REG_68K_D_SCRATCH_1);
+    line_end = block->length;
+    emit_bcc_s(block, 0);
+    emit_move_w_dn(block, REG_68K_D_SCRATCH_1, 80);
+    emit_cmpi_w_imm_dn(block, 80, REG_68K_D_SCRATCH_0);
+    have[0] = block->length;
+    emit_bcs_b(block, 0);
+    emit_move_w_dn(block, REG_68K_D_SCRATCH_1, 252);
+    emit_cmpi_w_imm_dn(block, 252, REG_68K_D_SCRATCH_0);
+    have[1] = block->length;
+    emit_bcs_b(block, 0);
+    patch_branch_b(block, line_end);
+    emit_move_w_dn(block, REG_68K_D_SCRATCH_1, LINE_CYCLES);
+
+    // minus where the loop head was, minus the pass just run
+    patch_branch_b(block, have[0]);
+    patch_branch_b(block, have[1]);
+    emit_sub_w_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
+    emit_subi_w_dn(block, loop->cycles, REG_68K_D_SCRATCH_1);
+    emit_ext_l_dn(block, REG_68K_D_SCRATCH_1);
+    no_skip = block->length;
+    emit_ble_b(block, 0);
+    return no_skip;
+}
+
+void compile_idle_loop(
+    struct code_block *block,
+    struct idle_loop *loop,
+    uint8_t jr_op,
+    uint16_t src_address
+) {
+    uint16_t loop_pc = src_address + loop->head;
+    size_t fall, in_budget, no_skip, in_reach, double_speed;
+    int cond;
+
+    cond = compile_flag_test(block, jr_op & 0x10 ? 0 : 2, jr_op & 0x08);
+    fall = block->length;
+    emit_bcc_opcode_w(block, cond ^ 1, 0);
+
+    // taken: what the back edge would charge, and its budget check
+    emit_add_cycles(block, pending_cycles + 4);
+    emit_cmp_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX,
+            REG_68K_D_CYCLE_COUNT);
+    in_budget = block->length;
+    emit_bcs_b(block, 0);
+    emit_move_l_dn(block, REG_68K_D_NEXT_PC, loop_pc);
+    emit_rts(block);
+    patch_branch_b(block, in_budget);
+
+    if (!loop->beam) {
+        emit_wake_skip(block, loop_pc);
+        patch_branch_w(block, fall);
+        return;
+    }
+
+    // the beam position is in PPU cycles, leave double speed alone
+    emit_tst_b_disp_an(block, JIT_CTX_EFF_DOUBLE_SPEED, REG_68K_A_CTX);
+    double_speed = block->length;
+    emit_bne_b(block, 0);
+
+    no_skip = emit_beam_distance(block, loop);
+    emit_add_l_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_CYCLE_COUNT);
+    emit_cmp_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX,
+            REG_68K_D_CYCLE_COUNT);
+    in_reach = block->length;
+    emit_bcs_b(block, 0);
+    emit_move_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX,
+            REG_68K_D_CYCLE_COUNT);
+    patch_branch_b(block, in_reach);
+#ifdef GB6_PROFILING
+    emit_addq_l_disp_an(block, 1, JIT_CTX_LY_SKIPS, REG_68K_A_CTX);
+#endif
+    emit_move_l_dn(block, REG_68K_D_NEXT_PC, loop_pc);
+    emit_rts(block);
+
+    // a change is already due: go around normally
+    patch_branch_b(block, double_speed);
+    patch_branch_b(block, no_skip);
+    emit_bra_w(block, (int16_t) m68k_offsets[loop->head] - (int16_t) (block->length + 2));
+
+    patch_branch_w(block, fall);
+}
+
+// Counted loops: a loop closed by dec r; jr nz back to its head that only
+// works on registers and reads memory. How often it goes around is in r
+// when it starts, so the head checks once that the whole loop fits under
+// the wake limit. If it does, a copy of the body without the budget check
+// on its back edge runs, else a copy with it. Cycles are still added
+// every pass, reads that depend on D2 see it exact.
+
+#define COUNTED_MAX_INSNS 12
+// either copy of one instruction, and the check with the back edges
+#define COUNTED_INSN_BYTES 64
+#define COUNTED_CHECK_BYTES 96
+
+// which registers an instruction writes. returns 0 for anything that
+// can't be in a counted loop: stores, stack, I/O, branches
+static int counted_classify(uint8_t op, uint8_t cb_op, int *writes)
+{
+    int dst = (op >> 3) & 7, pair = op >> 4;
+
+    *writes = 0;
+
+    if (op == 0xcb) {
+        if ((cb_op & 0xc0) == 0x40) {
+            // bit n, r; bit n, (hl)
+            return 1;
+        }
+        if ((cb_op & 7) == 6) {
+            return 0;
+        }
+        *writes = 1 << (cb_op & 7);
+        return 1;
+    }
+    if (op >= 0x40 && op < 0x80) {
+        // ld r, r'; ld r, (hl). halt sits where ld (hl), (hl) would
+        if (dst == 6) {
+            return 0;
+        }
+        *writes = 1 << dst;
+        return 1;
+    }
+    if (op >= 0x80 && op < 0xc0) {
+        // 8-bit ALU on A, cp writes nothing
+        *writes = dst == 7 ? 0 : 1 << GB_REG_A;
+        return 1;
+    }
+    if ((op & 0xc7) == 0xc6) {
+        *writes = op == 0xfe ? 0 : 1 << GB_REG_A;
+        return 1;
+    }
+    if ((op & 0xc6) == 0x04 || (op & 0xc7) == 0x06) {
+        // inc r, dec r, ld r, u8
+        if (dst == 6) {
+            return 0;
+        }
+        *writes = 1 << dst;
+        return 1;
+    }
+    if ((op & 0xcf) == 0x01 || (op & 0xc7) == 0x03) {
+        // ld rr, u16; inc rr; dec rr
+        if (pair == 3) {
+            return 0;
+        }
+        *writes = 3 << (pair * 2);
+        return 1;
+    }
+    switch (op) {
+    case 0x09: case 0x19: case 0x29: // add hl, rr
+        *writes = 1 << GB_REG_H | 1 << GB_REG_L;
+        return 1;
+    case 0x00: // nop
+    case 0x37: // scf
+    case 0x3f: // ccf
+        return 1;
+    case 0x07: case 0x0f: case 0x17: case 0x1f: // rlca, rrca, rla, rra
+    case 0x27: case 0x2f: // daa, cpl
+    case 0x0a: case 0x1a: // ld a, (bc); ld a, (de)
+        *writes = 1 << GB_REG_A;
+        return 1;
+    case 0x2a: case 0x3a: // ld a, (hl+); ld a, (hl-)
+        *writes = 1 << GB_REG_A | 1 << GB_REG_H | 1 << GB_REG_L;
+        return 1;
+    }
+    return 0;
+}
+
+int counted_loop_scan(
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t off,
+    int room,
+    struct counted_loop *loop
+) {
+    // written by the body before the dec
+    int written = 0, before = 0;
+    uint8_t last = 0;
+    int insns;
+
+    loop->head = off;
+    loop->cycles = 0;
+
+    for (insns = 0; insns < COUNTED_MAX_INSNS && off < 256; insns++) {
+        uint8_t op = READ_BYTE(off);
+        uint16_t next = off + insn_length[op];
+        int writes;
+
+        if (insns && flush_at[off]) {
+            return 0;
+        }
+
+        if (op == 0x20) {
+            int16_t target = (int16_t) next + (int8_t) READ_BYTE(off + 1);
+
+            // dec r with something in front of it, the empty one is
+            // compile_delay_loop's
+            if (target != loop->head || insns < 2 || (last & 0xc7) != 0x05
+                    || ((last >> 3) & 7) == GB_REG_HL) {
+                return 0;
+            }
+            loop->reg = (last >> 3) & 7;
+            // nothing else changes the count
+            if (before & (1 << loop->reg)) {
+                return 0;
+            }
+            if (room < COUNTED_CHECK_BYTES + 2 * (insns + 1) * COUNTED_INSN_BYTES) {
+                return 0;
+            }
+            loop->jr = off;
+            loop->cycles += instructions[op].cycles_branch;
+            return 1;
+        }
+
+        if (!counted_classify(op, READ_BYTE(off + 1), &writes)) {
+            return 0;
+        }
+        before = written;
+        written |= writes;
+        last = op;
+        loop->cycles += op == 0xcb ? instructions[0x100 + READ_BYTE(off + 1)].cycles
+                : instructions[op].cycles;
+        off = next;
+    }
+    return 0;
+}
+
+void compile_counted_check(struct code_block *block, struct counted_loop *loop)
+{
+    // d0 = passes, 0 meaning 256, times one pass. the last jr isn't
+    // taken, so this is 4 over
+    compile_get_gb_reg_d0(block, loop->reg);
+    emit_subq_w_dn(block, REG_68K_D_SCRATCH_0, 1);
+    emit_andi_w_dn(block, REG_68K_D_SCRATCH_0, 0xff);
+    emit_addq_w_dn(block, REG_68K_D_SCRATCH_0, 1);
+    emit_mulu_w_imm_dn(block, loop->cycles, REG_68K_D_SCRATCH_0);
+
+    // d2 + d0 >= wake_limit: the copy that checks
+    emit_add_l_dn_dn(block, REG_68K_D_CYCLE_COUNT, REG_68K_D_SCRATCH_0);
+    emit_cmp_l_disp_an_dn(block, JIT_CTX_WAKE_LIMIT, REG_68K_A_CTX,
+            REG_68K_D_SCRATCH_0);
+    loop->to_checked = block->length;
+    emit_bcc_w(block, 0);
+    loop->fast_head = block->length;
+}
+
+void compile_counted_branch(struct code_block *block, struct counted_loop *loop, int cond)
+{
+    size_t fall = block->length;
+
+    emit_bcc_opcode_b(block, cond ^ 1, 0);
+    emit_add_cycles(block, pending_cycles + 4);
+    emit_bra_w(block, (int16_t) loop->fast_head - (int16_t) (block->length + 2));
+    patch_branch_b(block, fall);
+}
@@ -61,4 +61,70 @@ void compile_delay_loop(
     uint16_t next_pc
 );
 
-#endif
\ No newline at end of file
+// a short loop that polls memory only interrupts and the beam change.
+// see timing.c
+struct idle_loop {
+    // source offsets of the loop head and of the jr cc closing the loop
+    uint16_t head;
+    uint16_t jr;
+    // reads LY or STAT
+    int beam;
+    // one pass with the jr taken
+    int cycles;
+};
+
+// recognizes a poll starting at the loop head off. returns 0 if there is none
+int idle_loop_scan(
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t off,
+    struct idle_loop *loop
+);
+
+// the closing jr: going around again fast-forwards to the wake limit, or
+// to the next line or mode boundary, and exits at the loop head
+void compile_idle_loop(
+    struct code_block *block,
+    struct idle_loop *loop,
+    uint8_t jr_op,
+    uint16_t src_address
+);
+
+// a loop counted down by dec r; jr nz with no stores, calls or I/O.
+// see timing.c
+struct counted_loop {
+    // source offsets of the loop head and of the closing jr nz
+    uint16_t head;
+    uint16_t jr;
+    // the GB_REG_* counted
+    int reg;
+    // one pass with the jr taken
+    int cycles;
+    // the check's branch to the copy that checks, where the copy that
+    // doesn't starts, and where the one that does
+    size_t to_checked;
+    size_t fast_head;
+    size_t checked_head;
+    // the bra.w from the end of the first copy past the second
+    size_t join;
+};
+
+// recognizes a counted loop starting at the loop head off, with room
+// bytes for both copies. returns 0 if there is none
+int counted_loop_scan(
+    struct compile_ctx *ctx,
+    uint16_t src_address,
+    uint16_t off,
+    int room,
+    struct counted_loop *loop
+);
+
+// at the loop head: whether all of the passes left fit in the budget,
+// branching to to_checked if not
+void compile_counted_check(struct code_block *block, struct counted_loop *loop);
+
+// the closing jr of the copy that doesn't check, cond from
+// compile_flag_test
+void compile_counted_branch(struct code_block *block, struct counted_loop *loop, int cond);
+
+#endif
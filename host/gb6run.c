@@ -784,12 +784,17 @@ static void usage(void)
         "  --log-raster         log raster-relevant register writes + summary\n"
         "  --scx-stats          row_scx uniformity summary to stderr\n"
         "  --dirty-stats        row-diff savings summary + clean-row assertion\n"
-        "  --exit-stats         exit budget causes + interrupt deliveries\n"
+        "  --exit-stats         exit budget causes + interrupt deliveries,\n"
+        "                       indirect exit cache hits (refilled in --chain),\n"
+        "                       code bytes saved by the peephole pass,\n"
+        "                       hot bytes per block, blocks reentered,\n"
+        "                       blocks compiled again once hot\n"
         "  --half-res           render 160x72 and dither to 1-bit like 1x mac B&W\n"
         "  --insn-log FILE      log every executed 68k instruction (- for stdout)\n"
         "  --no-stat-ints       drop STAT events from the scheduler (Mac menu toggle)\n"
         "  --dmg                run as original GB (Mac \"Run as GBC\" toggle off)\n"
         "  --chain              chain cached blocks like the Mac dispatcher\n"
+        "  --one-tier           compile every block fully the first time\n"
         "  --trace              per-dispatch state line to stderr\n"
         "  --status             print status bar messages to stderr\n");
 }
@@ -839,6 +844,7 @@ int main(int argc, char *argv[])
             opt_half_res = 1;
         } else if (!strcmp(argv[k], "--exit-stats")) {
             opt_exit_stats = 1;
+            host_exit_stats = 1;
         } else if (!strcmp(argv[k], "--insn-log") && k + 1 < argc) {
             opt_insn_log = argv[++k];
         } else if (!strcmp(argv[k], "--no-stat-ints")) {
@@ -847,6 +853,8 @@ int main(int argc, char *argv[])
             gbc_enabled = 0;
         } else if (!strcmp(argv[k], "--chain")) {
             host_chain = 1;
+        } else if (!strcmp(argv[k], "--one-tier")) {
+            host_one_tier = 1;
         } else if (!strcmp(argv[k], "--trace")) {
             host_trace = 1;
         } else if (!strcmp(argv[k], "--status")) {
@@ -990,6 +998,8 @@ int main(int argc, char *argv[])
             "gb6run: ran %u frames, %u dispatches, %zu serial bytes\n",
             host_frames(), host_dispatches, serial_len);
     if (opt_exit_stats) {
+        u32 ic_hits, ic_misses;
+
         fprintf(stderr,
                 "exit-stats: budget bound by stat=%u vblank=%u tima=%u "
                 "serial=%u wrap=%u\n",
@@ -1001,6 +1011,29 @@ int main(int argc, char *argv[])
                 host_int_delivered[0], host_int_delivered[1],
                 host_int_delivered[2], host_int_delivered[3],
                 host_int_delivered[4]);
+        host_ic_stats(&ic_hits, &ic_misses);
+        fprintf(stderr,
+                "exit-stats: indirect exit cache hits=%u misses=%u\n",
+                ic_hits, ic_misses);
+        fprintf(stderr,
+                "exit-stats: compiled %u code bytes, peephole saved %u\n",
+                host_code_bytes, host_peephole_saved);
+        fprintf(stderr,
+                "exit-stats: %u blocks, hot %u bytes/block, cold %u\n",
+                host_blocks,
+                host_blocks ? (host_code_bytes - host_cold_bytes) / host_blocks : 0,
+                host_cold_bytes);
+        fprintf(stderr,
+                "exit-stats: exits %u bytes, %.1f%% of code\n",
+                host_exit_bytes, host_code_bytes
+                        ? 100.0 * host_exit_bytes / host_code_bytes : 0.0);
+        fprintf(stderr,
+                "exit-stats: %u misses entered existing blocks, "
+                "%u version guards failed\n",
+                host_reentries, host_version_misses);
+        fprintf(stderr,
+                "exit-stats: %u quick blocks got hot and were compiled again\n",
+                host_tier_ups);
     }
 
     if (until_serial) {
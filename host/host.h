@@ -17,16 +17,18 @@ struct dmg;
 #define VECTOR_TABLE_END   0x000400
 #define RETURN_STUB_ADDR   0x000400  // blocks return here; write-traps to host
 #define EXC_STUB_ADDR      0x000410  // all exception vectors point here
-#define CHAIN_STUB_ADDR    0x000420  // dispatcher_return AND patch_helper:
+#define CHAIN_STUB_ADDR    0x000420  // dispatcher_return:
                                      // flags a chainable exit, then rts.
                                      // fast-forward exits (plain rts) skip
                                      // it, so they always sync, as on the Mac
 #define GATE_STUB_BASE     0x000440  // call-gate stubs, 16 bytes apart
+                                     // (room for 12, up to GATE_LINK)
 #define JIT_CTX_ADDR       0x000500  // 68k-side jit_context (A4)
-                                     // (0x60 bytes - full at JIT_CTX_MBC_WRITE)
-#define FRAME_SHADOW_ADDR  0x000560  // big-endian copy of dmg->frame_cycles
+                                     // (0x70 bytes - ends at JIT_CTX_IC_MISSES)
+#define FRAME_SHADOW_ADDR  0x000580  // big-endian copy of dmg->frame_cycles
 #define READ_TABLE_ADDR    0x000600  // 68k-side page tables (A5/A6),
 #define WRITE_TABLE_ADDR   0x000a00  // 16 4KB pages = 64 bytes each
+#define RET_STACK_ADDR     0x000e00  // return shadow stack ring (RET_STACK_SIZE)
 #define STACK_TOP          0x003000  // 68k stack, grows down
 #define DMG_ADDR           0x008000  // struct dmg
 #define WRAM_ADDR          0x00c000  // dmg->wram, WRAM_SIZE
@@ -51,6 +53,8 @@ enum {
     GATE_EXC,
     GATE_CHAIN,
     GATE_MBC_WRITE,
+    GATE_IC_MISS,
+    GATE_LINK,      // patch_helper: same as GATE_CHAIN, plus the call site
 };
 
 extern u8 m68k_mem[M68K_MEM_SIZE];
@@ -63,13 +67,24 @@ void host_gate(unsigned int index, unsigned int sp);
 void host_jit_init(struct dmg *dmg);
 int host_jit_run(void);
 u32 host_frames(void);
+void host_ic_stats(u32 *hits, u32 *misses);
 void host_dump_state(FILE *fp);
 extern int host_chain;
+extern int host_exit_stats;
+extern int host_one_tier;
 extern int host_trace;
 extern FILE *host_insn_log;
 extern u32 host_dispatches;
 extern u32 host_int_delivered[5];
 extern u32 host_exit_cause[];
+extern u32 host_blocks;
+extern u32 host_code_bytes;
+extern u32 host_peephole_saved;
+extern u32 host_cold_bytes;
+extern u32 host_exit_bytes;
+extern u32 host_reentries;
+extern u32 host_version_misses;
+extern u32 host_tier_ups;
 
 // gb6run.c - sink for captured serial bytes ($ff01/$ff02 writes)
 void host_serial_byte(u8 byte);
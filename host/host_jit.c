@@ -34,6 +34,9 @@
 #include "host.h"
 
 int host_chain;
+int host_exit_stats;
+// compile everything at TIER_FULL straight away
+int host_one_tier;
 int host_trace;
 FILE *host_insn_log;
 u32 host_dispatches;
@@ -43,6 +46,21 @@ u32 host_dispatches;
 u32 host_int_delivered[5];
 u32 host_exit_cause[EV_COUNT];
 
+// blocks and code bytes compiled, how many the peephole pass took out
+// of them and how many went to cold tails
+u32 host_blocks;
+u32 host_code_bytes;
+u32 host_peephole_saved;
+u32 host_cold_bytes;
+// spent on exits, see emit_block_exit
+u32 host_exit_bytes;
+// misses served by a reentry point of a block already compiled
+u32 host_reentries;
+// cached blocks whose version guard failed
+u32 host_version_misses;
+// quick blocks compiled again once hot
+u32 host_tier_ups;
+
 static struct dmg *dmg;
 static struct compile_ctx compile_ctx;
 
@@ -52,6 +70,10 @@ static int block_returned;
 // only exits the Mac dispatcher may chain. fast-forward exits (HALT, LY
 // waits) leave via plain rts and must sync so frame_cycles advances
 static int exit_chainable;
+// inline cache words of the indirect exit that missed (GATE_IC_MISS), or 0
+static u32 ic_site;
+// link table after the exit that called patch_helper (GATE_LINK), or 0
+static u32 link_site;
 static u8 serial_sb;
 
 #define PC_HISTORY_SIZE 16
@@ -304,6 +326,17 @@ void host_gate(unsigned int index, unsigned int sp)
     case GATE_CHAIN:
         exit_chainable = 1;
         break;
+    case GATE_LINK:
+        // patch_helper: (sp) is the exit's rts. for a banked target the
+        // link table follows it, filled in host_jit_run's chain path
+        link_site = m68_r32(sp) + 2;
+        exit_chainable = 1;
+        break;
+    case GATE_IC_MISS:
+        // dispatcher_ic: the refill happens in host_jit_run's chain path
+        ic_site = m68k_get_reg(NULL, M68K_REG_A1);
+        exit_chainable = 1;
+        break;
     case GATE_EXC:
         host_fatal("68k exception (vector fetch)");
         break;
@@ -360,6 +393,13 @@ static int emit_helpers(void)
     return 1;
 }
 
+// entries hold landings inside compiled blocks, so they die with the arena
+static void reset_ret_stack(void)
+{
+    memset(m68k_mem + RET_STACK_ADDR, 0xff, RET_STACK_SIZE);
+    ctx_w32(JIT_CTX_RET_SP, RET_STACK_ADDR);
+}
+
 // port of jit_clear_all_blocks
 static int clear_all_blocks(void)
 {
@@ -372,6 +412,8 @@ static int clear_all_blocks(void)
     if (!cache_init()) {
         return 0;
     }
+    block_links_reset();
+    reset_ret_stack();
 
     for (k = 0; k < 8; k++) {
         if (dmg->saved_write_page[k]) {
@@ -387,18 +429,52 @@ static int clear_all_blocks(void)
     return 1;
 }
 
-// port of jit_run's compile path; fatal on unrecoverable failure
-static void *compile_checked(u32 pc)
+// port of jit_invalidate_block, no CPU cache to flush
+void jit_invalidate_block(void *code)
 {
+    block_unlink_entry(code);
+}
+
+// the VERSION_* facts that hold now
+static u8 host_version(void)
+{
+    return jit_ctx.stack_in_ram ? VERSION_STACK_RAM : 0;
+}
+
+// port of jit_run's compile path; fatal on unrecoverable failure. stale
+// is the cached version whose guard failed, its version exit gets linked
+// to the new block instead of caching that. hot is the cached quick block
+// that used up its entries, the new block replaces it
+static void *compile_checked(
+    u32 pc,
+    struct code_block *stale,
+    struct code_block *hot
+) {
     struct code_block *block;
+    void *code;
 
     compile_ctx.current_bank = jit_ctx.current_rom_bank;
+    if (stale) {
+        host_version_misses++;
+    } else if (hot) {
+        host_tier_ups++;
+    } else {
+        code = block_reentry(&compile_ctx, pc);
+        if (code) {
+            host_reentries++;
+            return code;
+        }
+    }
+    compile_ctx.version = host_version();
+    compile_ctx.tier = host_one_tier || stale || hot ? TIER_FULL : TIER_QUICK;
     block = compile_block(pc, &compile_ctx);
 
     if (!block) {
         if (!clear_all_blocks()) {
             host_fatal("cache alloc fail after arena reset");
         }
+        stale = NULL;
+        hot = NULL;
         block = compile_block(pc, &compile_ctx);
         if (!block) {
             host_fatal("block alloc fail after arena reset");
@@ -412,7 +488,18 @@ static void *compile_checked(u32 pc)
         host_fatal("unsupported opcode");
     }
 
-    if (!cache_store(pc, jit_ctx.current_rom_bank, block->code)) {
+    host_blocks++;
+    host_code_bytes += block->length;
+    host_peephole_saved += block->peephole_saved;
+    host_cold_bytes += block->cold_bytes;
+    host_exit_bytes += block->exit_bytes;
+
+    if (hot) {
+        block_retire(hot, (u32) ((u8 *) block->code - m68k_mem));
+    }
+    if (stale) {
+        block_version_link(stale, (u32) ((u8 *) block->code - m68k_mem));
+    } else if (!cache_store(pc, jit_ctx.current_rom_bank, block->code)) {
         if (!clear_all_blocks()
                 || !cache_store(pc, jit_ctx.current_rom_bank, block->code)) {
             host_fatal("bank cache array alloc fail");
@@ -459,6 +546,8 @@ static void execute_block(void *code)
 
     block_returned = 0;
     exit_chainable = 0;
+    ic_site = 0;
+    link_site = 0;
     while (!block_returned) {
         m68k_execute(8000000);
         if (++guard > 32) {
@@ -561,9 +650,14 @@ void host_jit_init(struct dmg *d)
 
     compile_ctx.dmg = dmg;
     compile_ctx.read = dmg_read;
+    compile_ctx.read_bank = dmg_read_rom_bank;
     compile_ctx.cache_store = cache_store;
-    compile_ctx.alloc = arena_alloc;
+    compile_ctx.cache_lookup = cache_lookup;
+    compile_ctx.reserve = arena_reserve;
+    compile_ctx.commit = arena_commit;
     compile_ctx.current_bank = 1;
+    compile_ctx.ic_counters = host_exit_stats;
+    compile_ctx.hot_entries = TIER_HOT_ENTRIES;
     // 68k-space addresses: emitted stack fast paths embed these as
     // absolute A3 values, so they must be Musashi addresses, not host
     // pointers
@@ -614,6 +708,8 @@ void host_jit_init(struct dmg *d)
     write_trap_stub(gate_stub(GATE_EI_DI), GATE_EI_DI, 0);
     write_trap_stub(gate_stub(GATE_STOP), GATE_STOP, 0);
     write_trap_stub(gate_stub(GATE_MBC_WRITE), GATE_MBC_WRITE, 0);
+    write_trap_stub(gate_stub(GATE_IC_MISS), GATE_IC_MISS, 0);
+    write_trap_stub(gate_stub(GATE_LINK), GATE_LINK, 0);
 
     // host-side jit_ctx, mirroring jit_init
     memset(&jit_ctx, 0, sizeof jit_ctx);
@@ -641,13 +737,17 @@ void host_jit_init(struct dmg *d)
     ctx_w32(JIT_CTX_STOP_FUNC, gate_stub(GATE_STOP));
     ctx_w32(JIT_CTX_MBC_WRITE, gate_stub(GATE_MBC_WRITE));
     ctx_w32(JIT_CTX_DISPATCH, CHAIN_STUB_ADDR);
-    ctx_w32(JIT_CTX_PATCH_HELPER, CHAIN_STUB_ADDR);
+    ctx_w32(JIT_CTX_PATCH_HELPER, gate_stub(GATE_LINK));
+    ctx_w32(JIT_CTX_DISPATCH_IC, gate_stub(GATE_IC_MISS));
+    ctx_w32(JIT_CTX_IC_HITS, 0);
+    ctx_w32(JIT_CTX_IC_MISSES, 0);
     ctx_w32(JIT_CTX_FRAME_CYCLES_PTR, FRAME_SHADOW_ADDR);
     ctx_w32(JIT_CTX_READ_CYCLES, 0);
     jit_ctx.read_cycles = 0;
     ctx_w16(JIT_CTX_DAA_STATE, 0);
     ctx_w16(JIT_CTX_GB_SP, jit_ctx.gb_sp);
     ctx_w32(JIT_CTX_STACK_IN_RAM, jit_ctx.stack_in_ram);
+    reset_ret_stack();
     m68k_mem[JIT_CTX_ADDR + 16] = 0; // trace_enabled (dispatcher asm only)
 
     dmg->rom_bank_switch_hook = rom_bank_hook;
@@ -725,6 +825,48 @@ void host_dump_state(FILE *fp)
             jit_ctx.current_rom_bank, host_frames());
 }
 
+// port of dispatcher_ic's write-back: remember a found ROM target in the
+// inline cache of the indirect exit that missed
+static void ic_refill(u32 d3, void *code)
+{
+    if (!ic_site || d3 >= 0x8000) {
+        return;
+    }
+    m68_w32(ic_site + IC_TARGET, d3);
+    m68_w32(ic_site + IC_CODE, (u32) ((u8 *) code - m68k_mem));
+    m68k_mem[ic_site + IC_BANK] = jit_ctx.current_rom_bank;
+}
+
+// port of patch_helper's banked path: fill the first empty link slot with
+// the current bank and record it in the target's incoming links. bank 0
+// exits are never patched here, they just chain
+static void bank_link_fill(u32 d3, void *code)
+{
+    int k;
+    u32 slot;
+
+    if (!link_site || d3 < 0x4000 || d3 >= 0x8000) {
+        return;
+    }
+    for (k = 0; k < BANK_LINK_SLOTS; k++) {
+        slot = link_site + k * BANK_LINK_SIZE;
+        if (!m68_r16(slot + BANK_LINK_KEY)) {
+            // ROM never changes, so the slot is filled even when the link
+            // goes untracked (link_log.overflowed)
+            block_add_link(code, m68k_mem + slot);
+            m68_w32(slot + BANK_LINK_CODE, (u32) ((u8 *) code - m68k_mem));
+            m68_w16(slot + BANK_LINK_KEY, 0x100 | jit_ctx.current_rom_bank);
+            return;
+        }
+    }
+}
+
+void host_ic_stats(u32 *hits, u32 *misses)
+{
+    *hits = m68_r32(JIT_CTX_ADDR + JIT_CTX_IC_HITS);
+    *misses = m68_r32(JIT_CTX_ADDR + JIT_CTX_IC_MISSES);
+}
+
 // one dispatch: look up or compile the block at D3, execute it (chaining
 // through cached successors in --chain mode), then sync hardware and
 // deliver interrupts. returns 0 when emulation has stopped
@@ -740,7 +882,14 @@ int host_jit_run(void)
     d3 = m68k_get_reg(NULL, M68K_REG_D3);
     code = cache_lookup(d3, jit_ctx.current_rom_bank);
     if (!code) {
-        code = compile_checked(d3);
+        code = compile_checked(d3, NULL, NULL);
+    } else if (!block_version_holds(code, host_version())) {
+        u32 linked = block_version_target(code);
+
+        code = linked ? m68k_mem + linked
+                      : compile_checked(d3, block_from_code(code), NULL);
+    } else if (block_is_hot(code)) {
+        code = compile_checked(d3, NULL, block_from_code(code));
     }
 
 enter:
@@ -783,6 +932,8 @@ enter:
     if (host_chain && exit_chainable && d2 < jit_ctx.wake_limit) {
         code = cache_lookup(d3, jit_ctx.current_rom_bank);
         if (code) {
+            ic_refill(d3, code);
+            bank_link_fill(d3, code);
             goto enter;
         }
     }
@@ -109,6 +109,20 @@ void *arena_alloc(size_t size)
     return p;
 }
 
+void *arena_reserve(size_t min, size_t *size)
+{
+    if (arena_used + min > arena_capacity) {
+        return NULL;
+    }
+    *size = (arena_capacity - arena_used) & ~(size_t) 7;
+    return arena_base + arena_used;
+}
+
+void arena_commit(void *ptr, size_t used)
+{
+    arena_used = (u8 *) ptr - arena_base + ((used + 7) & ~(size_t) 7);
+}
+
 void arena_reset(void)
 {
     arena_used = 0;
@@ -690,6 +690,17 @@ u8 dmg_read(void *_dmg, u16 address)
     return val;
 }
 
+u8 dmg_read_rom_bank(void *_dmg, u8 bank, u16 address)
+{
+    struct dmg *dmg = (struct dmg *) _dmg;
+    u32 offset = (u32) bank * 0x4000 + (address - 0x4000);
+
+    if (offset >= dmg->rom->length) {
+        return 0xff;
+    }
+    return dmg->rom->data[offset];
+}
+
 void dmg_write_slow(struct dmg *dmg, u16 address, u8 data)
 {
     // ROM region writes go to MBC for bank switching
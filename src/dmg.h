@@ -135,6 +135,10 @@ void dmg_set_button(struct dmg *dmg, int field, int button, int pressed);
 u8 dmg_read(void *dmg, u16 address);
 void dmg_write(void *dmg, u16 address, u8 data);
 u16 dmg_read16(void *_dmg, u16 address);
+
+// a byte of ROM bank `bank` at 0x4000-0x7fff whichever bank is mapped, for
+// the compiler to follow far calls. 0xff past the end of the ROM
+u8 dmg_read_rom_bank(void *dmg, u8 bank, u16 address);
 void dmg_write16(void *_dmg, u16 address, u16 data);
 
 u8 dmg_read_slow(struct dmg *dmg, u16 address);
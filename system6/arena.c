@@ -51,21 +51,22 @@ void *arena_alloc(size_t size)
     return p;
 }
 
-// give back the tail of the most recent allocation. no-op if something
-// else was allocated after it (e.g. a bank cache page mid-compile)
-void arena_shrink(void *ptr, size_t old_size, size_t new_size)
+// the block compiler writes straight into the free tail and only then
+// knows how much it used
+void *arena_reserve(size_t min, size_t *size)
 {
-    old_size = (old_size + 3) & ~3;
-    new_size = (new_size + 3) & ~3;
-
-    if ((unsigned char *) ptr + old_size != arena_ptr) {
-        return;
-    }
-    if (new_size >= old_size) {
-        return;
+    if (arena_ptr + min > arena_end) {
+        return NULL;
     }
 
-    arena_ptr = (unsigned char *) ptr + new_size;
+    *size = (arena_end - arena_ptr) & ~3;
+    return arena_ptr;
+}
+
+void arena_commit(void *ptr, size_t used)
+{
+    used = (used + 3) & ~3;
+    arena_ptr = (unsigned char *) ptr + used;
 }
 
 void arena_reset(void)
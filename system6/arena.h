@@ -10,9 +10,13 @@ int arena_init(void);
 // bump-allocate from the arena, returns NULL if no space
 void *arena_alloc(size_t size);
 
-// shrink the most recent allocation to new_size, no-op if anything was
-// allocated after it
-void arena_shrink(void *ptr, size_t old_size, size_t new_size);
+// start a streamed allocation: returns all the free space if there is at
+// least min bytes, with its size in *size, NULL otherwise. nothing else
+// may be allocated until arena_commit
+void *arena_reserve(size_t min, size_t *size);
+
+// end a streamed allocation, keeping the first used bytes of it
+void arena_commit(void *ptr, size_t used);
 
 // reset arena pointer to base for instant "free all"
 void arena_reset(void);
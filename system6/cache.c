@@ -5,6 +5,7 @@
 #include "types.h"
 #include "cache.h"
 #include "arena.h"
+#include "jit.h"
 
 static void **bank0_cache;
 static void **upper_cache;
@@ -171,6 +172,13 @@ void cache_invalidate_upper_page(u8 page)
         }
     }
 
+    // exits patched straight into these blocks would keep running the old
+    // code, undo them first
+    for (k = first << 8; k < (idx + 1) << 8; k++) {
+        if (upper_cache[k]) {
+            jit_invalidate_block(upper_cache[k]);
+        }
+    }
     memset(&upper_cache[first << 8], 0,
             ((idx - first + 1) << 8) * sizeof(void *));
     for (k = first; k <= idx; k++) {
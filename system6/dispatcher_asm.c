@@ -2,7 +2,7 @@
 #include "dispatcher_asm.h"
 
 // Offset of the FlushCodeCache trap in patch_helper code
-#define CACHEFLUSH_OFFSET 102
+#define CACHEFLUSH_OFFSET 138
 
 // compiled blocks JMP here instead of RTS. This routine:
 // 1. Checks if accumulated cycles in D2 >= jit_ctx.wake_limit, if so, RTS to C
@@ -78,15 +78,82 @@ static void dispatcher_code_asm(void)
     );
 }
 
+// dispatcher_ic: indirect exits (jp (hl), ret) JMP here when their inline
+// cache misses, see compile_indirect_exit. The budget was already checked.
+// On entry: D3 = target GB PC, A1 = the site's cache words
+//
+// Same lookup as the dispatcher, but a ROM target that is found gets
+// written back into the site (target, code, current bank) before the JMP.
+// Upper region targets go to the plain dispatcher and are never cached.
+static void dispatcher_ic_code_asm(void)
+{
+    asm volatile(
+        "\t"
+        "tst.b 16(%%a4)\n\t"       // trace_enabled
+        "bne.s .Ldic_exit\n\t"
+
+        "cmpi.w #0x4000, %%d3\n\t"
+        "bcs.s .Ldic_bank0\n\t"
+
+        "cmpi.w #0x8000, %%d3\n\t"
+        "bcs.s .Ldic_banked\n\t"
+
+        "movea.l 32(%%a4), %%a0\n\t" // dispatcher_return
+        "jmp (%%a0)\n\t"
+        "\n"
+
+    ".Ldic_bank0:\n\t"
+        "movea.l 20(%%a4), %%a0\n\t" // bank0_cache
+        "moveq #0, %%d0\n\t"
+        "move.w %%d3, %%d0\n\t"
+        "lsl.l #2, %%d0\n\t"
+        "movea.l (%%a0,%%d0.l), %%a0\n\t"
+        "bra.s .Ldic_check_found\n\t"
+        "\n"
+
+    ".Ldic_banked:\n\t"
+        "movea.l 24(%%a4), %%a0\n\t" // banked_cache
+        "moveq #0, %%d0\n\t"
+        "move.b 17(%%a4), %%d0\n\t" // current_rom_bank
+        "lsl.l #2, %%d0\n\t"
+        "movea.l (%%a0,%%d0.l), %%a0\n\t"
+        "cmpa.w #0, %%a0\n\t"
+        "beq.s .Ldic_exit\n\t"
+        "moveq #0, %%d0\n\t"
+        "move.w %%d3, %%d0\n\t"
+        "subi.w #0x4000, %%d0\n\t"
+        "lsl.l #2, %%d0\n\t"
+        "movea.l (%%a0,%%d0.l), %%a0\n\t"
+        "\n"
+
+    ".Ldic_check_found:\n\t"
+        "cmpa.w #0, %%a0\n\t"
+        "beq.s .Ldic_exit\n\t"
+        "move.l %%d3, (%%a1)\n\t"        // IC_TARGET
+        "move.l %%a0, 4(%%a1)\n\t"       // IC_CODE
+        "move.b 17(%%a4), 8(%%a1)\n\t"   // IC_BANK
+        "jmp (%%a0)\n\t"
+        "\n"
+
+    ".Ldic_exit:\n\t"
+        "rts\n\t"
+
+        ::: "d0", "a0", "cc", "memory"
+    );
+}
+
 // patch_helper: called via JSR from patchable block exits
 // On entry: return address on stack points to after the JSR (the exit: rts)
 // D3 = target GB PC
 // A4 = context pointer
 //
 // This routine:
-// 1. Checks if target is in banked region (skip patching if so)
+// 1. Never patches upper region targets outside WRAM
 // 2. Looks up target in cache
-// 3. If found: patches the JSR into JMP.L and jumps to target
+// 3. If found: patches the JSR into JMP.L (bank 0 and WRAM targets) or
+//    fills a slot of the exit's bank link table (banked targets, see
+//    emit_bank_linked_exit), records the link (block_add_link) and jumps
+//    to target
 // 4. If not found: jumps to exit which RTSs to C
 static void patch_helper_code_asm(void)
 {
@@ -98,26 +165,15 @@ static void patch_helper_code_asm(void)
         "cmpi.w #0x4000, %%d3\n\t"
         "bcs.s .Lpatch_bank0\n\t"
 
-        // never patch direct jumps into upper region blocks: WRAM/HRAM
-        // code can be rewritten by the game and the block invalidated,
-        // and a patched JMP.L would keep running the stale code
+        // upper region: only WRAM blocks are linked to, and only while the
+        // link log has room. cache_invalidate_upper_page undoes the links
+        // when the game rewrites their code; HRAM writes are never caught
         "cmpi.w #0x8000, %%d3\n\t"
-        "bcc.s .Lpatch_no_patch\n\t"
+        "bcc.s .Lpatch_upper\n\t"
 
         // .banked: - lookup banked_cache[current_bank][d3 - 0x4000]
-
-        // TODO: this scenario can occur, but i think it's saved by the fact that
-        // 'jp hl' always goes through the dispatcher, and bank0 code with a
-        // hardcoded jp/call $5xxx where the intended target varies by bank is very rare:
-
-        // 1. block A is at address 0x1000 (bank 0, always visible)
-        // 2. block A has a patchable exit to address 0x5000 (banked region)
-        // 3. with bank 1 active, block A runs, patch_helper finds bank 1's code
-        //      at 0x5000, patches block A with JMP.L bank1_code
-        // 4. later, bank 2 is switched in
-        // 5. some other code jumps to 0x1000 - block A is found in bank0_cache and runs
-        // 6. block A's patched JMP goes directly to bank 1's code
-        // "bra.s .Lpatch_no_patch\n\t" // cacheflush_offset is 66 if using this and commenting out below
+        // and link it through the exit's bank table, never a JMP.L: the
+        // exit must keep checking which bank is mapped when it runs
         "movea.l 24(%%a4), %%a0\n\t"         // banked_cache
         "moveq #0, %%d0\n\t"
         "move.b 17(%%a4), %%d0\n\t"          // current_rom_bank
@@ -130,7 +186,7 @@ static void patch_helper_code_asm(void)
         "subi.w #0x4000, %%d0\n\t"
         "lsl.l #2, %%d0\n\t"
         "movea.l (%%a0,%%d0.l), %%a0\n\t"
-        "bra.s .Lpatch_check_found\n\t"
+        "bra.s .Lpatch_link_bank\n\t"
         "\n"
 
     ".Lpatch_bank0:\n\t"
@@ -143,20 +199,33 @@ static void patch_helper_code_asm(void)
         "\n"
 
     ".Lpatch_upper:\n\t"
+        "cmpi.w #0xc000, %%d3\n\t"
+        "bcs.s .Lpatch_no_patch\n\t"
+        "cmpi.w #0xe000, %%d3\n\t"
+        "bcc.s .Lpatch_no_patch\n\t"
         "movea.l 28(%%a4), %%a0\n\t"         // upper_cache
         "moveq #0, %%d0\n\t"
         "move.w %%d3, %%d0\n\t"
         "subi.w #0x8000, %%d0\n\t"
         "lsl.l #2, %%d0\n\t"
         "movea.l (%%a0,%%d0.l), %%a0\n\t"
+        "cmpa.w #0, %%a0\n\t"
+        "beq.s .Lpatch_no_patch\n\t"
+        "lea -6(%%a1), %%a1\n\t"
+        "bsr.w .Lpatch_record\n\t"
+        "tst.l %%d0\n\t"
+        "beq.s .Lpatch_link_full\n\t"       // untracked, can't be undone
+        "bra.s .Lpatch_do\n\t"
         "\n"
 
     ".Lpatch_check_found:\n\t"
         "cmpa.w #0, %%a0\n\t"
         "beq.s .Lpatch_no_patch\n\t"
-
-        // .do_patch:
         "lea -6(%%a1), %%a1\n\t"
+        // ROM never changes: link even when the record is lost
+        "bsr.w .Lpatch_record\n\t"
+
+    ".Lpatch_do:\n\t"
         "move.w #0x4ef9, (%%a1)+\n\t"        // JMP.L opcode
         "move.l %%a0, (%%a1)\n\t"
 
@@ -176,8 +245,69 @@ static void patch_helper_code_asm(void)
 
     ".Lpatch_no_patch:\n\t"
         "jmp (%%a1)\n\t"
+        "\n"
+
+        // banked target: A1 points at the exit's rts, the link table
+        // (BANK_LINK_SLOTS = 2 entries of key.w, code.l) follows it.
+        // fill the first empty slot with 0x0100 | bank; with both slots
+        // taken, just jump. only data is written, so no cache flush
+    ".Lpatch_link_bank:\n\t"
+        "cmpa.w #0, %%a0\n\t"
+        "beq.s .Lpatch_no_patch\n\t"
+        "addq.l #2, %%a1\n\t"
+        "tst.w (%%a1)\n\t"
+        "beq.s .Lpatch_link_slot\n\t"
+        "addq.l #6, %%a1\n\t"
+        "tst.w (%%a1)\n\t"
+        "bne.s .Lpatch_link_full\n\t"
+    ".Lpatch_link_slot:\n\t"
+        "bsr.w .Lpatch_record\n\t"
+        "move.l %%a0, 2(%%a1)\n\t"      // BANK_LINK_CODE
+        "move.b 17(%%a4), 1(%%a1)\n\t"  // key: current_rom_bank ...
+        "move.b #1, (%%a1)\n\t"         // ... | 0x0100, last so it's never
+                                         // valid before the code pointer
+    ".Lpatch_link_full:\n\t"
+        "jmp (%%a0)\n\t"
+        "\n"
+
+        // record site A1 as linked to A0 (block_add_link): in the target's
+        // header when it has one with room, otherwise in the link log. D0
+        // is 0 when the log is full too and the link goes untracked
+    ".Lpatch_record:\n\t"
+        "cmpi.l #0x47424c4b, -4(%%a0)\n\t"  // BLOCK_MAGIC
+        "bne.s .Lpatch_record_log\n\t"
+        "move.l -8(%%a0), %%d0\n\t"         // BLOCK_LINK_COUNT_AT
+        "moveq #6, %%d1\n\t"                // BLOCK_LINKS
+        "cmp.l %%d1, %%d0\n\t"
+        "bcc.s .Lpatch_record_log\n\t"
+        "addq.l #1, -8(%%a0)\n\t"
+        "lsl.l #2, %%d0\n\t"
+        "move.l %%a1, %%d1\n\t"
+        "sub.l %%a0, %%d1\n\t"
+        "move.l %%d1, -32(%%a0,%%d0.l)\n\t" // BLOCK_LINKS_AT
+        "moveq #1, %%d0\n\t"
+        "rts\n\t"
+    ".Lpatch_record_log:\n\t"
+        "move.l %%a2, -(%%sp)\n\t"
+        "movea.l 112(%%a4), %%a2\n\t"       // link_log
+        "move.l (%%a2), %%d0\n\t"           // LINK_LOG_COUNT
+        "cmpi.l #512, %%d0\n\t"             // LINK_LOG_SIZE
+        "bcc.s .Lpatch_record_lost\n\t"
+        "addq.l #1, (%%a2)\n\t"
+        "lsl.l #3, %%d0\n\t"
+        "move.l %%a1, 8(%%a2,%%d0.l)\n\t"   // LINK_LOG_LINKS: site ...
+        "move.l %%a0, 12(%%a2,%%d0.l)\n\t"  // ... and target
+        "moveq #1, %%d0\n\t"
+        "movea.l (%%sp)+, %%a2\n\t"
+        "rts\n\t"
+    ".Lpatch_record_lost:\n\t"
+        "moveq #1, %%d0\n\t"
+        "move.l %%d0, 4(%%a2)\n\t"          // LINK_LOG_OVERFLOWED
+        "moveq #0, %%d0\n\t"
+        "movea.l (%%sp)+, %%a2\n\t"
+        "rts\n\t"
 
-        ::: "d0", "a0", "a1", "cc", "memory"
+        ::: "d0", "d1", "a0", "a1", "cc", "memory"
     );
 }
 
@@ -186,6 +316,11 @@ void *get_dispatcher_code(void)
     return dispatcher_code_asm;
 }
 
+void *get_dispatcher_ic_code(void)
+{
+    return dispatcher_ic_code_asm;
+}
+
 void *get_patch_helper_code(void)
 {
     unsigned char *code = (unsigned char *)patch_helper_code_asm;
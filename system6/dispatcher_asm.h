@@ -2,6 +2,7 @@
 #define _DISPATCHER_ASM_H
 
 void *get_dispatcher_code(void);
+void *get_dispatcher_ic_code(void);
 void *get_patch_helper_code(void);
 
 #endif
\ No newline at end of file
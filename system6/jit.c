@@ -82,6 +82,9 @@ int jit_halted = 0;
 // compile-time context for address calculation
 static struct compile_ctx compile_ctx;
 
+// return shadow stack ring, aligned to RET_STACK_SIZE inside the buffer
+static u8 ret_stack_buf[RET_STACK_SIZE * 2];
+
 // this is a huge context switch and my main goal is to do this as little as
 // possible. currently it will not return to C when jumping to another compiled 
 // block. it still does to check and handle interrupts, though. 
@@ -137,6 +140,15 @@ static int jit_emit_helpers(void)
   return 1;
 }
 
+// Empty the return shadow stack, its landings die with the arena
+static void reset_ret_stack(void)
+{
+  unsigned long ring = ((unsigned long) ret_stack_buf + RET_STACK_SIZE - 1)
+      & ~(unsigned long) (RET_STACK_SIZE - 1);
+  memset((void *) ring, 0xff, RET_STACK_SIZE);
+  jit_ctx.ret_stack_top = (void *) ring;
+}
+
 // Sync jit_ctx cache pointers from lru.c, need to do this when the arena
 // is cleared and the cache is reinitialized with new arrays
 static void sync_cache_pointers(void)
@@ -172,12 +184,19 @@ void jit_init(struct dmg *dmg)
 
   compile_ctx.dmg = dmg;
   compile_ctx.read = dmg_read;
+  compile_ctx.read_bank = dmg_read_rom_bank;
   compile_ctx.cache_store = cache_store;
-  compile_ctx.alloc = arena_alloc;
+  compile_ctx.cache_lookup = cache_lookup;
+  compile_ctx.reserve = arena_reserve;
+  compile_ctx.commit = arena_commit;
   compile_ctx.wram_base = dmg->wram;
   compile_ctx.hram_base = dmg->hram;
   cache_set_hram(dmg->hram);
   compile_ctx.joyp_ptr = &dmg->joyp;
+  compile_ctx.hot_entries = TIER_HOT_ENTRIES;
+#ifdef GB6_PROFILING
+  compile_ctx.ic_counters = 1;
+#endif
 
   // ROM-bank select range for the compiler's same-bank write skip (MBC1 and 3 only)
   compile_ctx.bank_reg_lo = 0;
@@ -234,7 +253,9 @@ void jit_init(struct dmg *dmg)
   jit_ctx.stop_func = jit_handle_stop;
   jit_ctx.current_rom_bank = 1; // bank 1 is default after boot
   jit_ctx.dispatcher_return = get_dispatcher_code();
+  jit_ctx.dispatcher_ic = get_dispatcher_ic_code();
   jit_ctx.patch_helper = get_patch_helper_code();
+  jit_ctx.link_log = &link_log;
   jit_ctx.frame_cycles_ptr = &dmg->frame_cycles;
   jit_ctx.gb_sp = 0xfffe;  // initial SP (HRAM)
   jit_ctx.stack_in_ram = 1;   // fast mode - A3 points to native HRAM
@@ -243,7 +264,10 @@ void jit_init(struct dmg *dmg)
   jit_ctx.wake_limit = CYCLES_PER_FRAME;
   jit_ctx.skipped_cycles = 0;
   jit_ctx.ly_clamp_skips = 0;
+  jit_ctx.ic_hits = 0;
+  jit_ctx.ic_misses = 0;
   sync_cache_pointers();
+  reset_ret_stack();
 
   jit_regs.d2 = 0;
   jit_ctx.read_cycles = 0;
@@ -278,6 +302,8 @@ int jit_clear_all_blocks(void)
     return 0;
   }
   sync_cache_pointers();
+  block_links_reset();
+  reset_ret_stack();
 
   // every block is gone, so restore fast writes for pages that were
   // unmapped because they held compiled code
@@ -291,6 +317,23 @@ int jit_clear_all_blocks(void)
   return 1;
 }
 
+// drop a single cache entry: exits patched to it (to the whole block, for
+// a block start) go back through patch_helper. the arena space comes back
+// with the next jit_clear_all_blocks
+void jit_invalidate_block(void *code)
+{
+  block_unlink_entry(code);
+  if (TrapAvailable(_CacheFlush)) {
+    FlushCodeCache();
+  }
+}
+
+// the VERSION_* facts that hold now
+static u8 jit_version(void)
+{
+  return jit_ctx.stack_in_ram ? VERSION_STACK_RAM : 0;
+}
+
 // return 0 to stop 1 to keep going
 int jit_precompile(u8 bank, u16 pc)
 {
@@ -309,15 +352,14 @@ int jit_precompile(u8 bank, u16 pc)
     dmg_update_rom_bank(compile_ctx.dmg, bank);
   }
   compile_ctx.current_bank = bank;
+  compile_ctx.version = jit_version();
+  compile_ctx.tier = TIER_QUICK;
 
   block = compile_block(pc, &compile_ctx);
   if (!block) {
     return 0;
   }
 
-  arena_shrink(block, sizeof *block,
-      offsetof(struct code_block, code) + block->length);
-
   if (block->error) {
     jit_clear_all_blocks();
     return 0;
@@ -405,7 +447,7 @@ static void update_profiling_status_bar(u32 frames_now)
     static u32 last_counts[PROF_NUM_PHASES];
     u32 d[PROF_NUM_PHASES];
     u32 total = 0;
-    u32 jit_ms, render_ms, draw_ms, mem, skip, exec, norm, ly;
+    u32 jit_ms, render_ms, draw_ms, mem, skip, exec, norm, ly, ic;
     int k;
 
     for (k = 0; k < PROF_NUM_PHASES; k++) {
@@ -430,6 +472,12 @@ static void update_profiling_status_bar(u32 frames_now)
     jit_ctx.skipped_cycles = 0;
     jit_ctx.ly_clamp_skips = 0;
 
+    // indirect exit inline cache hit rate, percent
+    ic = jit_ctx.ic_hits + jit_ctx.ic_misses;
+    ic = ic ? jit_ctx.ic_hits * 100 / ic : 0;
+    jit_ctx.ic_hits = 0;
+    jit_ctx.ic_misses = 0;
+
     exec = skip < CYCLES_PER_FRAME ? CYCLES_PER_FRAME - skip : 0;
 
     // N: jit ms per frame's worth of GB code that actually ran
@@ -443,6 +491,7 @@ static void update_profiling_status_bar(u32 frames_now)
       if (ly) {
         sprintf(buf + strlen(buf), " L%lu", ly);
       }
+      sprintf(buf + strlen(buf), " I%lu", ic);
       set_status_bar(buf);
       return;
     }
@@ -457,7 +506,7 @@ static void update_profiling_status_bar(u32 frames_now)
 int jit_run(struct dmg *dmg)
 {
   void *code;
-  struct code_block *block;
+  struct code_block *block, *stale = NULL, *hot = NULL;
   char buf[64];
 
   if (jit_halted) {
@@ -467,6 +516,34 @@ int jit_run(struct dmg *dmg)
   // look up or compile block
   code = cache_lookup(jit_regs.d3, jit_ctx.current_rom_bank);
 
+  // a pc in the middle of a block usually has a way in already
+  if (!code) {
+    compile_ctx.current_bank = jit_ctx.current_rom_bank;
+    code = block_reentry(&compile_ctx, jit_regs.d3);
+  }
+
+  // the cached version's guard fails: run the version its exit was linked
+  // to, or compile one for what holds now and send the guard there from
+  // now on. the cache keeps the first version, its exit leads to the other
+  if (code && !block_version_holds(code, jit_version())) {
+    u32 linked = block_version_target(code);
+
+    if (linked) {
+      code = (void *) linked;
+    } else {
+      stale = block_from_code(code);
+      code = NULL;
+    }
+  }
+
+  // a quick block used up its entries and came back here: compile it
+  // fully and cache that instead. a mid-block code pointer never is, the
+  // count only sees entries at the start (compiler.h)
+  if (code && block_is_hot(code)) {
+    hot = block_from_code(code);
+    code = NULL;
+  }
+
   if (!code) {
     PROF_SET(PROF_COMPILE);
 
@@ -481,6 +558,8 @@ int jit_run(struct dmg *dmg)
 #endif
 
     compile_ctx.current_bank = jit_ctx.current_rom_bank;
+    compile_ctx.version = jit_version();
+    compile_ctx.tier = stale || hot ? TIER_FULL : TIER_QUICK;
     block = compile_block(jit_regs.d3, &compile_ctx);
 
     if (!block) {
@@ -488,6 +567,8 @@ int jit_run(struct dmg *dmg)
       if (!jit_clear_all_blocks()) {
         return 0;
       }
+      stale = NULL;
+      hot = NULL;
 
       block = compile_block(jit_regs.d3, &compile_ctx);
       if (!block) {
@@ -498,9 +579,6 @@ int jit_run(struct dmg *dmg)
       }
     }
 
-    arena_shrink(block, sizeof *block,
-        offsetof(struct code_block, code) + block->length);
-
     if (block->error) {
       sprintf(buf, "Error pc=%02x:%04x op=%02x", jit_ctx.current_rom_bank, 
                 block->failed_address, block->failed_opcode);
@@ -509,7 +587,13 @@ int jit_run(struct dmg *dmg)
       return 0;
     }
 
-    if (!cache_store(jit_regs.d3, jit_ctx.current_rom_bank, block->code)) {
+    if (hot) {
+      // inline caches and jump tables that still hold it jump on to this one
+      block_retire(hot, (u32) block->code);
+    }
+    if (stale) {
+      block_version_link(stale, (u32) block->code);
+    } else if (!cache_store(jit_regs.d3, jit_ctx.current_rom_bank, block->code)) {
       // this means this was the first block to be stored for a given bank, 
       // and the bank cache array couldn't be allocated. unrecoverable OOM?
       // i'm not actually sure...
@@ -38,6 +38,12 @@ typedef struct {
     /* 58 */ u32 ly_clamp_skips;         // GB6_PROFILING: LY-wait clamp skip count
     /* 5c */ void *mbc_write_func;       // per-type mbcN_write, for constant
                                          // ROM-range write sites
+    /* 60 */ void *ret_stack_top;        // top entry of the return shadow stack
+    /* 64 */ void *dispatcher_ic;        // dispatcher entry for inline cache misses
+    /* 68 */ u32 ic_hits;                // GB6_PROFILING: indirect exit cache hits
+    /* 6c */ u32 ic_misses;              // GB6_PROFILING: ... and misses
+    /* 70 */ void *link_log;             // links patch_helper can't keep in
+                                         // a block header (compiler.h)
 } jit_context;
 
 extern jit_context jit_ctx;
@@ -49,6 +55,9 @@ int jit_run(struct dmg *dmg);
 
 int jit_clear_all_blocks(void);
 
+// drop one cache entry, undoing the exits patched to it
+void jit_invalidate_block(void *code);
+
 // batch compilation of a saved block list (blocklist.c)
 int jit_precompile(u8 bank, u16 pc);
 void jit_precompile_finish(void);